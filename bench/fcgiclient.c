@@ -0,0 +1,274 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include <fastcgi.h>
+
+#include "fcgiclient.h"
+
+
+int LF_fcgiconnect(const char *address)
+{
+	const char *colon = strrchr(address, ':');
+
+	// Anything without a port is a unix socket
+	if(address[0] == '/' || colon == NULL){
+		struct sockaddr_un sun;
+		memset(&sun, 0, sizeof(sun));
+		sun.sun_family = AF_UNIX;
+		if(strlen(address) >= sizeof(sun.sun_path)){ return -1; }
+		strcpy(sun.sun_path, address);
+
+		int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if(fd == -1){ return -1; }
+		if(connect(fd, (struct sockaddr *)&sun, sizeof(sun))){
+			close(fd);
+			return -1;
+		}
+		return fd;
+	}
+
+	const char *host = address;
+	size_t hostlen = colon - address;
+	if(hostlen >= 2 && host[0] == '[' && host[hostlen-1] == ']'){
+		host++;
+		hostlen -= 2;
+	}
+
+	char hostname[hostlen+1];
+	memcpy(hostname, host, hostlen);
+	hostname[hostlen] = 0;
+
+	struct addrinfo hints, *res, *ai;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if(getaddrinfo((hostlen > 0 ? hostname : "127.0.0.1"), colon+1, &hints, &res)){ return -1; }
+
+	int fd = -1, one = 1;
+	for(ai = res; ai != NULL; ai = ai->ai_next){
+		if((fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)) == -1){ continue; }
+		if(connect(fd, ai->ai_addr, ai->ai_addrlen) == 0){
+			setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+			break;
+		}
+		close(fd);
+		fd = -1;
+	}
+
+	freeaddrinfo(res);
+	return fd;
+}
+
+
+void LF_fcgiinit(LF_fcgiconn *c, int fd)
+{
+	memset(c, 0, sizeof(LF_fcgiconn));
+	c->fd = fd;
+}
+
+
+void LF_fcgiclose(LF_fcgiconn *c)
+{
+	if(c->fd != -1){ close(c->fd); }
+	c->fd = -1;
+	c->off = c->len = 0;
+}
+
+
+static int LF_fcgigrow(unsigned char **buf, size_t *size, size_t need)
+{
+	if(need <= *size){ return 0; }
+
+	size_t n = (*size > 0 ? *size : 4096);
+	while(n < need){ n *= 2; }
+
+	unsigned char *p = realloc(*buf, n);
+	if(p == NULL){ return 1; }
+
+	*buf = p;
+	*size = n;
+	return 0;
+}
+
+
+// Appends records of a type holding data, split up as needed, and an
+// empty one to end the stream if end is set
+static int LF_fcgirecord(unsigned char **buf, size_t *len, size_t *size, int type, int id, const char *data, size_t dlen, int end)
+{
+	while(dlen > 0 || end){
+		size_t clen = (dlen > 65535 ? 65535 : dlen);
+		if(LF_fcgigrow(buf, size, *len + sizeof(FCGI_Header) + clen)){ return 1; }
+
+		FCGI_Header *h = (FCGI_Header *)(*buf + *len);
+		h->version = FCGI_VERSION_1;
+		h->type = type;
+		h->requestIdB1 = (id >> 8) & 0xff;
+		h->requestIdB0 = id & 0xff;
+		h->contentLengthB1 = (clen >> 8) & 0xff;
+		h->contentLengthB0 = clen & 0xff;
+		h->paddingLength = 0;
+		h->reserved = 0;
+
+		if(clen > 0){ memcpy(*buf + *len + sizeof(FCGI_Header), data, clen); }
+		*len += sizeof(FCGI_Header) + clen;
+
+		if(clen == 0){ break; }
+		data += clen;
+		dlen -= clen;
+	}
+	return 0;
+}
+
+
+static size_t LF_fcginvlen(unsigned char *p, size_t len)
+{
+	if(len < 128){
+		p[0] = len;
+		return 1;
+	}
+
+	p[0] = ((len >> 24) & 0x7f) | 0x80;
+	p[1] = (len >> 16) & 0xff;
+	p[2] = (len >> 8) & 0xff;
+	p[3] = len & 0xff;
+	return 4;
+}
+
+
+static int LF_fcgiwrite(int fd, const unsigned char *data, size_t len)
+{
+	while(len > 0){
+		ssize_t r = write(fd, data, len);
+		if(r == -1){
+			if(errno == EINTR){ continue; }
+			return 1;
+		}
+		data += r;
+		len -= r;
+	}
+	return 0;
+}
+
+
+int LF_fcgisend(LF_fcgiconn *c, int id, int keepconn, const LF_fcgiparam *params, int nparams, const char *body, size_t bodylen)
+{
+	// Built up and sent in one go, as a web server would
+	static __thread unsigned char *buf = NULL, *pbuf = NULL;
+	static __thread size_t size = 0, psize = 0;
+	size_t len = 0, plen = 0;
+
+	FCGI_BeginRequestBody begin;
+	memset(&begin, 0, sizeof(begin));
+	begin.roleB0 = FCGI_RESPONDER;
+	begin.flags = (keepconn ? FCGI_KEEP_CONN : 0);
+	if(LF_fcgirecord(&buf, &len, &size, FCGI_BEGIN_REQUEST, id, (const char *)&begin, sizeof(begin), 0)){
+		return 1;
+	}
+
+	for(int i=0; i < nparams; i++){
+		if(LF_fcgigrow(&pbuf, &psize, plen + 8 + params[i].namelen + params[i].valuelen)){ return 1; }
+		plen += LF_fcginvlen(pbuf + plen, params[i].namelen);
+		plen += LF_fcginvlen(pbuf + plen, params[i].valuelen);
+		memcpy(pbuf + plen, params[i].name, params[i].namelen);
+		plen += params[i].namelen;
+		memcpy(pbuf + plen, params[i].value, params[i].valuelen);
+		plen += params[i].valuelen;
+	}
+
+	if(LF_fcgirecord(&buf, &len, &size, FCGI_PARAMS, id, (const char *)pbuf, plen, 1) ||
+		LF_fcgirecord(&buf, &len, &size, FCGI_STDIN, id, body, bodylen, 1)){
+		return 1;
+	}
+
+	return LF_fcgiwrite(c->fd, buf, len);
+}
+
+
+// Makes sure there are need bytes buffered
+static int LF_fcgifill(LF_fcgiconn *c, size_t need)
+{
+	if((c->len - c->off) >= need){ return 0; }
+
+	if(c->off > 0){
+		memmove(c->data, c->data + c->off, c->len - c->off);
+		c->len -= c->off;
+		c->off = 0;
+	}
+
+	if(LF_fcgigrow(&c->data, &c->size, (need > 65536 ? need : 65536))){ return 1; }
+
+	while(c->len < need){
+		ssize_t r = read(c->fd, c->data + c->len, c->size - c->len);
+		if(r == 0){ return 1; }
+		if(r == -1){
+			if(errno == EINTR){ continue; }
+			return 1;
+		}
+		c->len += r;
+	}
+	return 0;
+}
+
+
+// Picks the status out of the response's header, 200 if there's none
+static int LF_fcgistatus(const char *data, size_t len)
+{
+	const char *p = data, *end = data + len;
+	while(p < end && *p != '\r' && *p != '\n'){
+		const char *eol = memchr(p, '\n', end - p);
+		if(eol == NULL){ eol = end; }
+
+		if((eol - p) > 8 && strncasecmp(p, "Status:", 7) == 0){ return atoi(p + 7); }
+		p = eol + 1;
+	}
+	return 200;
+}
+
+
+int LF_fcgirecv(LF_fcgiconn *c, int id, char **out, size_t *outlen, size_t *outsize)
+{
+	// Enough of the response is kept to find the status
+	char head[1024];
+	size_t headlen = 0;
+
+	for(;;){
+		if(LF_fcgifill(c, sizeof(FCGI_Header))){ return -1; }
+		FCGI_Header *h = (FCGI_Header *)(c->data + c->off);
+		size_t clen = (h->contentLengthB1 << 8) | h->contentLengthB0;
+		size_t rlen = sizeof(FCGI_Header) + clen + h->paddingLength;
+		int type = h->type, rid = (h->requestIdB1 << 8) | h->requestIdB0;
+
+		if(LF_fcgifill(c, rlen)){ return -1; }
+		const char *content = (const char *)c->data + c->off + sizeof(FCGI_Header);
+		c->off += rlen;
+
+		if(rid != id){ continue; }
+
+		if(type == FCGI_STDOUT && clen > 0){
+			size_t n = (clen < (sizeof(head) - headlen) ? clen : (sizeof(head) - headlen));
+			memcpy(head + headlen, content, n);
+			headlen += n;
+
+			if(out != NULL){
+				if(LF_fcgigrow((unsigned char **)out, outsize, *outlen + clen)){ return -1; }
+				memcpy(*out + *outlen, content, clen);
+				*outlen += clen;
+			}
+		} else if(type == FCGI_END_REQUEST){
+			if(clen < sizeof(FCGI_EndRequestBody)){ return -1; }
+			const FCGI_EndRequestBody *end = (const FCGI_EndRequestBody *)content;
+			if(end->protocolStatus != FCGI_REQUEST_COMPLETE){ return 503; }
+			return LF_fcgistatus(head, headlen);
+		}
+	}
+}
@@ -0,0 +1,31 @@
+// A request variable
+typedef struct {
+	const char *name;
+	size_t namelen;
+	const char *value;
+	size_t valuelen;
+} LF_fcgiparam;
+
+// Bytes read from a connection that are yet to be handled
+typedef struct {
+	int fd;
+	unsigned char *data;
+	size_t off;
+	size_t len;
+	size_t size;
+} LF_fcgiconn;
+
+// Opens a connection to host:port, or a unix socket given by its path.
+// Returns -1 on failure
+int LF_fcgiconnect(const char *);
+
+void LF_fcgiinit(LF_fcgiconn *, int);
+void LF_fcgiclose(LF_fcgiconn *);
+
+// Sends a responder request: its params, then its body, if any
+int LF_fcgisend(LF_fcgiconn *, int, int, const LF_fcgiparam *, int, const char *, size_t);
+
+// Reads records until the request ends, with what it wrote to stdout
+// appended to out (if out isn't NULL). Returns the HTTP status the
+// response had, or -1 if the connection failed
+int LF_fcgirecv(LF_fcgiconn *, int, char **, size_t *, size_t *);
@@ -0,0 +1,55 @@
+#include <stdint.h>
+
+#include "histogram.h"
+
+
+static int LF_histbucket(uint64_t v)
+{
+	if(v < 16){ return v; }
+
+	int msb = 63 - __builtin_clzll(v);
+	int b = 16 + (msb-4)*16 + ((v >> (msb-4)) & 15);
+	return (b < LF_HIST_BUCKETS ? b : LF_HIST_BUCKETS-1);
+}
+
+
+// Top of the range a bucket covers
+static uint64_t LF_histvalue(int b)
+{
+	if(b < 16){ return b; }
+
+	int msb = (b-16)/16 + 4;
+	return ((uint64_t)(16 + (b-16)%16 + 1) << (msb-4)) - 1;
+}
+
+
+void LF_histadd(LF_hist *h, uint64_t v)
+{
+	h->requests++;
+	h->buckets[LF_histbucket(v)]++;
+	if(v > h->max){ h->max = v; }
+}
+
+
+void LF_histmerge(LF_hist *h, const LF_hist *from)
+{
+	h->requests += from->requests;
+	h->errors += from->errors;
+	if(from->max > h->max){ h->max = from->max; }
+	for(int b=0; b < LF_HIST_BUCKETS; b++){ h->buckets[b] += from->buckets[b]; }
+}
+
+
+uint64_t LF_histquantile(const LF_hist *h, double q)
+{
+	uint64_t rank = (uint64_t)(q * h->requests + 0.5), seen = 0;
+	if(rank < 1){ rank = 1; }
+
+	for(int i=0; i < LF_HIST_BUCKETS; i++){
+		if((seen += h->buckets[i]) >= rank){
+			uint64_t v = LF_histvalue(i);
+			return (v < h->max ? v : h->max);
+		}
+	}
+	return h->max;
+}
@@ -0,0 +1,19 @@
+// Latency histogram: microseconds, exact below 16, then each power of
+// two split in 16, within about 3% up to 2^36us
+#define LF_HIST_BUCKETS 528
+
+typedef struct {
+	uint64_t requests;
+	uint64_t errors;
+	uint64_t max;
+	uint64_t buckets[LF_HIST_BUCKETS];
+} LF_hist;
+
+// Counts a request that took the given microseconds
+void LF_histadd(LF_hist *, uint64_t);
+
+// Adds the second histogram's counts to the first's
+void LF_histmerge(LF_hist *, const LF_hist *);
+
+// Microseconds within which the given fraction of requests were made
+uint64_t LF_histquantile(const LF_hist *, double);
@@ -0,0 +1,307 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "fcgiclient.h"
+#include "histogram.h"
+
+
+#define LF_BENCH_SCRIPTS 4
+#define LF_BENCH_PARAMS  16
+
+
+// A request in the mix
+typedef struct {
+	const char *name;
+	const char *script;
+	const char *method;
+	const char *content_type;
+	char *body;
+	size_t bodylen;
+	int weight;
+} LF_benchscript;
+
+typedef struct {
+	pthread_t thread;
+	unsigned int seed;
+	uint64_t connects;
+	LF_hist hists[LF_BENCH_SCRIPTS];
+} LF_benchclient;
+
+
+static LF_benchscript LF_benchscripts[LF_BENCH_SCRIPTS] = {
+	{ "hello", "/hello.lua", "GET", "", NULL, 0, 0 },
+	{ "form", "/form.lua", "POST", "application/x-www-form-urlencoded", NULL, 0, 0 },
+	{ "large", "/large.lua", "GET", "", NULL, 0, 0 },
+	{ "cpu", "/cpu.lua", "GET", "", NULL, 0, 0 }
+};
+
+static const char *LF_benchaddress = "127.0.0.1:9222";
+static const char *LF_benchroot = "bench/scripts";
+static int LF_benchkeepconn = 0;
+static int LF_benchtotal = 0;
+
+static volatile int LF_benchmeasuring = 0;
+static volatile int LF_benchstop = 0;
+
+
+static uint64_t LF_benchclock()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+
+static LF_benchscript *LF_benchpick(LF_benchclient *c)
+{
+	int r = rand_r(&c->seed) % LF_benchtotal;
+	for(int i=0; i < LF_BENCH_SCRIPTS; i++){
+		if(r < LF_benchscripts[i].weight){ return &LF_benchscripts[i]; }
+		r -= LF_benchscripts[i].weight;
+	}
+	return &LF_benchscripts[0];
+}
+
+
+static int LF_benchparam(LF_fcgiparam *p, const char *name, const char *value)
+{
+	p->name = name;
+	p->namelen = strlen(name);
+	p->value = value;
+	p->valuelen = strlen(value);
+	return 1;
+}
+
+
+// Requests one after the other, as fast as they're answered
+static void *LF_benchrun(void *arg)
+{
+	LF_benchclient *client = arg;
+	LF_fcgiconn conn;
+	LF_fcgiinit(&conn, -1);
+
+	while(!LF_benchstop){
+		LF_benchscript *s = LF_benchpick(client);
+
+		char filename[4096], length[24];
+		snprintf(filename, sizeof(filename), "%s%s", LF_benchroot, s->script);
+		snprintf(length, sizeof(length), "%zu", s->bodylen);
+
+		LF_fcgiparam params[LF_BENCH_PARAMS];
+		int n = 0;
+		n += LF_benchparam(&params[n], "GATEWAY_INTERFACE", "CGI/1.1");
+		n += LF_benchparam(&params[n], "SERVER_PROTOCOL", "HTTP/1.1");
+		n += LF_benchparam(&params[n], "REQUEST_METHOD", s->method);
+		n += LF_benchparam(&params[n], "SCRIPT_NAME", s->script);
+		n += LF_benchparam(&params[n], "SCRIPT_FILENAME", filename);
+		n += LF_benchparam(&params[n], "DOCUMENT_ROOT", LF_benchroot);
+		n += LF_benchparam(&params[n], "REQUEST_URI", s->script);
+		n += LF_benchparam(&params[n], "QUERY_STRING", "");
+		n += LF_benchparam(&params[n], "CONTENT_TYPE", s->content_type);
+		n += LF_benchparam(&params[n], "CONTENT_LENGTH", length);
+		n += LF_benchparam(&params[n], "REMOTE_ADDR", "127.0.0.1");
+		n += LF_benchparam(&params[n], "HTTP_HOST", "localhost");
+		n += LF_benchparam(&params[n], "HTTP_ACCEPT_ENCODING", "gzip");
+
+		uint64_t start = LF_benchclock();
+		int status = -1;
+
+		if(conn.fd == -1){
+			LF_fcgiinit(&conn, LF_fcgiconnect(LF_benchaddress));
+			client->connects++;
+		}
+		if(conn.fd != -1 && LF_fcgisend(&conn, 1, LF_benchkeepconn, params, n, s->body, s->bodylen) == 0){
+			status = LF_fcgirecv(&conn, 1, NULL, NULL, NULL);
+		}
+		if(status == -1 || !LF_benchkeepconn){ LF_fcgiclose(&conn); }
+
+		uint64_t elapsed = LF_benchclock() - start;
+
+		if(LF_benchmeasuring && !LF_benchstop){
+			LF_hist *h = &client->hists[s - LF_benchscripts];
+			LF_histadd(h, elapsed);
+			if(status != 200){ h->errors++; }
+		}
+
+		// Don't spin when the server isn't there
+		if(status == -1){ usleep(10000); }
+	}
+
+	LF_fcgiclose(&conn);
+	return NULL;
+}
+
+
+// Parses a mix like "hello:70,form:20,large:5,cpu:5"
+static int LF_benchmix(const char *mix)
+{
+	for(int i=0; i < LF_BENCH_SCRIPTS; i++){ LF_benchscripts[i].weight = 0; }
+	LF_benchtotal = 0;
+
+	const char *p = mix;
+	while(*p){
+		const char *end = strchr(p, ',');
+		if(end == NULL){ end = p + strlen(p); }
+
+		const char *colon = memchr(p, ':', end - p);
+		size_t namelen = (colon ? colon : end) - p;
+		int weight = (colon ? atoi(colon+1) : 1);
+
+		int found = 0;
+		for(int i=0; i < LF_BENCH_SCRIPTS; i++){
+			if(strlen(LF_benchscripts[i].name) == namelen &&
+				memcmp(LF_benchscripts[i].name, p, namelen) == 0){
+				LF_benchscripts[i].weight = (weight > 0 ? weight : 0);
+				found = 1;
+			}
+		}
+		if(!found){
+			fprintf(stderr, "Unknown script in mix: %.*s\n", (int)namelen, p);
+			return 1;
+		}
+
+		p = (*end ? end+1 : end);
+	}
+
+	for(int i=0; i < LF_BENCH_SCRIPTS; i++){ LF_benchtotal += LF_benchscripts[i].weight; }
+	return (LF_benchtotal == 0);
+}
+
+
+// A form with a number of fields of a given size, urlencoded
+static char *LF_benchform(int fields, int size, size_t *len)
+{
+	char *body = malloc(fields * (size + 16) + 1);
+	if(body == NULL){ return NULL; }
+
+	char *p = body;
+	for(int i=0; i < fields; i++){
+		p += sprintf(p, "%sfield%d=", (i ? "&" : ""), i);
+		for(int j=0; j < size; j++){ *p++ = (j % 8 == 7 ? '+' : 'a' + (i+j) % 26); }
+	}
+	*p = 0;
+
+	*len = p - body;
+	return body;
+}
+
+
+static void LF_benchprint(const char *name, const LF_hist *h, double seconds)
+{
+	printf("%-8s %10llu %8llu %10.1f %9.3f %9.3f %9.3f %9.3f\n",
+		name, (unsigned long long)h->requests, (unsigned long long)h->errors,
+		h->requests / seconds,
+		LF_histquantile(h, 0.5) / 1000.0, LF_histquantile(h, 0.99) / 1000.0,
+		LF_histquantile(h, 0.999) / 1000.0, h->max / 1000.0
+	);
+}
+
+
+static void LF_benchusage(const char *name)
+{
+	fprintf(stderr,
+		"Usage: %s [-a address] [-c connections] [-d seconds] [-w seconds]\n"
+		"       [-m mix] [-r root] [-k]\n\n"
+		"  -a  host:port or unix socket path (default 127.0.0.1:9222)\n"
+		"  -c  connections, each making one request at a time (default 16)\n"
+		"  -d  seconds measured (default 10)\n"
+		"  -w  seconds of warm up before measuring (default 2)\n"
+		"  -m  scripts and their weights (default hello:1)\n"
+		"      scripts: hello, form, large, cpu\n"
+		"  -r  directory holding the scripts (default bench/scripts)\n"
+		"  -k  keep connections open between requests\n",
+		name
+	);
+}
+
+
+int main(int argc, char *argv[])
+{
+	int connections = 16, duration = 10, warmup = 2, opt;
+	const char *mix = "hello:1";
+
+	while((opt = getopt(argc, argv, "a:c:d:w:m:r:kh")) != -1){
+		switch(opt){
+			case 'a': LF_benchaddress = optarg; break;
+			case 'c': connections = atoi(optarg); break;
+			case 'd': duration = atoi(optarg); break;
+			case 'w': warmup = atoi(optarg); break;
+			case 'm': mix = optarg; break;
+			case 'r': LF_benchroot = optarg; break;
+			case 'k': LF_benchkeepconn = 1; break;
+			default:
+				LF_benchusage(argv[0]);
+				return 1;
+		}
+	}
+
+	if(connections < 1 || duration < 1 || warmup < 0 || LF_benchmix(mix)){
+		LF_benchusage(argv[0]);
+		return 1;
+	}
+
+	// SCRIPT_FILENAME has to be absolute for the server to find it
+	static char root[4096];
+	if(LF_benchroot[0] != '/' && realpath(LF_benchroot, root) != NULL){ LF_benchroot = root; }
+
+	LF_benchscript *form = &LF_benchscripts[1];
+	form->body = LF_benchform(32, 64, &form->bodylen);
+
+	LF_benchclient *clients = calloc(connections, sizeof(LF_benchclient));
+	if(clients == NULL || form->body == NULL){
+		fprintf(stderr, "Not enough memory\n");
+		return 1;
+	}
+
+	for(int i=0; i < connections; i++){
+		clients[i].seed = i + 1;
+		if(pthread_create(&clients[i].thread, NULL, &LF_benchrun, &clients[i])){
+			fprintf(stderr, "Thread creation error\n");
+			return 1;
+		}
+	}
+
+	sleep(warmup);
+	uint64_t start = LF_benchclock();
+	LF_benchmeasuring = 1;
+	sleep(duration);
+	LF_benchstop = 1;
+	double seconds = (LF_benchclock() - start) / 1e6;
+
+	LF_hist total;
+	memset(&total, 0, sizeof(total));
+	uint64_t connects = 0;
+
+	for(int i=0; i < connections; i++){ pthread_join(clients[i].thread, NULL); }
+
+	printf("%s, %d connections%s, %s, %.1fs\n\n",
+		LF_benchaddress, connections, (LF_benchkeepconn ? " kept open" : ""), mix, seconds
+	);
+	printf("%-8s %10s %8s %10s %9s %9s %9s %9s\n",
+		"script", "requests", "errors", "req/s", "p50 ms", "p99 ms", "p999 ms", "max ms"
+	);
+
+	for(int s=0; s < LF_BENCH_SCRIPTS; s++){
+		LF_hist h;
+		memset(&h, 0, sizeof(h));
+
+		for(int i=0; i < connections; i++){ LF_histmerge(&h, &clients[i].hists[s]); }
+
+		if(LF_benchscripts[s].weight == 0){ continue; }
+		LF_benchprint(LF_benchscripts[s].name, &h, seconds);
+
+		LF_histmerge(&total, &h);
+	}
+
+	for(int i=0; i < connections; i++){ connects += clients[i].connects; }
+
+	LF_benchprint("total", &total, seconds);
+	printf("\n%llu connections made\n", (unsigned long long)connects);
+
+	return (total.requests > 0 && total.errors == 0 ? 0 : 2);
+}
@@ -0,0 +1,392 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "fcgiclient.h"
+#include "histogram.h"
+
+
+// The log's format is laid out in src/capture.h
+#define LF_REPLAY_MAGIC  "LFCAPTR1"
+#define LF_REPLAY_HEADER 38
+
+
+// A captured request, pointing into the mapped log
+typedef struct {
+	uint64_t start;
+	int status;
+	uint64_t size;
+	const unsigned char *params;
+	size_t paramslen;
+	const char *body;
+	size_t bodylen;
+	uint64_t bodytotal;
+} LF_replayreq;
+
+typedef struct {
+	pthread_t thread;
+	uint64_t matched;
+	uint64_t statuses;
+	uint64_t sizes;
+	LF_hist latency;
+	LF_hist lateness;
+} LF_replayclient;
+
+
+static const char *LF_replayaddress = "127.0.0.1:9222";
+static int LF_replaykeepconn = 0;
+static int LF_replayverbose = 0;
+static double LF_replayspeed = 1;
+
+// Prefix of SCRIPT_FILENAME and DOCUMENT_ROOT swapped for another, for
+// replaying against a server with its scripts somewhere else
+static const char *LF_replayfrom = NULL;
+static const char *LF_replayto = NULL;
+
+static LF_replayreq *LF_replayreqs = NULL;
+static size_t LF_replaycount = 0;
+static size_t LF_replaynext = 0;
+static uint64_t LF_replaybegin = 0;
+
+
+static uint64_t LF_replayclock()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+
+static uint64_t LF_replayget(const unsigned char *p, int bytes)
+{
+	uint64_t v = 0;
+	for(int i=bytes-1; i >= 0; i--){ v = (v << 8) | p[i]; }
+	return v;
+}
+
+
+static int LF_replaycompare(const void *a, const void *b)
+{
+	const LF_replayreq *x = a, *y = b;
+	return (x->start > y->start) - (x->start < y->start);
+}
+
+
+// Maps the log and indexes its records, in the order they started
+static int LF_replayload(const char *path)
+{
+	int fd = open(path, O_RDONLY);
+	if(fd == -1){ return 1; }
+
+	struct stat sb;
+	if(fstat(fd, &sb) || sb.st_size < 8){
+		close(fd);
+		return 1;
+	}
+
+	const unsigned char *data = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(data == MAP_FAILED || memcmp(data, LF_REPLAY_MAGIC, 8) != 0){ return 1; }
+
+	const unsigned char *p = data + 8, *end = data + sb.st_size;
+	size_t size = 0;
+
+	// A record cut short by the server stopping ends the log
+	while((end - p) >= LF_REPLAY_HEADER){
+		size_t len = LF_replayget(p, 4);
+		if(len < (LF_REPLAY_HEADER - 4) || (size_t)(end - p - 4) < len){ break; }
+
+		size_t paramslen = LF_replayget(p + 22, 4), bodylen = LF_replayget(p + 26, 4);
+		if((LF_REPLAY_HEADER + paramslen + bodylen) != (len + 4)){ break; }
+
+		if(LF_replaycount == size){
+			size = (size ? size * 2 : 1024);
+			LF_replayreq *reqs = realloc(LF_replayreqs, size * sizeof(LF_replayreq));
+			if(reqs == NULL){ return 1; }
+			LF_replayreqs = reqs;
+		}
+
+		LF_replayreq *r = &LF_replayreqs[LF_replaycount++];
+		r->start = LF_replayget(p + 4, 8);
+		r->status = LF_replayget(p + 12, 2);
+		r->size = LF_replayget(p + 14, 8);
+		r->params = p + LF_REPLAY_HEADER;
+		r->paramslen = paramslen;
+		r->body = (const char *)r->params + paramslen;
+		r->bodylen = bodylen;
+		r->bodytotal = LF_replayget(p + 30, 8);
+
+		p += len + 4;
+	}
+
+	qsort(LF_replayreqs, LF_replaycount, sizeof(LF_replayreq), &LF_replaycompare);
+	return (LF_replaycount == 0);
+}
+
+
+static int LF_replaynvlen(const unsigned char **p, const unsigned char *end, size_t *len)
+{
+	if(*p >= end){ return 1; }
+
+	if((**p & 0x80) == 0){
+		*len = *(*p)++;
+		return 0;
+	}
+
+	if((end - *p) < 4){ return 1; }
+	*len = ((size_t)((*p)[0] & 0x7f) << 24) | ((*p)[1] << 16) | ((*p)[2] << 8) | (*p)[3];
+	*p += 4;
+	return 0;
+}
+
+
+static int LF_replayis(const LF_fcgiparam *param, const char *name)
+{
+	size_t len = strlen(name);
+	return (param->namelen == len && memcmp(param->name, name, len) == 0);
+}
+
+
+// Decodes a request's params, rewriting those that can't be sent as they
+// were. Rewritten values are kept in buf until the request's been sent
+static int LF_replayparams(const LF_replayreq *r, LF_fcgiparam **params, int *size, char *buf, size_t bufsize)
+{
+	const unsigned char *p = r->params, *end = p + r->paramslen;
+	int n = 0;
+
+	while(p < end){
+		size_t klen, vlen;
+		if(LF_replaynvlen(&p, end, &klen) || LF_replaynvlen(&p, end, &vlen) ||
+			(size_t)(end - p) < klen || (size_t)(end - p - klen) < vlen){
+			return -1;
+		}
+
+		if(n == *size){
+			int grow = (*size ? *size * 2 : 64);
+			LF_fcgiparam *g = realloc(*params, grow * sizeof(LF_fcgiparam));
+			if(g == NULL){ return -1; }
+			*params = g;
+			*size = grow;
+		}
+
+		LF_fcgiparam *param = &(*params)[n++];
+		param->name = (const char *)p;
+		param->namelen = klen;
+		param->value = (const char *)p + klen;
+		param->valuelen = vlen;
+		p += klen + vlen;
+
+		// The body's only as long as what was captured of it
+		if(r->bodylen < r->bodytotal && LF_replayis(param, "CONTENT_LENGTH")){
+			int len = snprintf(buf, bufsize, "%zu", r->bodylen);
+			if(len < 0 || (size_t)len >= bufsize){ return -1; }
+			param->value = buf;
+			param->valuelen = len;
+			buf += len;
+			bufsize -= len;
+		}
+
+		size_t fromlen = (LF_replayfrom ? strlen(LF_replayfrom) : 0);
+		if(fromlen > 0 && param->valuelen >= fromlen &&
+			memcmp(param->value, LF_replayfrom, fromlen) == 0 &&
+			(LF_replayis(param, "SCRIPT_FILENAME") || LF_replayis(param, "DOCUMENT_ROOT"))){
+			int len = snprintf(buf, bufsize, "%s%.*s",
+				LF_replayto, (int)(param->valuelen - fromlen), param->value + fromlen
+			);
+			if(len < 0 || (size_t)len >= bufsize){ return -1; }
+			param->value = buf;
+			param->valuelen = len;
+			buf += len;
+			bufsize -= len;
+		}
+	}
+	return n;
+}
+
+
+// Takes the next request, waits until it's due, and sends it
+static void *LF_replayrun(void *arg)
+{
+	LF_replayclient *client = arg;
+	LF_fcgiconn conn;
+	LF_fcgiinit(&conn, -1);
+
+	LF_fcgiparam *params = NULL;
+	int paramsize = 0;
+	char *out = NULL;
+	size_t outsize = 0;
+	char buf[16384];
+
+	for(;;){
+		size_t i = __atomic_fetch_add(&LF_replaynext, 1, __ATOMIC_RELAXED);
+		if(i >= LF_replaycount){ break; }
+		const LF_replayreq *r = &LF_replayreqs[i];
+
+		uint64_t due = LF_replaybegin;
+		if(LF_replayspeed > 0){
+			due += (uint64_t)((r->start - LF_replayreqs[0].start) / LF_replayspeed);
+			uint64_t now = LF_replayclock();
+			if(due > now){ usleep(due - now); }
+		}
+
+		int n = LF_replayparams(r, &params, &paramsize, buf, sizeof(buf));
+		uint64_t start = LF_replayclock();
+		size_t outlen = 0;
+		int status = -1;
+
+		if(n >= 0){
+			if(conn.fd == -1){ LF_fcgiinit(&conn, LF_fcgiconnect(LF_replayaddress)); }
+			if(conn.fd != -1 && LF_fcgisend(&conn, 1, LF_replaykeepconn, params, n, r->body, r->bodylen) == 0){
+				status = LF_fcgirecv(&conn, 1, &out, &outlen, &outsize);
+			}
+			if(status == -1 || !LF_replaykeepconn){ LF_fcgiclose(&conn); }
+		}
+
+		uint64_t now = LF_replayclock();
+		LF_histadd(&client->latency, now - start);
+		if(LF_replayspeed > 0){ LF_histadd(&client->lateness, (start > due ? start - due : 0)); }
+
+		if(status == -1){ client->latency.errors++; }
+		if(status != r->status){
+			client->statuses++;
+		} else if(outlen != r->size){
+			client->sizes++;
+		} else {
+			client->matched++;
+		}
+
+		if(LF_replayverbose && (status != r->status || outlen != r->size)){
+			const char *script = "";
+			int scriptlen = 0;
+			for(int j=0; j < n; j++){
+				if(LF_replayis(&params[j], "REQUEST_URI")){
+					script = params[j].value;
+					scriptlen = params[j].valuelen;
+				}
+			}
+			printf("#%zu %.*s: status %d, was %d; %zu bytes, was %llu\n",
+				i, scriptlen, script, status, r->status, outlen, (unsigned long long)r->size
+			);
+		}
+	}
+
+	free(params);
+	free(out);
+	LF_fcgiclose(&conn);
+	return NULL;
+}
+
+
+static void LF_replayusage(const char *name)
+{
+	fprintf(stderr,
+		"Usage: %s [-a address] [-c connections] [-s speed] [-p from=to] [-k] [-v]\n"
+		"       capture-file\n\n"
+		"  -a  host:port or unix socket path (default 127.0.0.1:9222)\n"
+		"  -c  connections, each making one request at a time (default 16)\n"
+		"  -s  speed relative to when requests were captured, 0 for as\n"
+		"      fast as they're answered (default 1)\n"
+		"  -p  replace the from prefix of SCRIPT_FILENAME and DOCUMENT_ROOT\n"
+		"  -k  keep connections open between requests\n"
+		"  -v  list each request whose response didn't match\n",
+		name
+	);
+}
+
+
+int main(int argc, char *argv[])
+{
+	int connections = 16, opt;
+
+	while((opt = getopt(argc, argv, "a:c:s:p:kvh")) != -1){
+		switch(opt){
+			case 'a': LF_replayaddress = optarg; break;
+			case 'c': connections = atoi(optarg); break;
+			case 's': LF_replayspeed = atof(optarg); break;
+			case 'p':
+				LF_replayto = strchr(optarg, '=');
+				if(LF_replayto == NULL){
+					LF_replayusage(argv[0]);
+					return 1;
+				}
+				*(char *)LF_replayto++ = 0;
+				LF_replayfrom = optarg;
+				break;
+			case 'k': LF_replaykeepconn = 1; break;
+			case 'v': LF_replayverbose = 1; break;
+			default:
+				LF_replayusage(argv[0]);
+				return 1;
+		}
+	}
+
+	if(connections < 1 || LF_replayspeed < 0 || optind != argc-1){
+		LF_replayusage(argv[0]);
+		return 1;
+	}
+
+	if(LF_replayload(argv[optind])){
+		fprintf(stderr, "No requests could be read from %s\n", argv[optind]);
+		return 1;
+	}
+
+	LF_replayclient *clients = calloc(connections, sizeof(LF_replayclient));
+	if(clients == NULL){
+		fprintf(stderr, "Not enough memory\n");
+		return 1;
+	}
+
+	LF_replaybegin = LF_replayclock();
+	for(int i=0; i < connections; i++){
+		if(pthread_create(&clients[i].thread, NULL, &LF_replayrun, &clients[i])){
+			fprintf(stderr, "Thread creation error\n");
+			return 1;
+		}
+	}
+
+	LF_replayclient total;
+	memset(&total, 0, sizeof(total));
+
+	for(int i=0; i < connections; i++){
+		pthread_join(clients[i].thread, NULL);
+		total.matched += clients[i].matched;
+		total.statuses += clients[i].statuses;
+		total.sizes += clients[i].sizes;
+		LF_histmerge(&total.latency, &clients[i].latency);
+		LF_histmerge(&total.lateness, &clients[i].lateness);
+	}
+	double seconds = (LF_replayclock() - LF_replaybegin) / 1e6;
+	double captured = (LF_replayreqs[LF_replaycount-1].start - LF_replayreqs[0].start) / 1e6;
+
+	printf("%s, %d connections%s, %zu requests captured over %.1fs, replayed in %.1fs\n\n",
+		LF_replayaddress, connections, (LF_replaykeepconn ? " kept open" : ""),
+		LF_replaycount, captured, seconds
+	);
+	printf("%-18s %10llu\n", "matched", (unsigned long long)total.matched);
+	printf("%-18s %10llu\n", "status differed", (unsigned long long)total.statuses);
+	printf("%-18s %10llu\n", "size differed", (unsigned long long)total.sizes);
+	printf("%-18s %10llu\n", "failed", (unsigned long long)total.latency.errors);
+	printf("%-18s %10.1f\n\n", "req/s", total.latency.requests / seconds);
+
+	printf("%-10s %9s %9s %9s %9s\n", "", "p50 ms", "p99 ms", "p999 ms", "max ms");
+	printf("%-10s %9.3f %9.3f %9.3f %9.3f\n", "latency",
+		LF_histquantile(&total.latency, 0.5) / 1000.0, LF_histquantile(&total.latency, 0.99) / 1000.0,
+		LF_histquantile(&total.latency, 0.999) / 1000.0, total.latency.max / 1000.0
+	);
+	if(LF_replayspeed > 0){
+		// How far behind the captured pacing requests were sent
+		printf("%-10s %9.3f %9.3f %9.3f %9.3f\n", "lateness",
+			LF_histquantile(&total.lateness, 0.5) / 1000.0, LF_histquantile(&total.lateness, 0.99) / 1000.0,
+			LF_histquantile(&total.lateness, 0.999) / 1000.0, total.lateness.max / 1000.0
+		);
+	}
+
+	return (total.matched == LF_replaycount ? 0 : 2);
+}
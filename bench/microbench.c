@@ -0,0 +1,279 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include <fcgi_config.h>
+#include <fcgiapp.h>
+#include <fastcgi.h>
+
+#include <lua5.1/lua.h>
+
+#include "../src/lua.h"
+#include "../src/config.h"
+#include "../src/cache.h"
+#include "../src/query.h"
+#include "../src/response.h"
+#include "../src/lfuncs.h"
+#include "../src/app.h"
+#include "../src/session.h"
+
+
+// Built with -Wl,--wrap for each of these, so every allocation made by
+// the server, Lua and libfcgi goes through here and is counted
+void *__real_malloc(size_t);
+void *__real_calloc(size_t, size_t);
+void *__real_realloc(void *, size_t);
+void __real_free(void *);
+
+static uint64_t LF_allocs = 0;
+
+void *__wrap_malloc(size_t size){ LF_allocs++; return __real_malloc(size); }
+void *__wrap_calloc(size_t n, size_t size){ LF_allocs++; return __real_calloc(n, size); }
+void *__wrap_realloc(void *ptr, size_t size){ if(size > 0){ LF_allocs++; } return __real_realloc(ptr, size); }
+void __wrap_free(void *ptr){ __real_free(ptr); }
+
+
+#define LF_BENCH_CONTENT_TYPE "text/html; charset=iso-8859-1"
+
+// What nginx's fastcgi_params sends, with a browser's headers
+static char *LF_benchenv[] = {
+	"QUERY_STRING=id=1234&sort=name&page=2&q=lua+fastcgi",
+	"REQUEST_METHOD=GET",
+	"CONTENT_TYPE=",
+	"CONTENT_LENGTH=",
+	"SCRIPT_NAME=/hello.lua",
+	"REQUEST_URI=/hello.lua?id=1234&sort=name&page=2&q=lua+fastcgi",
+	"DOCUMENT_URI=/hello.lua",
+	"DOCUMENT_ROOT=bench/scripts",
+	"SERVER_PROTOCOL=HTTP/1.1",
+	"REQUEST_SCHEME=http",
+	"GATEWAY_INTERFACE=CGI/1.1",
+	"SERVER_SOFTWARE=nginx/1.24.0",
+	"REMOTE_ADDR=192.0.2.10",
+	"REMOTE_PORT=53124",
+	"SERVER_ADDR=192.0.2.1",
+	"SERVER_PORT=80",
+	"SERVER_NAME=example.com",
+	"REDIRECT_STATUS=200",
+	"SCRIPT_FILENAME=bench/scripts/hello.lua",
+	"HTTP_HOST=example.com",
+	"HTTP_USER_AGENT=Mozilla/5.0 (X11; Linux x86_64; rv:128.0) Gecko/20100101 Firefox/128.0",
+	"HTTP_ACCEPT=text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8",
+	"HTTP_ACCEPT_LANGUAGE=en-US,en;q=0.5",
+	"HTTP_ACCEPT_ENCODING=gzip, deflate, br",
+	"HTTP_REFERER=http://example.com/index.lua",
+	"HTTP_COOKIE=theme=dark; LFSESSID=0123456789abcdef0123456789abcdef",
+	"HTTP_CONNECTION=keep-alive",
+	"HTTP_UPGRADE_INSECURE_REQUESTS=1",
+	NULL
+};
+
+static const char LF_benchquery[] = "id=1234&sort=name&page=2&q=lua+fastcgi&tags=a%2Cb%2Cc&empty=&flag";
+
+
+// Output stream that throws away whatever's written to it
+static unsigned char LF_benchoutbuf[8192];
+
+static void LF_benchempty(FCGX_Stream *stream, int doClose)
+{
+	stream->wrNext = LF_benchoutbuf;
+}
+
+static void LF_benchfill(FCGX_Stream *stream)
+{
+	stream->isClosed = 1;
+}
+
+
+typedef struct {
+	FCGX_Stream in;
+	FCGX_Stream out;
+	FCGX_Request request;
+	LF_state state;
+	lua_State *l;
+	LF_pool *pool;
+} LF_bench;
+
+
+static void LF_benchinit(LF_bench *b)
+{
+	memset(b, 0, sizeof(LF_bench));
+
+	b->in.isReader = 1;
+	b->in.fillBuffProc = &LF_benchfill;
+
+	b->out.wrNext = LF_benchoutbuf;
+	b->out.stop = LF_benchoutbuf + sizeof(LF_benchoutbuf);
+	b->out.emptyBuffProc = &LF_benchempty;
+
+	b->request.role = FCGI_RESPONDER;
+	b->request.in = &b->in;
+	b->request.out = &b->out;
+	b->request.envp = LF_benchenv;
+
+	LF_config *config = LF_createconfig();
+	b->state.upload_memory = config->upload_memory;
+	b->state.upload_dir = config->upload_dir;
+	b->state.upload_parts_max = config->upload_parts_max;
+	b->state.upload_files_max = config->upload_files_max;
+	b->state.output.buffer = config->output_buffer;
+	b->state.output.direct = 1;
+
+	b->pool = LF_newpool(1, 1, LF_BENCH_CONTENT_TYPE, config->state_reuse, 0);
+	b->l = LF_poolget(b->pool);
+	LF_envparams(&b->state, LF_benchenv);
+	LF_parserequest(b->l, &b->request, &b->state);
+}
+
+
+// A new sandboxed state, closed again
+static void LF_benchnewstate(LF_bench *b)
+{
+	LF_closestate(LF_newstate(1, LF_BENCH_CONTENT_TYPE));
+}
+
+
+// Reading the request's variables into a state
+static void LF_benchparserequest(LF_bench *b)
+{
+	LF_envparams(&b->state, b->request.envp);
+	LF_parserequest(b->l, &b->request, &b->state);
+	LF_endrequest(&b->state);
+}
+
+
+static void LF_benchquerystring(LF_bench *b)
+{
+	char out[sizeof(LF_benchquery)];
+	LF_parsequerystring(b->l, out, LF_benchquery, sizeof(LF_benchquery)-1);
+	lua_pop(b->l, 1);
+}
+
+
+// Loading a script the script cache has compiled
+static void LF_benchfileload(LF_bench *b)
+{
+	LF_fileload(b->l, "/hello.lua", "bench/scripts/hello.lua");
+	lua_pop(b->l, 1);
+}
+
+
+// A first print(), which puts the header together, then the response
+// being sent
+static void LF_benchpprint(LF_bench *b)
+{
+	LF_responsebegin(&b->state);
+	b->state.committed = 0;
+
+	lua_pushcfunction(b->l, &LF_print);
+	lua_pushliteral(b->l, "Hello, world!");
+	lua_call(b->l, 1, 0);
+
+	LF_responsefinish(&b->state);
+}
+
+
+// A whole request short of the socket: a pooled state has the request
+// read into it, hello.lua loaded and run, and is reset for the next
+static void LF_benchrequest(LF_bench *b)
+{
+	lua_State *l = LF_poolget(b->pool);
+	LF_envparams(&b->state, b->request.envp);
+	LF_parserequest(l, &b->request, &b->state);
+
+	int r = LF_loadscript(l);
+	if(r == 0 && lua_pcall(l, 0, 0, 0)){ r = LF_ERRANY; }
+	LF_responseerror(&b->state, l, r, LF_BENCH_CONTENT_TYPE);
+	LF_responsefinish(&b->state);
+	LF_endrequest(&b->state);
+	LF_poolput(b->pool, l);
+}
+
+
+typedef struct {
+	const char *name;
+	void (*run)(LF_bench *);
+} LF_benchmark;
+
+static const LF_benchmark LF_benchmarks[] = {
+	{ "newstate", &LF_benchnewstate },
+	{ "parserequest", &LF_benchparserequest },
+	{ "parsequerystring", &LF_benchquerystring },
+	{ "fileload", &LF_benchfileload },
+	{ "pprint", &LF_benchpprint },
+	{ "request", &LF_benchrequest },
+	{ NULL, NULL }
+};
+
+
+static uint64_t LF_benchclock()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+int main(int argc, char *argv[])
+{
+	double seconds = 1;
+	int opt;
+
+	while((opt = getopt(argc, argv, "t:h")) != -1){
+		switch(opt){
+			case 't': seconds = atof(optarg); break;
+			default:
+				fprintf(stderr, "Usage: %s [-t seconds] [benchmark ...]\n", argv[0]);
+				return 1;
+		}
+	}
+
+	LF_cacheinit(1024);
+	LF_appinit(1048576);
+	LF_sessioninit("LFSESSID", 1800, 1024, 65536);
+
+	if(access("bench/scripts/hello.lua", R_OK)){
+		fprintf(stderr, "Run from the top of the source tree\n");
+		return 1;
+	}
+
+	LF_bench b;
+	LF_benchinit(&b);
+
+	printf("%-18s %12s %12s %12s\n", "benchmark", "ops", "ns/op", "allocs/op");
+
+	for(const LF_benchmark *m = LF_benchmarks; m->name != NULL; m++){
+		if(optind < argc){
+			int wanted = 0;
+			for(int i=optind; i < argc; i++){ wanted |= (strcmp(argv[i], m->name) == 0); }
+			if(!wanted){ continue; }
+		}
+
+		// Warms up while finding out roughly how many runs fill the time
+		uint64_t n = 1, elapsed = 0;
+		for(;;){
+			uint64_t start = LF_benchclock();
+			for(uint64_t i=0; i < n; i++){ m->run(&b); }
+			elapsed = LF_benchclock() - start;
+
+			if(elapsed >= 100000000ULL){ break; }
+			n *= 10;
+		}
+		n = (uint64_t)(n * (seconds * 1e9 / elapsed)) + 1;
+
+		uint64_t allocs = LF_allocs, start = LF_benchclock();
+		for(uint64_t i=0; i < n; i++){ m->run(&b); }
+		elapsed = LF_benchclock() - start;
+		allocs = LF_allocs - allocs;
+
+		printf("%-18s %12llu %12.1f %12.2f\n",
+			m->name, (unsigned long long)n, (double)elapsed / n, (double)allocs / n
+		);
+	}
+
+	return 0;
+}
@@ -0,0 +1,63 @@
+#!/bin/bash
+# Benchmarks lua-fastcgi run with each of a number of thread counts.
+#
+# usage: bench/run.sh [threads ...]
+#
+# Set in the environment:
+#   MIX          scripts and weights, e.g. hello:70,form:20,large:5,cpu:5
+#   CONNECTIONS  connections lf-bench keeps busy (default 64)
+#   DURATION     seconds measured for each run (default 10)
+#   KEEPCONN     1 to keep connections open between requests
+#   EVENT        1 to run the server's event workers
+#   PORT         port the server listens on (default 9333)
+
+cd "$(dirname "$0")/.." || exit 1
+
+MIX=${MIX:-hello:70,form:20,large:5,cpu:5}
+CONNECTIONS=${CONNECTIONS:-64}
+DURATION=${DURATION:-10}
+PORT=${PORT:-9333}
+THREADS=${*:-1 2 4 8}
+
+if [ "$KEEPCONN" = 1 ]; then KEEP=-k; else KEEP=; fi
+if [ "$EVENT" = 1 ]; then EVENTCFG=true; else EVENTCFG=false; fi
+
+if [ ! -x bench/lua-fastcgi ] || [ ! -x bench/lf-bench ]; then
+	echo "Build with 'make bench' first" >&2
+	exit 1
+fi
+
+ROOT=$(pwd)
+DIR=$(mktemp -d) || exit 1
+trap 'kill $PID 2>/dev/null; rm -rf "$DIR"' EXIT INT TERM
+
+for T in $THREADS; do
+	cat > "$DIR/lua-fastcgi.lua" <<CONFIG
+return {
+	listen = "127.0.0.1:$PORT",
+	backlog = 1024,
+	threads = $T,
+	event = $EVENTCFG,
+	mem_max = 4194304,
+	output_max = 0,
+	cpu_sec = 5,
+	cpu_usec = 0
+}
+CONFIG
+
+	(cd "$DIR" && exec "$ROOT/bench/lua-fastcgi" > /dev/null) &
+	PID=$!
+
+	# Wait for it to start listening
+	for i in 1 2 3 4 5 6 7 8 9 10; do
+		if (exec 3<>/dev/tcp/127.0.0.1/$PORT) 2>/dev/null; then break; fi
+		sleep 0.2
+	done
+
+	echo "== $T thread(s)"
+	bench/lf-bench -a "127.0.0.1:$PORT" -c "$CONNECTIONS" -d "$DURATION" -m "$MIX" -r "$ROOT/bench/scripts" $KEEP
+	echo
+
+	kill $PID
+	wait $PID 2>/dev/null
+done
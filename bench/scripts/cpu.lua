@@ -0,0 +1,7 @@
+-- Keeps the CPU busy for a few milliseconds
+local function fib(n)
+	if n < 2 then return n end
+	return fib(n-1) + fib(n-2)
+end
+
+print(fib(22))
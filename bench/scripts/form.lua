@@ -0,0 +1,8 @@
+-- Touches every field of a urlencoded POST
+local fields, bytes = 0, 0
+for name, value in pairs(POST) do
+	fields = fields + 1
+	bytes = bytes + #value
+end
+
+print(string.format("%d fields, %d bytes", fields, bytes))
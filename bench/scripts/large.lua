@@ -0,0 +1,5 @@
+-- 256KB of output, more than is buffered, so it's streamed
+local line = string.rep("0123456789abcdef", 64) .. "\n"
+for i=1,256 do
+	write(line)
+end
@@ -1,3 +1,5 @@
+-- Read at startup and again on SIGHUP, see README.md for what a reload
+-- changes
 return {
 	-- IP/Port to listen on
 	-- Default: "127.0.0.1:9222"	
@@ -7,6 +9,27 @@ return {
 	-- Default: 100
 	backlog  = 100,
 
+	-- Number of sockets to listen on, each bound to the same address with
+	-- SO_REUSEPORT so the kernel spreads connections between them rather
+	-- than every thread accepting from one socket. Threads are shared out
+	-- between the sockets; setting this to threads gives each thread its
+	-- own. Only applies to IP addresses. 0 shares a single socket
+	-- Default: 0
+	listeners = 0,
+
+	-- Serve many connections from each thread with epoll, rather than one
+	-- request per thread at a time. Scripts run as coroutines, suspended
+	-- while their output waits on a slow client, so threads can be kept
+	-- to one per CPU. Connections the web server keeps open (e.g. nginx's
+	-- fastcgi_keep_conn) may carry several requests at once. Request
+	-- bodies are held in memory, those over 16MB are refused
+	-- Default: false
+	event = false,
+
+	-- Most connections each thread serves at once in event mode
+	-- Default: 1024
+	event_connections = 1024,
+
 	-- Number of threads to spin off. Usually one per CPU
 	-- (plus hardware threads) is a good idea
 	-- Default: 4
@@ -33,5 +56,216 @@ return {
 	output_max = 65536,
 
 	-- Default content type returned in header
-	content_type = "text/html; charset=iso-8859-1"
+	content_type = "text/html; charset=iso-8859-1",
+
+	-- Maximum number of compiled scripts to keep cached, shared by all
+	-- threads. Scripts are recompiled when their mtime or size changes,
+	-- and the least recently used is dropped when it's full. 0 disables
+	-- the cache
+	-- Default: 1024
+	script_cache = 1024,
+
+	-- Most bytes of files read by readfile() kept in memory, shared by all
+	-- threads. Files larger than a sixteenth of this are read without
+	-- being cached. When it's full, the least recently read files are
+	-- dropped. 0 disables the cache
+	-- Default: 16777216
+	file_cache = 16777216,
+
+	-- Seconds a cached file is read from before it's checked for changes.
+	-- 0 checks it every time it's read
+	-- Default: 1
+	file_cache_check = 1,
+
+	-- Largest file readfile() reads, or 0 for no limit. Larger files
+	-- return an error
+	-- Default: 16777216
+	file_size_max = 16777216,
+
+	-- Number of requests a Lua state serves before it's closed. Between
+	-- requests, states are reset to their initial globals and garbage
+	-- collected. 1 creates a new state for every request
+	-- Default: 100
+	state_reuse = 100,
+
+	-- Size of the chunks each thread's request arena allocates, in bytes.
+	-- When set, states allocate from a per-thread arena that's released
+	-- in one go when the request finishes (state_reuse is then ignored).
+	-- Debug builds print each request's peak arena usage, a guide for
+	-- setting mem_max. 0 allocates with malloc instead
+	-- Default: 0
+	arena_chunk = 0,
+
+	-- multipart/form-data fields up to this many bytes are held in memory
+	-- and show up in POST as strings. Uploaded files and larger fields are
+	-- spooled to a temporary file and show up as a table holding their
+	-- filename, content_type, size and a file reader
+	-- Default: 8192
+	upload_memory = 8192,
+
+	-- Directory uploads are spooled to. Files are unlinked as soon as
+	-- they're created and closed when the request ends
+	-- Default: "/tmp"
+	upload_dir = "/tmp",
+
+	-- Most parts a multipart/form-data body may have, and most of them
+	-- that may be spooled to upload_dir. Requests with more are refused
+	-- with an error. 0 for no limit
+	-- Default: 1000, 20
+	upload_parts_max = 1000,
+	upload_files_max = 20,
+
+	-- Responses up to this many bytes are held back and sent in one go
+	-- with a Content-Length. Larger responses are streamed as they're
+	-- written. 0 streams every response
+	-- Default: 65536
+	output_buffer = 65536,
+
+	-- How sendfile(path) responds with a file under DOCUMENT_ROOT:
+	-- "direct" sends it from the kernel straight to the web server,
+	-- "x-accel-redirect" has nginx send it, from the location named by
+	-- sendfile_prefix followed by the file's percent-encoded path under
+	-- DOCUMENT_ROOT, and "x-sendfile" passes the file's full path to a
+	-- web server that supports X-Sendfile. Either way nothing more can
+	-- be printed after it. The web server takes the Content-Type from
+	-- HEADER, so it should be set to match the file
+	-- Default: "direct"
+	sendfile = "direct",
+
+	-- Internal nginx location files sent with X-Accel-Redirect are found
+	-- under. e.g. "/protected/"
+	-- Default: "/"
+	sendfile_prefix = "/",
+
+	-- Content type prefixes to gzip or deflate, mapped to a compression
+	-- level from 1 (fastest) to 9 (smallest). The longest matching prefix
+	-- wins. Responses are only compressed for clients that accept it, and
+	-- never when the script sets its own Content-Encoding or
+	-- Content-Length. e.g. { ["text/"] = 6, ["application/json"] = 4 }
+	-- Default: {} (disabled)
+	compress = {},
+
+	-- Buffered responses smaller than this many bytes aren't compressed
+	-- Default: 256
+	compress_min = 256,
+
+	-- Most memory, in bytes, the APP store shared by every thread may
+	-- use. Scripts keep booleans, numbers, strings and flat tables of
+	-- those in it with APP.set(key, value[, ttl]), APP.get(key),
+	-- APP.incr(key[, by[, ttl]]) and APP.cas(key, old, new[, ttl]).
+	-- 0 disables it
+	-- Default: 1048576
+	app_max = 1048576,
+
+	-- File the database is kept in, a log every change is appended to and
+	-- compacted in the background. Scripts keep booleans, numbers, strings
+	-- and flat tables of those in it with DB.put(key, value), DB.get(key),
+	-- DB.delete(key) and DB.scan(prefix[, limit[, after]]), which returns
+	-- up to limit (100) keys in order, mapped to their values, and the
+	-- last key if there are more. Every key is held in memory.
+	-- e.g. "/var/lib/lua-fastcgi/db"
+	-- Default: nil (disabled)
+	db = nil,
+
+	-- Makes DB.put() and DB.delete() wait for their change to be synced
+	-- to disk, sharing the sync with any other thread's changes. Otherwise
+	-- changes are synced every second. In event mode, changes are synced
+	-- straight away without waiting, so the thread's other connections
+	-- aren't held up
+	-- Default: true
+	db_sync = true,
+
+	-- Most database operations each request may make, or 0 for no limit
+	-- Default: 100
+	db_ops_max = 100,
+
+	-- Most bytes of keys and values each request may read from and write
+	-- to the database, or 0 for no limit
+	-- Default: 1048576
+	db_bytes_max = 1048576,
+
+	-- Name of the cookie holding a client's session id. Scripts keep
+	-- booleans, numbers, strings and flat tables of those in SESSION,
+	-- which is saved when the script finishes without error. A new
+	-- session's cookie is sent with the headers, so it should be touched
+	-- before the response grows past output_buffer
+	-- Default: "LFSESSID"
+	session_cookie = "LFSESSID",
+
+	-- Seconds a session lasts since it was last used
+	-- Default: 1800
+	session_ttl = 1800,
+
+	-- Most sessions kept, the least recently used go first. 0 disables
+	-- sessions
+	-- Default: 1024
+	session_max = 1024,
+
+	-- Most bytes a session's keys and packed values may take up. Changes
+	-- that would take a session past this aren't saved. 0 for no limit
+	-- Default: 65536
+	session_bytes_max = 65536,
+
+	-- Script name prefixes mapped to seconds their responses are cached
+	-- for, keyed on the script's file, method and query string. Only GET
+	-- and HEAD requests are cached. Scripts can also cache
+	-- their own with cache(ttl[, vary]), where vary lists request
+	-- variables (e.g. "HTTP_ACCEPT_LANGUAGE") or, prefixed with '?', the
+	-- query string parameters that make responses differ. Cached
+	-- responses are sent without running the script, and while one's
+	-- being made other requests for it wait rather than run the script
+	-- too. Only whole 200 responses without a Set-Cookie or SESSION are
+	-- cached. e.g. { ["/news/"] = 5 }
+	-- Default: {} (disabled)
+	microcache = {},
+
+	-- Most memory cached responses may take up, in bytes. Responses
+	-- larger than a sixteenth of this aren't cached. 0 disables caching
+	-- Default: 8388608
+	microcache_max = 8388608,
+
+	-- Script name the server's metrics are served on, as Prometheus text:
+	-- requests by outcome, limits tripped, and quantiles of the time each
+	-- script spends being parsed, loaded, executed and flushed. Requests
+	-- for scripts that never loaded are timed together as "(other)".
+	-- Requests for the metrics never reach a script, so the web server
+	-- should only let trusted clients through. e.g. "/lf-status"
+	-- Default: nil (disabled)
+	status_path = nil,
+
+	-- File errors are appended to, those of the server and of scripts,
+	-- including whatever they pass to log(). Each thread queues what it
+	-- logs for a logging thread to write out, so never waits on the file;
+	-- should it log faster than that, entries are dropped and counted.
+	-- e.g. "/var/log/lua-fastcgi/error.log"
+	-- Default: nil (stderr)
+	error_log = nil,
+
+	-- File a line of JSON is appended to for every request, with its
+	-- script, status, bytes sent, seconds spent in each phase and limits
+	-- tripped. e.g. "/var/log/lua-fastcgi/access.log"
+	-- Default: nil (disabled)
+	access_log = nil,
+
+	-- File requests are captured to, with their params, body, and the
+	-- status and size of their response, to be replayed against another
+	-- server with bench/lf-replay. Bodies and cookies are captured as
+	-- they are, so the file should be treated as carefully as the
+	-- traffic. e.g. "/var/tmp/lua-fastcgi.capture"
+	-- Default: nil (disabled)
+	capture = nil,
+
+	-- Fraction of requests captured, between 0 and 1
+	-- Default: 1
+	capture_rate = 1,
+
+	-- Most the capture file may grow to, in bytes, after which nothing
+	-- more is captured
+	-- Default: 1073741824
+	capture_max = 1073741824,
+
+	-- Most of each request's body captured, in bytes. Longer bodies are
+	-- cut short, and replayed with the shorter length
+	-- Default: 65536
+	capture_body_max = 65536
 }
@@ -0,0 +1,422 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <lua5.1/lua.h>
+#include <lua5.1/lauxlib.h>
+
+#include "pack.h"
+#include "app.h"
+
+
+// Independently locked parts of the store, keys are spread between them
+// by hash so threads rarely wait on each other
+#define LF_APP_SHARDS  64
+#define LF_APP_BUCKETS 16
+
+
+// An entry's key, followed by its packed value
+typedef struct LF_appentry {
+	uint32_t hash;
+	double expires;
+	size_t keylen;
+	size_t len;
+
+	struct LF_appentry *next;
+	char data[];
+} LF_appentry;
+
+typedef struct {
+	pthread_rwlock_t lock;
+	LF_appentry **buckets;
+	size_t nbuckets;
+	size_t count;
+} LF_appshard;
+
+
+static LF_appshard LF_appshards[LF_APP_SHARDS];
+static size_t LF_appmax = 0;
+static size_t LF_appused = 0;
+
+// Values are packed into and copied out to here, outside of any lock
+static __thread LF_packbuf LF_appbuf = { NULL, 0, 0 };
+
+
+static inline uint32_t LF_apphash(const char *key, size_t len)
+{
+	uint32_t h = 2166136261u;
+	for(size_t i=0; i < len; i++){
+		h ^= (unsigned char)key[i];
+		h *= 16777619u;
+	}
+	return h;
+}
+
+
+static inline LF_appshard *LF_appshard_of(uint32_t hash)
+{
+	return &LF_appshards[hash % LF_APP_SHARDS];
+}
+
+
+static double LF_appnow()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + (ts.tv_nsec / 1e9);
+}
+
+
+static inline int LF_appexpired(LF_appentry *e, double now)
+{
+	return (e->expires > 0 && e->expires <= now);
+}
+
+
+static inline size_t LF_appsize(LF_appentry *e)
+{
+	return sizeof(LF_appentry) + e->keylen + e->len;
+}
+
+
+// Finds the link to an entry in a shard, or to where it would go. NULL
+// if the shard's empty
+static LF_appentry **LF_appfind(LF_appshard *s, uint32_t hash, const char *key, size_t keylen)
+{
+	if(s->buckets == NULL){ return NULL; }
+
+	LF_appentry **p = &s->buckets[(hash / LF_APP_SHARDS) & (s->nbuckets - 1)];
+	for(; *p != NULL; p = &(*p)->next){
+		LF_appentry *e = *p;
+		if(e->hash == hash && e->keylen == keylen && memcmp(e->data, key, keylen) == 0){ break; }
+	}
+	return p;
+}
+
+
+static void LF_appfree(LF_appentry *e)
+{
+	__atomic_sub_fetch(&LF_appused, LF_appsize(e), __ATOMIC_RELAXED);
+	free(e);
+}
+
+
+// Unlinks and frees an entry, shard must be write locked
+static void LF_appremove(LF_appshard *s, LF_appentry **p)
+{
+	LF_appentry *e = *p;
+	*p = e->next;
+	s->count--;
+	LF_appfree(e);
+}
+
+
+static void LF_apppurge(LF_appshard *s, double now)
+{
+	for(size_t i=0; s->buckets != NULL && i < s->nbuckets; i++){
+		LF_appentry **p = &s->buckets[i];
+		while(*p != NULL){
+			if(LF_appexpired(*p, now)){ LF_appremove(s, p); }
+			else { p = &(*p)->next; }
+		}
+	}
+}
+
+
+// Doubles a shard's buckets once it's as full as it has buckets. Failing
+// to grow only makes the chains longer
+static void LF_appgrow(LF_appshard *s)
+{
+	if(s->buckets != NULL && s->count < s->nbuckets){ return; }
+
+	size_t n = (s->nbuckets ? s->nbuckets * 2 : LF_APP_BUCKETS);
+	LF_appentry **buckets = calloc(n, sizeof(LF_appentry *));
+	if(buckets == NULL){ return; }
+
+	for(size_t i=0; i < s->nbuckets; i++){
+		LF_appentry *e = s->buckets[i];
+		while(e != NULL){
+			LF_appentry *next = e->next;
+			LF_appentry **b = &buckets[(e->hash / LF_APP_SHARDS) & (n - 1)];
+			e->next = *b;
+			*b = e;
+			e = next;
+		}
+	}
+
+	free(s->buckets);
+	s->buckets = buckets;
+	s->nbuckets = n;
+}
+
+
+// Makes an entry from a key and packed value, charging it to the store.
+// Expired entries in the shard are dropped to make room if need be, so
+// the shard must be write locked. An entry it replaces, of replacing
+// bytes, is freed once it's in, so only the difference has to fit. NULL
+// if there's no room
+static LF_appentry *LF_appnew(LF_appshard *s, uint32_t hash, const char *key, size_t keylen, const char *val, size_t len, double ttl, double now, size_t replacing)
+{
+	size_t size = sizeof(LF_appentry) + keylen + len;
+	if(__atomic_add_fetch(&LF_appused, size, __ATOMIC_RELAXED) > (LF_appmax + replacing)){
+		LF_apppurge(s, now);
+		if(__atomic_load_n(&LF_appused, __ATOMIC_RELAXED) > (LF_appmax + replacing)){
+			__atomic_sub_fetch(&LF_appused, size, __ATOMIC_RELAXED);
+			return NULL;
+		}
+	}
+
+	LF_appentry *e = malloc(size);
+	if(e == NULL){
+		__atomic_sub_fetch(&LF_appused, size, __ATOMIC_RELAXED);
+		return NULL;
+	}
+
+	e->hash = hash;
+	e->expires = (ttl > 0 ? now + ttl : 0);
+	e->keylen = keylen;
+	e->len = len;
+	memcpy(e->data, key, keylen);
+	memcpy(e->data + keylen, val, len);
+	return e;
+}
+
+
+// Replaces the entry for a key with a new one, or removes it if val is
+// NULL. Shard must be write locked. Returns 0 on success
+static int LF_appreplace(LF_appshard *s, uint32_t hash, const char *key, size_t keylen, const char *val, size_t len, double ttl, double now)
+{
+	// An expired entry's purged rather than replaced
+	LF_appentry **p = LF_appfind(s, hash, key, keylen);
+	size_t replacing = (p != NULL && *p != NULL && !LF_appexpired(*p, now) ? LF_appsize(*p) : 0);
+
+	LF_appentry *e = NULL;
+	if(val != NULL && (e = LF_appnew(s, hash, key, keylen, val, len, ttl, now, replacing)) == NULL){
+		return 1;
+	}
+
+	// Purging and growing may move the entry's link, so it's found again
+	p = LF_appfind(s, hash, key, keylen);
+	if(p != NULL && *p != NULL){ LF_appremove(s, p); }
+	if(e == NULL){ return 0; }
+
+	LF_appgrow(s);
+	if((p = LF_appfind(s, hash, key, keylen)) == NULL){
+		LF_appfree(e);
+		return 1;
+	}
+
+	e->next = NULL;
+	*p = e;
+	s->count++;
+	return 0;
+}
+
+
+// Packs the value at idx onto the end of the thread's buffer
+static void LF_apppack(lua_State *l, int idx)
+{
+	switch(LF_pack(l, idx, &LF_appbuf)){
+		case 1: luaL_argerror(l, idx, "can't be stored"); break;
+		case 2: luaL_error(l, "Not enough memory."); break;
+	}
+}
+
+
+static double LF_appttl(lua_State *l, int idx)
+{
+	double ttl = luaL_optnumber(l, idx, 0);
+	return (ttl > 0 ? ttl : 0);
+}
+
+
+// APP.get(key), the value stored for key or nil
+static int LF_appget(lua_State *l)
+{
+	size_t keylen;
+	const char *key = luaL_checklstring(l, 1, &keylen);
+	uint32_t hash = LF_apphash(key, keylen);
+	LF_appshard *s = LF_appshard_of(hash);
+	int found = 0;
+
+	pthread_rwlock_rdlock(&s->lock);
+
+	// Lua may raise errors while unpacking, so the value's copied out
+	// to be unpacked once the lock's released
+	LF_appentry **p = LF_appfind(s, hash, key, keylen);
+	if(p != NULL && *p != NULL && !LF_appexpired(*p, LF_appnow())){
+		LF_appentry *e = *p;
+		if(e->len > LF_appbuf.size){
+			char *data = realloc(LF_appbuf.data, e->len);
+			if(data != NULL){
+				LF_appbuf.data = data;
+				LF_appbuf.size = e->len;
+			}
+		}
+
+		if(e->len <= LF_appbuf.size){
+			memcpy(LF_appbuf.data, e->data + e->keylen, e->len);
+			LF_appbuf.len = e->len;
+			found = 1;
+		}
+	}
+
+	pthread_rwlock_unlock(&s->lock);
+
+	if(!found || LF_unpack(l, LF_appbuf.data, LF_appbuf.len)){ lua_pushnil(l); }
+	return 1;
+}
+
+
+// APP.set(key, value[, ttl]), stores value for key, for ttl seconds if
+// given. A nil value removes the key. Returns false if the store is full
+static int LF_appset(lua_State *l)
+{
+	size_t keylen;
+	const char *key = luaL_checklstring(l, 1, &keylen);
+	double ttl = LF_appttl(l, 3);
+	int del = lua_isnoneornil(l, 2);
+
+	LF_appbuf.len = 0;
+	if(!del){ LF_apppack(l, 2); }
+
+	uint32_t hash = LF_apphash(key, keylen);
+	LF_appshard *s = LF_appshard_of(hash);
+
+	pthread_rwlock_wrlock(&s->lock);
+	int r = LF_appreplace(
+		s, hash, key, keylen, (del ? NULL : LF_appbuf.data),
+		LF_appbuf.len, ttl, LF_appnow()
+	);
+	pthread_rwlock_unlock(&s->lock);
+
+	lua_pushboolean(l, (r == 0));
+	return 1;
+}
+
+
+// APP.incr(key[, by[, ttl]]), adds by (1 by default) to the number stored
+// for key, starting from 0. Returns the new number, or nil if the key
+// holds something else or the store is full. A ttl sets a new expiry
+static int LF_appincr(lua_State *l)
+{
+	size_t keylen;
+	const char *key = luaL_checklstring(l, 1, &keylen);
+	lua_Number by = luaL_optnumber(l, 2, 1);
+	double ttl = LF_appttl(l, 3);
+
+	uint32_t hash = LF_apphash(key, keylen);
+	LF_appshard *s = LF_appshard_of(hash);
+	double now = LF_appnow();
+	lua_Number n = by;
+	int r = 0;
+
+	pthread_rwlock_wrlock(&s->lock);
+
+	LF_appentry **p = LF_appfind(s, hash, key, keylen);
+	LF_appentry *e = (p != NULL ? *p : NULL);
+	if(e != NULL && !LF_appexpired(e, now)){
+		char *val = e->data + e->keylen;
+		if(e->len == 1 + sizeof(lua_Number) && val[0] == LF_PACK_NUMBER){
+			memcpy(&n, val + 1, sizeof(n));
+			n += by;
+			memcpy(val + 1, &n, sizeof(n));
+			if(ttl > 0){ e->expires = now + ttl; }
+		} else {
+			r = 1;
+		}
+	} else {
+		char val[1 + sizeof(lua_Number)];
+		val[0] = LF_PACK_NUMBER;
+		memcpy(val + 1, &n, sizeof(n));
+		r = LF_appreplace(s, hash, key, keylen, val, sizeof(val), ttl, now);
+	}
+
+	pthread_rwlock_unlock(&s->lock);
+
+	if(r){ lua_pushnil(l); }
+	else { lua_pushnumber(l, n); }
+	return 1;
+}
+
+
+// APP.cas(key, old, new[, ttl]), stores new for key only if it currently
+// holds old, where nil means the key isn't set. A nil new removes the key.
+// Returns whether it was stored
+static int LF_appcas(lua_State *l)
+{
+	size_t keylen;
+	const char *key = luaL_checklstring(l, 1, &keylen);
+	double ttl = LF_appttl(l, 4);
+	int absent = lua_isnoneornil(l, 2), del = lua_isnoneornil(l, 3);
+
+	// Both values are packed into the buffer, one after the other
+	LF_appbuf.len = 0;
+	if(!absent){ LF_apppack(l, 2); }
+	size_t oldlen = LF_appbuf.len;
+	if(!del){ LF_apppack(l, 3); }
+
+	uint32_t hash = LF_apphash(key, keylen);
+	LF_appshard *s = LF_appshard_of(hash);
+	double now = LF_appnow();
+	int r = 1;
+
+	pthread_rwlock_wrlock(&s->lock);
+
+	LF_appentry **p = LF_appfind(s, hash, key, keylen);
+	LF_appentry *e = (p != NULL ? *p : NULL);
+	if(e != NULL && LF_appexpired(e, now)){ e = NULL; }
+
+	if(absent ? (e == NULL) :
+		(e != NULL && e->len == oldlen && memcmp(e->data + e->keylen, LF_appbuf.data, oldlen) == 0)){
+		r = LF_appreplace(
+			s, hash, key, keylen, (del ? NULL : LF_appbuf.data + oldlen),
+			LF_appbuf.len - oldlen, ttl, now
+		);
+	}
+
+	pthread_rwlock_unlock(&s->lock);
+
+	lua_pushboolean(l, (r == 0));
+	return 1;
+}
+
+
+void LF_appinit(size_t max)
+{
+	LF_appmax = max;
+	for(int i=0; i < LF_APP_SHARDS; i++){
+		pthread_rwlock_init(&LF_appshards[i].lock, NULL);
+		LF_appshards[i].buckets = NULL;
+		LF_appshards[i].nbuckets = 0;
+		LF_appshards[i].count = 0;
+	}
+}
+
+
+void LF_openapp(lua_State *l)
+{
+	if(LF_appmax == 0){ return; }
+
+	lua_createtable(l, 0, 4);
+
+	lua_pushstring(l, "get");
+	lua_pushcfunction(l, &LF_appget);
+	lua_rawset(l, -3);
+
+	lua_pushstring(l, "set");
+	lua_pushcfunction(l, &LF_appset);
+	lua_rawset(l, -3);
+
+	lua_pushstring(l, "incr");
+	lua_pushcfunction(l, &LF_appincr);
+	lua_rawset(l, -3);
+
+	lua_pushstring(l, "cas");
+	lua_pushcfunction(l, &LF_appcas);
+	lua_rawset(l, -3);
+
+	lua_setglobal(l, "APP");
+}
@@ -0,0 +1,6 @@
+// Sets the most memory the application store may use in bytes, 0
+// disables it
+void LF_appinit(size_t);
+
+// Adds the APP table to a state, if the store is enabled
+void LF_openapp(lua_State *);
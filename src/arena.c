@@ -0,0 +1,238 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <lua5.1/lua.h>
+
+#include "arena.h"
+
+
+// Blocks up to LF_ARENA_SMALL bytes come from size classes, 16 bytes apart
+#define LF_ARENA_ALIGN   16
+#define LF_ARENA_SMALL   512
+#define LF_ARENA_CLASSES (LF_ARENA_SMALL / LF_ARENA_ALIGN)
+
+#define LF_arenaclass(sz) (((sz) + LF_ARENA_ALIGN - 1) / LF_ARENA_ALIGN - 1)
+
+
+// Chunk header, the chunk's memory follows it
+typedef struct LF_arenachunk {
+	struct LF_arenachunk *next;
+	size_t pad;
+} LF_arenachunk;
+
+
+// Header for large blocks, which are allocated individually
+typedef struct LF_arenablock {
+	struct LF_arenablock *prev;
+	struct LF_arenablock *next;
+	size_t size;
+	size_t pad;
+} LF_arenablock;
+
+
+struct LF_arena {
+	size_t chunksize;
+	LF_arenachunk *chunks;
+	char *next;
+	char *end;
+
+	void *free[LF_ARENA_CLASSES];
+	LF_arenablock *large;
+
+	size_t *limit;
+	size_t used;
+	size_t peak;
+	size_t nchunks;
+};
+
+
+LF_arena *LF_newarena(size_t chunksize)
+{
+	LF_arena *a = malloc(sizeof(LF_arena));
+	if(a == NULL){ return NULL; }
+
+	memset(a, 0, sizeof(LF_arena));
+	a->chunksize = (chunksize < LF_ARENA_SMALL * 4 ? LF_ARENA_SMALL * 4 : chunksize);
+	return a;
+}
+
+
+void LF_freearena(LF_arena *a)
+{
+	LF_arenareset(a);
+	free(a->chunks);
+	free(a);
+}
+
+
+// Carves a small block from the current chunk, starting a new one if needed
+static void *LF_arenacarve(LF_arena *a, size_t sz)
+{
+	if((size_t)(a->end - a->next) < sz){
+		LF_arenachunk *c = malloc(sizeof(LF_arenachunk) + a->chunksize);
+		if(c == NULL){ return NULL; }
+
+		c->next = a->chunks;
+		a->chunks = c;
+		a->next = (char *)(c + 1);
+		a->end = a->next + a->chunksize;
+		a->nchunks++;
+	}
+
+	void *p = a->next;
+	a->next += sz;
+	return p;
+}
+
+
+static void *LF_arenaget(LF_arena *a, size_t sz)
+{
+	if(sz <= LF_ARENA_SMALL){
+		size_t c = LF_arenaclass(sz);
+		void *p = a->free[c];
+		if(p != NULL){
+			a->free[c] = *(void **)p;
+			return p;
+		}
+		return LF_arenacarve(a, (c+1) * LF_ARENA_ALIGN);
+	}
+
+	LF_arenablock *b = malloc(sizeof(LF_arenablock) + sz);
+	if(b == NULL){ return NULL; }
+
+	b->size = sz;
+	b->prev = NULL;
+	b->next = a->large;
+	if(a->large){ a->large->prev = b; }
+	a->large = b;
+	return b + 1;
+}
+
+
+static void LF_arenaput(LF_arena *a, void *p, size_t sz)
+{
+	if(sz <= LF_ARENA_SMALL){
+		size_t c = LF_arenaclass(sz);
+		*(void **)p = a->free[c];
+		a->free[c] = p;
+		return;
+	}
+
+	LF_arenablock *b = (LF_arenablock *)p - 1;
+	if(b->prev){ b->prev->next = b->next; }
+	else { a->large = b->next; }
+	if(b->next){ b->next->prev = b->prev; }
+	free(b);
+}
+
+
+// Grows or shrinks a large block in place with realloc
+static void *LF_arenaregrow(LF_arena *a, void *p, size_t sz)
+{
+	LF_arenablock *b = realloc((LF_arenablock *)p - 1, sizeof(LF_arenablock) + sz);
+	if(b == NULL){ return NULL; }
+
+	b->size = sz;
+	if(b->prev){ b->prev->next = b; }
+	else { a->large = b; }
+	if(b->next){ b->next->prev = b; }
+	return b + 1;
+}
+
+
+// lua_Alloc backed by an arena, enforcing the arena's memory limit
+void *LF_arenaalloc(void *ud, void *ptr, size_t osize, size_t nsize)
+{
+	LF_arena *a = ud;
+	void *p;
+
+	if(ptr == NULL){ osize = 0; }
+
+	if(nsize == 0){
+		if(ptr != NULL){ LF_arenaput(a, ptr, osize); }
+		if(a->limit){ *a->limit += osize; }
+		a->used -= osize;
+		return NULL;
+	}
+
+	if(a->limit && nsize > osize && (nsize - osize) > *a->limit){ return NULL; }
+
+	if(ptr != NULL && osize <= LF_ARENA_SMALL && nsize <= LF_ARENA_SMALL &&
+		LF_arenaclass(osize) == LF_arenaclass(nsize)){
+		p = ptr;
+	} else if(ptr != NULL && osize > LF_ARENA_SMALL && nsize > LF_ARENA_SMALL){
+		if((p = LF_arenaregrow(a, ptr, nsize)) == NULL){ return NULL; }
+	} else {
+		if((p = LF_arenaget(a, nsize)) == NULL){ return NULL; }
+		if(ptr != NULL){
+			memcpy(p, ptr, (osize < nsize ? osize : nsize));
+			LF_arenaput(a, ptr, osize);
+		}
+	}
+
+	if(a->limit){
+		*a->limit += osize;
+		*a->limit -= nsize;
+	}
+
+	a->used += nsize;
+	a->used -= osize;
+	if(a->used > a->peak){ a->peak = a->used; }
+	return p;
+}
+
+
+// Makes allocations count against limit, as LF_limit_alloc does
+void LF_arenalimit(LF_arena *a, size_t *limit)
+{
+	a->limit = limit;
+}
+
+
+// Releases everything allocated from the arena at once, keeping the
+// first chunk for the next state
+void LF_arenareset(LF_arena *a)
+{
+	while(a->large){
+		LF_arenablock *b = a->large;
+		a->large = b->next;
+		free(b);
+	}
+
+	while(a->chunks && a->chunks->next){
+		LF_arenachunk *c = a->chunks;
+		a->chunks = c->next;
+		free(c);
+	}
+
+	if(a->chunks){
+		a->next = (char *)(a->chunks + 1);
+		a->end = a->next + a->chunksize;
+	} else {
+		a->next = a->end = NULL;
+	}
+
+	memset(a->free, 0, sizeof(a->free));
+	a->limit = NULL;
+	a->used = 0;
+	a->peak = 0;
+	a->nchunks = (a->chunks ? 1 : 0);
+}
+
+
+// Peak bytes in use and chunks allocated since the last reset
+void LF_arenastats(LF_arena *a, size_t *peak, size_t *chunks)
+{
+	*peak = a->peak;
+	*chunks = a->nchunks;
+}
+
+
+// Returns the arena backing a state, if any
+LF_arena *LF_statearena(lua_State *l)
+{
+	void *ud = NULL;
+	if(lua_getallocf(l, &ud) == &LF_arenaalloc){ return ud; }
+	return NULL;
+}
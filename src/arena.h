@@ -0,0 +1,9 @@
+typedef struct LF_arena LF_arena;
+
+LF_arena *LF_newarena(size_t);
+void LF_freearena(LF_arena *);
+void *LF_arenaalloc(void *, void *, size_t, size_t);
+void LF_arenalimit(LF_arena *, size_t *);
+void LF_arenareset(LF_arena *);
+void LF_arenastats(LF_arena *, size_t *, size_t *);
+LF_arena *LF_statearena(lua_State *);
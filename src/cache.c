@@ -0,0 +1,179 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include <lua5.1/lua.h>
+#include <lua5.1/lauxlib.h>
+
+#include "cache.h"
+
+
+#define LF_CACHE_BUCKETS 256
+
+
+// A compiled chunk, identified by the file it was compiled from
+typedef struct LF_chunk {
+	dev_t dev;
+	ino_t ino;
+	struct timespec mtime;
+	off_t size;
+
+	char *code;
+	size_t len;
+	time_t used;
+
+	struct LF_chunk *next;
+} LF_chunk;
+
+
+// Growable buffer used while dumping a chunk
+typedef struct {
+	char *code;
+	size_t len;
+	size_t size;
+} LF_dumpbuf;
+
+
+static pthread_rwlock_t LF_cachelock = PTHREAD_RWLOCK_INITIALIZER;
+static LF_chunk *LF_cachebuckets[LF_CACHE_BUCKETS];
+static size_t LF_cachecount = 0;
+static size_t LF_cachemax = 0;
+
+
+static inline size_t LF_cachehash(struct stat *sb)
+{
+	return ((size_t)sb->st_ino ^ ((size_t)sb->st_dev << 7)) % LF_CACHE_BUCKETS;
+}
+
+
+// Checks if a chunk was compiled from the current version of a file
+static inline int LF_chunkcurrent(LF_chunk *c, struct stat *sb)
+{
+	return c->size == sb->st_size &&
+		c->mtime.tv_sec == sb->st_mtim.tv_sec &&
+		c->mtime.tv_nsec == sb->st_mtim.tv_nsec;
+}
+
+
+static LF_chunk *LF_chunkfind(struct stat *sb)
+{
+	for(LF_chunk *c = LF_cachebuckets[LF_cachehash(sb)]; c; c = c->next){
+		if(c->ino == sb->st_ino && c->dev == sb->st_dev){ return c; }
+	}
+	return NULL;
+}
+
+
+static int LF_chunkwriter(lua_State *l, const void *p, size_t sz, void *ud)
+{
+	LF_dumpbuf *buf = ud;
+
+	if((buf->len + sz) > buf->size){
+		size_t size = buf->size ? buf->size : 4096;
+		while(size < (buf->len + sz)){ size *= 2; }
+
+		char *code = realloc(buf->code, size);
+		if(code == NULL){ return 1; }
+
+		buf->code = code;
+		buf->size = size;
+	}
+
+	memcpy(buf->code + buf->len, p, sz);
+	buf->len += sz;
+	return 0;
+}
+
+
+// Drops the least recently used chunk, which makes way for a new one
+// and in time for chunks of files that have since changed or gone
+static void LF_chunkevict()
+{
+	LF_chunk **oldest = NULL;
+	for(size_t i=0; i < LF_CACHE_BUCKETS; i++){
+		for(LF_chunk **p = &LF_cachebuckets[i]; *p != NULL; p = &(*p)->next){
+			if(oldest == NULL || (*p)->used < (*oldest)->used){ oldest = p; }
+		}
+	}
+	if(oldest == NULL){ return; }
+
+	LF_chunk *c = *oldest;
+	*oldest = c->next;
+	LF_cachecount--;
+	free(c->code);
+	free(c);
+}
+
+
+// Sets the maximum number of cached chunks, 0 disables the cache
+void LF_cacheinit(size_t max)
+{
+	LF_cachemax = max;
+}
+
+
+// Pushes the cached chunk for a file, if one exists and is current.
+// Returns 0 on success, -1 if there is no usable entry or a lua_load
+// error code
+int LF_cacheload(lua_State *l, struct stat *sb, const char *name)
+{
+	if(LF_cachemax == 0){ return -1; }
+
+	int r = -1;
+	pthread_rwlock_rdlock(&LF_cachelock);
+
+	LF_chunk *c = LF_chunkfind(sb);
+	if(c != NULL && LF_chunkcurrent(c, sb)){
+		// Holding the read lock keeps the code alive while it's undumped
+		__atomic_store_n(&c->used, time(NULL), __ATOMIC_RELAXED);
+		r = luaL_loadbuffer(l, c->code, c->len, name);
+	}
+
+	pthread_rwlock_unlock(&LF_cachelock);
+	return r;
+}
+
+
+// Dumps the function on top of the stack into the cache, replacing
+// any chunk compiled from an older version of the same file, or the
+// least recently used chunk if the cache is full
+void LF_cachestore(lua_State *l, struct stat *sb)
+{
+	if(LF_cachemax == 0){ return; }
+
+	LF_dumpbuf buf = { NULL, 0, 0 };
+	if(lua_dump(l, &LF_chunkwriter, &buf)){
+		free(buf.code);
+		return;
+	}
+
+	pthread_rwlock_wrlock(&LF_cachelock);
+
+	LF_chunk *c = LF_chunkfind(sb);
+	if(c != NULL){
+		free(c->code);
+	} else if((c = malloc(sizeof(LF_chunk))) != NULL){
+		while(LF_cachecount >= LF_cachemax){ LF_chunkevict(); }
+
+		size_t h = LF_cachehash(sb);
+		c->dev = sb->st_dev;
+		c->ino = sb->st_ino;
+		c->next = LF_cachebuckets[h];
+		LF_cachebuckets[h] = c;
+		LF_cachecount++;
+	} else {
+		pthread_rwlock_unlock(&LF_cachelock);
+		free(buf.code);
+		return;
+	}
+
+	c->mtime = sb->st_mtim;
+	c->size = sb->st_size;
+	c->code = buf.code;
+	c->len = buf.len;
+	c->used = time(NULL);
+
+	pthread_rwlock_unlock(&LF_cachelock);
+}
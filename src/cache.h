@@ -0,0 +1,3 @@
+void LF_cacheinit(size_t);
+int LF_cacheload(lua_State *, struct stat *, const char *);
+void LF_cachestore(lua_State *, struct stat *);
@@ -0,0 +1,292 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include <fcgiapp.h>
+
+#include <lua5.1/lua.h>
+
+#include "lua.h"
+#include "capture.h"
+
+
+// Most of the body copied at a time
+#define LF_CAPTURE_READ 8192
+
+
+struct LF_capture {
+	// The stream the script reads the body from, filled from source
+	FCGX_Stream stream;
+	FCGX_Stream *source;
+	unsigned char buf[LF_CAPTURE_READ];
+
+	int active;
+	uint64_t start;
+	unsigned int seed;
+
+	char *body;
+	size_t bodylen;
+	size_t bodysize;
+	uintmax_t bodytotal;
+
+	unsigned char *record;
+	size_t recordsize;
+};
+
+
+static pthread_mutex_t LF_capturelock = PTHREAD_MUTEX_INITIALIZER;
+static int LF_capturefd = -1;
+static double LF_capturerate = 1;
+static size_t LF_capturemax = 0;
+static size_t LF_capturebodymax = 0;
+static size_t LF_capturewritten = 0;
+
+
+static int LF_capturewrite(const void *data, size_t len)
+{
+	const char *p = data;
+	while(len > 0){
+		ssize_t r = write(LF_capturefd, p, len);
+		if(r == -1){
+			if(errno == EINTR){ continue; }
+			return 1;
+		}
+		p += r;
+		len -= r;
+	}
+	return 0;
+}
+
+
+int LF_captureinit(const char *path, double rate, size_t max, size_t bodymax)
+{
+	if(path == NULL || rate <= 0 || max == 0){ return 0; }
+
+	int fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+	if(fd == -1){ return 1; }
+
+	struct stat sb;
+	if(fstat(fd, &sb)){
+		close(fd);
+		return 1;
+	}
+
+	LF_capturefd = fd;
+	LF_capturerate = rate;
+	LF_capturemax = max;
+	LF_capturebodymax = bodymax;
+	LF_capturewritten = sb.st_size;
+
+	// A new log starts with its header
+	if(sb.st_size == 0){
+		if(LF_capturewrite(LF_CAPTURE_MAGIC, 8)){
+			close(fd);
+			LF_capturefd = -1;
+			return 1;
+		}
+		LF_capturewritten = 8;
+	}
+	return 0;
+}
+
+
+LF_capture *LF_newcapture()
+{
+	if(LF_capturefd == -1){ return NULL; }
+
+	LF_capture *c = calloc(1, sizeof(LF_capture));
+	if(c == NULL){ return NULL; }
+
+	c->seed = time(NULL) ^ (uintptr_t)c;
+	return c;
+}
+
+
+void LF_freecapture(LF_capture *c)
+{
+	if(c == NULL){ return; }
+	free(c->body);
+	free(c->record);
+	free(c);
+}
+
+
+// Keeps as much of the body as is wanted
+static void LF_capturebody(LF_capture *c, const unsigned char *data, size_t len)
+{
+	c->bodytotal += len;
+
+	size_t n = (LF_capturebodymax - c->bodylen);
+	if(n > len){ n = len; }
+	if(n == 0){ return; }
+
+	if((c->bodylen + n) > c->bodysize){
+		size_t size = (c->bodysize ? c->bodysize : LF_CAPTURE_READ);
+		while(size < (c->bodylen + n)){ size *= 2; }
+
+		char *body = realloc(c->body, size);
+		if(body == NULL){ return; }
+		c->body = body;
+		c->bodysize = size;
+	}
+
+	memcpy(c->body + c->bodylen, data, n);
+	c->bodylen += n;
+}
+
+
+// Refills the script's stream with what's buffered in the source, only
+// waiting for more when there's none
+static void LF_capturefill(FCGX_Stream *stream)
+{
+	LF_capture *c = stream->data;
+	FCGX_Stream *in = c->source;
+
+	int r = 0;
+	if(in->rdNext == in->stop){
+		int ch = FCGX_GetChar(in);
+		if(ch != EOF){ c->buf[r++] = ch; }
+	}
+
+	size_t n = in->stop - in->rdNext;
+	if(n > (size_t)(LF_CAPTURE_READ - r)){ n = LF_CAPTURE_READ - r; }
+	if(n > 0){
+		int got = FCGX_GetStr((char *)c->buf + r, n, in);
+		if(got > 0){ r += got; }
+	}
+
+	if(r == 0){
+		stream->rdNext = stream->stop = c->buf;
+		stream->isClosed = 1;
+		return;
+	}
+
+	LF_capturebody(c, c->buf, r);
+	stream->rdNext = c->buf;
+	stream->stop = c->buf + r;
+}
+
+
+FCGX_Stream *LF_capturestart(LF_capture *c, LF_state *state, FCGX_Stream *in)
+{
+	if(c == NULL){ return in; }
+	c->active = 0;
+
+	if(((double)rand_r(&c->seed) / ((double)RAND_MAX + 1)) >= LF_capturerate ||
+		__atomic_load_n(&LF_capturewritten, __ATOMIC_RELAXED) >= LF_capturemax){
+		return in;
+	}
+
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	c->start = (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+
+	c->active = 1;
+	c->bodylen = 0;
+	c->bodytotal = 0;
+	c->source = in;
+
+	memset(&c->stream, 0, sizeof(FCGX_Stream));
+	c->stream.rdNext = c->stream.stop = c->stream.stopUnget = c->buf;
+	c->stream.isReader = 1;
+	c->stream.fillBuffProc = &LF_capturefill;
+	c->stream.data = c;
+	return &c->stream;
+}
+
+
+static unsigned char *LF_captureput(unsigned char *p, uint64_t v, int bytes)
+{
+	for(int i=0; i < bytes; i++){ *p++ = (v >> (i*8)) & 0xff; }
+	return p;
+}
+
+
+static size_t LF_capturenvlen(unsigned char *p, size_t len)
+{
+	if(len < 128){
+		p[0] = len;
+		return 1;
+	}
+
+	p[0] = ((len >> 24) & 0x7f) | 0x80;
+	p[1] = (len >> 16) & 0xff;
+	p[2] = (len >> 8) & 0xff;
+	p[3] = len & 0xff;
+	return 4;
+}
+
+
+void LF_capturefinish(LF_capture *c, LF_state *state, int status, uintmax_t size)
+{
+	if(c == NULL || !c->active){ return; }
+	c->active = 0;
+
+	// The rest of the body, should the script not have read it all
+	while(!c->stream.isClosed && c->bodylen < LF_capturebodymax){
+		c->stream.rdNext = c->stream.stop;
+		LF_capturefill(&c->stream);
+	}
+
+	size_t paramslen = 0;
+	for(size_t i=0; i < state->nparams; i++){
+		paramslen += 8 + state->params[i].namelen + state->params[i].valuelen;
+	}
+
+	size_t need = LF_CAPTURE_HEADER + paramslen + c->bodylen;
+	if(need > c->recordsize){
+		unsigned char *record = realloc(c->record, need);
+		if(record == NULL){ return; }
+		c->record = record;
+		c->recordsize = need;
+	}
+
+	// Params first, so their real length is known for the header
+	unsigned char *p = c->record + LF_CAPTURE_HEADER;
+	for(size_t i=0; i < state->nparams; i++){
+		const LF_param *param = &state->params[i];
+		p += LF_capturenvlen(p, param->namelen);
+		p += LF_capturenvlen(p, param->valuelen);
+		memcpy(p, param->name, param->namelen);
+		p += param->namelen;
+		memcpy(p, param->value, param->valuelen);
+		p += param->valuelen;
+	}
+	paramslen = p - (c->record + LF_CAPTURE_HEADER);
+
+	if(c->bodylen > 0){ memcpy(p, c->body, c->bodylen); }
+	p += c->bodylen;
+
+	// Cached responses are sent before the request's parsed, so its
+	// length is taken from the params
+	const LF_param *length = LF_getparam(state, "CONTENT_LENGTH", 14);
+	uintmax_t total = (length ? strtoumax(length->value, NULL, 10) : 0);
+	if(c->bodytotal > total){ total = c->bodytotal; }
+	size_t len = p - c->record;
+
+	unsigned char *h = c->record;
+	h = LF_captureput(h, len - 4, 4);
+	h = LF_captureput(h, c->start, 8);
+	h = LF_captureput(h, status, 2);
+	h = LF_captureput(h, size, 8);
+	h = LF_captureput(h, paramslen, 4);
+	h = LF_captureput(h, c->bodylen, 4);
+	h = LF_captureput(h, total, 8);
+
+	pthread_mutex_lock(&LF_capturelock);
+	if((LF_capturewritten + len) <= LF_capturemax && LF_capturewrite(c->record, len) == 0){
+		__atomic_store_n(&LF_capturewritten, LF_capturewritten + len, __ATOMIC_RELAXED);
+	} else {
+		// Full, or the log can't be written, so nothing more is captured
+		__atomic_store_n(&LF_capturewritten, LF_capturemax, __ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(&LF_capturelock);
+}
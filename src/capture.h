@@ -0,0 +1,35 @@
+// Captured requests are appended to a log, after an 8 byte "LFCAPTR1"
+// header, as records of little-endian fields:
+//
+//   uint32  length of the rest of the record
+//   uint64  when the request started, in microseconds since the epoch
+//   uint16  the response's status
+//   uint64  bytes of response sent, header included
+//   uint32  length of the params
+//   uint32  length of the body captured
+//   uint64  length of the body the request had, more if it was cut short
+//   params, as FastCGI name-value pairs
+//   body
+#define LF_CAPTURE_MAGIC  "LFCAPTR1"
+#define LF_CAPTURE_HEADER 38
+
+typedef struct LF_capture LF_capture;
+
+// Opens the log requests are captured to, capturing rate (0 to 1) of
+// them until max bytes have been written, with bodies cut short at
+// bodymax bytes. Returns non-zero if the log couldn't be opened
+int LF_captureinit(const char *, double, size_t, size_t);
+
+// What a request being captured needs, NULL if capturing's off
+LF_capture *LF_newcapture();
+
+// Frees what LF_newcapture() made
+void LF_freecapture(LF_capture *);
+
+// Decides whether to capture a request whose params have been read. If
+// it's captured, the stream returned copies the body as it's read from
+// in, otherwise in is returned
+FCGX_Stream *LF_capturestart(LF_capture *, LF_state *, FCGX_Stream *);
+
+// Logs a request being captured, with its response's status and size
+void LF_capturefinish(LF_capture *, LF_state *, int, uintmax_t);
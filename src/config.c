@@ -1,6 +1,9 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <strings.h>
+#include <limits.h>
+#include <pthread.h>
 
 #include <lua5.1/lua.h>
 #include <lua5.1/lauxlib.h>
@@ -9,6 +12,14 @@
 #include "config.h"
 
 
+// The configuration workers take their settings from, a reference to it
+// is held by whatever's publishing it
+static pthread_mutex_t LF_configlock = PTHREAD_MUTEX_INITIALIZER;
+static LF_config *LF_configcurrent = NULL;
+
+static void LF_freeconfig(LF_config *);
+
+
 // Checks if a file exists
 static int LF_fileexists(char *path)
 {
@@ -17,6 +28,43 @@ static int LF_fileexists(char *path)
 }
 
 
+// Reads a table of prefixes mapped to positive numbers, on top of the
+// stack, into rules. Numbers are capped at max
+static void LF_loadrules(lua_State *l, LF_rule **rules, int *nrules, int max)
+{
+	if(!lua_istable(l, -1)){ return; }
+	int t = lua_gettop(l);
+
+	int count = 0;
+	lua_pushnil(l);
+	while(lua_next(l, t)){
+		count++;
+		lua_pop(l, 1);
+	}
+
+	*rules = malloc(sizeof(LF_rule) * (count > 0 ? count : 1));
+	*nrules = 0;
+
+	lua_pushnil(l);
+	while(*rules != NULL && lua_next(l, t)){
+		if(lua_type(l, -2) == LUA_TSTRING && lua_isnumber(l, -1)){
+			size_t len = 0;
+			const char *str = lua_tolstring(l, -2, &len);
+			int value = lua_tointeger(l, -1);
+
+			if(len > 0 && value > 0){
+				LF_rule *rule = &(*rules)[(*nrules)++];
+				rule->prefix = malloc(len+1);
+				memcpy(rule->prefix, str, len+1);
+				rule->len = len;
+				rule->value = (value > max ? max : value);
+			}
+		}
+		lua_pop(l, 1);
+	}
+}
+
+
 // Create configuration with default settings
 LF_config *LF_createconfig()
 {
@@ -24,19 +72,130 @@ LF_config *LF_createconfig()
 	if(c == NULL){ return NULL; }
 
 	// Default settings
-	c->listen = "127.0.0.1:9222";
+	c->listen = strdup("127.0.0.1:9222");
 	c->backlog = 100;
+	c->listeners = 0;
+	c->event = 0;
+	c->event_connections = 1024;
 	c->threads = 1;
 	c->sandbox = 1;
 	c->mem_max = 65536;
 	c->output_max = 65536;
 	c->cpu_usec = 500000;
 	c->cpu_sec  = 0;
+	c->content_type = strdup("text/html; charset=iso-8859-1");
+	c->script_cache = 1024;
+	c->file_cache = 16777216;
+	c->file_cache_check = 1;
+	c->file_size_max = 16777216;
+	c->state_reuse = 100;
+	c->arena_chunk = 0;
+	c->upload_memory = 8192;
+	c->upload_dir = strdup("/tmp");
+	c->upload_parts_max = 1000;
+	c->upload_files_max = 20;
+	c->output_buffer = 65536;
+
+	c->sendfile = LF_SENDFILE_DIRECT;
+	c->sendfile_prefix = strdup("/");
+	c->compress = NULL;
+	c->ncompress = 0;
+	c->compress_min = 256;
+	c->app_max = 1048576;
+	c->db = NULL;
+	c->db_sync = 1;
+	c->db_ops_max = 100;
+	c->db_bytes_max = 1048576;
+	c->session_cookie = strdup("LFSESSID");
+	c->session_ttl = 1800;
+	c->session_max = 1024;
+	c->session_bytes_max = 65536;
+	c->microcache = NULL;
+	c->nmicrocache = 0;
+	c->microcache_max = 8388608;
+	c->status_path = NULL;
+
+	c->error_log = NULL;
+	c->access_log = NULL;
+
+	c->capture = NULL;
+	c->capture_rate = 1;
+	c->capture_max = 1073741824;
+	c->capture_body_max = 65536;
+
+	c->refs = 1;
+	if(c->listen == NULL || c->content_type == NULL || c->upload_dir == NULL ||
+		c->sendfile_prefix == NULL || c->session_cookie == NULL){
+		LF_freeconfig(c);
+		return NULL;
+	}
 
 	return c;
 }
 
 
+// Frees a configuration and everything it holds
+static void LF_freeconfig(LF_config *c)
+{
+	free(c->listen);
+	free(c->content_type);
+	free(c->upload_dir);
+	free(c->sendfile_prefix);
+	free(c->session_cookie);
+	free(c->status_path);
+	free(c->db);
+	free(c->error_log);
+	free(c->access_log);
+	free(c->capture);
+
+	for(int i=0; i < c->ncompress; i++){ free(c->compress[i].prefix); }
+	free(c->compress);
+	for(int i=0; i < c->nmicrocache; i++){ free(c->microcache[i].prefix); }
+	free(c->microcache);
+
+	free(c);
+}
+
+
+LF_config *LF_configget()
+{
+	pthread_mutex_lock(&LF_configlock);
+	LF_config *c = LF_configcurrent;
+	if(c != NULL){ LF_configref(c); }
+	pthread_mutex_unlock(&LF_configlock);
+	return c;
+}
+
+
+void LF_configref(LF_config *c)
+{
+	__atomic_add_fetch(&c->refs, 1, __ATOMIC_RELAXED);
+}
+
+
+void LF_configrelease(LF_config *c)
+{
+	if(c != NULL && __atomic_sub_fetch(&c->refs, 1, __ATOMIC_ACQ_REL) == 0){ LF_freeconfig(c); }
+}
+
+
+int LF_configchanged(LF_config *c)
+{
+	return (c != __atomic_load_n(&LF_configcurrent, __ATOMIC_ACQUIRE));
+}
+
+
+void LF_configpublish(LF_config *c)
+{
+	pthread_mutex_lock(&LF_configlock);
+	LF_config *old = LF_configcurrent;
+	__atomic_store_n(&LF_configcurrent, c, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&LF_configlock);
+
+	LF_configrelease(old);
+}
+
+
 // Load configuration
 int LF_loadconfig(LF_config *cfg, char *path)
 {
@@ -59,6 +218,7 @@ int LF_loadconfig(LF_config *cfg, char *path)
 			const char *str = lua_tolstring(l, 2, &len);
 
 			if(len > 0){
+				free(cfg->listen);
 				cfg->listen = malloc(len+1);
 				memcpy(cfg->listen, str, len+1);
 			}
@@ -72,6 +232,24 @@ int LF_loadconfig(LF_config *cfg, char *path)
 
 		lua_settop(l, 1);
 
+		lua_pushstring(l, "listeners");
+		lua_rawget(l, 1);
+		if(lua_isnumber(l, 2)){ cfg->listeners = lua_tonumber(l, 2); }
+
+		lua_settop(l, 1);
+
+		lua_pushstring(l, "event");
+		lua_rawget(l, 1);
+		if(lua_isboolean(l, 2)){ cfg->event = lua_toboolean(l, 2); }
+
+		lua_settop(l, 1);
+
+		lua_pushstring(l, "event_connections");
+		lua_rawget(l, 1);
+		if(lua_isnumber(l, 2)){ cfg->event_connections = lua_tonumber(l, 2); }
+
+		lua_settop(l, 1);
+
 		lua_pushstring(l, "threads");
 		lua_rawget(l, 1);
 		if(lua_isnumber(l, 2)){ cfg->threads = lua_tonumber(l, 2); }
@@ -115,10 +293,293 @@ int LF_loadconfig(LF_config *cfg, char *path)
 			const char *str = lua_tolstring(l, 2, &len);
 
 			if(len > 0){
+				free(cfg->content_type);
 				cfg->content_type = malloc(len+1);
 				memcpy(cfg->content_type, str, len+1);
 			}
 		}
+
+		lua_settop(l, 1);
+
+		lua_pushstring(l, "script_cache");
+		lua_rawget(l, 1);
+		if(lua_isnumber(l, 2)){ cfg->script_cache = lua_tonumber(l, 2); }
+
+		lua_settop(l, 1);
+
+		lua_pushstring(l, "file_cache");
+		lua_rawget(l, 1);
+		if(lua_isnumber(l, 2)){ cfg->file_cache = lua_tonumber(l, 2); }
+
+		lua_settop(l, 1);
+
+		lua_pushstring(l, "file_cache_check");
+		lua_rawget(l, 1);
+		if(lua_isnumber(l, 2)){ cfg->file_cache_check = lua_tonumber(l, 2); }
+
+		lua_settop(l, 1);
+
+		lua_pushstring(l, "file_size_max");
+		lua_rawget(l, 1);
+		if(lua_isnumber(l, 2)){ cfg->file_size_max = lua_tonumber(l, 2); }
+
+		lua_settop(l, 1);
+
+		lua_pushstring(l, "state_reuse");
+		lua_rawget(l, 1);
+		if(lua_isnumber(l, 2)){ cfg->state_reuse = lua_tonumber(l, 2); }
+
+		lua_settop(l, 1);
+
+		lua_pushstring(l, "arena_chunk");
+		lua_rawget(l, 1);
+		if(lua_isnumber(l, 2)){ cfg->arena_chunk = lua_tonumber(l, 2); }
+
+		lua_settop(l, 1);
+
+		lua_pushstring(l, "upload_memory");
+		lua_rawget(l, 1);
+		if(lua_isnumber(l, 2)){ cfg->upload_memory = lua_tonumber(l, 2); }
+
+		lua_settop(l, 1);
+
+		lua_pushstring(l, "upload_dir");
+		lua_rawget(l, 1);
+		if(lua_isstring(l, 2)){
+			size_t len = 0;
+			const char *str = lua_tolstring(l, 2, &len);
+
+			if(len > 0){
+				free(cfg->upload_dir);
+				cfg->upload_dir = malloc(len+1);
+				memcpy(cfg->upload_dir, str, len+1);
+			}
+		}
+
+		lua_settop(l, 1);
+
+		lua_pushstring(l, "upload_parts_max");
+		lua_rawget(l, 1);
+		if(lua_isnumber(l, 2)){ cfg->upload_parts_max = lua_tonumber(l, 2); }
+
+		lua_settop(l, 1);
+
+		lua_pushstring(l, "upload_files_max");
+		lua_rawget(l, 1);
+		if(lua_isnumber(l, 2)){ cfg->upload_files_max = lua_tonumber(l, 2); }
+
+		lua_settop(l, 1);
+
+		lua_pushstring(l, "output_buffer");
+		lua_rawget(l, 1);
+		if(lua_isnumber(l, 2)){ cfg->output_buffer = lua_tonumber(l, 2); }
+
+		lua_settop(l, 1);
+
+		lua_pushstring(l, "sendfile");
+		lua_rawget(l, 1);
+		if(lua_isstring(l, 2)){
+			const char *str = lua_tostring(l, 2);
+
+			if(strcasecmp(str, "x-accel-redirect") == 0){
+				cfg->sendfile = LF_SENDFILE_XACCEL;
+			} else if(strcasecmp(str, "x-sendfile") == 0){
+				cfg->sendfile = LF_SENDFILE_XSENDFILE;
+			} else {
+				cfg->sendfile = LF_SENDFILE_DIRECT;
+			}
+		}
+
+		lua_settop(l, 1);
+
+		lua_pushstring(l, "sendfile_prefix");
+		lua_rawget(l, 1);
+		if(lua_isstring(l, 2)){
+			size_t len = 0;
+			const char *str = lua_tolstring(l, 2, &len);
+
+			if(len > 0){
+				free(cfg->sendfile_prefix);
+				cfg->sendfile_prefix = malloc(len+1);
+				memcpy(cfg->sendfile_prefix, str, len+1);
+			}
+		}
+
+		lua_settop(l, 1);
+
+		// Content type prefixes mapped to compression levels
+		lua_pushstring(l, "compress");
+		lua_rawget(l, 1);
+		LF_loadrules(l, &cfg->compress, &cfg->ncompress, 9);
+
+		lua_settop(l, 1);
+
+		lua_pushstring(l, "compress_min");
+		lua_rawget(l, 1);
+		if(lua_isnumber(l, 2)){ cfg->compress_min = lua_tonumber(l, 2); }
+
+		lua_settop(l, 1);
+
+		lua_pushstring(l, "app_max");
+		lua_rawget(l, 1);
+		if(lua_isnumber(l, 2)){ cfg->app_max = lua_tonumber(l, 2); }
+
+		lua_settop(l, 1);
+
+		lua_pushstring(l, "db");
+		lua_rawget(l, 1);
+		if(lua_isstring(l, 2)){
+			size_t len = 0;
+			const char *str = lua_tolstring(l, 2, &len);
+
+			if(len > 0){
+				free(cfg->db);
+				cfg->db = malloc(len+1);
+				memcpy(cfg->db, str, len+1);
+			}
+		}
+
+		lua_settop(l, 1);
+
+		lua_pushstring(l, "db_sync");
+		lua_rawget(l, 1);
+		if(lua_isboolean(l, 2)){ cfg->db_sync = lua_toboolean(l, 2); }
+
+		lua_settop(l, 1);
+
+		lua_pushstring(l, "db_ops_max");
+		lua_rawget(l, 1);
+		if(lua_isnumber(l, 2)){ cfg->db_ops_max = lua_tonumber(l, 2); }
+
+		lua_settop(l, 1);
+
+		lua_pushstring(l, "db_bytes_max");
+		lua_rawget(l, 1);
+		if(lua_isnumber(l, 2)){ cfg->db_bytes_max = lua_tonumber(l, 2); }
+
+		lua_settop(l, 1);
+
+		lua_pushstring(l, "session_cookie");
+		lua_rawget(l, 1);
+		if(lua_isstring(l, 2)){
+			size_t len = 0;
+			const char *str = lua_tolstring(l, 2, &len);
+
+			if(len > 0){
+				free(cfg->session_cookie);
+				cfg->session_cookie = malloc(len+1);
+				memcpy(cfg->session_cookie, str, len+1);
+			}
+		}
+
+		lua_settop(l, 1);
+
+		lua_pushstring(l, "session_ttl");
+		lua_rawget(l, 1);
+		if(lua_isnumber(l, 2)){ cfg->session_ttl = lua_tonumber(l, 2); }
+
+		lua_settop(l, 1);
+
+		lua_pushstring(l, "session_max");
+		lua_rawget(l, 1);
+		if(lua_isnumber(l, 2)){ cfg->session_max = lua_tonumber(l, 2); }
+
+		lua_settop(l, 1);
+
+		lua_pushstring(l, "session_bytes_max");
+		lua_rawget(l, 1);
+		if(lua_isnumber(l, 2)){ cfg->session_bytes_max = lua_tonumber(l, 2); }
+
+		lua_settop(l, 1);
+
+		// Script name prefixes mapped to seconds to cache responses for
+		lua_pushstring(l, "microcache");
+		lua_rawget(l, 1);
+		LF_loadrules(l, &cfg->microcache, &cfg->nmicrocache, INT_MAX);
+
+		lua_settop(l, 1);
+
+		lua_pushstring(l, "microcache_max");
+		lua_rawget(l, 1);
+		if(lua_isnumber(l, 2)){ cfg->microcache_max = lua_tonumber(l, 2); }
+
+		lua_settop(l, 1);
+
+		lua_pushstring(l, "status_path");
+		lua_rawget(l, 1);
+		if(lua_isstring(l, 2)){
+			size_t len = 0;
+			const char *str = lua_tolstring(l, 2, &len);
+
+			if(len > 0){
+				free(cfg->status_path);
+				cfg->status_path = malloc(len+1);
+				memcpy(cfg->status_path, str, len+1);
+			}
+		}
+
+		lua_settop(l, 1);
+
+		lua_pushstring(l, "error_log");
+		lua_rawget(l, 1);
+		if(lua_isstring(l, 2)){
+			size_t len = 0;
+			const char *str = lua_tolstring(l, 2, &len);
+
+			if(len > 0){
+				free(cfg->error_log);
+				cfg->error_log = malloc(len+1);
+				memcpy(cfg->error_log, str, len+1);
+			}
+		}
+
+		lua_settop(l, 1);
+
+		lua_pushstring(l, "access_log");
+		lua_rawget(l, 1);
+		if(lua_isstring(l, 2)){
+			size_t len = 0;
+			const char *str = lua_tolstring(l, 2, &len);
+
+			if(len > 0){
+				free(cfg->access_log);
+				cfg->access_log = malloc(len+1);
+				memcpy(cfg->access_log, str, len+1);
+			}
+		}
+
+		lua_settop(l, 1);
+
+		lua_pushstring(l, "capture");
+		lua_rawget(l, 1);
+		if(lua_isstring(l, 2)){
+			size_t len = 0;
+			const char *str = lua_tolstring(l, 2, &len);
+
+			if(len > 0){
+				free(cfg->capture);
+				cfg->capture = malloc(len+1);
+				memcpy(cfg->capture, str, len+1);
+			}
+		}
+
+		lua_settop(l, 1);
+
+		lua_pushstring(l, "capture_rate");
+		lua_rawget(l, 1);
+		if(lua_isnumber(l, 2)){ cfg->capture_rate = lua_tonumber(l, 2); }
+
+		lua_settop(l, 1);
+
+		lua_pushstring(l, "capture_max");
+		lua_rawget(l, 1);
+		if(lua_isnumber(l, 2)){ cfg->capture_max = lua_tonumber(l, 2); }
+
+		lua_settop(l, 1);
+
+		lua_pushstring(l, "capture_body_max");
+		lua_rawget(l, 1);
+		if(lua_isnumber(l, 2)){ cfg->capture_body_max = lua_tonumber(l, 2); }
 	}
 
 	lua_close(l);
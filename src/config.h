@@ -1,6 +1,21 @@
+// A prefix, of a content type or script name, and what it's mapped to
+typedef struct LF_rule {
+	char *prefix;
+	size_t len;
+	int value;
+} LF_rule;
+
+// How sendfile() responds
+#define LF_SENDFILE_DIRECT    0
+#define LF_SENDFILE_XACCEL    1
+#define LF_SENDFILE_XSENDFILE 2
+
 typedef struct {
 	char *listen;
 	int backlog;
+	int listeners;
+	int event;
+	int event_connections;
 	int threads;
 
 	int sandbox;
@@ -10,7 +25,74 @@ typedef struct {
 	unsigned long cpu_sec;
 
 	char *content_type;
+
+	size_t script_cache;
+	size_t file_cache;
+	int file_cache_check;
+	size_t file_size_max;
+	int state_reuse;
+	size_t arena_chunk;
+
+	size_t upload_memory;
+	char *upload_dir;
+	int upload_parts_max;
+	int upload_files_max;
+
+	size_t output_buffer;
+
+	int sendfile;
+	char *sendfile_prefix;
+
+	LF_rule *compress;
+	int ncompress;
+	size_t compress_min;
+
+	size_t app_max;
+
+	char *db;
+	int db_sync;
+	size_t db_ops_max;
+	size_t db_bytes_max;
+
+	char *session_cookie;
+	int session_ttl;
+	size_t session_max;
+	size_t session_bytes_max;
+
+	LF_rule *microcache;
+	int nmicrocache;
+	size_t microcache_max;
+
+	char *status_path;
+
+	char *error_log;
+	char *access_log;
+
+	char *capture;
+	double capture_rate;
+	size_t capture_max;
+	size_t capture_body_max;
+
+	// References held to it, it's freed once they're all released
+	int refs;
 } LF_config;
 
+// Creates a configuration with default settings, referenced once
 LF_config *LF_createconfig();
 int LF_loadconfig(LF_config *, char *);
+
+// Takes a reference to the published configuration
+LF_config *LF_configget();
+
+// Takes another reference to a configuration already referenced
+void LF_configref(LF_config *);
+
+// Releases a reference, freeing the configuration once there are none
+void LF_configrelease(LF_config *);
+
+// Whether a configuration's been replaced since it was published
+int LF_configchanged(LF_config *);
+
+// Publishes a configuration for workers to pick up between requests,
+// taking over the caller's reference to it
+void LF_configpublish(LF_config *);
@@ -0,0 +1,906 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <zlib.h>
+#include <fcgiapp.h>
+
+#include <lua5.1/lua.h>
+#include <lua5.1/lauxlib.h>
+
+#include "lua.h"
+#include "pack.h"
+#include "db.h"
+
+
+// The log starts with this, followed by records of a CRC32 of the rest of
+// the record, the key's length, the value's length or LF_DB_DELETED, then
+// the key and packed value, all in the machine's own byte order
+#define LF_DB_MAGIC   "LFDB0001"
+#define LF_DB_HEADER  12
+#define LF_DB_DELETED 0xffffffffu
+
+#define LF_DB_KEYMAX  65535
+#define LF_DB_BUCKETS 1024
+
+// Least the log's mapped with, it's remapped at twice its size as it grows
+#define LF_DB_MAPMIN  1048576
+
+// The log's compacted once it holds more dead records than live ones, and
+// at least this many bytes of them
+#define LF_DB_COMPACTMIN 1048576
+#define LF_DB_COMPACTBUF 1048576
+
+// Most keys DB.scan() returns by default
+#define LF_DB_SCANLIMIT 100
+
+
+// A key, and where its value is in the log
+typedef struct LF_dbentry {
+	uint32_t hash;
+	uint32_t keylen;
+	uint32_t len;
+	uint64_t off;
+
+	struct LF_dbentry *next;
+	char key[];
+} LF_dbentry;
+
+// A record being moved from one log to another as it's compacted
+typedef struct {
+	uint64_t from;
+	uint64_t to;
+	size_t size;
+} LF_dbmove;
+
+
+static char *LF_dbpath = NULL;
+static int LF_dbfd = -1;
+static int LF_dbsync = 1;
+static size_t LF_dbopsmax = 0;
+static size_t LF_dbbytesmax = 0;
+
+// The index and mapping, read locked to read values out, write locked to
+// change what's in them
+static pthread_rwlock_t LF_dbindexlock = PTHREAD_RWLOCK_INITIALIZER;
+static LF_dbentry **LF_dbbuckets = NULL;
+static size_t LF_dbnbuckets = 0;
+static size_t LF_dbcount = 0;
+static char *LF_dbmap = NULL;
+static size_t LF_dbmaplen = 0;
+
+// Held by whatever's appending to the log, and while it's compacted. The
+// index only changes while it's held
+static pthread_mutex_t LF_dbwritelock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t LF_dbend = 0;
+static uint64_t LF_dblive = 0;
+
+// Writes are numbered, one fsync commits every write before it
+static pthread_mutex_t LF_dbsynclock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t LF_dbsynccond = PTHREAD_COND_INITIALIZER;
+static uint64_t LF_dbwritten = 0;
+static uint64_t LF_dbsynced = 0;
+static int LF_dbsyncing = 0;
+
+// Set, under the sync lock, to have the database's thread sync writes
+// the event workers don't wait for
+static pthread_cond_t LF_dbkickcond = PTHREAD_COND_INITIALIZER;
+static int LF_dbkicked = 0;
+
+// Records are built in, and values copied out to, here
+static __thread LF_packbuf LF_dbbuf = { NULL, 0, 0 };
+static __thread LF_dbentry **LF_dbmatches = NULL;
+static __thread size_t LF_dbmatchsize = 0;
+
+
+static inline uint32_t LF_dbhash(const char *key, size_t len)
+{
+	uint32_t h = 2166136261u;
+	for(size_t i=0; i < len; i++){
+		h ^= (unsigned char)key[i];
+		h *= 16777619u;
+	}
+	return h;
+}
+
+
+static inline size_t LF_dbsize(LF_dbentry *e)
+{
+	return LF_DB_HEADER + e->keylen + e->len;
+}
+
+
+// Finds the link to a key's entry, or to where it would go. NULL if the
+// index has no buckets
+static LF_dbentry **LF_dbfind(uint32_t hash, const char *key, size_t keylen)
+{
+	if(LF_dbbuckets == NULL){ return NULL; }
+
+	LF_dbentry **p = &LF_dbbuckets[hash & (LF_dbnbuckets - 1)];
+	for(; *p != NULL; p = &(*p)->next){
+		LF_dbentry *e = *p;
+		if(e->hash == hash && e->keylen == keylen && memcmp(e->key, key, keylen) == 0){ break; }
+	}
+	return p;
+}
+
+
+// Doubles the buckets once there are as many keys. Failing to grow only
+// makes the chains longer
+static void LF_dbgrow()
+{
+	if(LF_dbbuckets != NULL && LF_dbcount < LF_dbnbuckets){ return; }
+
+	size_t n = (LF_dbnbuckets ? LF_dbnbuckets * 2 : LF_DB_BUCKETS);
+	LF_dbentry **buckets = calloc(n, sizeof(LF_dbentry *));
+	if(buckets == NULL){ return; }
+
+	for(size_t i=0; i < LF_dbnbuckets; i++){
+		LF_dbentry *e = LF_dbbuckets[i];
+		while(e != NULL){
+			LF_dbentry *next = e->next;
+			LF_dbentry **b = &buckets[e->hash & (n - 1)];
+			e->next = *b;
+			*b = e;
+			e = next;
+		}
+	}
+
+	free(LF_dbbuckets);
+	LF_dbbuckets = buckets;
+	LF_dbnbuckets = n;
+}
+
+
+// Points a key at a value at off in the log, or removes it if len is
+// LF_DB_DELETED, keeping count of the live records. Returns non-zero if
+// there isn't the memory
+static int LF_dbindex(uint32_t hash, const char *key, size_t keylen, uint64_t off, uint32_t len)
+{
+	LF_dbentry **p = LF_dbfind(hash, key, keylen);
+	if(p != NULL && *p != NULL){
+		LF_dbentry *e = *p;
+		LF_dblive -= LF_dbsize(e);
+
+		if(len != LF_DB_DELETED){
+			e->off = off;
+			e->len = len;
+			LF_dblive += LF_dbsize(e);
+			return 0;
+		}
+
+		*p = e->next;
+		LF_dbcount--;
+		free(e);
+		return 0;
+	}
+	if(len == LF_DB_DELETED){ return 0; }
+
+	LF_dbentry *e = malloc(sizeof(LF_dbentry) + keylen);
+	if(e == NULL){ return 1; }
+
+	e->hash = hash;
+	e->keylen = keylen;
+	e->len = len;
+	e->off = off;
+	memcpy(e->key, key, keylen);
+
+	LF_dbgrow();
+	if((p = LF_dbfind(hash, key, keylen)) == NULL){
+		free(e);
+		return 1;
+	}
+
+	e->next = NULL;
+	*p = e;
+	LF_dbcount++;
+	LF_dblive += LF_dbsize(e);
+	return 0;
+}
+
+
+static uint32_t LF_dbcrc(const char *record, size_t len)
+{
+	return crc32(0, (const Bytef *)record + 4, len - 4);
+}
+
+
+// Maps the log with room to grow into past len. Past its end is never
+// read, so isn't touched
+static char *LF_dbmapfile(int fd, uint64_t len, size_t *maplen)
+{
+	size_t size = LF_DB_MAPMIN;
+	while(size < len * 2){ size *= 2; }
+
+	char *map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+	if(map == MAP_FAILED){ return NULL; }
+
+	*maplen = size;
+	return map;
+}
+
+
+static int LF_dbwrite(int fd, const char *data, size_t len, uint64_t off)
+{
+	while(len > 0){
+		ssize_t r = pwrite(fd, data, len, off);
+		if(r == -1){
+			if(errno == EINTR){ continue; }
+			return 1;
+		}
+		data += r;
+		len -= r;
+		off += r;
+	}
+	return 0;
+}
+
+
+// Syncs the log's directory, so a rename into it lasts
+static void LF_dbsyncdir()
+{
+	const char *slash = strrchr(LF_dbpath, '/');
+	size_t len = (slash ? (size_t)(slash - LF_dbpath) : 0);
+
+	char dir[len+2];
+	if(slash == NULL){ strcpy(dir, "."); }
+	else if(len == 0){ strcpy(dir, "/"); }
+	else {
+		memcpy(dir, LF_dbpath, len);
+		dir[len] = 0;
+	}
+
+	int fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if(fd == -1){ return; }
+	fsync(fd);
+	close(fd);
+}
+
+
+// Waits for everything up to the seq'th write to be synced. Whoever gets
+// there first syncs for everyone waiting, so concurrent writes share one
+// fsync. Returns non-zero if the sync failed
+static int LF_dbcommit(uint64_t seq)
+{
+	int r = 0;
+
+	pthread_mutex_lock(&LF_dbsynclock);
+	while(LF_dbsynced < seq){
+		if(LF_dbsyncing){
+			pthread_cond_wait(&LF_dbsynccond, &LF_dbsynclock);
+			continue;
+		}
+
+		LF_dbsyncing = 1;
+		uint64_t target = __atomic_load_n(&LF_dbwritten, __ATOMIC_ACQUIRE);
+		int fd = LF_dbfd;
+		pthread_mutex_unlock(&LF_dbsynclock);
+
+		r = fdatasync(fd);
+
+		pthread_mutex_lock(&LF_dbsynclock);
+		LF_dbsyncing = 0;
+		if(r == 0 && target > LF_dbsynced){ LF_dbsynced = target; }
+		pthread_cond_broadcast(&LF_dbsynccond);
+		if(r){ break; }
+	}
+	pthread_mutex_unlock(&LF_dbsynclock);
+
+	return r;
+}
+
+
+// Has the database's thread sync what's been written, without waiting
+static void LF_dbkick()
+{
+	pthread_mutex_lock(&LF_dbsynclock);
+	LF_dbkicked = 1;
+	pthread_cond_signal(&LF_dbkickcond);
+	pthread_mutex_unlock(&LF_dbsynclock);
+}
+
+
+// Appends the record built in the thread's buffer and indexes it. If
+// writes are synced and wait is set, waits for it to be, otherwise it's
+// left to the database's thread. Returns non-zero on failure
+static int LF_dbappend(uint32_t hash, const char *key, uint32_t keylen, uint32_t len, int wait)
+{
+	char *record = LF_dbbuf.data;
+	size_t size = LF_dbbuf.len;
+	memcpy(record + 4, &keylen, 4);
+	memcpy(record + 8, &len, 4);
+
+	uint32_t crc = LF_dbcrc(record, size);
+	memcpy(record, &crc, 4);
+
+	pthread_mutex_lock(&LF_dbwritelock);
+	uint64_t off = LF_dbend;
+
+	// Keys that aren't there have nothing to delete. The index only
+	// changes with the lock held, so it's read without its own
+	if(len == LF_DB_DELETED){
+		LF_dbentry **p = LF_dbfind(hash, key, keylen);
+		if(p == NULL || *p == NULL){
+			pthread_mutex_unlock(&LF_dbwritelock);
+			return 0;
+		}
+	}
+
+	// Grows the mapping first, so the record's never written without
+	// being readable
+	if((off + size) > LF_dbmaplen){
+		size_t maplen;
+		char *map = LF_dbmapfile(LF_dbfd, off + size, &maplen);
+		if(map == NULL){
+			pthread_mutex_unlock(&LF_dbwritelock);
+			return 1;
+		}
+
+		pthread_rwlock_wrlock(&LF_dbindexlock);
+		char *old = LF_dbmap;
+		size_t oldlen = LF_dbmaplen;
+		LF_dbmap = map;
+		LF_dbmaplen = maplen;
+		pthread_rwlock_unlock(&LF_dbindexlock);
+		munmap(old, oldlen);
+	}
+
+	// Half a record is cut back off, to not be left in the way of the next
+	if(LF_dbwrite(LF_dbfd, record, size, off)){
+		if(ftruncate(LF_dbfd, off)){}
+		pthread_mutex_unlock(&LF_dbwritelock);
+		return 1;
+	}
+	LF_dbend = off + size;
+
+	pthread_rwlock_wrlock(&LF_dbindexlock);
+	int r = LF_dbindex(hash, key, keylen, off + LF_DB_HEADER + keylen, len);
+	pthread_rwlock_unlock(&LF_dbindexlock);
+
+	uint64_t seq = __atomic_add_fetch(&LF_dbwritten, 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&LF_dbwritelock);
+
+	if(r){ return 1; }
+	if(!LF_dbsync){ return 0; }
+	if(!wait){
+		LF_dbkick();
+		return 0;
+	}
+	return LF_dbcommit(seq);
+}
+
+
+// Copies len bytes of one log to another through buf
+static int LF_dbcopy(int from, uint64_t off, int to, uint64_t dst, size_t len, char *buf)
+{
+	while(len > 0){
+		size_t n = (len < LF_DB_COMPACTBUF ? len : LF_DB_COMPACTBUF);
+		ssize_t r = pread(from, buf, n, off);
+		if(r == -1 && errno == EINTR){ continue; }
+		if(r <= 0 || LF_dbwrite(to, buf, r, dst)){ return 1; }
+
+		off += r;
+		dst += r;
+		len -= r;
+	}
+	return 0;
+}
+
+
+static int LF_dbmovecompare(const void *a, const void *b)
+{
+	uint64_t x = ((const LF_dbmove *)a)->from, y = ((const LF_dbmove *)b)->from;
+	return (x > y) - (x < y);
+}
+
+
+// Where a live record's been moved to
+static uint64_t LF_dbmoved(LF_dbmove *moves, size_t n, uint64_t from)
+{
+	size_t lo = 0, hi = n;
+	while(lo < hi){
+		size_t mid = lo + (hi - lo) / 2;
+		if(moves[mid].from < from){ lo = mid + 1; }
+		else { hi = mid; }
+	}
+	return moves[lo].to;
+}
+
+
+// Rewrites the log with only its live records, once there's enough dead
+// in it. The records live when it starts are copied while writes carry
+// on. Writes only wait while whatever they appended meanwhile is copied
+// after them, and the new log is swapped in
+static void LF_dbcompact()
+{
+	pthread_mutex_lock(&LF_dbwritelock);
+
+	uint64_t dead = (LF_dbend - 8) - LF_dblive;
+	if(dead < LF_DB_COMPACTMIN || dead < LF_dblive){
+		pthread_mutex_unlock(&LF_dbwritelock);
+		return;
+	}
+
+	// Where the live records are. Nothing else changes the index while
+	// writes wait, so it's walked without its lock
+	size_t nmoves = 0;
+	LF_dbmove *moves = malloc(sizeof(LF_dbmove) * (LF_dbcount > 0 ? LF_dbcount : 1));
+	if(moves == NULL){
+		pthread_mutex_unlock(&LF_dbwritelock);
+		return;
+	}
+	for(size_t i=0; i < LF_dbnbuckets; i++){
+		for(LF_dbentry *e = LF_dbbuckets[i]; e != NULL; e = e->next){
+			moves[nmoves].from = e->off - LF_DB_HEADER - e->keylen;
+			moves[nmoves].size = LF_dbsize(e);
+			nmoves++;
+		}
+	}
+
+	// Only this thread ever replaces the log, so it stays open
+	uint64_t snap = LF_dbend;
+	int old = LF_dbfd;
+	pthread_mutex_unlock(&LF_dbwritelock);
+
+	qsort(moves, nmoves, sizeof(LF_dbmove), &LF_dbmovecompare);
+
+	size_t pathlen = strlen(LF_dbpath);
+	char path[pathlen + 9];
+	memcpy(path, LF_dbpath, pathlen);
+	memcpy(path + pathlen, ".compact", 9);
+
+	int locked = 0;
+	char *buf = malloc(LF_DB_COMPACTBUF);
+	int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if(buf == NULL || fd == -1 || LF_dbwrite(fd, LF_DB_MAGIC, 8, 0)){ goto fail; }
+
+	// Records next to each other are copied together
+	uint64_t end = 8;
+	for(size_t i=0; i < nmoves;){
+		size_t run = 0, j = i;
+		for(; j < nmoves && moves[j].from == moves[i].from + run; j++){
+			moves[j].to = end + run;
+			run += moves[j].size;
+		}
+
+		if(LF_dbcopy(old, moves[i].from, fd, end, run, buf)){ goto fail; }
+		end += run;
+		i = j;
+	}
+	if(fdatasync(fd)){ goto fail; }
+
+	// Then whatever was written meanwhile, as it is
+	pthread_mutex_lock(&LF_dbwritelock);
+	locked = 1;
+
+	uint64_t tail = end, taillen = LF_dbend - snap;
+	if(taillen > 0 && (LF_dbcopy(old, snap, fd, tail, taillen, buf) || fdatasync(fd))){ goto fail; }
+	end += taillen;
+
+	size_t maplen;
+	char *map = LF_dbmapfile(fd, end, &maplen);
+	if(map == NULL){ goto fail; }
+
+	if(rename(path, LF_dbpath)){
+		munmap(map, maplen);
+		goto fail;
+	}
+	LF_dbsyncdir();
+
+	// Every write so far is in the new log, and already synced
+	pthread_mutex_lock(&LF_dbsynclock);
+	while(LF_dbsyncing){ pthread_cond_wait(&LF_dbsynccond, &LF_dbsynclock); }
+
+	pthread_rwlock_wrlock(&LF_dbindexlock);
+	char *oldmap = LF_dbmap;
+	size_t oldlen = LF_dbmaplen;
+	LF_dbmap = map;
+	LF_dbmaplen = maplen;
+
+	uint64_t live = 0;
+	for(size_t i=0; i < LF_dbnbuckets; i++){
+		for(LF_dbentry *e = LF_dbbuckets[i]; e != NULL; e = e->next){
+			uint64_t from = e->off - LF_DB_HEADER - e->keylen;
+			uint64_t to = (from >= snap ? tail + (from - snap) : LF_dbmoved(moves, nmoves, from));
+			e->off = to + LF_DB_HEADER + e->keylen;
+			live += LF_dbsize(e);
+		}
+	}
+	pthread_rwlock_unlock(&LF_dbindexlock);
+
+	close(old);
+	LF_dbfd = fd;
+	LF_dbsynced = __atomic_load_n(&LF_dbwritten, __ATOMIC_ACQUIRE);
+	pthread_cond_broadcast(&LF_dbsynccond);
+	pthread_mutex_unlock(&LF_dbsynclock);
+
+	munmap(oldmap, oldlen);
+	LF_dbend = end;
+	LF_dblive = live;
+
+	pthread_mutex_unlock(&LF_dbwritelock);
+	free(moves);
+	free(buf);
+	return;
+
+	fail:
+	if(fd != -1){
+		close(fd);
+		unlink(path);
+	}
+	if(locked){ pthread_mutex_unlock(&LF_dbwritelock); }
+	free(moves);
+	free(buf);
+}
+
+
+// Syncs writes that aren't waited on every second, or as soon as an event
+// worker's written, and compacts the log every second
+static void *LF_dbthread(void *arg)
+{
+	struct timespec next;
+	clock_gettime(CLOCK_REALTIME, &next);
+
+	for(;;){
+		next.tv_sec++;
+
+		pthread_mutex_lock(&LF_dbsynclock);
+		for(;;){
+			while(!LF_dbkicked && pthread_cond_timedwait(&LF_dbkickcond, &LF_dbsynclock, &next) == 0){}
+			if(!LF_dbkicked){ break; }
+
+			LF_dbkicked = 0;
+			pthread_mutex_unlock(&LF_dbsynclock);
+			LF_dbcommit(__atomic_load_n(&LF_dbwritten, __ATOMIC_ACQUIRE));
+			pthread_mutex_lock(&LF_dbsynclock);
+		}
+		pthread_mutex_unlock(&LF_dbsynclock);
+
+		if(!LF_dbsync){ LF_dbcommit(__atomic_load_n(&LF_dbwritten, __ATOMIC_ACQUIRE)); }
+		LF_dbcompact();
+	}
+	return NULL;
+}
+
+
+// Indexes every record in the log, cutting off whatever follows the
+// first that's torn or corrupt
+static int LF_dbload(int fd, uint64_t size)
+{
+	if(size == 0){
+		if(LF_dbwrite(fd, LF_DB_MAGIC, 8, 0)){ return 1; }
+		size = 8;
+	}
+
+	if((LF_dbmap = LF_dbmapfile(fd, size, &LF_dbmaplen)) == NULL){ return 1; }
+	if(size < 8 || memcmp(LF_dbmap, LF_DB_MAGIC, 8) != 0){ return 1; }
+
+	uint64_t off = 8;
+	while((size - off) >= LF_DB_HEADER){
+		const char *record = LF_dbmap + off;
+		uint32_t crc, keylen, len;
+		memcpy(&crc, record, 4);
+		memcpy(&keylen, record + 4, 4);
+		memcpy(&len, record + 8, 4);
+
+		uint64_t rsize = LF_DB_HEADER + (uint64_t)keylen + (len == LF_DB_DELETED ? 0 : len);
+		if(keylen > LF_DB_KEYMAX || rsize > (size - off) || LF_dbcrc(record, rsize) != crc){ break; }
+
+		const char *key = record + LF_DB_HEADER;
+		if(LF_dbindex(LF_dbhash(key, keylen), key, keylen, off + LF_DB_HEADER + keylen, len)){ return 1; }
+		off += rsize;
+	}
+
+	if(off < size && ftruncate(fd, off)){ return 1; }
+	LF_dbend = off;
+	return 0;
+}
+
+
+int LF_dbinit(const char *path, int sync, size_t ops, size_t bytes)
+{
+	if(path == NULL){ return 0; }
+
+	int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if(fd == -1){ return 1; }
+
+	struct stat sb;
+	if(fstat(fd, &sb) || LF_dbload(fd, sb.st_size)){
+		close(fd);
+		return 1;
+	}
+
+	LF_dbpath = strdup(path);
+	LF_dbfd = fd;
+	LF_dbsync = sync;
+	LF_dbopsmax = ops;
+	LF_dbbytesmax = bytes;
+
+	pthread_t thread;
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	int r = pthread_create(&thread, &attr, &LF_dbthread, NULL);
+	pthread_attr_destroy(&attr);
+
+	if(r){
+		close(fd);
+		LF_dbfd = -1;
+		return 1;
+	}
+	return 0;
+}
+
+
+// The request's gone over a limit, counted as one of the limits tripped
+static int LF_dblimit(lua_State *l, LF_state *state)
+{
+	state->trips |= LF_TRIPDB;
+	return luaL_error(l, "Database limit exceeded.");
+}
+
+
+// Counts operations and bytes against the request's limits
+static void LF_dbcharge(lua_State *l, size_t ops, size_t bytes)
+{
+	LF_state *state = LF_getstate(l);
+	if(state == NULL){ return; }
+
+	state->db_ops += ops;
+	state->db_bytes += bytes;
+	if((LF_dbopsmax > 0 && state->db_ops > LF_dbopsmax) ||
+		(LF_dbbytesmax > 0 && state->db_bytes > LF_dbbytesmax)){
+		LF_dblimit(l, state);
+	}
+}
+
+
+// Bytes the request may still move, before going over its limit
+static size_t LF_dbremaining(lua_State *l)
+{
+	LF_state *state = LF_getstate(l);
+	if(state == NULL || LF_dbbytesmax == 0){ return SIZE_MAX; }
+	return (state->db_bytes < LF_dbbytesmax ? LF_dbbytesmax - state->db_bytes : 0);
+}
+
+
+static const char *LF_dbcheckkey(lua_State *l, size_t *keylen)
+{
+	const char *key = luaL_checklstring(l, 1, keylen);
+	if(*keylen > LF_DB_KEYMAX){ luaL_argerror(l, 1, "key too long"); }
+	return key;
+}
+
+
+static int LF_dbreserve(LF_packbuf *buf, size_t len)
+{
+	if(len <= buf->size){ return 0; }
+
+	size_t size = (buf->size ? buf->size : 256);
+	while(size < len){ size *= 2; }
+
+	char *data = realloc(buf->data, size);
+	if(data == NULL){ return 1; }
+	buf->data = data;
+	buf->size = size;
+	return 0;
+}
+
+
+// DB.get(key), the value stored for key or nil
+static int LF_dbget(lua_State *l)
+{
+	size_t keylen;
+	const char *key = LF_dbcheckkey(l, &keylen);
+	LF_dbcharge(l, 1, keylen);
+
+	uint32_t hash = LF_dbhash(key, keylen);
+	int found = 0;
+
+	// Lua may raise errors while unpacking, so the value's copied out
+	// to be unpacked once the lock's released
+	pthread_rwlock_rdlock(&LF_dbindexlock);
+	LF_dbentry **p = LF_dbfind(hash, key, keylen);
+	if(p != NULL && *p != NULL && LF_dbreserve(&LF_dbbuf, (*p)->len) == 0){
+		memcpy(LF_dbbuf.data, LF_dbmap + (*p)->off, (*p)->len);
+		LF_dbbuf.len = (*p)->len;
+		found = 1;
+	}
+	pthread_rwlock_unlock(&LF_dbindexlock);
+
+	if(!found){
+		lua_pushnil(l);
+		return 1;
+	}
+
+	LF_dbcharge(l, 0, LF_dbbuf.len);
+	if(LF_unpack(l, LF_dbbuf.data, LF_dbbuf.len)){ lua_pushnil(l); }
+	return 1;
+}
+
+
+// DB.put(key, value), stores value for key once it's written to the log,
+// and synced if db_sync is set and it's not running in event mode. A nil
+// value deletes the key. Returns false if it couldn't be written
+static int LF_dbput(lua_State *l)
+{
+	size_t keylen;
+	const char *key = LF_dbcheckkey(l, &keylen);
+	int del = lua_isnoneornil(l, 2);
+
+	// The record's built around the packed value
+	LF_dbbuf.len = 0;
+	if(LF_dbreserve(&LF_dbbuf, LF_DB_HEADER + keylen)){ luaL_error(l, "Not enough memory."); }
+	memcpy(LF_dbbuf.data + LF_DB_HEADER, key, keylen);
+	LF_dbbuf.len = LF_DB_HEADER + keylen;
+
+	if(!del){
+		switch(LF_pack(l, 2, &LF_dbbuf)){
+			case 1: luaL_argerror(l, 2, "can't be stored"); break;
+			case 2: luaL_error(l, "Not enough memory."); break;
+		}
+	}
+
+	size_t len = LF_dbbuf.len - LF_DB_HEADER - keylen;
+	if(len >= LF_DB_DELETED){ luaL_argerror(l, 2, "too large"); }
+	LF_dbcharge(l, 1, keylen + len);
+
+	// Event workers would hold up every connection they serve waiting
+	// for the sync, so leave it to the database's thread
+	LF_state *state = LF_getstate(l);
+	int wait = (state == NULL || state->thread == NULL);
+
+	int r = LF_dbappend(LF_dbhash(key, keylen), key, keylen, (del ? LF_DB_DELETED : len), wait);
+	lua_pushboolean(l, (r == 0));
+	return 1;
+}
+
+
+// DB.delete(key), removes key. Returns false if it couldn't be written
+static int LF_dbdelete(lua_State *l)
+{
+	lua_settop(l, 1);
+	lua_pushnil(l);
+	return LF_dbput(l);
+}
+
+
+static int LF_dbcompare(const void *a, const void *b)
+{
+	const LF_dbentry *x = *(LF_dbentry * const *)a, *y = *(LF_dbentry * const *)b;
+	int r = memcmp(x->key, y->key, (x->keylen < y->keylen ? x->keylen : y->keylen));
+	if(r != 0){ return r; }
+	return (x->keylen > y->keylen) - (x->keylen < y->keylen);
+}
+
+
+// DB.scan(prefix[, limit[, after]]), a table of up to limit keys starting
+// with prefix mapped to their values, the first in byte order of those
+// after the key after. Every key's looked at, so it's best kept to small
+// databases. A second result is the last key, if there are more to come
+static int LF_dbscan(lua_State *l)
+{
+	size_t prefixlen, afterlen = 0;
+	const char *prefix = luaL_checklstring(l, 1, &prefixlen);
+	int limit = luaL_optinteger(l, 2, LF_DB_SCANLIMIT);
+	const char *after = luaL_optlstring(l, 3, NULL, &afterlen);
+	if(limit < 1){ luaL_argerror(l, 2, "must be positive"); }
+	LF_dbcharge(l, 1, prefixlen);
+
+	size_t remaining = LF_dbremaining(l), nmatches = 0, found = 0;
+	int more = 0, over = 0, nomem = 0;
+	LF_dbbuf.len = 0;
+
+	pthread_rwlock_rdlock(&LF_dbindexlock);
+
+	for(size_t i=0; i < LF_dbnbuckets && !nomem; i++){
+		for(LF_dbentry *e = LF_dbbuckets[i]; e != NULL; e = e->next){
+			if(e->keylen < prefixlen || memcmp(e->key, prefix, prefixlen) != 0){ continue; }
+			if(after != NULL){
+				size_t n = (e->keylen < afterlen ? e->keylen : afterlen);
+				int r = memcmp(e->key, after, n);
+				if(r < 0 || (r == 0 && e->keylen <= afterlen)){ continue; }
+			}
+
+			if(nmatches == LF_dbmatchsize){
+				size_t size = (LF_dbmatchsize ? LF_dbmatchsize * 2 : 64);
+				LF_dbentry **m = realloc(LF_dbmatches, size * sizeof(LF_dbentry *));
+				if(m == NULL){
+					nomem = 1;
+					break;
+				}
+				LF_dbmatches = m;
+				LF_dbmatchsize = size;
+			}
+			LF_dbmatches[nmatches++] = e;
+		}
+	}
+
+	// Keys and values are copied out one after the other, stopping short
+	// of going over the request's limit
+	if(!nomem){
+		qsort(LF_dbmatches, nmatches, sizeof(LF_dbentry *), &LF_dbcompare);
+		for(found = 0; found < nmatches && found < (size_t)limit; found++){
+			LF_dbentry *e = LF_dbmatches[found];
+			size_t size = 8 + e->keylen + e->len;
+			if((LF_dbbuf.len + size) > remaining){
+				over = 1;
+				break;
+			}
+			if(LF_dbreserve(&LF_dbbuf, LF_dbbuf.len + size)){
+				nomem = 1;
+				break;
+			}
+
+			char *p = LF_dbbuf.data + LF_dbbuf.len;
+			memcpy(p, &e->keylen, 4);
+			memcpy(p + 4, &e->len, 4);
+			memcpy(p + 8, e->key, e->keylen);
+			memcpy(p + 8 + e->keylen, LF_dbmap + e->off, e->len);
+			LF_dbbuf.len += size;
+		}
+		more = (found < nmatches);
+	}
+
+	pthread_rwlock_unlock(&LF_dbindexlock);
+
+	if(nomem){ luaL_error(l, "Not enough memory."); }
+	if(over){ LF_dblimit(l, LF_getstate(l)); }
+	LF_dbcharge(l, 0, LF_dbbuf.len);
+
+	lua_createtable(l, 0, found);
+	const char *p = LF_dbbuf.data, *last = NULL;
+	uint32_t lastlen = 0;
+	for(size_t i=0; i < found; i++){
+		uint32_t keylen, len;
+		memcpy(&keylen, p, 4);
+		memcpy(&len, p + 4, 4);
+
+		lua_pushlstring(l, p + 8, keylen);
+		if(LF_unpack(l, p + 8 + keylen, len)){ lua_pushnil(l); }
+		lua_rawset(l, -3);
+
+		last = p + 8;
+		lastlen = keylen;
+		p += 8 + keylen + len;
+	}
+
+	if(more && last != NULL){
+		lua_pushlstring(l, last, lastlen);
+		return 2;
+	}
+	return 1;
+}
+
+
+void LF_opendb(lua_State *l)
+{
+	if(LF_dbfd == -1){ return; }
+
+	lua_createtable(l, 0, 4);
+
+	lua_pushstring(l, "get");
+	lua_pushcfunction(l, &LF_dbget);
+	lua_rawset(l, -3);
+
+	lua_pushstring(l, "put");
+	lua_pushcfunction(l, &LF_dbput);
+	lua_rawset(l, -3);
+
+	lua_pushstring(l, "delete");
+	lua_pushcfunction(l, &LF_dbdelete);
+	lua_rawset(l, -3);
+
+	lua_pushstring(l, "scan");
+	lua_pushcfunction(l, &LF_dbscan);
+	lua_rawset(l, -3);
+
+	lua_setglobal(l, "DB");
+}
@@ -0,0 +1,9 @@
+// Opens the database log at path, rebuilding its index, and starts the
+// thread that syncs and compacts it. If sync is set, writes wait for
+// their fsync. Each request may make up to ops operations moving up to
+// bytes bytes, 0 for no limit. A NULL path disables it, returns non-zero
+// if the log can't be opened
+int LF_dbinit(const char *, int, size_t, size_t);
+
+// Adds the DB table to a state, if the database is enabled
+void LF_opendb(lua_State *);
@@ -0,0 +1,1049 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+
+#include <fcgiapp.h>
+#include <fastcgi.h>
+
+#include <lua5.1/lua.h>
+
+#include "lua.h"
+#include "config.h"
+#include "response.h"
+#include "session.h"
+#include "microcache.h"
+#include "metrics.h"
+#include "capture.h"
+#include "log.h"
+#include "lua-fastcgi.h"
+#include "event.h"
+
+
+#ifndef EPOLLEXCLUSIVE
+#define EPOLLEXCLUSIVE (1u << 28)
+#endif
+
+// Bytes read from a connection at a time
+#define LF_EVENT_READ      65536
+// Size of each request's output stream buffer
+#define LF_EVENT_STREAM    8192
+// Scripts yield once this much output is waiting to be sent, and are
+// resumed once it's down to the low water mark
+#define LF_EVENT_HIGHWATER 262144
+#define LF_EVENT_LOWWATER  65536
+// Idle states kept by each thread
+#define LF_EVENT_POOL      32
+// Events handled per epoll_wait()
+#define LF_EVENT_BATCH     64
+// Largest block of params accepted for a request
+#define LF_EVENT_PARAMSMAX 1048576
+// Largest body accepted for a request, it's held in memory whole
+#define LF_EVENT_BODYMAX   16777216
+// Requests a connection may have going at once
+#define LF_EVENT_CONNREQS  64
+
+
+// Request stages
+#define LF_EPARAMS  0
+#define LF_ESTDIN   1
+#define LF_ERUNNING 2
+#define LF_EWAITING 3
+#define LF_ESENDING 4
+
+
+typedef struct LF_worker LF_worker;
+typedef struct LF_conn LF_conn;
+typedef struct LF_ereq LF_ereq;
+
+struct LF_ereq {
+	LF_state state;
+	LF_limits limits;
+	FCGX_Request request;
+	FCGX_Stream in;
+	FCGX_Stream out;
+	unsigned char outbuf[LF_EVENT_STREAM];
+
+	LF_capture *capture;
+
+	// The configuration the request started under
+	LF_config *config;
+
+	LF_conn *conn;
+	int id;
+	int keepconn;
+	int stage;
+
+	lua_State *l;
+	lua_State *co;
+
+	char *params;
+	size_t paramslen;
+	size_t paramssize;
+
+	char *body;
+	size_t bodylen;
+	size_t bodysize;
+	size_t bodymax;
+
+	LF_ereq *next;
+};
+
+struct LF_conn {
+	LF_worker *worker;
+	int fd;
+	uint32_t events;
+
+	char *in;
+	size_t inlen;
+	size_t insize;
+
+	char *out;
+	size_t outoff;
+	size_t outlen;
+	size_t outsize;
+
+	// Requests in progress, in the order they're resumed in
+	LF_ereq *reqs;
+	int nreqs;
+	int closing;
+	int dead;
+
+	// Set once a request's been started on it. Until then it's kept open
+	// even if it's closing, as the web server's sending one
+	int served;
+
+	LF_conn *next;
+	LF_conn *prev;
+};
+
+struct LF_worker {
+	LF_params *params;
+	LF_config *config;
+	int epfd;
+	int listener;
+	int listening;
+	int conns;
+	LF_conn *list;
+
+	LF_pool *pool;
+	LF_limits *limits;
+	LF_metrics *metrics;
+	LF_ereq *free;
+};
+
+
+static void LF_eventresume(LF_ereq *);
+
+
+static int LF_eventgrow(void *buf, size_t *size, size_t need, size_t unit)
+{
+	if(need <= *size){ return 0; }
+
+	size_t n = (*size > 0 ? *size : 64);
+	while(n < need){ n *= 2; }
+
+	void *p = realloc(*(void **)buf, n * unit);
+	if(p == NULL){ return 1; }
+
+	*(void **)buf = p;
+	*size = n;
+	return 0;
+}
+
+
+// Queues a record for sending, split into several if it's too long for
+// one. An empty record is queued for len 0
+static int LF_connrecord(LF_conn *c, int type, int id, const void *data, size_t len)
+{
+	if(c->dead){ return 0; }
+
+	do {
+		size_t clen = (len > 65535 ? 65535 : len);
+		if(LF_eventgrow(&c->out, &c->outsize, c->outlen + sizeof(FCGI_Header) + clen, 1)){
+			return 1;
+		}
+
+		FCGI_Header *h = (FCGI_Header *)(c->out + c->outlen);
+		h->version = FCGI_VERSION_1;
+		h->type = type;
+		h->requestIdB1 = (id >> 8) & 0xff;
+		h->requestIdB0 = id & 0xff;
+		h->contentLengthB1 = (clen >> 8) & 0xff;
+		h->contentLengthB0 = clen & 0xff;
+		h->paddingLength = 0;
+		h->reserved = 0;
+
+		if(clen > 0){ memcpy(c->out + c->outlen + sizeof(FCGI_Header), data, clen); }
+		c->outlen += sizeof(FCGI_Header) + clen;
+
+		data = (const char *)data + clen;
+		len -= clen;
+	} while(len > 0);
+
+	return 0;
+}
+
+
+static void LF_connend(LF_conn *c, int id, int status)
+{
+	FCGI_EndRequestBody body;
+	memset(&body, 0, sizeof(body));
+	body.protocolStatus = status;
+	LF_connrecord(c, FCGI_END_REQUEST, id, &body, sizeof(body));
+}
+
+
+static size_t LF_connpending(LF_conn *c)
+{
+	return c->outlen - c->outoff;
+}
+
+
+// Output stream buffer is full, move it into the connection's queue
+static void LF_eventempty(FCGX_Stream *stream, int doClose)
+{
+	LF_ereq *req = stream->data;
+	size_t len = stream->wrNext - req->outbuf;
+
+	if(len > 0 && LF_connrecord(req->conn, FCGI_STDOUT, req->id, req->outbuf, len)){
+		stream->isClosed = 1;
+	}
+	if(req->conn->dead){ stream->isClosed = 1; }
+
+	stream->wrNext = req->outbuf;
+}
+
+
+// The whole body is read before the script starts, there's never more
+static void LF_eventfill(FCGX_Stream *stream)
+{
+	stream->isClosed = 1;
+}
+
+
+// Whether a script should wait for its connection to drain
+static int LF_eventcongested(void *data)
+{
+	LF_ereq *req = data;
+	return (LF_connpending(req->conn) >= LF_EVENT_HIGHWATER);
+}
+
+
+static LF_ereq *LF_eventnewreq(LF_worker *w, LF_conn *c, int id, int keepconn)
+{
+	LF_ereq *req = w->free;
+	if(req != NULL){
+		w->free = req->next;
+	} else {
+		// Requests aren't freed until the thread exits, so readers made
+		// in an old one can always tell by the serial that it's over
+		if((req = calloc(1, sizeof(LF_ereq))) == NULL){ return NULL; }
+
+		req->state.congested = &LF_eventcongested;
+		req->state.data = req;
+		req->capture = LF_newcapture();
+	}
+
+	// Requests keep to the configuration they started under, even if
+	// the thread picks up a new one before they're done
+	LF_config *config = w->config;
+	LF_configref(config);
+	req->config = config;
+	req->state.upload_memory = config->upload_memory;
+	req->state.upload_dir = config->upload_dir;
+	req->state.upload_parts_max = config->upload_parts_max;
+	req->state.upload_files_max = config->upload_files_max;
+	req->state.output.buffer = config->output_buffer;
+	req->state.output.rules = config->compress;
+	req->state.output.nrules = config->ncompress;
+	req->state.output.compress_min = config->compress_min;
+	req->state.output.sendfile = config->sendfile;
+	req->state.output.sendprefix = config->sendfile_prefix;
+	req->state.output.capturemax = config->microcache_max / 16;
+
+	req->conn = c;
+	req->id = id;
+	req->keepconn = keepconn;
+	req->stage = LF_EPARAMS;
+	req->l = NULL;
+	req->co = NULL;
+	req->paramslen = 0;
+	req->bodylen = 0;
+	req->state.thread = NULL;
+	req->state.fds = NULL;
+	req->state.nfds = 0;
+	req->state.file = NULL;
+
+	req->next = c->reqs;
+	c->reqs = req;
+	c->nreqs++;
+	c->served = 1;
+	return req;
+}
+
+
+static LF_ereq *LF_eventfindreq(LF_conn *c, int id)
+{
+	LF_ereq *req = c->reqs;
+	while(req != NULL && req->id != id){ req = req->next; }
+	return req;
+}
+
+
+static void LF_eventunlink(LF_ereq *req)
+{
+	LF_ereq **p = &req->conn->reqs;
+	while(*p != req){ p = &(*p)->next; }
+	*p = req->next;
+	req->conn->nreqs--;
+}
+
+
+static void LF_eventrelease(LF_ereq *req)
+{
+	LF_conn *c = req->conn;
+	LF_worker *w = c->worker;
+
+	LF_eventunlink(req);
+	if(!req->keepconn){ c->closing = 1; }
+
+	LF_configrelease(req->config);
+	req->config = NULL;
+	req->conn = NULL;
+	req->next = w->free;
+	w->free = req;
+}
+
+
+// Returns a request's state to the pool, unless the pool it came from has
+// been replaced along with the configuration
+static void LF_eventputstate(LF_ereq *req)
+{
+	LF_worker *w = req->conn->worker;
+	if(req->config == w->config){ LF_poolput(w->pool, req->l); }
+	else { LF_dropstate(req->l); }
+}
+
+
+// Gives up on a request, if its connection is still there (i.e. the web
+// server sent FCGI_ABORT_REQUEST) it's told the request is over
+static void LF_eventabort(LF_ereq *req)
+{
+	LF_conn *c = req->conn;
+
+	if(req->l != NULL){
+		LF_metricsaborted(c->worker->metrics, &req->state);
+		LF_endrequest(&req->state);
+		LF_eventputstate(req);
+	}
+	LF_mcachedone(&req->state, 0);
+
+	LF_connrecord(c, FCGI_STDOUT, req->id, NULL, 0);
+	LF_connend(c, req->id, FCGI_REQUEST_COMPLETE);
+	LF_eventrelease(req);
+}
+
+
+// Ends a request that's run its course, error being its LF_ERR* outcome
+static void LF_eventfinish(LF_ereq *req, int error)
+{
+	LF_conn *c = req->conn;
+	uint64_t start = LF_metricsclock();
+
+	LF_responsefinish(&req->state);
+	LF_mcachedone(&req->state, (error == LF_ERRNONE));
+	LF_capturefinish(req->capture, &req->state, req->state.output.status, req->state.output.sent);
+	LF_eventempty(&req->out, 1);
+	LF_connrecord(c, FCGI_STDOUT, req->id, NULL, 0);
+	LF_connend(c, req->id, FCGI_REQUEST_COMPLETE);
+
+	req->state.timing[LF_PHASEFLUSH] = LF_metricsclock() - start;
+	LF_logaccess(&req->state, req->state.output.status, req->state.output.sent, 0);
+	LF_metricsrecord(c->worker->metrics, &req->state, error);
+
+	LF_endrequest(&req->state);
+	LF_eventputstate(req);
+	LF_eventrelease(req);
+}
+
+
+// Reads a name or value length from a name-value pair
+static int LF_eventnvlen(const unsigned char **p, const unsigned char *end, size_t *len)
+{
+	if(*p >= end){ return 1; }
+
+	if((**p & 0x80) == 0){
+		*len = *(*p)++;
+		return 0;
+	}
+
+	if((end - *p) < 4){ return 1; }
+	*len = ((size_t)((*p)[0] & 0x7f) << 24) | ((*p)[1] << 16) | ((*p)[2] << 8) | (*p)[3];
+	*p += 4;
+	return 0;
+}
+
+
+// Decodes the name-value pairs of the params where they are. Each value
+// is terminated over the first byte of the pair after it, which has
+// been read by then, and the last over the spare byte at the end
+static int LF_eventparams(LF_ereq *req)
+{
+	if(LF_eventgrow(&req->params, &req->paramssize, req->paramslen + 1, 1)){ return 1; }
+
+	LF_state *state = &req->state;
+	unsigned char *p = (unsigned char *)req->params, *end = p + req->paramslen;
+	unsigned char *prev = NULL;
+
+	state->nparams = 0;
+	while(p < end){
+		size_t klen, vlen;
+		if(LF_eventnvlen((const unsigned char **)&p, end, &klen) ||
+			LF_eventnvlen((const unsigned char **)&p, end, &vlen)){
+			return 1;
+		}
+		if((size_t)(end - p) < klen || (size_t)(end - p - klen) < vlen){ return 1; }
+		if(prev != NULL){ *prev = 0; }
+
+		if(LF_eventgrow(&state->params, &state->paramsize, state->nparams + 1, sizeof(LF_param))){
+			return 1;
+		}
+
+		LF_param *param = &state->params[state->nparams++];
+		param->name = (char *)p;
+		param->namelen = klen;
+		param->value = (char *)p + klen;
+		param->valuelen = vlen;
+
+		p += klen + vlen;
+		prev = p;
+	}
+	if(prev != NULL){ *prev = 0; }
+	return 0;
+}
+
+
+static void LF_eventstart(LF_ereq *req)
+{
+	LF_conn *c = req->conn;
+	LF_worker *w = c->worker;
+	LF_config *config = req->config;
+	uint64_t start = LF_metricsclock();
+
+	memset(&req->in, 0, sizeof(FCGX_Stream));
+	req->in.rdNext = req->in.stopUnget = (unsigned char *)req->body;
+	req->in.stop = req->in.rdNext + req->bodylen;
+	req->in.isReader = 1;
+	req->in.fillBuffProc = &LF_eventfill;
+	req->in.data = req;
+
+	memset(&req->out, 0, sizeof(FCGX_Stream));
+	req->out.wrNext = req->outbuf;
+	req->out.stop = req->outbuf + LF_EVENT_STREAM;
+	req->out.emptyBuffProc = &LF_eventempty;
+	req->out.data = req;
+
+	memset(&req->request, 0, sizeof(FCGX_Request));
+	req->request.requestId = req->id;
+	req->request.role = FCGI_RESPONDER;
+	req->request.in = &req->in;
+	req->request.out = &req->out;
+	req->request.ipcFd = c->fd;
+	req->request.keepConnection = req->keepconn;
+
+	if(LF_metricsrequest(&req->state)){
+		size_t len;
+		char *text = LF_metricsrender(&len);
+		if(text != NULL){
+			LF_connrecord(c, FCGI_STDOUT, req->id, text, len);
+		} else {
+			static const char error[] = "Status: 500 Internal Server Error\r\n\r\n";
+			LF_connrecord(c, FCGI_STDOUT, req->id, error, sizeof(error)-1);
+		}
+		free(text);
+		LF_eventabort(req);
+		return;
+	}
+
+	// The body's all here already, so capturing it never waits
+	req->request.in = LF_capturestart(req->capture, &req->state, &req->in);
+
+	// Cached responses are sent straight away. Waiting for another request
+	// to make one would hold up the whole thread, so it's only done by
+	// the thread workers
+	LF_mcentry *hit = LF_mcacheget(&req->state, 0);
+	if(hit != NULL){
+		size_t len;
+		const char *data = LF_mcachedata(hit, &len);
+		LF_connrecord(c, FCGI_STDOUT, req->id, data, len);
+		LF_mcacherelease(hit);
+		LF_capturefinish(req->capture, &req->state, 200, len);
+		LF_logaccess(&req->state, 200, len, 1);
+		LF_metricscached(w->metrics);
+		LF_eventabort(req);
+		return;
+	}
+
+	if((req->l = LF_poolget(w->pool)) == NULL){
+		static const char error[] = "Status: 500 Internal Server Error\r\n\r\n";
+		LF_connrecord(c, FCGI_STDOUT, req->id, error, sizeof(error)-1);
+		LF_eventabort(req);
+		return;
+	}
+
+	req->limits = *w->limits;
+	LF_setlimits(
+		&req->limits, config->mem_max, config->output_max,
+		config->cpu_sec, config->cpu_usec
+	);
+
+	LF_parserequest(req->l, &req->request, &req->state);
+	LF_enablelimits(req->l, &req->limits);
+	LF_pauselimits(&req->limits);
+
+	uint64_t now = LF_metricsclock();
+	req->state.timing[LF_PHASEPARSE] = now - start;
+
+	// The script runs in a thread of its own, so it can be suspended.
+	// The state's stack keeps it referenced
+	req->co = lua_newthread(req->l);
+	req->state.thread = req->co;
+
+	int r = LF_loadscript(req->co);
+	req->state.timing[LF_PHASELOAD] = LF_metricsclock() - now;
+	if(r){
+		LF_responseerror(&req->state, req->co, r, config->content_type);
+		LF_eventfinish(req, r);
+		return;
+	}
+
+	req->stage = LF_ERUNNING;
+	LF_eventresume(req);
+}
+
+
+// Queues more of the file a script's sending, as much as keeps the
+// connection under its high water mark. Returns non-zero while there's
+// more of it
+static int LF_eventpump(LF_ereq *req)
+{
+	size_t pending = LF_connpending(req->conn);
+	return LF_responsepump(&req->state, (pending < LF_EVENT_HIGHWATER ? LF_EVENT_HIGHWATER - pending : 0));
+}
+
+
+// Runs the script until it finishes or has to wait for output to drain.
+// Only the time it spends running counts towards its execute phase
+static void LF_eventresume(LF_ereq *req)
+{
+	LF_config *config = req->config;
+	int r;
+	for(;;){
+		uint64_t start = LF_metricsclock();
+		LF_resumelimits(req->co, &req->limits);
+		r = lua_resume(req->co, 0);
+		LF_pauselimits(&req->limits);
+		req->state.timing[LF_PHASEEXECUTE] += LF_metricsclock() - start;
+
+		if(r != LUA_YIELD){ break; }
+
+		// Anything else that yielded it just goes again
+		lua_settop(req->co, 0);
+		if(LF_eventcongested(req)){
+			req->stage = LF_EWAITING;
+			return;
+		}
+	}
+
+	if(r == LUA_ERRMEM && config->mem_max > 0){ req->state.trips |= LF_TRIPMEMORY; }
+	if(LF_cpulimited(&req->limits)){ req->state.trips |= LF_TRIPCPU; }
+
+	r = (r ? LF_ERRANY : LF_ERRNONE);
+	LF_responseerror(&req->state, req->co, r, config->content_type);
+	if(r == 0){ LF_sessionsave(req->l, &req->state); }
+
+	// A file from sendfile() goes out as the connection drains, even if
+	// the script failed after sending it
+	if((r == 0 || req->state.output.file != -1) && LF_eventpump(req)){
+		req->stage = LF_ESENDING;
+		return;
+	}
+	LF_eventfinish(req, r);
+}
+
+
+static int LF_eventappend(char **buf, size_t *len, size_t *size, const char *data, size_t dlen)
+{
+	if(LF_eventgrow(buf, size, *len + dlen, 1)){ return 1; }
+	memcpy(*buf + *len, data, dlen);
+	*len += dlen;
+	return 0;
+}
+
+
+static void LF_eventnvpair(char **buf, size_t *len, size_t *size, const char *name, const char *value)
+{
+	unsigned char lens[2] = { strlen(name), strlen(value) };
+	LF_eventappend(buf, len, size, (char *)lens, 2);
+	LF_eventappend(buf, len, size, name, lens[0]);
+	LF_eventappend(buf, len, size, value, lens[1]);
+}
+
+
+// Answers FCGI_GET_VALUES with what's asked of the values it knows
+static void LF_eventvalues(LF_conn *c, const char *content, size_t len)
+{
+	LF_config *config = c->worker->config;
+	const unsigned char *p = (const unsigned char *)content, *end = p + len;
+	char *out = NULL;
+	size_t outlen = 0, outsize = 0;
+
+	char conns[24], reqs[24];
+	snprintf(conns, sizeof(conns), "%d", config->threads * config->event_connections);
+	snprintf(reqs, sizeof(reqs), "%d", config->threads * config->event_connections * LF_EVENT_CONNREQS);
+
+	while(p < end){
+		size_t klen, vlen;
+		if(LF_eventnvlen(&p, end, &klen) || LF_eventnvlen(&p, end, &vlen)){ break; }
+		if((size_t)(end - p) < klen || (size_t)(end - p - klen) < vlen){ break; }
+
+		const char *name = (const char *)p;
+		p += klen + vlen;
+
+		if(klen == 14 && memcmp(name, FCGI_MAX_CONNS, 14) == 0){
+			LF_eventnvpair(&out, &outlen, &outsize, FCGI_MAX_CONNS, conns);
+		} else if(klen == 13 && memcmp(name, FCGI_MAX_REQS, 13) == 0){
+			LF_eventnvpair(&out, &outlen, &outsize, FCGI_MAX_REQS, reqs);
+		} else if(klen == 15 && memcmp(name, FCGI_MPXS_CONNS, 15) == 0){
+			LF_eventnvpair(&out, &outlen, &outsize, FCGI_MPXS_CONNS, "1");
+		}
+	}
+
+	LF_connrecord(c, FCGI_GET_VALUES_RESULT, FCGI_NULL_REQUEST_ID, out, outlen);
+	free(out);
+}
+
+
+// Handles a record from the web server, returns non-zero if the
+// connection should be dropped
+static int LF_connhandle(LF_conn *c, int type, int id, const char *content, size_t len)
+{
+	if(id == FCGI_NULL_REQUEST_ID){
+		if(type == FCGI_GET_VALUES){
+			LF_eventvalues(c, content, len);
+		} else {
+			FCGI_UnknownTypeBody body;
+			memset(&body, 0, sizeof(body));
+			body.type = type;
+			LF_connrecord(c, FCGI_UNKNOWN_TYPE, FCGI_NULL_REQUEST_ID, &body, sizeof(body));
+		}
+		return 0;
+	}
+
+	LF_ereq *req = LF_eventfindreq(c, id);
+	if(type != FCGI_BEGIN_REQUEST && req == NULL){ return 0; }
+
+	switch(type){
+		case FCGI_BEGIN_REQUEST: {
+			if(len < sizeof(FCGI_BeginRequestBody)){ return 1; }
+			const FCGI_BeginRequestBody *b = (const FCGI_BeginRequestBody *)content;
+
+			// Begin records for requests in progress are ignored
+			if(req != NULL){ break; }
+
+			if(((b->roleB1 << 8) | b->roleB0) != FCGI_RESPONDER){
+				LF_connend(c, id, FCGI_UNKNOWN_ROLE);
+			} else if(c->nreqs >= LF_EVENT_CONNREQS ||
+				LF_eventnewreq(c->worker, c, id, (b->flags & FCGI_KEEP_CONN)) == NULL){
+				LF_connend(c, id, FCGI_OVERLOADED);
+			}
+		} break;
+
+		case FCGI_ABORT_REQUEST:
+			LF_eventabort(req);
+		break;
+
+		case FCGI_PARAMS:
+			if(req->stage != LF_EPARAMS){ break; }
+
+			if(len == 0){
+				if(LF_eventparams(req)){ return 1; }
+				req->stage = LF_ESTDIN;
+
+				// The body's no longer than it was said to be
+				const LF_param *length = LF_getparam(&req->state, "CONTENT_LENGTH", 14);
+				uintmax_t max = (length ? strtoumax(length->value, NULL, 10) : 0);
+				if(max > LF_EVENT_BODYMAX){
+					static const char error[] = "Status: 413 Request Entity Too Large\r\n\r\n";
+					LF_connrecord(c, FCGI_STDOUT, id, error, sizeof(error)-1);
+					LF_eventabort(req);
+					break;
+				}
+				req->bodymax = max;
+			} else if((req->paramslen + len) > LF_EVENT_PARAMSMAX ||
+				LF_eventappend(&req->params, &req->paramslen, &req->paramssize, content, len)){
+				return 1;
+			}
+		break;
+
+		case FCGI_STDIN:
+			if(req->stage != LF_ESTDIN){ break; }
+
+			if(len == 0){
+				LF_eventstart(req);
+			} else if((req->bodylen + len) > req->bodymax ||
+				LF_eventappend(&req->body, &req->bodylen, &req->bodysize, content, len)){
+				return 1;
+			}
+		break;
+	}
+	return 0;
+}
+
+
+// Handles every complete record read so far
+static int LF_connrecords(LF_conn *c)
+{
+	size_t pos = 0;
+	while((c->inlen - pos) >= sizeof(FCGI_Header)){
+		const FCGI_Header *h = (const FCGI_Header *)(c->in + pos);
+		size_t clen = (h->contentLengthB1 << 8) | h->contentLengthB0;
+		size_t rlen = sizeof(FCGI_Header) + clen + h->paddingLength;
+		if((c->inlen - pos) < rlen){ break; }
+
+		if(h->version != FCGI_VERSION_1){ return 1; }
+
+		int id = (h->requestIdB1 << 8) | h->requestIdB0;
+		if(LF_connhandle(c, h->type, id, c->in + pos + sizeof(FCGI_Header), clen)){ return 1; }
+		pos += rlen;
+	}
+
+	if(pos > 0){
+		memmove(c->in, c->in + pos, c->inlen - pos);
+		c->inlen -= pos;
+	}
+	return 0;
+}
+
+
+// Whether so much output's waiting on a connection that no more requests
+// should be read from it until it drains
+static int LF_connbacklogged(LF_conn *c)
+{
+	return (LF_connpending(c) >= LF_EVENT_HIGHWATER);
+}
+
+
+static void LF_connread(LF_conn *c)
+{
+	while(!LF_connbacklogged(c)){
+		if(LF_eventgrow(&c->in, &c->insize, c->inlen + LF_EVENT_READ, 1)){
+			c->dead = 1;
+			return;
+		}
+
+		ssize_t r = read(c->fd, c->in + c->inlen, c->insize - c->inlen);
+		if(r == 0){
+			c->dead = 1;
+			return;
+		}
+		if(r == -1){
+			if(errno == EINTR){ continue; }
+			if(errno != EAGAIN && errno != EWOULDBLOCK){ c->dead = 1; }
+			return;
+		}
+
+		c->inlen += r;
+		if(LF_connrecords(c)){
+			c->dead = 1;
+			return;
+		}
+	}
+}
+
+
+static void LF_connwrite(LF_conn *c)
+{
+	while(!c->dead && c->outoff < c->outlen){
+		ssize_t r = write(c->fd, c->out + c->outoff, c->outlen - c->outoff);
+		if(r == -1){
+			if(errno == EINTR){ continue; }
+			if(errno != EAGAIN && errno != EWOULDBLOCK){ c->dead = 1; }
+			break;
+		}
+		c->outoff += r;
+	}
+
+	if(c->outoff == c->outlen){
+		c->outoff = c->outlen = 0;
+	} else if(c->outoff > (c->outsize / 2)){
+		memmove(c->out, c->out + c->outoff, c->outlen - c->outoff);
+		c->outlen -= c->outoff;
+		c->outoff = 0;
+	}
+}
+
+
+// Adds or removes the listening socket, so no more connections are
+// accepted than the thread is allowed
+static void LF_eventlisten(LF_worker *w, int listen)
+{
+	if(listen && __atomic_load_n(&w->params->retired, __ATOMIC_ACQUIRE)){ return; }
+	if(listen == w->listening){ return; }
+
+	if(listen){
+		// Only one of the threads sharing the socket is woken
+		struct epoll_event ev;
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+		ev.data.ptr = NULL;
+		if(epoll_ctl(w->epfd, EPOLL_CTL_ADD, w->listener, &ev)){ return; }
+	} else {
+		epoll_ctl(w->epfd, EPOLL_CTL_DEL, w->listener, NULL);
+	}
+	w->listening = listen;
+}
+
+
+static void LF_connclose(LF_conn *c)
+{
+	LF_worker *w = c->worker;
+
+	c->dead = 1;
+	while(c->reqs != NULL){ LF_eventabort(c->reqs); }
+
+	if(c->prev != NULL){ c->prev->next = c->next; }
+	else { w->list = c->next; }
+	if(c->next != NULL){ c->next->prev = c->prev; }
+
+	epoll_ctl(w->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+	close(c->fd);
+	free(c->in);
+	free(c->out);
+	free(c);
+
+	w->conns--;
+	LF_eventlisten(w, 1);
+}
+
+
+// Sends what it can, resumes waiting scripts and files being sent while
+// the connection is drained and closes the connection if it's done with.
+// Each request resumed goes to the back of the line, so they take turns
+static void LF_connservice(LF_conn *c)
+{
+	for(;;){
+		LF_connwrite(c);
+		if(c->dead || LF_connpending(c) >= LF_EVENT_LOWWATER){ break; }
+
+		LF_ereq *req = c->reqs;
+		while(req != NULL && req->stage != LF_EWAITING && req->stage != LF_ESENDING){ req = req->next; }
+		if(req == NULL){ break; }
+
+		LF_eventunlink(req);
+		LF_ereq **p = &c->reqs;
+		while(*p != NULL){ p = &(*p)->next; }
+		req->next = NULL;
+		*p = req;
+		c->nreqs++;
+
+		if(req->stage == LF_ESENDING){
+			if(!LF_eventpump(req)){ LF_eventfinish(req, LF_ERRNONE); }
+			continue;
+		}
+
+		req->stage = LF_ERUNNING;
+		LF_eventresume(req);
+	}
+
+	if(c->dead || (c->closing && c->served && c->reqs == NULL && LF_connpending(c) == 0)){
+		LF_connclose(c);
+		return;
+	}
+
+	// A backed up connection's only written to, and hangups are noticed
+	// when writing fails
+	uint32_t events = EPOLLOUT;
+	if(!LF_connbacklogged(c)){ events = EPOLLIN | EPOLLRDHUP | (LF_connpending(c) > 0 ? EPOLLOUT : 0); }
+	if(events != c->events){
+		struct epoll_event ev;
+		memset(&ev, 0, sizeof(ev));
+		ev.events = events;
+		ev.data.ptr = c;
+		if(epoll_ctl(c->worker->epfd, EPOLL_CTL_MOD, c->fd, &ev) == 0){ c->events = events; }
+	}
+}
+
+
+static void LF_eventaccept(LF_worker *w)
+{
+	while(w->conns < w->config->event_connections){
+		int fd = accept4(w->listener, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if(fd == -1){
+			if(errno == EINTR){ continue; }
+			break;
+		}
+
+		LF_conn *c = calloc(1, sizeof(LF_conn));
+		if(c == NULL){
+			close(fd);
+			continue;
+		}
+
+		c->worker = w;
+		c->fd = fd;
+		c->events = EPOLLIN | EPOLLRDHUP;
+
+		struct epoll_event ev;
+		memset(&ev, 0, sizeof(ev));
+		ev.events = c->events;
+		ev.data.ptr = c;
+		if(epoll_ctl(w->epfd, EPOLL_CTL_ADD, fd, &ev)){
+			close(fd);
+			free(c);
+			continue;
+		}
+
+		c->next = w->list;
+		if(w->list != NULL){ w->list->prev = c; }
+		w->list = c;
+		w->conns++;
+	}
+
+	if(w->conns >= w->config->event_connections){ LF_eventlisten(w, 0); }
+}
+
+
+// Switches to a new configuration, along with a pool of states to suit
+// it. States taken from the old pool are dropped as they're finished with
+static void LF_eventconfig(LF_worker *w)
+{
+	if(w->config != NULL && !LF_configchanged(w->config)){ return; }
+
+	LF_config *config = LF_configget();
+	LF_pool *pool = LF_newpool(
+		LF_EVENT_POOL, config->sandbox, config->content_type,
+		config->state_reuse, config->arena_chunk
+	);
+	if(pool == NULL){
+		LF_configrelease(config);
+		return;
+	}
+
+	LF_freepool(w->pool);
+	LF_configrelease(w->config);
+	w->pool = pool;
+	w->config = config;
+}
+
+
+// The supervisor's woken the thread, there may be a new configuration or
+// it may have been retired. A retired thread stops accepting, lets its
+// connections finish the requests they have going and closes them. If
+// its socket's being closed, it takes what's still queued on it first
+static void LF_eventwake(LF_worker *w)
+{
+	uint64_t n;
+	while(read(w->params->wake, &n, sizeof(n)) == -1 && errno == EINTR){}
+
+	LF_eventconfig(w);
+	if(!__atomic_load_n(&w->params->retired, __ATOMIC_ACQUIRE)){ return; }
+
+	if(__atomic_load_n(&w->params->socket->closing, __ATOMIC_ACQUIRE)){ LF_eventaccept(w); }
+	LF_eventlisten(w, 0);
+	for(LF_conn *c = w->list, *next; c != NULL; c = next){
+		next = c->next;
+		c->closing = 1;
+		LF_connservice(c);
+	}
+}
+
+
+void *event_run(void *arg)
+{
+	LF_params *params = arg;
+
+	LF_worker w;
+	memset(&w, 0, sizeof(w));
+	w.params = params;
+	w.listener = params->socket->fd;
+	w.limits = LF_newlimits();
+	w.metrics = LF_newmetrics();
+	LF_eventconfig(&w);
+
+	w.epfd = -1;
+	if(w.config == NULL || (w.epfd = epoll_create1(EPOLL_CLOEXEC)) == -1){
+		LF_logerror((w.config == NULL ? "LF_newpool(): memory allocation error" : "epoll_create1() failure"));
+		LF_freepool(w.pool);
+		LF_freelimits(w.limits);
+		LF_metricsrelease(w.metrics);
+		LF_configrelease(w.config);
+		return NULL;
+	}
+
+	// The wake eventfd is told apart by pointing at the worker
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = &w;
+	epoll_ctl(w.epfd, EPOLL_CTL_ADD, params->wake, &ev);
+
+	LF_eventlisten(&w, 1);
+
+	struct epoll_event events[LF_EVENT_BATCH];
+	while(!__atomic_load_n(&params->retired, __ATOMIC_ACQUIRE) || w.conns > 0){
+		int n = epoll_wait(w.epfd, events, LF_EVENT_BATCH, -1);
+		if(n == -1){
+			if(errno != EINTR){ LF_logerror("epoll_wait() failure"); }
+			continue;
+		}
+
+		// Waking may close connections, so it waits for the rest of the
+		// batch to be handled
+		int woken = 0;
+		for(int i=0; i < n; i++){
+			LF_conn *c = events[i].data.ptr;
+			if(c == NULL){
+				LF_eventaccept(&w);
+				continue;
+			}
+			if(c == (LF_conn *)&w){
+				woken = 1;
+				continue;
+			}
+
+			if(events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)){
+				LF_connread(c);
+			}
+			LF_connservice(c);
+		}
+
+		if(woken){ LF_eventwake(&w); }
+	}
+
+	while(w.free != NULL){
+		LF_ereq *req = w.free;
+		w.free = req->next;
+		LF_freestate(&req->state);
+		LF_freecapture(req->capture);
+		free(req->params);
+		free(req->body);
+		free(req);
+	}
+
+	close(w.epfd);
+	LF_freepool(w.pool);
+	LF_freelimits(w.limits);
+	LF_metricsrelease(w.metrics);
+	LF_configrelease(w.config);
+	return NULL;
+}
@@ -0,0 +1,2 @@
+// Worker serving many connections at once from one thread with epoll
+void *event_run(void *);
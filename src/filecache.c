@@ -0,0 +1,266 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include <fcgiapp.h>
+
+#include <lua5.1/lua.h>
+
+#include "lua.h"
+#include "filecache.h"
+
+
+#define LF_FILECACHE_BUCKETS 256
+
+
+// A file read into memory, found by the path it was asked for by. It's
+// copied rather than mapped, as a mapping faults should the file be
+// truncated while it's read. Files too big to cache are read for the one
+// read and belong to no bucket
+struct LF_file {
+	char *path;
+	char *real;
+
+	dev_t dev;
+	ino_t ino;
+	struct timespec mtime;
+	off_t size;
+
+	char *data;
+	size_t len;
+
+	time_t checked;
+	time_t used;
+	int refs;
+
+	struct LF_file *next;
+};
+
+
+static pthread_rwlock_t LF_filecachelock = PTHREAD_RWLOCK_INITIALIZER;
+static LF_file *LF_filecachebuckets[LF_FILECACHE_BUCKETS];
+static size_t LF_filecachebytes = 0;
+static size_t LF_filecachemax = 0;
+static size_t LF_filesizemax = 0;
+static int LF_filecachecheck = 1;
+
+
+static size_t LF_filecachehash(const char *path)
+{
+	uint32_t h = 2166136261u;
+	for(; *path; path++){ h = (h ^ (unsigned char)*path) * 16777619u; }
+	return h % LF_FILECACHE_BUCKETS;
+}
+
+
+static LF_file *LF_filefind(const char *path)
+{
+	for(LF_file *f = LF_filecachebuckets[LF_filecachehash(path)]; f; f = f->next){
+		if(strcmp(f->path, path) == 0){ return f; }
+	}
+	return NULL;
+}
+
+
+static void LF_filefree(LF_file *f)
+{
+	free(f->data);
+	free(f->path);
+	free(f->real);
+	free(f);
+}
+
+
+void LF_filerelease(LF_file *f)
+{
+	if(__atomic_sub_fetch(&f->refs, 1, __ATOMIC_ACQ_REL) == 0){ LF_filefree(f); }
+}
+
+
+void LF_filecacheinit(size_t max, size_t sizemax, int check)
+{
+	LF_filecachemax = max;
+	LF_filesizemax = sizemax;
+	LF_filecachecheck = (check > 0 ? check : 0);
+}
+
+
+// A root without a trailing slash only contains what's under it as a
+// directory, so /var/www doesn't contain /var/www2
+int LF_confined(const char *root, size_t rootlen, const char *real)
+{
+	if(rootlen == 0 || strncmp(root, real, rootlen) != 0){ return 0; }
+	return (root[rootlen-1] == '/' || real[rootlen] == '/' || real[rootlen] == 0);
+}
+
+
+// Reads the file a path resolves to, if it's a regular file under root
+static LF_file *LF_fileread(const char *path, const char *root, size_t rootlen, int *error)
+{
+	char real[4096];
+	if(realpath(path, real) == NULL){
+		*error = (errno == ENOENT || errno == ENOTDIR ? LF_ERRNOTFOUND : (errno == EACCES ? LF_ERRACCESS : LF_ERRANY));
+		return NULL;
+	}
+	if(!LF_confined(root, rootlen, real)){
+		*error = LF_ERRNOPATH;
+		return NULL;
+	}
+
+	// Not blocking on FIFOs, which aren't read anyway
+	int fd = open(real, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+	if(fd == -1){
+		*error = (errno == ENOENT ? LF_ERRNOTFOUND : (errno == EACCES ? LF_ERRACCESS : LF_ERRANY));
+		return NULL;
+	}
+
+	struct stat sb;
+	if(fstat(fd, &sb) || !S_ISREG(sb.st_mode)){
+		close(fd);
+		*error = LF_ERRACCESS;
+		return NULL;
+	}
+	if(LF_filesizemax > 0 && sb.st_size > LF_filesizemax){
+		close(fd);
+		*error = LF_ERRTOOBIG;
+		return NULL;
+	}
+
+	LF_file *f = calloc(1, sizeof(LF_file));
+	if(f == NULL || (f->path = strdup(path)) == NULL || (f->real = strdup(real)) == NULL){
+		if(f != NULL){ free(f->path); }
+		free(f);
+		close(fd);
+		*error = LF_ERRMEMORY;
+		return NULL;
+	}
+
+	// A file that shrinks while it's read is kept as far as it was read
+	if(sb.st_size > 0){
+		if((f->data = malloc(sb.st_size)) == NULL){
+			close(fd);
+			LF_filefree(f);
+			*error = LF_ERRMEMORY;
+			return NULL;
+		}
+
+		while(f->len < sb.st_size){
+			ssize_t r = pread(fd, f->data + f->len, sb.st_size - f->len, f->len);
+			if(r == -1 && errno == EINTR){ continue; }
+			if(r == -1){
+				close(fd);
+				LF_filefree(f);
+				*error = LF_ERRANY;
+				return NULL;
+			}
+			if(r == 0){ break; }
+			f->len += r;
+		}
+	}
+	close(fd);
+
+	f->dev = sb.st_dev;
+	f->ino = sb.st_ino;
+	f->mtime = sb.st_mtim;
+	f->size = sb.st_size;
+	f->checked = time(NULL);
+	f->used = f->checked;
+	f->refs = 1;
+	return f;
+}
+
+
+// Drops the least recently read files until there's room for len bytes
+static void LF_fileevict(size_t len)
+{
+	while(LF_filecachebytes > 0 && (LF_filecachebytes + len) > LF_filecachemax){
+		LF_file **oldest = NULL;
+		for(size_t i=0; i < LF_FILECACHE_BUCKETS; i++){
+			for(LF_file **p = &LF_filecachebuckets[i]; *p != NULL; p = &(*p)->next){
+				if(oldest == NULL || (*p)->used < (*oldest)->used){ oldest = p; }
+			}
+		}
+		if(oldest == NULL){ return; }
+
+		LF_file *f = *oldest;
+		*oldest = f->next;
+		LF_filecachebytes -= f->len;
+		LF_filerelease(f);
+	}
+}
+
+
+static int LF_filesame(LF_file *a, LF_file *b)
+{
+	return a->dev == b->dev && a->ino == b->ino && a->size == b->size &&
+		a->mtime.tv_sec == b->mtime.tv_sec && a->mtime.tv_nsec == b->mtime.tv_nsec &&
+		strcmp(a->real, b->real) == 0;
+}
+
+
+LF_file *LF_fileget(const char *path, const char *root, size_t rootlen, int *error)
+{
+	time_t now = time(NULL);
+
+	// A file checked recently enough is served without touching the disk
+	pthread_rwlock_rdlock(&LF_filecachelock);
+	LF_file *f = LF_filefind(path);
+	if(f != NULL && (now - f->checked) < LF_filecachecheck && LF_confined(root, rootlen, f->real)){
+		__atomic_add_fetch(&f->refs, 1, __ATOMIC_RELAXED);
+		__atomic_store_n(&f->used, now, __ATOMIC_RELAXED);
+		pthread_rwlock_unlock(&LF_filecachelock);
+		return f;
+	}
+	pthread_rwlock_unlock(&LF_filecachelock);
+
+	LF_file *nf = LF_fileread(path, root, rootlen, error);
+	if(nf == NULL || LF_filecachemax == 0){ return nf; }
+
+	pthread_rwlock_wrlock(&LF_filecachelock);
+
+	// Unchanged, so the copy there is kept
+	f = LF_filefind(path);
+	if(f != NULL && LF_filesame(f, nf)){
+		f->checked = nf->checked;
+		f->used = nf->used;
+		__atomic_add_fetch(&f->refs, 1, __ATOMIC_RELAXED);
+		pthread_rwlock_unlock(&LF_filecachelock);
+		LF_filefree(nf);
+		return f;
+	}
+
+	if(f != NULL){
+		LF_file **p = &LF_filecachebuckets[LF_filecachehash(path)];
+		while(*p != f){ p = &(*p)->next; }
+		*p = f->next;
+		LF_filecachebytes -= f->len;
+		LF_filerelease(f);
+	}
+
+	// Files too big to share the cache fairly are only kept while read
+	if(nf->len <= (LF_filecachemax / 16)){
+		LF_fileevict(nf->len);
+
+		size_t h = LF_filecachehash(path);
+		nf->next = LF_filecachebuckets[h];
+		LF_filecachebuckets[h] = nf;
+		nf->refs++;
+		LF_filecachebytes += nf->len;
+	}
+
+	pthread_rwlock_unlock(&LF_filecachelock);
+	return nf;
+}
+
+
+const char *LF_filedata(LF_file *f, size_t *len)
+{
+	*len = f->len;
+	return (f->data != NULL ? f->data : "");
+}
@@ -0,0 +1,18 @@
+// A file read by readfile(), kept in memory and shared by all threads
+typedef struct LF_file LF_file;
+
+// Sets the most bytes of files kept cached, the largest file that's read,
+// and how many seconds a file is served before it's checked for changes
+void LF_filecacheinit(size_t, size_t, int);
+
+// Checks a resolved path lies under a document root
+int LF_confined(const char *, size_t, const char *);
+
+// Finds the file at a path, which must lie under the given document
+// root. Returns NULL, with error set to an LF_ERR* code, if it can't be
+// read. The file returned must be released
+LF_file *LF_fileget(const char *, const char *, size_t, int *);
+
+const char *LF_filedata(LF_file *, size_t *);
+
+void LF_filerelease(LF_file *);
@@ -1,6 +1,11 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
 
 #include <fcgiapp.h>
 
@@ -8,98 +13,118 @@
 #include <lua5.1/lauxlib.h>
 
 #include "lua.h"
+#include "config.h"
 #include "lfuncs.h"
+#include "response.h"
+#include "session.h"
+#include "filecache.h"
+#include "log.h"
 
 
-// replacement print function, outputs to FCGI stream
-static int LF_pprint(lua_State *l, int cr)
+// Output's gone over the limit, counted as one of the limits tripped
+static int LF_outputlimit(lua_State *l, LF_state *state)
 {
-	int args = lua_gettop(l);
+	state->trips |= LF_TRIPOUTPUT;
+	return luaL_error(l, "Output limit exceeded.");
+}
 
-	// Fetch the response
-	lua_pushstring(l, "STATE");
-	lua_rawget(l, LUA_REGISTRYINDEX);
-	LF_state *state = lua_touserdata(l, args+1);
-	lua_pop(l, 1);
 
-	// fetch limits
-	lua_pushstring(l, "RESPONSE_LIMIT");
-	lua_rawget(l, LUA_REGISTRYINDEX);
-	size_t *limit = lua_touserdata(l, args+1);
-	lua_pop(l, 1);
+// Assembles the header from HEADER, if the response isn't committed yet.
+// It's sent along with the body, once the body's length is known. args
+// is the index of the last of the caller's arguments
+static void LF_commitheader(lua_State *l, LF_state *state, int args)
+{
+	if(state->committed){ return; }
+	size_t *limit = state->output_limit;
 
-	// If the response isn't committed, send the header
-	if(!state->committed){
-		lua_getglobal(l, "HEADER");
-		if(!lua_istable(l, args+1)){ luaL_error(l, "Invalid HEADER (Not table)."); }
+	lua_getglobal(l, "HEADER");
+	if(!lua_istable(l, args+1)){ luaL_error(l, "Invalid HEADER (Not table)."); }
 
-		lua_pushstring(l, "Status");
-		lua_rawget(l, args+1);
+	lua_pushstring(l, "Status");
+	lua_rawget(l, args+1);
 
-		// If the status has been explicitly set, send that
-		if(!lua_isnil(l, args+2)){
-			if(!lua_isstring(l, args+2)){
-				luaL_error(l, "Invalid HEADER (Invalid Status).");
-			}
+	// If the status has been explicitly set, send that
+	if(!lua_isnil(l, args+2)){
+		if(!lua_isstring(l, args+2)){
+			luaL_error(l, "Invalid HEADER (Invalid Status).");
+		}
 
-			size_t len;
-			const char *str = lua_tolstring(l, args+2, &len);
+		size_t len;
+		const char *str = lua_tolstring(l, args+2, &len);
 
-			if(limit){
-				if((len+10) > *limit){ luaL_error(l, "Output limit exceeded."); }
-				*limit -= (len+10);
-			}
+		if(limit){
+			if((len+10) > *limit){ LF_outputlimit(l, state); }
+			*limit -= (len+10);
+		}
 
-			FCGX_PutStr("Status: ", 8, state->response);
-			FCGX_PutStr(str, len, state->response);
-			FCGX_PutStr("\r\n", 2, state->response);
-			state->committed = 1;
+		if(LF_responseheader(state, "Status", 6, str, len)){
+			luaL_error(l, "Not enough memory.");
+		}
+	}
+	lua_pop(l, 1); // Pop the status
+
+	// Loop over the header, ignoring status, but sending everything else
+	lua_pushnil(l);
+	while(lua_next(l, args+1)){
+		// If the key or the value isn't a string (or number) throw an error
+		if(!lua_isstring(l, args+2) || !lua_isstring(l, args+3)){
+			luaL_error(l, "Invalid HEADER (Invalid key and/or value).");
 		}
-		lua_pop(l, 1); // Pop the status
 
-		// Loop over the header, ignoring status, but sending everything else
-		lua_pushnil(l);
-		while(lua_next(l, args+1)){
-			// If the key or the value isn't a string (or number) throw an error
-			if(!lua_isstring(l, args+2) || !lua_isstring(l, args+3)){
-				luaL_error(l, "Invalid HEADER (Invalid key and/or value).");
-			}
+		size_t keylen = 0;
+		const char *key = lua_tolstring(l, args+2, &keylen);
+		if(keylen == 6 && memcmp(key, "Status", 6) == 0){
+			// Clear the last value out
+			lua_pop(l, 1);
+			continue;
+		}
 
-			size_t keylen = 0;
-			const char *key = lua_tolstring(l, args+2, &keylen);
-			if(keylen == 6 && memcmp(key, "Status", 6) == 0){
-				// Clear the last value out
-				lua_pop(l, 1);
-				continue;
-			}
+		size_t vallen = 0;
+		const char *val = lua_tolstring(l, args+3, &vallen);
 
-			size_t vallen = 0;
-			const char *val = lua_tolstring(l, args+3, &vallen);
+		if(limit){
+			if((vallen+keylen+4) > *limit){ LF_outputlimit(l, state); }
+			*limit -= (vallen+keylen+4);
+		}
 
-			if(limit){
-				if((vallen+keylen+4) > *limit){ luaL_error(l, "Output limit exceeded."); }
-				*limit -= (vallen+keylen+4);
-			}
+		if(LF_responseheader(state, key, keylen, val, vallen)){
+			luaL_error(l, "Not enough memory.");
+		}
 
-			FCGX_PutStr(key, keylen, state->response);
-			FCGX_PutStr(": ", 2, state->response);
-			FCGX_PutStr(val, vallen, state->response);
-			FCGX_PutStr("\r\n", 2, state->response);
+		lua_pop(l, 1); // Clear the last value out
+	}
+	lua_pop(l, 1); // Clear the table out
 
-			state->committed = 1;
-			lua_pop(l, 1); // Clear the last value out
-		}
-		lua_pop(l, 1); // Clear the table out
+	// A new session's cookie goes out with the rest of the header
+	if(state->session == LF_SESSION_NEW && LF_sessioncookie(state)){
+		luaL_error(l, "Not enough memory.");
+	}
 
-		if(limit){
-			if(2 >= *limit){ luaL_error(l, "Output limit exceeded."); }
-			*limit -= 2;
-		}
+	if(limit){
+		if(2 >= *limit){ LF_outputlimit(l, state); }
+		*limit -= 2;
+	}
+
+	state->committed = 1;
+}
+
+
+// replacement print function, outputs to FCGI stream
+static int LF_pprint(lua_State *l, int cr)
+{
+	int args = lua_gettop(l);
 
-		FCGX_PutS("\r\n", state->response);
-		state->committed = 1;
+	// Fetch the response and its limit
+	LF_state *state = LF_getstate(l);
+	size_t *limit = state->output_limit;
+
+	// Nothing can follow a file sendfile() has sent
+	if(state->output.file != -1 || state->output.handedoff){
+		luaL_error(l, "Response already sent by sendfile().");
 	}
 
+	LF_commitheader(l, state, args);
+
 	size_t strlen;
 	const char *str;
 	for(int i=1; i <= args; i++){
@@ -109,11 +134,11 @@ static int LF_pprint(lua_State *l, int cr)
 			case LUA_TBOOLEAN:
 				str = lua_tolstring(l, i, &strlen);
 				if(limit){
-					if(strlen > *limit){ luaL_error(l, "Output limit exceeded."); }
+					if(strlen > *limit){ LF_outputlimit(l, state); }
 					*limit -= strlen;
 				}
 
-				FCGX_PutStr(str, strlen, state->response);
+				LF_responsewrite(state, str, strlen);
 			break;
 
 			default: /* Ignore other types */ break;
@@ -122,11 +147,16 @@ static int LF_pprint(lua_State *l, int cr)
 
 	if(cr){
 		if(limit){
-			if(*limit == 0){ luaL_error(l, "Output limit exceeded."); }
+			if(*limit == 0){ LF_outputlimit(l, state); }
 			(*limit)--;
 		}
 
-		FCGX_PutChar('\n', state->response);
+		LF_responsewrite(state, "\n", 1);
+	}
+
+	// Under the event worker, wait for the connection to drain
+	if(state->congested != NULL && state->congested(state->data) && LF_yieldable(l, state)){
+		return lua_yield(l, 0);
 	}
 	return 0;
 }
@@ -136,6 +166,81 @@ int LF_print(lua_State *l){ return LF_pprint(l, 1); }
 int LF_write(lua_State *l){ return LF_pprint(l, 0); }
 
 
+// log(...), writes its arguments to the error log as one message, along
+// with the script's name
+int LF_log(lua_State *l)
+{
+	int args = lua_gettop(l);
+	LF_state *state = LF_getstate(l);
+	if(state == NULL){ return 0; }
+
+	luaL_Buffer b;
+	luaL_buffinit(l, &b);
+	for(int i=1; i <= args; i++){
+		switch(lua_type(l, i)){
+			case LUA_TSTRING:
+			case LUA_TNUMBER:
+			case LUA_TBOOLEAN:
+				lua_pushvalue(l, i);
+				luaL_addvalue(&b);
+			break;
+
+			default: /* Ignore other types */ break;
+		}
+	}
+	luaL_pushresult(&b);
+
+	size_t len;
+	const char *message = lua_tolstring(l, -1, &len);
+	LF_logscript(state, message, len);
+	return 0;
+}
+
+
+// cache(ttl[, vary]), the response is cached for ttl seconds, keyed on the
+// script, query string and the request variables named in vary. Names
+// starting with '?' are query string parameters, and when given only
+// they're keyed on from the query string
+int LF_cache(lua_State *l)
+{
+	lua_Number ttl = luaL_checknumber(l, 1);
+	if(!lua_isnoneornil(l, 2)){ luaL_checktype(l, 2, LUA_TTABLE); }
+
+	LF_state *state = LF_getstate(l);
+	if(state == NULL){ return 0; }
+
+	LF_cacheuse *c = &state->cache;
+	c->varylen = 0;
+
+	int n = (lua_istable(l, 2) ? lua_objlen(l, 2) : 0);
+	for(int i=1; i <= n; i++){
+		lua_rawgeti(l, 2, i);
+		if(lua_type(l, -1) != LUA_TSTRING){ luaL_error(l, "Invalid vary (Not string)."); }
+
+		size_t len;
+		const char *name = lua_tolstring(l, -1, &len);
+		if((c->varylen + len + 1) > c->varysize){
+			size_t size = (c->varylen + len + 1) * 2;
+			char *vary = realloc(c->vary, size);
+			if(vary == NULL){ luaL_error(l, "Not enough memory."); }
+
+			c->vary = vary;
+			c->varysize = size;
+		}
+
+		memcpy(c->vary + c->varylen, name, len + 1);
+		c->varylen += len + 1;
+		lua_pop(l, 1);
+	}
+
+	c->ttl = ttl;
+
+	// Nothing's been sent until the response outgrows its buffer
+	if(!state->output.streaming){ state->output.capturing = 1; }
+	return 0;
+}
+
+
 int LF_loadstring(lua_State *l)
 {
 	size_t sz;
@@ -157,12 +262,29 @@ int LF_loadstring(lua_State *l)
 }
 
 
-int LF_loadfile(lua_State *l)
+// Pushes nil and the message for an LF_ERR* code
+static int LF_pusherror(lua_State *l, int error)
 {
-	size_t sz;
-	const char *spath = luaL_checklstring(l, 1, &sz);
+	lua_pushnil(l);
+	switch(error){
+		case LF_ERRACCESS: lua_pushstring(l, "Access denied."); break;
+		case LF_ERRMEMORY: lua_pushstring(l, "Not enough memory."); break;
+		case LF_ERRNOTFOUND: lua_pushstring(l, "No such file or directory."); break;
+		case LF_ERRBYTECODE: lua_pushstring(l, "Compiled bytecode not supported."); break;
+		case LF_ERRTOOBIG: lua_pushstring(l, "File too large."); break;
+		case LF_ERRNOPATH:
+		case LF_ERRNONAME: lua_pushstring(l, "Invalid path."); break;
+		default: lua_pushstring(l, "Unknown error."); break;
+	}
+	return 2;
+}
+
 
-  lua_pushstring(l, "DOCUMENT_ROOT");
+// Joins a script's path onto DOCUMENT_ROOT, which root is pointed at.
+// Returns the root's length, or 0 with nil and an error pushed
+static size_t LF_rootpath(lua_State *l, const char *spath, size_t sz, char *hpath, const char **root)
+{
+	lua_pushstring(l, "DOCUMENT_ROOT");
 	lua_rawget(l, LUA_REGISTRYINDEX);
 	char *document_root = lua_touserdata(l, -1);
 	lua_pop(l, 1);
@@ -170,7 +292,7 @@ int LF_loadfile(lua_State *l)
 	if(document_root == NULL){
 		lua_pushnil(l);
 		lua_pushstring(l, "DOCUMENT_ROOT not defined.");
-		return 2;
+		return 0;
 	}
 
 	size_t dz = strlen(document_root);
@@ -178,68 +300,52 @@ int LF_loadfile(lua_State *l)
 	if(dz == 0){
 		lua_pushnil(l);
 		lua_pushstring(l, "DOCUMENT_ROOT empty.");
-		return 2;
+		return 0;
 	}
 
-	size_t hz = dz + sz;
-	if((hz + 2) > 4096){
+	if((dz + sz + 2) > 4096){
 		lua_pushnil(l);
 		lua_pushstring(l, "Path too large.");
-		return 2;
+		return 0;
 	}
 
-	char hpath[4096];
+	size_t hz = dz;
 	memcpy(&hpath[0], document_root, dz);
-	if(hpath[dz-1] != '/' && spath[0] != '/'){ hpath[dz] = '/'; }
-	memcpy(&hpath[dz+1], spath, sz);
-	hpath[hz+1] = 0;
+	if(hpath[dz-1] != '/' && spath[0] != '/'){ hpath[hz++] = '/'; }
+	memcpy(&hpath[hz], spath, sz);
+	hpath[hz+sz] = 0;
 
-	char rpath[4096];
-	char *ptr = realpath(hpath, rpath);
-	if(ptr == NULL || memcmp(document_root, rpath, dz) != 0){
-		lua_pushnil(l);
-		lua_pushstring(l, "Invalid path.");
-		return 2;
-	}
-
-	switch(LF_fileload(l, &spath[0], &hpath[0])){
-		case 0:
-			return 1;
-		break;
+	*root = document_root;
+	return dz;
+}
 
-		case LF_ERRACCESS:
-			lua_pushnil(l);
-			lua_pushstring(l, "Access denied.");
-		break;
 
-		case LF_ERRMEMORY:
-			lua_pushnil(l);
-			lua_pushstring(l, "Not enough memory.");
-		break;
+int LF_loadfile(lua_State *l)
+{
+	size_t sz;
+	const char *spath = luaL_checklstring(l, 1, &sz);
 
-		case LF_ERRNOTFOUND:
-			lua_pushnil(l);
-			lua_pushstring(l, "No such file or directory.");
-		break;
+	char hpath[4096];
+	const char *document_root;
+	size_t dz = LF_rootpath(l, spath, sz, hpath, &document_root);
+	if(dz == 0){ return 2; }
 
-		case LF_ERRSYNTAX:
-			lua_pushnil(l);
-			lua_insert(l, -2);
-		break;
+	char rpath[4096];
+	char *ptr = realpath(hpath, rpath);
+	if(ptr == NULL || !LF_confined(document_root, dz, rpath)){
+		return LF_pusherror(l, LF_ERRNOPATH);
+	}
 
-		case LF_ERRBYTECODE:
-			lua_pushnil(l);
-			lua_pushstring(l, "Compiled bytecode not supported.");
-		break;
+	int r = LF_fileload(l, &spath[0], &rpath[0]);
+	if(r == 0){ return 1; }
 
-		case LF_ERRNOPATH:
-		case LF_ERRNONAME:
-			lua_pushnil(l);
-			lua_pushstring(l, "Invalid path.");
-		break;
+	if(r == LF_ERRSYNTAX){
+		lua_pushnil(l);
+		lua_insert(l, -2);
+		return 2;
 	}
-	
-	return 2;
+
+	return LF_pusherror(l, r);
 }
 
 
@@ -255,3 +361,140 @@ int LF_dofile(lua_State *l)
 
 	return 0;
 }
+
+
+// readfile(path[, offset[, length]]), the contents of a file under
+// DOCUMENT_ROOT, or length bytes of them from offset bytes in
+int LF_readfile(lua_State *l)
+{
+	size_t sz;
+	const char *spath = luaL_checklstring(l, 1, &sz);
+	lua_Number offset = luaL_optnumber(l, 2, 0);
+	lua_Number length = luaL_optnumber(l, 3, -1);
+	luaL_argcheck(l, offset >= 0, 2, "negative offset");
+
+	char hpath[4096];
+	const char *document_root;
+	size_t dz = LF_rootpath(l, spath, sz, hpath, &document_root);
+	if(dz == 0){ return 2; }
+
+	int error;
+	LF_file *f = LF_fileget(hpath, document_root, dz, &error);
+	if(f == NULL){ return LF_pusherror(l, error); }
+
+	size_t len;
+	const char *data = LF_filedata(f, &len);
+	size_t off = (offset < len ? (size_t)offset : len);
+	size_t n = len - off;
+	if(length >= 0 && length < n){ n = length; }
+
+	// Should copying it out run out of memory, the request's end
+	// releases the file instead
+	LF_state *state = LF_getstate(l);
+	if(state != NULL){ state->file = f; }
+	lua_pushlstring(l, data + off, n);
+	if(state != NULL){ state->file = NULL; }
+
+	LF_filerelease(f);
+	return 1;
+}
+
+
+// sendfile(path), responds with a file under DOCUMENT_ROOT. It's either
+// sent from the kernel straight to the connection, or the web server's
+// told where to find it with X-Accel-Redirect or X-Sendfile
+int LF_sendfile(lua_State *l)
+{
+	size_t sz;
+	const char *spath = luaL_checklstring(l, 1, &sz);
+	lua_settop(l, 1);
+
+	LF_state *state = LF_getstate(l);
+	if(state == NULL){ return 0; }
+
+	LF_output *o = &state->output;
+	if(o->streaming || o->bodylen > 0 || o->file != -1 || o->handedoff){
+		luaL_error(l, "Response already started.");
+	}
+
+	char hpath[4096];
+	const char *document_root;
+	size_t dz = LF_rootpath(l, spath, sz, hpath, &document_root);
+	if(dz == 0){ return 2; }
+
+	char rpath[4096];
+	if(realpath(hpath, rpath) == NULL){
+		return LF_pusherror(l, (errno == ENOENT || errno == ENOTDIR ? LF_ERRNOTFOUND : LF_ERRNOPATH));
+	}
+	if(!LF_confined(document_root, dz, rpath)){ return LF_pusherror(l, LF_ERRNOPATH); }
+
+	if(o->sendfile != LF_SENDFILE_DIRECT){
+		// The path goes out in a header, which it mustn't break
+		for(const char *p = rpath; *p; p++){
+			if((unsigned char)*p < 0x20 || *p == 0x7f){ return LF_pusherror(l, LF_ERRNOPATH); }
+		}
+
+		LF_commitheader(l, state, 1);
+
+		char value[16384];
+		int len;
+		if(o->sendfile == LF_SENDFILE_XACCEL){
+			size_t plen = strlen(o->sendprefix);
+			while(plen > 0 && o->sendprefix[plen-1] == '/'){ plen--; }
+
+			// The web server takes it as a URI, so anything in the path
+			// that would end it early or be decoded is percent-encoded.
+			// Every byte of it fits in the buffer encoded
+			const char *rel = rpath + dz;
+			while(*rel == '/'){ rel++; }
+			len = snprintf(value, sizeof(value), "%.*s/", (int)plen, o->sendprefix);
+			for(; *rel && len >= 0 && (size_t)len < (sizeof(value) - 3); rel++){
+				unsigned char c = *rel;
+				if(isalnum(c) || strchr("/-._~", c) != NULL){
+					value[len++] = c;
+				} else {
+					value[len++] = '%';
+					value[len++] = "0123456789ABCDEF"[c >> 4];
+					value[len++] = "0123456789ABCDEF"[c & 15];
+				}
+			}
+			if(*rel){ len = -1; }
+		} else {
+			len = snprintf(value, sizeof(value), "%s", rpath);
+		}
+
+		const char *name = (o->sendfile == LF_SENDFILE_XACCEL ? "X-Accel-Redirect" : "X-Sendfile");
+		if(len < 0 || (size_t)len >= sizeof(value) || LF_responseheader(state, name, strlen(name), value, len)){
+			luaL_error(l, "Not enough memory.");
+		}
+
+		o->handedoff = 1;
+		lua_pushboolean(l, 1);
+		return 1;
+	}
+
+	// Not blocking on FIFOs, which aren't sent anyway
+	int fd = open(rpath, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+	if(fd == -1){ return LF_pusherror(l, (errno == EACCES ? LF_ERRACCESS : LF_ERRNOTFOUND)); }
+
+	// Closed when the request ends, should anything below throw
+	if(LF_trackfd(state, fd)){
+		close(fd);
+		return LF_pusherror(l, LF_ERRMEMORY);
+	}
+
+	struct stat sb;
+	if(fstat(fd, &sb) || !S_ISREG(sb.st_mode)){ return LF_pusherror(l, LF_ERRACCESS); }
+
+	LF_commitheader(l, state, 1);
+
+	size_t *limit = state->output_limit;
+	if(limit){
+		if((uintmax_t)sb.st_size > *limit){ LF_outputlimit(l, state); }
+		*limit -= sb.st_size;
+	}
+
+	LF_responsefile(state, fd, 0, sb.st_size);
+	lua_pushboolean(l, 1);
+	return 1;
+}
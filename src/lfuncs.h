@@ -4,6 +4,12 @@ int LF_print(lua_State *);
 // Writes FCGI output without a carriage return
 int LF_write(lua_State *);
 
+// log() function, writes to the error log
+int LF_log(lua_State *);
+
+// cache() function, caches the response for the number of seconds given
+int LF_cache(lua_State *);
+
 // loadstring() function with anti-bytecode security measures
 int LF_loadstring(lua_State *);
 
@@ -12,3 +18,9 @@ int LF_loadfile(lua_State *);
 
 // dofile() function with sandboxing security measures
 int LF_dofile(lua_State *);
+
+// readfile() function, reads files under DOCUMENT_ROOT through a shared cache
+int LF_readfile(lua_State *);
+
+// sendfile() function, responds with a file under DOCUMENT_ROOT
+int LF_sendfile(lua_State *);
@@ -0,0 +1,499 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <fcgiapp.h>
+
+#include <lua5.1/lua.h>
+
+#include "lua.h"
+#include "log.h"
+
+
+// Bytes in each thread's ring, a power of two
+#define LF_LOG_RING 262144
+
+// Longest message kept, longer ones are cut short
+#define LF_LOG_MESSAGE 4096
+
+// Nanoseconds the logger waits between emptying the rings
+#define LF_LOG_INTERVAL 10000000
+
+// Entries are queued as their length, a kind and a time in microseconds
+// since the epoch, followed by what's logged
+#define LF_LOG_HEADER 13
+#define LF_LOG_ERROR  1
+#define LF_LOG_ACCESS 2
+
+
+// An access log entry, followed by its script's name
+typedef struct {
+	int status;
+	int trips;
+	int cached;
+	uint64_t bytes;
+	uint64_t timing[LF_PHASES];
+} LF_logrecord;
+
+// Written to only by its thread, up to head, and emptied only by the
+// logger, up to tail
+typedef struct LF_logring {
+	uint64_t head;
+	uint64_t tail;
+	uint64_t dropped;
+
+	// Set while a thread has it, rings outlive their thread and are
+	// taken up by the next to log
+	int owned;
+
+	struct LF_logring *next;
+	char data[LF_LOG_RING];
+} LF_logring;
+
+typedef struct {
+	char *data;
+	size_t len;
+	size_t size;
+} LF_logbuf;
+
+
+static pthread_mutex_t LF_loglock = PTHREAD_MUTEX_INITIALIZER;
+static LF_logring *LF_logrings = NULL;
+static int LF_logrunning = 0;
+static int LF_logerrorfd = 2;
+static int LF_logaccessfd = -1;
+
+// Entries dropped by threads without a ring, and times the logger's
+// emptied the rings
+static uint64_t LF_logunringed = 0;
+static uint64_t LF_logpasses = 0;
+
+static __thread LF_logring *LF_logown = NULL;
+static pthread_key_t LF_logkey;
+static pthread_once_t LF_logonce = PTHREAD_ONCE_INIT;
+
+static const char *LF_logtrips[] = { "cpu", "memory", "output", "db" };
+
+
+static uint64_t LF_lognow()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+
+static int LF_logprintf(LF_logbuf *b, const char *fmt, ...)
+{
+	for(;;){
+		va_list ap;
+		va_start(ap, fmt);
+		int n = vsnprintf(b->data + b->len, b->size - b->len, fmt, ap);
+		va_end(ap);
+		if(n < 0){ return 1; }
+
+		if((b->len + n) < b->size){
+			b->len += n;
+			return 0;
+		}
+
+		size_t size = (b->size ? b->size : 4096);
+		while(size <= (b->len + n)){ size *= 2; }
+
+		char *data = realloc(b->data, size);
+		if(data == NULL){ return 1; }
+		b->data = data;
+		b->size = size;
+	}
+}
+
+
+static int LF_logappend(LF_logbuf *b, const char *data, size_t len)
+{
+	if((b->len + len) > b->size){
+		size_t size = (b->size ? b->size : 4096);
+		while(size < (b->len + len)){ size *= 2; }
+
+		char *p = realloc(b->data, size);
+		if(p == NULL){ return 1; }
+		b->data = p;
+		b->size = size;
+	}
+
+	if(len > 0){ memcpy(b->data + b->len, data, len); }
+	b->len += len;
+	return 0;
+}
+
+
+// Appends text, with control characters that could start a line of their
+// own turned into spaces
+static void LF_logtext(LF_logbuf *b, const char *text, size_t len)
+{
+	if(LF_logappend(b, text, len)){ return; }
+	for(char *p = b->data + b->len - len; p < (b->data + b->len); p++){
+		if((unsigned char)*p < 0x20){ *p = ' '; }
+	}
+}
+
+
+// Appends text as a JSON string
+static void LF_logjson(LF_logbuf *b, const char *text, size_t len)
+{
+	LF_logappend(b, "\"", 1);
+	size_t start = 0;
+	for(size_t i=0; i < len; i++){
+		unsigned char ch = text[i];
+		if(ch != '"' && ch != '\\' && ch >= 0x20){ continue; }
+
+		LF_logappend(b, text + start, i - start);
+		if(ch < 0x20){ LF_logprintf(b, "\\u%04x", ch); }
+		else { LF_logprintf(b, "\\%c", ch); }
+		start = i + 1;
+	}
+	LF_logappend(b, text + start, len - start);
+	LF_logappend(b, "\"", 1);
+}
+
+
+static void LF_logtime(LF_logbuf *b, uint64_t time)
+{
+	time_t sec = time / 1000000;
+	struct tm tm;
+	gmtime_r(&sec, &tm);
+
+	char date[32];
+	strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", &tm);
+	LF_logprintf(b, "%s.%06uZ", date, (unsigned int)(time % 1000000));
+}
+
+
+// Formats an entry onto the end of the error or access log's buffer
+static void LF_logformat(int kind, uint64_t time, const char *data, size_t len, LF_logbuf *errors, LF_logbuf *accesses)
+{
+	if(kind == LF_LOG_ERROR){
+		LF_logtime(errors, time);
+		LF_logprintf(errors, " ");
+		LF_logtext(errors, data, len);
+		LF_logprintf(errors, "\n");
+		return;
+	}
+
+	if(kind != LF_LOG_ACCESS || len < sizeof(LF_logrecord)){ return; }
+
+	LF_logrecord r;
+	memcpy(&r, data, sizeof(r));
+
+	LF_logprintf(accesses, "{\"time\":\"");
+	LF_logtime(accesses, time);
+	LF_logprintf(accesses, "\",\"script\":");
+	LF_logjson(accesses, data + sizeof(r), len - sizeof(r));
+	LF_logprintf(
+		accesses, ",\"status\":%d,\"bytes\":%llu,\"cached\":%s",
+		r.status, (unsigned long long)r.bytes, (r.cached ? "true" : "false")
+	);
+	LF_logprintf(
+		accesses, ",\"parse\":%.6f,\"load\":%.6f,\"execute\":%.6f,\"flush\":%.6f,\"trips\":[",
+		r.timing[LF_PHASEPARSE] / 1e9, r.timing[LF_PHASELOAD] / 1e9,
+		r.timing[LF_PHASEEXECUTE] / 1e9, r.timing[LF_PHASEFLUSH] / 1e9
+	);
+
+	const char *sep = "";
+	for(int i=0; i < 4; i++){
+		if(r.trips & (1 << i)){
+			LF_logprintf(accesses, "%s\"%s\"", sep, LF_logtrips[i]);
+			sep = ",";
+		}
+	}
+	LF_logprintf(accesses, "]}\n");
+}
+
+
+static void LF_logwrite(int fd, LF_logbuf *b)
+{
+	const char *p = b->data;
+	size_t len = b->len;
+	while(fd != -1 && len > 0){
+		ssize_t r = write(fd, p, len);
+		if(r == -1){
+			if(errno == EINTR){ continue; }
+			break;
+		}
+		p += r;
+		len -= r;
+	}
+	b->len = 0;
+}
+
+
+// Copies out of a ring from a position in it, wrapping round its end
+static void LF_logcopyout(const char *ring, uint64_t at, char *to, size_t len)
+{
+	if(len == 0){ return; }
+
+	size_t i = at & (LF_LOG_RING - 1), n = LF_LOG_RING - i;
+	if(n > len){ n = len; }
+	memcpy(to, ring + i, n);
+	memcpy(to + n, ring, len - n);
+}
+
+
+static void LF_logcopyin(char *ring, uint64_t at, const char *from, size_t len)
+{
+	if(len == 0){ return; }
+
+	size_t i = at & (LF_LOG_RING - 1), n = LF_LOG_RING - i;
+	if(n > len){ n = len; }
+	memcpy(ring + i, from, n);
+	memcpy(ring, from + n, len - n);
+}
+
+
+// Empties every thread's ring every LF_LOG_INTERVAL, writing out what's
+// in them a log at a time
+static void *LF_logthread(void *arg)
+{
+	LF_logbuf errors = { NULL, 0, 0 }, accesses = { NULL, 0, 0 };
+	char *entries = malloc(LF_LOG_RING);
+	uint64_t dropped = 0;
+
+	struct timespec interval = { 0, LF_LOG_INTERVAL };
+	for(;;){
+		nanosleep(&interval, NULL);
+
+		LF_logring *r = __atomic_load_n(&LF_logrings, __ATOMIC_ACQUIRE);
+		for(; r != NULL && entries != NULL; r = r->next){
+			uint64_t tail = r->tail;
+			uint64_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+			if(head == tail){ continue; }
+
+			// Copied out first, so the thread has its room back sooner
+			size_t len = head - tail;
+			LF_logcopyout(r->data, tail, entries, len);
+			__atomic_store_n(&r->tail, head, __ATOMIC_RELEASE);
+
+			for(size_t off = 0; (off + LF_LOG_HEADER) <= len;){
+				uint32_t elen;
+				uint64_t time;
+				memcpy(&elen, entries + off, 4);
+				memcpy(&time, entries + off + 5, 8);
+				if(elen < LF_LOG_HEADER || (off + elen) > len){ break; }
+
+				LF_logformat(
+					entries[off + 4], time, entries + off + LF_LOG_HEADER,
+					elen - LF_LOG_HEADER, &errors, &accesses
+				);
+				off += elen;
+			}
+		}
+
+		uint64_t d = LF_logdropped();
+		if(d > dropped){
+			LF_logtime(&errors, LF_lognow());
+			LF_logprintf(&errors, " %llu log entries dropped\n", (unsigned long long)(d - dropped));
+			dropped = d;
+		}
+
+		if(errors.len > 0){ LF_logwrite(LF_logerrorfd, &errors); }
+		if(accesses.len > 0){ LF_logwrite(LF_logaccessfd, &accesses); }
+		__atomic_add_fetch(&LF_logpasses, 1, __ATOMIC_RELEASE);
+	}
+	return NULL;
+}
+
+
+// Gives a thread's ring up as it exits
+static void LF_logdisown(void *r)
+{
+	__atomic_store_n(&((LF_logring *)r)->owned, 0, __ATOMIC_RELEASE);
+}
+
+
+static void LF_logkeyinit()
+{
+	pthread_key_create(&LF_logkey, &LF_logdisown);
+}
+
+
+// The calling thread's ring, taken up or made the first time it logs
+static LF_logring *LF_logthreadring()
+{
+	if(LF_logown != NULL){ return LF_logown; }
+	pthread_once(&LF_logonce, &LF_logkeyinit);
+
+	LF_logring *r = __atomic_load_n(&LF_logrings, __ATOMIC_ACQUIRE);
+	for(; r != NULL; r = r->next){
+		int owned = 0;
+		if(__atomic_compare_exchange_n(&r->owned, &owned, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)){ break; }
+	}
+
+	if(r == NULL){
+		if((r = calloc(1, sizeof(LF_logring))) == NULL){ return NULL; }
+		r->owned = 1;
+
+		pthread_mutex_lock(&LF_loglock);
+		r->next = LF_logrings;
+		__atomic_store_n(&LF_logrings, r, __ATOMIC_RELEASE);
+		pthread_mutex_unlock(&LF_loglock);
+	}
+
+	pthread_setspecific(LF_logkey, r);
+	LF_logown = r;
+	return r;
+}
+
+
+// Queues an entry made of a and b on the thread's ring. Until the logger
+// starts, entries are written straight out
+static void LF_logpush(int kind, const void *a, size_t alen, const void *b, size_t blen)
+{
+	uint64_t now = LF_lognow();
+
+	if(!__atomic_load_n(&LF_logrunning, __ATOMIC_ACQUIRE)){
+		LF_logbuf entry = { NULL, 0, 0 }, errors = { NULL, 0, 0 }, accesses = { NULL, 0, 0 };
+		if(LF_logappend(&entry, a, alen) == 0 && LF_logappend(&entry, b, blen) == 0){
+			LF_logformat(kind, now, entry.data, entry.len, &errors, &accesses);
+			LF_logwrite(LF_logerrorfd, &errors);
+			LF_logwrite(LF_logaccessfd, &accesses);
+		}
+		free(entry.data);
+		free(errors.data);
+		free(accesses.data);
+		return;
+	}
+
+	LF_logring *r = LF_logthreadring();
+	if(r == NULL){
+		__atomic_add_fetch(&LF_logunringed, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	size_t len = LF_LOG_HEADER + alen + blen;
+	uint64_t head = r->head;
+	uint64_t tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+	if((LF_LOG_RING - (head - tail)) < len){
+		__atomic_add_fetch(&r->dropped, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	char header[LF_LOG_HEADER];
+	uint32_t len32 = len;
+	memcpy(header, &len32, 4);
+	header[4] = kind;
+	memcpy(header + 5, &now, 8);
+
+	LF_logcopyin(r->data, head, header, LF_LOG_HEADER);
+	LF_logcopyin(r->data, head + LF_LOG_HEADER, a, alen);
+	LF_logcopyin(r->data, head + LF_LOG_HEADER + alen, b, blen);
+	__atomic_store_n(&r->head, head + len, __ATOMIC_RELEASE);
+}
+
+
+static int LF_logopen(const char *path)
+{
+	return open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0640);
+}
+
+
+int LF_loginit(const char *error, const char *access)
+{
+	int r = 0;
+
+	if(error != NULL){
+		int fd = LF_logopen(error);
+		if(fd != -1){ LF_logerrorfd = fd; }
+		else { r = 1; }
+	}
+
+	if(access != NULL){
+		if((LF_logaccessfd = LF_logopen(access)) == -1){ r = 1; }
+	}
+
+	pthread_t thread;
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	if(pthread_create(&thread, &attr, &LF_logthread, NULL) == 0){
+		__atomic_store_n(&LF_logrunning, 1, __ATOMIC_RELEASE);
+	} else {
+		r = 1;
+	}
+	pthread_attr_destroy(&attr);
+
+	return r;
+}
+
+
+void LF_logerror(const char *fmt, ...)
+{
+	char message[LF_LOG_MESSAGE];
+
+	va_list ap;
+	va_start(ap, fmt);
+	int len = vsnprintf(message, sizeof(message), fmt, ap);
+	va_end(ap);
+
+	if(len < 0){ return; }
+	if(len >= (int)sizeof(message)){ len = sizeof(message) - 1; }
+	LF_logpush(LF_LOG_ERROR, message, len, NULL, 0);
+}
+
+
+void LF_logscript(LF_state *state, const char *text, size_t len)
+{
+	const LF_param *script = LF_getparam(state, "SCRIPT_NAME", 11);
+	if(len > LF_LOG_MESSAGE){ len = LF_LOG_MESSAGE; }
+
+	LF_logerror(
+		"%s: %.*s", (script ? script->value : "(unknown)"), (int)len, text
+	);
+}
+
+
+void LF_logaccess(LF_state *state, int status, uintmax_t bytes, int cached)
+{
+	if(LF_logaccessfd == -1){ return; }
+
+	LF_logrecord r;
+	r.status = status;
+	r.trips = state->trips;
+	r.cached = cached;
+	r.bytes = bytes;
+	memcpy(r.timing, state->timing, sizeof(r.timing));
+
+	const LF_param *script = LF_getparam(state, "SCRIPT_NAME", 11);
+	size_t len = (script ? script->valuelen : 0);
+	if(len > LF_LOG_MESSAGE){ len = LF_LOG_MESSAGE; }
+
+	LF_logpush(LF_LOG_ACCESS, &r, sizeof(r), (script ? script->value : NULL), len);
+}
+
+
+uint64_t LF_logdropped()
+{
+	uint64_t dropped = __atomic_load_n(&LF_logunringed, __ATOMIC_RELAXED);
+
+	LF_logring *r = __atomic_load_n(&LF_logrings, __ATOMIC_ACQUIRE);
+	for(; r != NULL; r = r->next){ dropped += __atomic_load_n(&r->dropped, __ATOMIC_RELAXED); }
+	return dropped;
+}
+
+
+
+void LF_logflush()
+{
+	// Whatever's queued now is written by the end of the next full pass
+	uint64_t pass = __atomic_load_n(&LF_logpasses, __ATOMIC_ACQUIRE);
+	struct timespec interval = { 0, LF_LOG_INTERVAL };
+	for(int i=0; i < (1000000000 / LF_LOG_INTERVAL) && __atomic_load_n(&LF_logrunning, __ATOMIC_ACQUIRE); i++){
+		if(__atomic_load_n(&LF_logpasses, __ATOMIC_ACQUIRE) >= (pass + 2)){ break; }
+		nanosleep(&interval, NULL);
+	}
+}
@@ -0,0 +1,23 @@
+// Opens the error and access logs and starts the thread that writes out
+// what every other thread logs. Without an error log errors go to stderr,
+// without an access log requests aren't logged. Returns non-zero if a log
+// can't be opened
+int LF_loginit(const char *, const char *);
+
+// Logs an error, formatted as printf would. Entries are queued on the
+// calling thread's own ring, which is never waited on: should it be full
+// the entry's dropped and counted instead
+void LF_logerror(const char *, ...);
+
+// Logs a message from a request's script, along with the script's name
+void LF_logscript(LF_state *, const char *, size_t);
+
+// Logs a finished request: its script, status, bytes sent, phase timings
+// and the limits it tripped. cached is set for responses from the cache
+void LF_logaccess(LF_state *, int, uintmax_t, int);
+
+// Entries dropped so far for want of room
+uint64_t LF_logdropped();
+
+// Waits, a second at most, for what's been logged so far to be written
+void LF_logflush();
@@ -4,40 +4,47 @@
 #include <string.h>
 #include <errno.h>
 #include <time.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 
 #include <fcgi_config.h>
 #include <fcgiapp.h>
 
 #include <lua5.1/lua.h>
 #include <pthread.h>
+#include <sys/stat.h>
 
 #include "lua.h"
 #include "config.h"
+#include "cache.h"
+#include "filecache.h"
+#include "arena.h"
+#include "response.h"
+#include "app.h"
+#include "db.h"
+#include "session.h"
+#include "microcache.h"
+#include "metrics.h"
+#include "capture.h"
+#include "log.h"
+#include "event.h"
 #include "lua-fastcgi.h"
 
 
-static char *http_status_strings[] = {
-	[200] = "OK",
-	[403] = "Forbidden",
-	[404] = "Not Found",
-	[500] = "Internal Server Error"
-};
-
-
-#define senderror(status_code,error_string) \
-	if(!state.committed){ \
-			FCGX_FPrintF(request.out, "Status: %d %s\r\n", status_code, http_status_strings[status_code]); \
-			FCGX_FPrintF(request.out, "Content-Type: %s\r\n\r\n", config->content_type); \
-			state.committed = 1; \
-	} \
-	FCGX_PutS(error_string, state.response);
-
-
 #ifdef DEBUG
 static void printcfg(LF_config *cfg)
 {
 	printf("Listen: %s\n", cfg->listen);
 	printf("Backlog: %d\n", cfg->backlog);
+	printf("Listeners: %d\n", cfg->listeners);
+	printf("Event: %d\n", cfg->event);
+	printf("Event Connections: %d\n", cfg->event_connections);
 	printf("Threads: %d\n", cfg->threads);
 	printf("Sandbox: %d\n", cfg->sandbox);
 	printf("Max Memory: %zu\n", cfg->mem_max);
@@ -45,6 +52,43 @@ static void printcfg(LF_config *cfg)
 	printf("CPU usec: %lu\n", cfg->cpu_usec);
 	printf("CPU sec: %lu\n", cfg->cpu_sec);
 	printf("Default Content Type: %s\n", cfg->content_type);
+	printf("Script Cache: %zu\n", cfg->script_cache);
+	printf("File Cache: %zu\n", cfg->file_cache);
+	printf("File Cache Check: %d\n", cfg->file_cache_check);
+	printf("File Size Max: %zu\n", cfg->file_size_max);
+	printf("State Reuse: %d\n", cfg->state_reuse);
+	printf("Arena Chunk: %zu\n", cfg->arena_chunk);
+	printf("Upload Memory: %zu\n", cfg->upload_memory);
+	printf("Upload Directory: %s\n", cfg->upload_dir);
+	printf("Upload Parts Max: %d\n", cfg->upload_parts_max);
+	printf("Upload Files Max: %d\n", cfg->upload_files_max);
+	printf("Output Buffer: %zu\n", cfg->output_buffer);
+	printf("Sendfile: %d\n", cfg->sendfile);
+	printf("Sendfile Prefix: %s\n", cfg->sendfile_prefix);
+	for(int i=0; i < cfg->ncompress; i++){
+		printf("Compress: %s (level %d)\n", cfg->compress[i].prefix, cfg->compress[i].value);
+	}
+	printf("Compress Min: %zu\n", cfg->compress_min);
+	printf("App Max: %zu\n", cfg->app_max);
+	printf("DB: %s\n", (cfg->db ? cfg->db : "(none)"));
+	printf("DB Sync: %d\n", cfg->db_sync);
+	printf("DB Ops Max: %zu\n", cfg->db_ops_max);
+	printf("DB Bytes Max: %zu\n", cfg->db_bytes_max);
+	printf("Session Cookie: %s\n", cfg->session_cookie);
+	printf("Session TTL: %d\n", cfg->session_ttl);
+	printf("Session Max: %zu\n", cfg->session_max);
+	printf("Session Bytes Max: %zu\n", cfg->session_bytes_max);
+	for(int i=0; i < cfg->nmicrocache; i++){
+		printf("Microcache: %s (%d seconds)\n", cfg->microcache[i].prefix, cfg->microcache[i].value);
+	}
+	printf("Microcache Max: %zu\n", cfg->microcache_max);
+	printf("Status Path: %s\n", (cfg->status_path ? cfg->status_path : "(none)"));
+	printf("Error Log: %s\n", (cfg->error_log ? cfg->error_log : "(stderr)"));
+	printf("Access Log: %s\n", (cfg->access_log ? cfg->access_log : "(none)"));
+	printf("Capture: %s\n", (cfg->capture ? cfg->capture : "(none)"));
+	printf("Capture Rate: %g\n", cfg->capture_rate);
+	printf("Capture Max: %zu\n", cfg->capture_max);
+	printf("Capture Body Max: %zu\n", cfg->capture_body_max);
 	printf("\n");
 }
 
@@ -59,125 +103,688 @@ static void printvars(FCGX_Request *request)
 #endif
 
 
+// Opens a TCP listener with SO_REUSEPORT set, so several can be bound to
+// the same address and the kernel balances connections between them.
+// Takes the same host:port form as FCGX_OpenSocket
+static int LF_openreuseport(const char *address, int backlog)
+{
+	const char *colon = strrchr(address, ':');
+	if(colon == NULL){ return -1; }
+
+	// Strip brackets from IPv6 addresses
+	const char *host = address;
+	size_t hostlen = colon - address;
+	if(hostlen >= 2 && host[0] == '[' && host[hostlen-1] == ']'){
+		host++;
+		hostlen -= 2;
+	}
+
+	char hostname[hostlen+1];
+	memcpy(hostname, host, hostlen);
+	hostname[hostlen] = 0;
+
+	// An empty host binds to every IPv4 address, as libfcgi does
+	struct addrinfo hints, *res, *ai;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = (hostlen > 0 ? AF_UNSPEC : AF_INET);
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+	if(getaddrinfo((hostlen > 0 ? hostname : NULL), colon+1, &hints, &res)){ return -1; }
+
+	int fd = -1, one = 1;
+	for(ai = res; ai != NULL; ai = ai->ai_next){
+		if((fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)) == -1){ continue; }
+
+		if(setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) == 0 &&
+			setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) == 0 &&
+			bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 &&
+			listen(fd, backlog) == 0){
+			break;
+		}
+
+		close(fd);
+		fd = -1;
+	}
+
+	freeaddrinfo(res);
+	return fd;
+}
+
+
+// Workers the supervisor has started, including retired ones until
+// they're done, and the sockets they're currently started on
+static LF_params **LF_workers = NULL;
+static int LF_nworkers = 0;
+static LF_socket **LF_sockets = NULL;
+static int LF_nsockets = 0;
+static char *LF_listening = NULL;
+static void *(*LF_run)(void *) = NULL;
+
+
 void *thread_run(void *arg)
 {
 	LF_params *params = arg;
-	LF_config *config = params->config;
+	LF_config *config = NULL;
 	LF_limits *limits = LF_newlimits();
+	LF_metrics *metrics = LF_newmetrics();
+	LF_capture *capture = LF_newcapture();
+	LF_pool *pool = NULL;
 	LF_state state;
 	lua_State *l;
 
+	state.params = NULL;
+	state.nparams = 0;
+	state.paramsize = 0;
+	state.serial = 0;
+	state.thread = NULL;
+	state.congested = NULL;
+	memset(&state.output, 0, sizeof(state.output));
+	state.output.direct = 1;
+	memset(&state.cache, 0, sizeof(state.cache));
+	state.session_loaded = NULL;
+	state.session_loadedlen = 0;
+	state.session_loadedsize = 0;
+	memset(state.timing, 0, sizeof(state.timing));
+	state.trips = 0;
+	state.fds = NULL;
+	state.nfds = 0;
+	state.file = NULL;
+
 	FCGX_Request request;
-	FCGX_InitRequest(&request, params->socket, 0);
+	FCGX_InitRequest(&request, params->socket->fd, 0);
+
+	// Connections are waited for alongside the supervisor waking the
+	// worker, and only one of the workers sharing a socket is woken
+	int epfd = epoll_create1(EPOLL_CLOEXEC);
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+	ev.data.ptr = NULL;
+	int failed = (epfd == -1 || epoll_ctl(epfd, EPOLL_CTL_ADD, params->socket->fd, &ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = params;
+	if(failed || epoll_ctl(epfd, EPOLL_CTL_ADD, params->wake, &ev)){
+		LF_logerror("epoll_create1() failure");
+		failed = 1;
+	}
+
+	// A retired worker leaves straight away, unless its socket's being
+	// closed. Then it takes whatever's still queued on it first
+	while(!failed){
+		int retired = __atomic_load_n(&params->retired, __ATOMIC_ACQUIRE);
+		if(retired && !__atomic_load_n(&params->socket->closing, __ATOMIC_ACQUIRE)){ break; }
+
+		// A connection the web server kept open is read from instead
+		if(!retired && request.ipcFd < 0){
+			struct epoll_event events[2];
+			int n = epoll_wait(epfd, events, 2, -1);
+			int ready = 0;
+			for(int i=0; i < n; i++){
+				if(events[i].data.ptr == NULL){ ready = 1; }
+				else {
+					uint64_t count;
+					if(read(params->wake, &count, sizeof(count))){}
+				}
+			}
+			if(!ready){ continue; }
+		}
+
+		// Another worker may have got there first
+		int a = FCGX_Accept_r(&request);
+		if(a == -EAGAIN){
+			if(retired){ break; }
+			continue;
+		}
+		if(a){
+			if(retired){ break; }
+			LF_logerror("FCGX_Accept_r() failure");
+			continue;
+		}
+
+		// Configuration is picked up between requests, along with a
+		// new pool of states made to suit it. One that couldn't be made
+		// is tried again on the next request
+		if(config == NULL || pool == NULL || LF_configchanged(config)){
+			LF_configrelease(config);
+			config = LF_configget();
+
+			LF_freepool(pool);
+			pool = LF_newpool(
+				1, config->sandbox, config->content_type,
+				config->state_reuse, config->arena_chunk
+			);
+			if(pool == NULL){ LF_logerror("LF_newpool(): memory allocation error"); }
+
+			state.upload_memory = config->upload_memory;
+			state.upload_dir = config->upload_dir;
+			state.upload_parts_max = config->upload_parts_max;
+			state.upload_files_max = config->upload_files_max;
+			state.output.buffer = config->output_buffer;
+			state.output.rules = config->compress;
+			state.output.nrules = config->ncompress;
+			state.output.compress_min = config->compress_min;
+			state.output.sendfile = config->sendfile;
+			state.output.sendprefix = config->sendfile_prefix;
+			state.output.capturemax = config->microcache_max / 16;
+		}
 
-	for(;;){
 		LF_setlimits(
 			limits, config->mem_max, config->output_max,
 			config->cpu_sec, config->cpu_usec
 		);
 
-		l = LF_newstate(config->sandbox, config->content_type);
+		#ifdef DEBUG
+		printvars(&request);
+		#endif
+
+		uint64_t start = LF_metricsclock();
+		LF_envparams(&state, request.envp);
 
-		if(FCGX_Accept_r(&request)){ 
-			printf("FCGX_Accept_r() failure\n");
-			LF_closestate(l);
+		if(LF_metricsrequest(&state)){
+			size_t len;
+			char *text = LF_metricsrender(&len);
+			if(text != NULL){ FCGX_PutStr(text, len, request.out); }
+			else { FCGX_FPrintF(request.out, "Status: 500 Internal Server Error\r\n\r\n"); }
+			free(text);
+			FCGX_Finish_r(&request);
 			continue;
 		}
 
-		#ifdef DEBUG
-		printvars(&request);
-		struct timespec rstart, rend;
-		clock_gettime(CLOCK_MONOTONIC, &rstart);
-		#endif
+		// The script reads the body through whatever's capturing it
+		FCGX_Stream *in = request.in;
+		request.in = LF_capturestart(capture, &state, in);
+
+		// Cached responses are sent without a state being involved
+		LF_mcentry *hit = LF_mcacheget(&state, 1);
+		if(hit != NULL){
+			size_t len;
+			const char *data = LF_mcachedata(hit, &len);
+			FCGX_PutStr(data, len, request.out);
+			LF_mcacherelease(hit);
+			LF_capturefinish(capture, &state, 200, len);
+			LF_logaccess(&state, 200, len, 1);
+			request.in = in;
+			FCGX_Finish_r(&request);
+			LF_metricscached(metrics);
+			continue;
+		}
+
+		// Without a state the request's only answered with an error
+		l = (pool != NULL ? LF_poolget(pool) : NULL);
+		if(l == NULL){
+			state.committed = 0;
+			state.response = request.out;
+			state.request = &request;
+			LF_responsebegin(&state);
+			LF_responseerror(&state, NULL, LF_ERRMEMORY, config->content_type);
+			LF_responsefinish(&state);
+			LF_mcachedone(&state, 0);
+			LF_capturefinish(capture, &state, state.output.status, state.output.sent);
+			request.in = in;
+
+			FCGX_FFlush(request.out);
+			memset(state.timing, 0, sizeof(state.timing));
+			state.timing[LF_PHASEPARSE] = LF_metricsclock() - start;
+			LF_logaccess(&state, state.output.status, state.output.sent, 0);
+			LF_metricsrecord(metrics, &state, LF_ERRMEMORY);
+			FCGX_Finish_r(&request);
+			continue;
+		}
 
 		LF_parserequest(l, &request, &state);
 
+		uint64_t now = LF_metricsclock();
+		state.timing[LF_PHASEPARSE] = now - start;
+		start = now;
+
+		LF_enablelimits(l, limits);
+
+		int r = LF_loadscript(l);
+		now = LF_metricsclock();
+		state.timing[LF_PHASELOAD] = now - start;
+		start = now;
+
+		if(r == 0){
+			int e = lua_pcall(l, 0, 0, 0);
+			if(e){ r = LF_ERRANY; }
+			if(e == LUA_ERRMEM && config->mem_max > 0){ state.trips |= LF_TRIPMEMORY; }
+
+			now = LF_metricsclock();
+			state.timing[LF_PHASEEXECUTE] = now - start;
+			start = now;
+		}
+		if(LF_cpulimited(limits)){ state.trips |= LF_TRIPCPU; }
+
+		LF_responseerror(&state, l, r, config->content_type);
+		if(r == 0){ LF_sessionsave(l, &state); }
+
+		LF_responsefinish(&state);
+		LF_mcachedone(&state, (r == 0));
+		LF_capturefinish(capture, &state, state.output.status, state.output.sent);
+		request.in = in;
+
+		// The params point into envp, which FCGX_Finish_r() frees, so the
+		// request's logged and recorded once its response has been flushed
+		FCGX_FFlush(request.out);
+		state.timing[LF_PHASEFLUSH] = LF_metricsclock() - start;
+		LF_logaccess(&state, state.output.status, state.output.sent, 0);
+		LF_metricsrecord(metrics, &state, r);
+		FCGX_Finish_r(&request);
+		LF_endrequest(&state);
+
 		#ifdef DEBUG
-		clock_gettime(CLOCK_MONOTONIC, &rend);
-		// Assumes the request returns in less than a second (which it should)
-		printf("Request parsed in %luns\n", (rend.tv_nsec-rstart.tv_nsec));
+		LF_arena *arena = LF_statearena(l);
+		if(arena != NULL){
+			size_t peak, chunks;
+			LF_arenastats(arena, &peak, &chunks);
+			printf("Arena peak %zu bytes in %zu chunks\n", peak, chunks);
+		}
 		#endif
 
-		LF_enablelimits(l, limits);
+		// The timer's stopped before the state goes idle in the pool
+		LF_disablelimits(limits);
+		LF_poolput(pool, l);
+	}
 
-		switch(LF_loadscript(l)){
-			case 0:
-				if(lua_pcall(l, 0, 0, 0)){
-					if(lua_isstring(l, -1)){
-						senderror(500, lua_tostring(l, -1));
-					} else {
-						senderror(500, "unspecified lua error");
-					}
-				} else if(!state.committed){
-					senderror(200, "");
-				}
-			break;
+	FCGX_Free(&request, 1);
+	if(epfd != -1){ close(epfd); }
+	LF_freepool(pool);
+	LF_freelimits(limits);
+	LF_freecapture(capture);
+	LF_metricsrelease(metrics);
+	LF_freestate(&state);
+	LF_configrelease(config);
+	return NULL;
+}
 
-			case LF_ERRACCESS: senderror(403, "access denied"); break;
-			case LF_ERRMEMORY: senderror(500, "not enough memory"); break;
-			case LF_ERRNOTFOUND:
-				printf("404\n");
-				senderror(404, "no such file or directory");
-			break;
-			case LF_ERRSYNTAX: senderror(500, lua_tostring(l, -1)); break;
-			case LF_ERRBYTECODE: senderror(403, "compiled bytecode not supported"); break;
-			case LF_ERRNOPATH: senderror(500, "SCRIPT_FILENAME not provided"); break;
-			case LF_ERRNONAME: senderror(500, "SCRIPT_NAME not provided"); break;
+
+static void LF_socketrelease(LF_socket *s)
+{
+	if(__atomic_sub_fetch(&s->users, 1, __ATOMIC_ACQ_REL) == 0){
+		close(s->fd);
+		free(s);
+	}
+}
+
+
+// Runs a worker, letting the supervisor know once it's exited
+static void *LF_worker(void *arg)
+{
+	LF_params *params = arg;
+	LF_run(params);
+
+	LF_socketrelease(params->socket);
+	__atomic_store_n(&params->done, 1, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+
+// Opens the sockets a configuration listens on, for nthreads workers.
+// Returns non-zero if any can't be opened
+static int LF_openlisteners(LF_config *config, int nthreads)
+{
+	// Unix sockets can't be shared with SO_REUSEPORT
+	int n = 1;
+	if(config->listeners > 0){
+		if(strchr(config->listen, ':') == NULL){
+			LF_logerror("listeners ignored: %s isn't an IP address", config->listen);
+		} else {
+			n = (config->listeners < nthreads ? config->listeners : nthreads);
 		}
+	}
 
-		FCGX_Finish_r(&request);
-		LF_closestate(l);
+	LF_socket **sockets = malloc(sizeof(LF_socket *) * n);
+	char *listening = strdup(config->listen);
+	if(sockets == NULL || listening == NULL){
+		free(sockets);
+		free(listening);
+		return 1;
+	}
+
+	for(int i=0; i < n; i++){
+		if((sockets[i] = malloc(sizeof(LF_socket))) != NULL){
+			if(config->listeners > 0 && n > 1){
+				sockets[i]->fd = LF_openreuseport(config->listen, config->backlog);
+			} else {
+				sockets[i]->fd = FCGX_OpenSocket(config->listen, config->backlog);
+			}
+			sockets[i]->users = 1;
+			sockets[i]->closing = 0;
+
+			// Workers wait for connections themselves, so accepting
+			// never blocks
+			if(sockets[i]->fd >= 0){
+				int flags = fcntl(sockets[i]->fd, F_GETFL);
+				fcntl(sockets[i]->fd, F_SETFL, flags | O_NONBLOCK);
+			}
+		}
+
+		if(sockets[i] == NULL || sockets[i]->fd < 0){
+			LF_logerror("FCGX_OpenSocket() failure: could not open %s", config->listen);
+			free(sockets[i]);
+			for(int j=0; j < i; j++){ LF_socketrelease(sockets[j]); }
+			free(sockets);
+			free(listening);
+			return 1;
+		}
 	}
+
+	LF_sockets = sockets;
+	LF_nsockets = n;
+	LF_listening = listening;
+	return 0;
+}
+
+
+// Workers started on a socket and not yet retired
+static int LF_socketworkers(LF_socket *s)
+{
+	int n = 0;
+	for(int i=0; i < LF_nworkers; i++){
+		if(LF_workers[i]->socket == s && !LF_workers[i]->retired){ n++; }
+	}
+	return n;
+}
+
+
+// Starts a worker on whichever socket has the fewest
+static int LF_spawn()
+{
+	LF_socket *s = LF_sockets[0];
+	for(int i=1; i < LF_nsockets; i++){
+		if(LF_socketworkers(LF_sockets[i]) < LF_socketworkers(s)){ s = LF_sockets[i]; }
+	}
+
+	LF_params **workers = realloc(LF_workers, sizeof(LF_params *) * (LF_nworkers + 1));
+	if(workers == NULL){ return 1; }
+	LF_workers = workers;
+
+	LF_params *params = calloc(1, sizeof(LF_params));
+	if(params == NULL){ return 1; }
+
+	if((params->wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1){
+		free(params);
+		return 1;
+	}
+
+	params->socket = s;
+	__atomic_add_fetch(&s->users, 1, __ATOMIC_RELAXED);
+
+	pthread_t thread;
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	int r = pthread_create(&thread, &attr, &LF_worker, params);
+	pthread_attr_destroy(&attr);
+
+	if(r){
+		LF_logerror("Thread creation error: %d", r);
+		LF_socketrelease(s);
+		close(params->wake);
+		free(params);
+		return 1;
+	}
+
+	LF_workers[LF_nworkers++] = params;
+	return 0;
+}
+
+
+// Nudges a worker into checking for a new configuration, or whether it's
+// been retired
+static void LF_wake(LF_params *params)
+{
+	uint64_t one = 1;
+	if(write(params->wake, &one, sizeof(one)) == -1 && errno != EAGAIN){
+		LF_logerror("Error waking worker: %s", strerror(errno));
+	}
+}
+
+
+static void LF_retire(LF_params *params)
+{
+	__atomic_store_n(&params->retired, 1, __ATOMIC_RELEASE);
+	LF_wake(params);
+}
+
+
+// Frees the params of retired workers that have exited
+static void LF_reap()
+{
+	int n = 0;
+	for(int i=0; i < LF_nworkers; i++){
+		LF_params *params = LF_workers[i];
+		if(__atomic_load_n(&params->done, __ATOMIC_ACQUIRE)){
+			close(params->wake);
+			free(params);
+		} else {
+			LF_workers[n++] = params;
+		}
+	}
+	LF_nworkers = n;
+}
+
+
+static int LF_samestr(const char *a, const char *b)
+{
+	if(a == NULL || b == NULL){ return (a == b); }
+	return (strcmp(a, b) == 0);
+}
+
+
+static int LF_samerules(LF_rule *a, int na, LF_rule *b, int nb)
+{
+	if(na != nb){ return 0; }
+	for(int i=0; i < na; i++){
+		if(a[i].value != b[i].value || strcmp(a[i].prefix, b[i].prefix) != 0){ return 0; }
+	}
+	return 1;
+}
+
+
+#define LF_RESTARTONLY(same, name) \
+	if(!(same)){ LF_logerror("Reload: %s only changes on restart", name); }
+
+// Warns of settings that changed but are only read on startup
+static void LF_restartonly(LF_config *a, LF_config *b)
+{
+	LF_RESTARTONLY(a->event == b->event, "event");
+	LF_RESTARTONLY(a->script_cache == b->script_cache, "script_cache");
+	LF_RESTARTONLY(a->file_cache == b->file_cache, "file_cache");
+	LF_RESTARTONLY(a->file_cache_check == b->file_cache_check, "file_cache_check");
+	LF_RESTARTONLY(a->file_size_max == b->file_size_max, "file_size_max");
+	LF_RESTARTONLY(a->app_max == b->app_max, "app_max");
+	LF_RESTARTONLY(LF_samestr(a->db, b->db), "db");
+	LF_RESTARTONLY(a->db_sync == b->db_sync, "db_sync");
+	LF_RESTARTONLY(a->db_ops_max == b->db_ops_max, "db_ops_max");
+	LF_RESTARTONLY(a->db_bytes_max == b->db_bytes_max, "db_bytes_max");
+	LF_RESTARTONLY(LF_samestr(a->session_cookie, b->session_cookie), "session_cookie");
+	LF_RESTARTONLY(a->session_ttl == b->session_ttl, "session_ttl");
+	LF_RESTARTONLY(a->session_max == b->session_max, "session_max");
+	LF_RESTARTONLY(a->session_bytes_max == b->session_bytes_max, "session_bytes_max");
+	LF_RESTARTONLY(LF_samerules(a->microcache, a->nmicrocache, b->microcache, b->nmicrocache), "microcache");
+	LF_RESTARTONLY(a->microcache_max == b->microcache_max, "microcache_max");
+	LF_RESTARTONLY(LF_samestr(a->status_path, b->status_path), "status_path");
+	LF_RESTARTONLY(LF_samestr(a->error_log, b->error_log), "error_log");
+	LF_RESTARTONLY(LF_samestr(a->access_log, b->access_log), "access_log");
+	LF_RESTARTONLY(LF_samestr(a->capture, b->capture), "capture");
+	LF_RESTARTONLY(a->capture_rate == b->capture_rate, "capture_rate");
+	LF_RESTARTONLY(a->capture_max == b->capture_max, "capture_max");
+	LF_RESTARTONLY(a->capture_body_max == b->capture_body_max, "capture_body_max");
+}
+
+
+// Re-reads lua-fastcgi.lua and publishes it, then grows or shrinks the
+// workers to match. If listen changed, the new address is bound before
+// any of the old workers are retired, and their sockets are shut down
+static void LF_reload(LF_config *startup, LF_config **current)
+{
+	LF_config *config = LF_createconfig();
+	if(config == NULL){
+		LF_logerror("Reload: memory allocation error");
+		return;
+	}
+	if(LF_loadconfig(config, "./lua-fastcgi.lua")){
+		LF_logerror("Reload: error loading lua-fastcgi.lua, keeping the current configuration");
+		LF_configrelease(config);
+		return;
+	}
+
+	#ifdef DEBUG
+	printcfg(config);
+	#endif
+
+	LF_restartonly(startup, config);
+
+	int nthreads = (config->threads > 0 ? config->threads : 1);
+	int rebind = (strcmp(config->listen, LF_listening) != 0);
+	if(!rebind){
+		LF_RESTARTONLY(config->backlog == (*current)->backlog, "backlog, unless listen changes,");
+		LF_RESTARTONLY(config->listeners == (*current)->listeners, "listeners, unless listen changes,");
+	}
+
+	LF_socket **old = LF_sockets;
+	int nold = LF_nsockets;
+	char *oldlisten = LF_listening;
+	if(rebind && LF_openlisteners(config, nthreads)){
+		LF_logerror("Reload: keeping the current configuration");
+		LF_configrelease(config);
+		return;
+	}
+
+	// The supervisor keeps a reference of its own to compare against
+	LF_configref(config);
+	LF_configpublish(config);
+	LF_configrelease(*current);
+	*current = config;
+
+	if(rebind){
+		// Connections still queued on the old sockets are taken by the
+		// workers retired from them, which close them on their way out
+		for(int i=0; i < nold; i++){ __atomic_store_n(&old[i]->closing, 1, __ATOMIC_RELEASE); }
+		for(int i=0; i < LF_nworkers; i++){
+			if(!LF_workers[i]->retired){ LF_retire(LF_workers[i]); }
+		}
+
+		for(int i=0; i < nold; i++){ LF_socketrelease(old[i]); }
+		free(old);
+		free(oldlisten);
+		LF_logerror("Reload: now listening on %s", LF_listening);
+	}
+
+	// Sockets can't be left without a worker
+	if(nthreads < LF_nsockets){
+		LF_logerror("Reload: keeping %d threads, one per listener", LF_nsockets);
+		nthreads = LF_nsockets;
+	}
+
+	int live = 0;
+	for(int i=0; i < LF_nworkers; i++){
+		if(!LF_workers[i]->retired){ live++; }
+	}
+
+	for(; live < nthreads; live++){
+		if(LF_spawn()){ break; }
+	}
+
+	// Workers are retired from whichever socket has the most
+	for(; live > nthreads; live--){
+		LF_params *last = NULL;
+		for(int i=0; i < LF_nworkers; i++){
+			LF_params *params = LF_workers[i];
+			if(params->retired){ continue; }
+			if(last == NULL || LF_socketworkers(params->socket) > LF_socketworkers(last->socket)){ last = params; }
+		}
+		if(last == NULL){ break; }
+		LF_retire(last);
+	}
+
+	// Event workers are woken to pick the configuration up straight away
+	for(int i=0; i < LF_nworkers; i++){
+		if(!LF_workers[i]->retired){ LF_wake(LF_workers[i]); }
+	}
+
+	LF_logerror("Reload: running %d threads", live);
 }
 
 
 int main()
 {
+	// SIGHUP is waited on by the supervisor, so it's blocked before any
+	// other thread's started to inherit it
+	sigset_t hup;
+	sigemptyset(&hup);
+	sigaddset(&hup, SIGHUP);
+	pthread_sigmask(SIG_BLOCK, &hup, NULL);
+
 	if(FCGX_Init() != 0){
-		printf("FCGX_Init() failure\n");
+		LF_logerror("FCGX_Init() failure");
 		exit(EXIT_FAILURE);
 	}
 
 	LF_config *config = LF_createconfig();
 	if(config == NULL){
-		printf("LF_createconfig(): memory allocation error\n");
+		LF_logerror("LF_createconfig(): memory allocation error");
 		exit(EXIT_FAILURE);
 	}
 
 	if(LF_loadconfig(config, "./lua-fastcgi.lua")){
-		printf("Error loading lua-fastcgi.lua\n");
+		LF_logerror("Error loading lua-fastcgi.lua");
 	}
 
 	#ifdef DEBUG
 	printcfg(config);
 	#endif
 
-	int socket = FCGX_OpenSocket(config->listen, config->backlog);
-	if(socket < 0){
-		printf("FCGX_OpenSocket() failure: could not open %s\n", config->listen);
+	if(LF_loginit(config->error_log, config->access_log)){
+		LF_logerror("Error opening error_log or access_log");
+	}
+
+	LF_cacheinit(config->script_cache);
+	LF_filecacheinit(config->file_cache, config->file_size_max, config->file_cache_check);
+	LF_appinit(config->app_max);
+
+	if(LF_dbinit(config->db, config->db_sync, config->db_ops_max, config->db_bytes_max)){
+		LF_logerror("Error opening database %s", config->db);
+	}
+
+	LF_sessioninit(config->session_cookie, config->session_ttl, config->session_max, config->session_bytes_max);
+	LF_mcacheinit(config->microcache, config->nmicrocache, config->microcache_max);
+	LF_metricsinit(config->status_path);
+
+	if(LF_captureinit(config->capture, config->capture_rate, config->capture_max, config->capture_body_max)){
+		LF_logerror("Error opening capture file %s", config->capture);
+	}
+
+	// What's set up above keeps pointers into the startup configuration,
+	// so a reference to it is held for good. Another is the supervisor's
+	LF_config *current = config;
+	LF_configref(config);
+	LF_configref(config);
+	LF_configpublish(config);
+
+	int nthreads = (config->threads > 0 ? config->threads : 1);
+	if(LF_openlisteners(config, nthreads)){
+		LF_logflush();
 		exit(EXIT_FAILURE);
 	}
 
-	LF_params *params = malloc(sizeof(LF_params));
-	params->socket = socket;
-	params->config = config;
-
-	if(config->threads == 1){
-		thread_run(params);
-	} else {
-		pthread_attr_t attr;
-		pthread_attr_init(&attr);
-		pthread_t threads[config->threads];
-		for(int i=0; i < config->threads; i++){
-			int r = pthread_create(&threads[i], &attr, &thread_run, params);
-			if(r){
-				printf("Thread creation error: %d\n", r);
-				exit(EXIT_FAILURE);
-			}
+	LF_run = (config->event ? &event_run : &thread_run);
+	for(int i=0; i < nthreads; i++){
+		if(LF_spawn()){
+			LF_logflush();
+			exit(EXIT_FAILURE);
 		}
+	}
 
-		pthread_join(threads[0], NULL);
+	// The main thread stays on as the supervisor, reloading on SIGHUP and
+	// tidying up after retired workers
+	struct timespec second = { 1, 0 };
+	for(;;){
+		int sig = sigtimedwait(&hup, NULL, &second);
+		LF_reap();
+		if(sig == SIGHUP){ LF_reload(config, &current); }
 	}
-	
+
 	return 0;
 }
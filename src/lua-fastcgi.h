@@ -1,5 +1,19 @@
+// A listening socket, closed once the last worker using it has exited.
+// Listeners don't block, and closing is set once they're no longer
+// listened on, for workers to take what's still queued before they exit
 typedef struct {
-	LF_config	*config;
-	int socket;
-} LF_params;
+	int fd;
+	int users;
+	int closing;
+} LF_socket;
 
+// What a worker's started with. Workers take the published configuration
+// themselves, picking up a new one between requests. The supervisor sets
+// retired to have a worker finish what it's doing and exit, waking it
+// through wake, and frees the params once done is set
+typedef struct {
+	LF_socket *socket;
+	int wake;
+	int retired;
+	int done;
+} LF_params;
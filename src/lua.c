@@ -2,14 +2,17 @@
 #include <inttypes.h>
 #include <stdint.h>
 #include <string.h>
+#include <strings.h>
 #include <unistd.h>
-#include <ctype.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
 #include <sys/time.h>
-#include <sys/resource.h>
+#include <sys/syscall.h>
 
 #include <fcgiapp.h>
 
@@ -19,6 +22,17 @@
 
 #include "lua.h"
 #include "lfuncs.h"
+#include "cache.h"
+#include "arena.h"
+#include "query.h"
+#include "multipart.h"
+#include "reader.h"
+#include "response.h"
+#include "app.h"
+#include "db.h"
+#include "log.h"
+#include "session.h"
+#include "filecache.h"
 
 
 #ifdef DEBUG
@@ -33,37 +47,91 @@ void LF_printstack(lua_State *l)
 #endif
 
 
-// Gets current thread usage
-static int LF_threadusage(struct timeval *tv)
+// Registry key of the current request's LF_state, only its address matters
+static char LF_statekey;
+
+
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+
+// Set once the thread's CPU timer expires during a request
+static __thread volatile sig_atomic_t LF_cpuexceeded = 0;
+// State the CPU timer hooks when it expires
+static __thread lua_State *volatile LF_cpustate = NULL;
+
+static pthread_once_t LF_cpuonce = PTHREAD_ONCE_INIT;
+
+
+// limits cpu usage
+static void LF_limit_hook(lua_State *l, lua_Debug *d)
 {
-	struct rusage usage;
-	if(getrusage(RUSAGE_SELF, &usage) == -1){
-		return 1;
+	if(LF_cpuexceeded){ luaL_error(l, "CPU limit exceeded"); }
+}
+
+
+// SIGXCPU handler, the calling thread has used up its CPU time. Scripts
+// run unhooked until this point, lua_sethook is safe to call from here
+static void LF_cpuexpired(int sig)
+{
+	LF_cpuexceeded = 1;
+
+	lua_State *l = LF_cpustate;
+	if(l != NULL){
+		lua_sethook(l, &LF_limit_hook, LUA_MASKCALL | LUA_MASKRET | LUA_MASKCOUNT, 1);
 	}
+}
 
-	// Add user to sys to get actual usage
-	tv->tv_usec = usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
-	tv->tv_sec = usage.ru_utime.tv_sec + usage.ru_stime.tv_sec;
 
-	if(tv->tv_usec > 1000000){
-		tv->tv_usec -= 1000000;
-		tv->tv_sec++;
+static void LF_cpuinit()
+{
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = &LF_cpuexpired;
+	sa.sa_flags = SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+	if(sigaction(SIGXCPU, &sa, NULL)){
+		LF_logerror("SIGXCPU handler error, CPU limits won't be enforced: %s", strerror(errno));
 	}
-	return 0;
 }
 
 
-// limits cpu usage
-static void LF_limit_hook(lua_State *l, lua_Debug *d)
+// Replacement coroutine.create/wrap. Hooks are per coroutine and new
+// coroutines inherit their creator's, so they're created with a cheap
+// hook that checks if the thread's CPU time has run out
+static int LF_cocreate(lua_State *l)
 {
-	lua_pushstring(l, "CPU_LIMIT");
-	lua_rawget(l, LUA_REGISTRYINDEX);
-	struct timeval *limit = lua_touserdata(l, -1);
-	lua_pop(l, 1);
+	int hooked = (lua_gethook(l) != NULL);
+	if(!hooked){ lua_sethook(l, &LF_limit_hook, LUA_MASKCOUNT, 1000); }
+
+	lua_pushvalue(l, lua_upvalueindex(1));
+	lua_insert(l, 1);
+	int r = lua_pcall(l, lua_gettop(l)-1, LUA_MULTRET, 0);
 
-	struct timeval tv;
-	if(LF_threadusage(&tv)){ luaL_error(l, "CPU usage sample error"); }
-	if(timercmp(&tv, limit, >)){ luaL_error(l, "CPU limit exceeded"); }
+	if(!hooked){ lua_sethook(l, NULL, 0, 0); }
+	if(r){ lua_error(l); }
+
+	// The timer may have expired (and been unhooked) in the meantime
+	if(LF_cpuexceeded){ luaL_error(l, "CPU limit exceeded"); }
+	return lua_gettop(l);
+}
+
+
+static void LF_cowrap(lua_State *l, const char *name)
+{
+	lua_getglobal(l, LUA_COLIBNAME);
+	if(!lua_istable(l, -1)){
+		lua_pop(l, 1);
+		return;
+	}
+
+	lua_pushstring(l, name);
+	lua_pushstring(l, name);
+	lua_rawget(l, -3);
+	lua_pushcclosure(l, &LF_cocreate, 1);
+	lua_rawset(l, -3);
+	lua_pop(l, 1);
 }
 
 
@@ -101,10 +169,34 @@ LF_limits *LF_newlimits()
 	if(limits == NULL){ return NULL; }
 
 	memset(limits, 0, sizeof(LF_limits));
+
+	// Timer measuring this thread's CPU time, signalling only this thread
+	pthread_once(&LF_cpuonce, &LF_cpuinit);
+
+	struct sigevent sev;
+	memset(&sev, 0, sizeof(sev));
+	sev.sigev_notify = SIGEV_THREAD_ID;
+	sev.sigev_signo = SIGXCPU;
+	sev.sigev_notify_thread_id = syscall(SYS_gettid);
+
+	if(timer_create(CLOCK_THREAD_CPUTIME_ID, &sev, &limits->cputimer) == 0){
+		limits->cputimed = 1;
+	} else {
+		LF_logerror("CPU timer creation error, CPU limits won't be enforced on this thread: %s", strerror(errno));
+	}
+
 	return limits;
 }
 
 
+void LF_freelimits(LF_limits *limits)
+{
+	if(limits == NULL){ return; }
+	if(limits->cputimed){ timer_delete(limits->cputimer); }
+	free(limits);
+}
+
+
 void LF_setlimits(LF_limits *limits, size_t memory, size_t output, uint32_t cpu_sec, uint32_t cpu_usec)
 {
 	limits->memory = memory;
@@ -116,24 +208,12 @@ void LF_setlimits(LF_limits *limits, size_t memory, size_t output, uint32_t cpu_
 
 void LF_enablelimits(lua_State *l, LF_limits *limits)
 {
-	if(limits->cpu.tv_usec > 0 || limits->cpu.tv_sec > 0){
-		struct timeval curr;
-		if(LF_threadusage(&curr)){
-			printf("CPU usage sample error\n"); // FIX ME
-		} else {
-			timeradd(&limits->cpu, &curr, &limits->cpu);
-			lua_sethook(l, &LF_limit_hook, LUA_MASKCOUNT, 1000);
-		}
+	limits->cpuexceeded = 0;
+	LF_resumelimits(l, limits);
 
-		lua_pushstring(l, "CPU_LIMIT");
-		lua_pushlightuserdata(l, &limits->cpu);
-		lua_rawset(l, LUA_REGISTRYINDEX);
-	}
-
-	if(limits->output){
-		lua_pushstring(l, "RESPONSE_LIMIT");
-		lua_pushlightuserdata(l, &limits->output);
-		lua_rawset(l, LUA_REGISTRYINDEX);
+	LF_state *state = LF_getstate(l);
+	if(state != NULL){
+		state->output_limit = (limits->output ? &limits->output : NULL);
 	}
 
 	if(limits->memory){
@@ -141,15 +221,123 @@ void LF_enablelimits(lua_State *l, LF_limits *limits)
 		lua_pushlightuserdata(l, &limits->memory);
 		lua_rawset(l, LUA_REGISTRYINDEX);
 
-		lua_setallocf(l, &LF_limit_alloc, &limits->memory);
+		// Arenas keep their own allocator and enforce the same limit
+		LF_arena *arena = LF_statearena(l);
+		if(arena != NULL){ LF_arenalimit(arena, &limits->memory); }
+		else { lua_setallocf(l, &LF_limit_alloc, &limits->memory); }
 	}
 }
 
 
-// Initialize a new lua state using specific parameters
-lua_State *LF_newstate(int sandbox, char *content_type)
+// Stops CPU accounting once a request's state has been released
+void LF_disablelimits(LF_limits *limits)
+{
+	if(limits->cputimed){
+		struct itimerspec its;
+		memset(&its, 0, sizeof(its));
+		timer_settime(limits->cputimer, 0, &its, NULL);
+	}
+
+	LF_cpustate = NULL;
+}
+
+
+// Suspends CPU accounting while a request is waiting, keeping what's left
+// of its CPU time in limits, so requests can take turns on a thread
+void LF_pauselimits(LF_limits *limits)
+{
+	if(limits->cputimed && (limits->cpu.tv_usec > 0 || limits->cpu.tv_sec > 0)){
+		struct itimerspec its, left;
+		memset(&its, 0, sizeof(its));
+		timer_settime(limits->cputimer, 0, &its, &left);
+
+		if(left.it_value.tv_sec == 0 && left.it_value.tv_nsec == 0){
+			// Ran out, keep a limit so it isn't taken for no limit at all
+			limits->cpuexceeded = 1;
+			limits->cpu.tv_sec = 0;
+			limits->cpu.tv_usec = 1;
+		} else {
+			limits->cpu.tv_sec = left.it_value.tv_sec;
+			limits->cpu.tv_usec = (left.it_value.tv_nsec + 999) / 1000;
+		}
+	}
+
+	limits->cpuexceeded |= LF_cpuexceeded;
+	LF_cpuexceeded = 0;
+	LF_cpustate = NULL;
+}
+
+
+// Starts or resumes CPU accounting for a request about to run in l
+void LF_resumelimits(lua_State *l, LF_limits *limits)
+{
+	LF_cpuexceeded = limits->cpuexceeded;
+
+	if(limits->cputimed && (limits->cpu.tv_usec > 0 || limits->cpu.tv_sec > 0)){
+		struct itimerspec its;
+		memset(&its, 0, sizeof(its));
+		its.it_value.tv_sec = limits->cpu.tv_sec + (limits->cpu.tv_usec / 1000000);
+		its.it_value.tv_nsec = (limits->cpu.tv_usec % 1000000) * 1000;
+
+		LF_cpustate = l;
+		if(timer_settime(limits->cputimer, 0, &its, NULL)){
+			LF_logerror("CPU timer error, this request's CPU limit won't be enforced: %s", strerror(errno));
+		}
+	}
+
+	if(LF_cpuexceeded){
+		lua_sethook(l, &LF_limit_hook, LUA_MASKCALL | LUA_MASKRET | LUA_MASKCOUNT, 1);
+	}
+}
+
+
+// Whether the CPU limit has run out during the current request
+int LF_cpulimited(LF_limits *limits)
+{
+	return (limits->cpuexceeded || LF_cpuexceeded);
+}
+
+
+// Checks that a C function called by the script in l can yield. Lua 5.1
+// can't yield across C functions, metamethods or iterators, so only the
+// request's own thread may, when nothing but plain calls lead from the
+// script's main chunk to the caller
+int LF_yieldable(lua_State *l, LF_state *state)
+{
+	if(state == NULL || l != state->thread){ return 0; }
+
+	lua_Debug ar, next;
+	for(int level=0; lua_getstack(l, level, &ar); level++){
+		if(!lua_getinfo(l, "Sn", &ar)){ return 0; }
+
+		if(!lua_getstack(l, level+1, &next)){
+			return (level > 0 && strcmp(ar.what, "main") == 0);
+		}
+
+		if(level > 0 && strcmp(ar.what, "Lua") != 0 && strcmp(ar.what, "main") != 0){
+			return 0;
+		}
+
+		if(ar.namewhat[0] == 0 || strcmp(ar.namewhat, "for iterator") == 0){ return 0; }
+	}
+	return 0;
+}
+
+
+// Reports errors raised outside of any protected call
+// Lua exits once this returns, so the log's given a chance to be written
+static int LF_panic(lua_State *l)
+{
+	const char *error = lua_tostring(l, -1);
+	LF_logerror("PANIC: unprotected error in call to Lua API (%s)", (error ? error : "unknown error"));
+	LF_logflush();
+	return 0;
+}
+
+
+// Loads libraries and globals into a newly created state
+static lua_State *LF_openstate(lua_State *l, int sandbox, char *content_type)
 {
-	lua_State *l = luaL_newstate();
 	if(l == NULL){ return NULL; }
 
 	// Load base
@@ -186,11 +374,31 @@ lua_State *LF_newstate(int sandbox, char *content_type)
 		lua_register(l, "dofile", &LF_dofile);
 	}
 
+	// Create coroutines subject to CPU limits
+	LF_cowrap(l, "create");
+	LF_cowrap(l, "wrap");
+
 	// Register the print function
 	lua_register(l, "print", &LF_print);
 	// Register the write function
 	lua_register(l, "write", &LF_write);
 
+	// Register the log function
+	lua_register(l, "log", &LF_log);
+
+	// Register the cache function
+	lua_register(l, "cache", &LF_cache);
+
+	// Register the readfile and sendfile functions
+	lua_register(l, "readfile", &LF_readfile);
+	lua_register(l, "sendfile", &LF_sendfile);
+
+	// Setup the "APP" store
+	LF_openapp(l);
+
+	// Setup the "DB" database
+	LF_opendb(l);
+
 	// Setup the "HEADER" value
 	lua_newtable(l);
 
@@ -204,152 +412,328 @@ lua_State *LF_newstate(int sandbox, char *content_type)
 }
 
 
-// Set GET variables
-static void LF_parsequerystring(lua_State *l, char *query_string, char *table)
+// Initialize a new lua state using specific parameters
+lua_State *LF_newstate(int sandbox, char *content_type)
 {
-	lua_newtable(l);
+	return LF_openstate(luaL_newstate(), sandbox, content_type);
+}
 
-	int stack = lua_gettop(l);
 
-	char *sptr, *optr, *nptr;
-	for(nptr = optr = sptr = &query_string[0]; 1; optr++){
-		switch(*optr){
-			case '+':
-				*nptr++ = ' ';
-			break;
+// Initialize a new lua state allocating from an arena
+static lua_State *LF_newarenastate(LF_arena *arena, int sandbox, char *content_type)
+{
+	lua_State *l = lua_newstate(&LF_arenaalloc, arena);
+	if(l == NULL){ return NULL; }
 
-			case '=':
-				// Push a key, if it's valid and there's not already one
-				if(lua_gettop(l) == stack){
-					if((nptr-sptr) > 0){ lua_pushlstring(l, sptr, (nptr - sptr)); }
-					sptr = nptr;
-				} else {
-					*nptr++ = '=';
-				}
-			break;
+	lua_atpanic(l, &LF_panic);
+	return LF_openstate(l, sandbox, content_type);
+}
 
-			case '&':
-				// Push key or value if valid
-				if((nptr-sptr) > 0){ lua_pushlstring(l, sptr, (nptr - sptr)); }
 
-				// Push value, if there is already a key
-				if(lua_gettop(l) == (stack+1)){ lua_pushstring(l, ""); }
+// Pushes the REQUEST table, holding every FastCGI variable
+static void LF_pushrequest(lua_State *l, LF_state *state)
+{
+	lua_createtable(l, 0, state->nparams);
+	for(size_t i=0; i < state->nparams; i++){
+		const LF_param *p = &state->params[i];
+		lua_pushlstring(l, p->name, p->namelen); // Push Key
+		lua_pushlstring(l, p->value, p->valuelen); // Push Value
+		lua_rawset(l, -3); // Set key/value into table
+	}
+}
 
-				// Set key/value if they exist
-				if(lua_gettop(l) == (stack+2)){ lua_rawset(l, stack); }
 
-				sptr = nptr;
-			break;
+// Pushes the GET table, parsed from QUERY_STRING
+static int LF_pushget(lua_State *l, LF_state *state)
+{
+	if(state->query_string == NULL){ return 0; }
+
+	// The variable itself stays intact for REQUEST
+	size_t len = strlen(state->query_string);
+	char *out = lua_newuserdata(l, len+1);
+	LF_parsequerystring(l, out, state->query_string, len);
+	lua_remove(l, -2);
+	return 1;
+}
 
-			case '%': {
-				// Decode hex percent encoded sets, if valid
-				char c1 = *(optr+1), c2 = *(optr+2);
-				if(isxdigit(c1) && isxdigit(c2)){
-					char digit = 16 * (c1 >= 'A' ? (c1 & 0xdf) - '7' : (c1 - '0'));
-					digit += (c2 >= 'A' ? (c2 & 0xdf) - '7' : (c2 - '0'));
-					*nptr++ = digit;
-					optr += 2;
-				} else {
-					*nptr++ = '%';
-				}
-			} break;
 
-			case '\0':
-				// Push key or value if valid
-				if((nptr-sptr) > 0){ lua_pushlstring(l, sptr, (nptr - sptr)); }
+// Pushes the POST table, parsed from a form encoded or multipart body
+static int LF_pushpost(lua_State *l, LF_state *state)
+{
+	if(state->content_length == 0 || state->content_type == NULL){ return 0; }
 
-				// Push value, if needed
-				if(lua_gettop(l) == (stack+1)){ lua_pushstring(l, ""); }
+	if(strncasecmp(state->content_type, "multipart/form-data", 19) == 0){
+		size_t blen;
+		const char *boundary = LF_multipartboundary(state->content_type, &blen);
+		if(boundary == NULL){ return 0; }
 
-				// Set key/value if valid
-				if(lua_gettop(l) == (stack+2)){ lua_rawset(l, stack); }
+		switch(LF_parsemultipart(l, state, boundary, blen)){
+			case LF_MULTIPART_ESPOOL: luaL_error(l, "Unable to store uploaded file."); break;
+			case LF_MULTIPART_ELIMIT: luaL_error(l, "Too many parts in upload."); break;
+		}
+		return 1;
+	}
 
-				// Finally, set the table
-				lua_setglobal(l, table);
-				return;
-			break;
+	if(strncasecmp(state->content_type, "application/x-www-form-urlencoded", 33) != 0){
+		return 0;
+	}
 
-			default:
-				*nptr++ = *optr;
-			break;
+	// Whatever REQUEST_BODY hasn't already consumed
+	uintmax_t left = (state->content_read < state->content_length ?
+		state->content_length - state->content_read : 0);
+
+	size_t len = (left > INT_MAX ? INT_MAX : left);
+	char *content = lua_newuserdata(l, (len > 0 ? len : 1));
+	int r = (len > 0 ? FCGX_GetStr(content, len, state->request->in) : 0);
+	state->content_read += (r > 0 ? r : 0);
+	LF_parsequerystring(l, content, content, (r > 0 ? r : 0));
+	lua_remove(l, -2);
+	return 1;
+}
+
+
+// Builds the global named by the second argument, for LF_lazyglobal
+static int LF_lazybuild(lua_State *l)
+{
+	LF_state *state = lua_touserdata(l, 1);
+
+	switch(lua_objlen(l, 2)){
+		case 3: return LF_pushget(l, state);
+		case 4: return LF_pushpost(l, state);
+		case 12: LF_pushbodyreader(l, state); return 1;
+		default:
+			if(*lua_tostring(l, 2) == 'S'){ return LF_sessionload(l, state); }
+			LF_pushrequest(l, state);
+			return 1;
+	}
+}
+
+
+// __index for the globals, builds REQUEST, GET, POST, REQUEST_BODY and
+// SESSION on first access
+static int LF_lazyglobal(lua_State *l)
+{
+	if(lua_type(l, 2) != LUA_TSTRING){ return 0; }
+
+	size_t len;
+	const char *key = lua_tolstring(l, 2, &len);
+
+	switch(len){
+		case 3: if(memcmp(key, "GET", 3) == 0){ break; } return 0;
+		case 4: if(memcmp(key, "POST", 4) == 0){ break; } return 0;
+		case 7:
+			if(memcmp(key, "REQUEST", 7) == 0 || memcmp(key, "SESSION", 7) == 0){ break; }
+		return 0;
+		case 12: if(memcmp(key, "REQUEST_BODY", 12) == 0){ break; } return 0;
+		default: return 0;
+	}
+
+	LF_state *state = LF_getstate(l);
+	if(state == NULL){ return 0; }
+
+	// Request variables don't count against the memory limit, as when
+	// they were set up before the limits were enabled
+	lua_pushstring(l, "MEMORY_LIMIT");
+	lua_rawget(l, LUA_REGISTRYINDEX);
+	size_t *limit = lua_touserdata(l, -1), saved = 0;
+	lua_pop(l, 1);
+	if(limit){
+		saved = *limit;
+		*limit = SIZE_MAX / 2;
+	}
+
+	// Protected, so the limit is always put back
+	lua_pushcfunction(l, &LF_lazybuild);
+	lua_pushlightuserdata(l, state);
+	lua_pushvalue(l, 2);
+	int r = lua_pcall(l, 2, 1, 0);
+
+	if(limit){ *limit = saved; }
+	if(r){ lua_error(l); }
+	if(lua_isnil(l, -1)){ return 1; }
+
+	// Memoize the value in the globals
+	lua_pushvalue(l, 2);
+	lua_pushvalue(l, -2);
+	lua_rawset(l, 1);
+	return 1;
+}
+
+
+// Keeps track of a file descriptor to close when the request ends
+int LF_trackfd(LF_state *state, int fd)
+{
+	int *fds = realloc(state->fds, sizeof(int) * (state->nfds + 1));
+	if(fds == NULL){ return 1; }
+
+	fds[state->nfds++] = fd;
+	state->fds = fds;
+	return 0;
+}
+
+
+// Releases resources held for a request, once its script has finished
+void LF_endrequest(LF_state *state)
+{
+	for(int i=0; i < state->nfds; i++){ close(state->fds[i]); }
+	free(state->fds);
+	state->fds = NULL;
+	state->nfds = 0;
+
+	if(state->file != NULL){ LF_filerelease(state->file); }
+	state->file = NULL;
+}
+
+
+// Frees what a worker's request state holds between requests, once the
+// worker's finished with it
+void LF_freestate(LF_state *state)
+{
+	LF_endrequest(state);
+	LF_responsefree(state);
+	free(state->params);
+	free(state->cache.vary);
+	free(state->cache.key);
+	free(state->session_loaded);
+}
+
+
+// Fetches the state of the request being served, keyed by address so
+// print() and friends don't have to intern a string to find it
+LF_state *LF_getstate(lua_State *l)
+{
+	lua_pushlightuserdata(l, &LF_statekey);
+	lua_rawget(l, LUA_REGISTRYINDEX);
+	LF_state *state = lua_touserdata(l, -1);
+	lua_pop(l, 1);
+	return state;
+}
+
+
+// Points the state's params at libfcgi's NAME=VALUE environment. Should
+// there not be room for them all, the request only sees those that fit
+void LF_envparams(LF_state *state, char **envp)
+{
+	size_t n = 0;
+	for(char **p = envp; *p; ++p){ n++; }
+
+	if(n > state->paramsize){
+		LF_param *params = realloc(state->params, sizeof(LF_param) * n);
+		if(params != NULL){
+			state->params = params;
+			state->paramsize = n;
 		}
 	}
+
+	state->nparams = 0;
+	for(char **p = envp; *p && state->nparams < state->paramsize; ++p){
+		char *vptr = strchr(*p, '=');
+		if(vptr == NULL){ continue; }
+
+		LF_param *param = &state->params[state->nparams++];
+		param->name = *p;
+		param->namelen = (vptr - *p);
+		param->value = (vptr+1);
+		param->valuelen = strlen(vptr+1);
+	}
 }
 
 
-// Parses fastcgi request
-void LF_parserequest(lua_State *l, FCGX_Request *request, LF_state *state)
+// Finds a request variable by name
+const LF_param *LF_getparam(LF_state *state, const char *name, size_t len)
 {
-	uintmax_t content_length = 0;
-	char *content_type = NULL;
+	for(size_t i=0; i < state->nparams; i++){
+		const LF_param *p = &state->params[i];
+		if(p->namelen == len && memcmp(p->name, name, len) == 0){ return p; }
+	}
+	return NULL;
+}
+
 
+// Parses fastcgi request, its variables having been put in the state's
+// params already
+void LF_parserequest(lua_State *l, FCGX_Request *request, LF_state *state)
+{
 	state->committed = 0;
 	state->response = request->out;
-	lua_pushstring(l, "STATE");
+	state->request = request;
+	state->serial++;
+	state->query_string = NULL;
+	state->content_type = NULL;
+	state->content_length = 0;
+	state->content_read = 0;
+	state->cookie = NULL;
+	state->session = LF_SESSION_NONE;
+	state->session_loadedlen = 0;
+	state->output_limit = NULL;
+	state->db_ops = 0;
+	state->db_bytes = 0;
+	LF_responsebegin(state);
+
+	lua_pushlightuserdata(l, &LF_statekey);
 	lua_pushlightuserdata(l, state);
 	lua_rawset(l, LUA_REGISTRYINDEX);
 
-	lua_newtable(l);
-	for(char **p = request->envp; *p; ++p){
-		char *vptr = strchr(*p, '=');
-		int keylen = (vptr - *p);
+	for(size_t i=0; i < state->nparams; i++){
+		const char *name = state->params[i].name;
+		char *value = state->params[i].value;
 
-		lua_pushlstring(l, *p, keylen); // Push Key
-		lua_pushstring(l, (vptr+1)); // Push Value
-		lua_rawset(l, 1); // Set key/value into table
-		
-		switch(keylen){
+		switch(state->params[i].namelen){
 			case 11:
-				if(memcmp(*p, "SCRIPT_NAME", 11) == 0){
+				if(memcmp(name, "SCRIPT_NAME", 11) == 0){
 					lua_pushstring(l, "SCRIPT_NAME");
-					lua_pushlightuserdata(l, (vptr+1));
+					lua_pushlightuserdata(l, value);
 					lua_rawset(l, LUA_REGISTRYINDEX);
+				} else if(memcmp(name, "HTTP_COOKIE", 11) == 0){
+					state->cookie = value;
 				}
 			break;
 
 			case 12: 
-				if(memcmp(*p, "QUERY_STRING", 12) == 0){
-					LF_parsequerystring(l, (vptr+1), "GET");
-				} if(memcmp(*p, "CONTENT_TYPE", 12) == 0){
-					content_type = (vptr+1);
+				if(memcmp(name, "QUERY_STRING", 12) == 0){
+					state->query_string = value;
+				} else if(memcmp(name, "CONTENT_TYPE", 12) == 0){
+					state->content_type = value;
 				}
 			break;
 
 			case 13:
-				if(memcmp(*p, "DOCUMENT_ROOT", 13) == 0){
+				if(memcmp(name, "DOCUMENT_ROOT", 13) == 0){
 					lua_pushstring(l, "DOCUMENT_ROOT");
-					lua_pushlightuserdata(l, (vptr+1));
+					lua_pushlightuserdata(l, value);
 					lua_rawset(l, LUA_REGISTRYINDEX);
 				}
 			break;
 
 			case 14:
-				if(memcmp(*p, "CONTENT_LENGTH", 14) == 0){
-					content_length = strtoumax((vptr+1), NULL, 10);
+				if(memcmp(name, "CONTENT_LENGTH", 14) == 0){
+					state->content_length = strtoumax(value, NULL, 10);
 				}
 			break;
 
 			case 15:
-				if(memcmp(*p, "SCRIPT_FILENAME", 15) == 0){
+				if(memcmp(name, "SCRIPT_FILENAME", 15) == 0){
 					lua_pushstring(l, "SCRIPT_FILENAME");
-					lua_pushlightuserdata(l, (vptr+1));
+					lua_pushlightuserdata(l, value);
 					lua_rawset(l, LUA_REGISTRYINDEX);
 				}
 			break;
+
+			case 20:
+				if(state->output.nrules > 0 && memcmp(name, "HTTP_ACCEPT_ENCODING", 20) == 0){
+					state->output.encoding = LF_acceptencoding(value);
+				}
+			break;
 		}
 	}
-	lua_setglobal(l, "REQUEST");
 
-	if(content_length > 0 && content_type != NULL && memcmp(content_type, "application/x-www-form-urlencoded", 33) == 0){
-		char *content = lua_newuserdata(l, content_length+1);
-		int r = FCGX_GetStr(
-			content, (content_length > INT_MAX ? INT_MAX : content_length),
-			request->in
-		);
-		*(content + r) = 0; // Add NUL byte at end for proper string
-		LF_parsequerystring(l, content, "POST");
-		lua_pop(l, 1);
-	}
+	// REQUEST, GET, POST, REQUEST_BODY and SESSION are only built if the
+	// script uses them
+	lua_newtable(l);
+	lua_pushstring(l, "__index");
+	lua_pushcfunction(l, &LF_lazyglobal);
+	lua_rawset(l, -3);
+	lua_setmetatable(l, LUA_GLOBALSINDEX);
 }
 
 
@@ -373,6 +757,14 @@ int LF_fileload(lua_State *l, const char *name, char *scriptpath)
 	if((fd = open(scriptpath, O_RDONLY)) == -1){ goto errorL; }
 	
 	if(fstat(fd, &sb) == -1){ goto errorL; }
+
+	// Use the cached chunk if the file hasn't changed since it was compiled
+	switch(LF_cacheload(l, &sb, scriptname)){
+		case -1: break;
+		case 0: close(fd); return 0;
+		case LUA_ERRMEM: close(fd); return LF_ERRMEMORY;
+		default: close(fd); return LF_ERRSYNTAX;
+	}
 	
 	if((script = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0)) == NULL){
 		goto errorL;
@@ -386,6 +778,7 @@ int LF_fileload(lua_State *l, const char *name, char *scriptpath)
 		switch(luaL_loadbuffer(l, script, sb.st_size, scriptname)){
 			case LUA_ERRSYNTAX: r = LF_ERRSYNTAX; break;
 			case LUA_ERRMEM: r = LF_ERRMEMORY; break;
+			case 0: LF_cachestore(l, &sb); break;
 		}
 	}
 
@@ -426,5 +819,272 @@ int LF_loadscript(lua_State *l)
 // Closes a state
 void LF_closestate(lua_State *l)
 {
+	// Finalizers are still subject to CPU limits, but the timer mustn't
+	// touch the state once it's freed
+	if(LF_cpustate == l){ LF_cpustate = NULL; }
+	lua_sethook(l, &LF_limit_hook, LUA_MASKCOUNT, 1000);
+
 	lua_close(l);
 }
+
+
+// Plain allocator, used while a state sits idle in a pool
+static void *LF_alloc(void *ud, void *ptr, size_t osize, size_t nsize)
+{
+	if(nsize == 0){
+		free(ptr);
+		return NULL;
+	}
+	return realloc(ptr, nsize);
+}
+
+
+// Stores a shallow copy of the table at idx in the baseline table at b,
+// keyed by the table itself
+static void LF_snapshot(lua_State *l, int idx, int b)
+{
+	lua_pushvalue(l, idx);
+	lua_newtable(l);
+	int copy = lua_gettop(l);
+
+	lua_pushnil(l);
+	while(lua_next(l, idx)){
+		lua_pushvalue(l, -2);
+		lua_insert(l, -2);
+		lua_rawset(l, copy);
+	}
+
+	lua_rawset(l, b);
+}
+
+
+// Records the pristine globals of a new state, so it can be reset to them
+static void LF_savestate(lua_State *l)
+{
+	lua_newtable(l);
+	int b = lua_gettop(l);
+
+	LF_snapshot(l, LUA_GLOBALSINDEX, b);
+
+	// Library tables and HEADER are reachable from the globals
+	lua_pushnil(l);
+	while(lua_next(l, LUA_GLOBALSINDEX)){
+		if(lua_istable(l, -1) && !lua_rawequal(l, -1, LUA_GLOBALSINDEX)){
+			LF_snapshot(l, lua_gettop(l), b);
+		}
+		lua_pop(l, 1);
+	}
+
+	// The string metatable is reachable through getmetatable()
+	lua_pushliteral(l, "");
+	if(lua_getmetatable(l, -1)){
+		LF_snapshot(l, lua_gettop(l), b);
+		lua_pop(l, 1);
+	}
+	lua_pop(l, 1);
+
+	lua_pushstring(l, "BASELINE");
+	lua_insert(l, b);
+	lua_rawset(l, LUA_REGISTRYINDEX);
+
+	lua_pushstring(l, "GLOBALS");
+	lua_pushvalue(l, LUA_GLOBALSINDEX);
+	lua_rawset(l, LUA_REGISTRYINDEX);
+}
+
+
+// Restores every table in the baseline and collects the request's garbage
+static int LF_restorestate(lua_State *l)
+{
+	// The globals table itself may have been swapped out with setfenv
+	lua_pushstring(l, "GLOBALS");
+	lua_rawget(l, LUA_REGISTRYINDEX);
+	lua_replace(l, LUA_GLOBALSINDEX);
+
+	lua_pushstring(l, "BASELINE");
+	lua_rawget(l, LUA_REGISTRYINDEX);
+	int b = lua_gettop(l);
+
+	lua_pushnil(l);
+	while(lua_next(l, b)){
+		int copy = lua_gettop(l), orig = copy-1;
+
+		// Clear out whatever the request left in the table
+		lua_pushnil(l);
+		while(lua_next(l, orig)){
+			lua_pop(l, 1);
+			lua_pushvalue(l, -1);
+			lua_pushnil(l);
+			lua_rawset(l, orig);
+		}
+
+		lua_pushnil(l);
+		while(lua_next(l, copy)){
+			lua_pushvalue(l, -2);
+			lua_insert(l, -2);
+			lua_rawset(l, orig);
+		}
+
+		lua_pushnil(l);
+		lua_setmetatable(l, orig);
+
+		lua_pop(l, 1); // Pop the copy, leaving the key
+	}
+
+	// Undo any collectgarbage() tuning and free the request's garbage
+	lua_gc(l, LUA_GCRESTART, 0);
+	lua_gc(l, LUA_GCSETPAUSE, 200);
+	lua_gc(l, LUA_GCSETSTEPMUL, 200);
+	lua_gc(l, LUA_GCCOLLECT, 0);
+	return 0;
+}
+
+
+// Resets a used state to the baseline recorded when it was created.
+// Returns 0 on success, the state should be closed otherwise
+int LF_resetstate(lua_State *l)
+{
+	static const char *keys[] = {
+		"SCRIPT_NAME", "SCRIPT_FILENAME", "DOCUMENT_ROOT", "MEMORY_LIMIT", NULL
+	};
+
+	lua_settop(l, 0);
+	lua_setallocf(l, &LF_alloc, NULL);
+
+	// Finalizers may run, so they're hooked until the state is clean
+	lua_sethook(l, &LF_limit_hook, LUA_MASKCOUNT, 1000);
+	int r = lua_cpcall(l, &LF_restorestate, NULL);
+	lua_sethook(l, NULL, 0, 0);
+	if(r){ return 1; }
+
+	for(int i=0; keys[i] != NULL; i++){
+		lua_pushstring(l, keys[i]);
+		lua_pushnil(l);
+		lua_rawset(l, LUA_REGISTRYINDEX);
+	}
+
+	lua_pushlightuserdata(l, &LF_statekey);
+	lua_pushnil(l);
+	lua_rawset(l, LUA_REGISTRYINDEX);
+	return 0;
+}
+
+
+// Creates a pool holding up to size idle states, each used at most reuse
+// times. If chunksize is non-zero, states are instead allocated from
+// arenas of chunksize byte chunks and discarded wholesale after each use
+LF_pool *LF_newpool(int size, int sandbox, char *content_type, int reuse, size_t chunksize)
+{
+	LF_pool *pool = malloc(sizeof(LF_pool));
+	if(pool == NULL){ return NULL; }
+
+	if(size < 1){ size = 1; }
+	pool->states = malloc(sizeof(lua_State *) * size);
+	pool->arenas = malloc(sizeof(LF_arena *) * size);
+	if(pool->states == NULL || pool->arenas == NULL){
+		free(pool->states);
+		free(pool->arenas);
+		free(pool);
+		return NULL;
+	}
+
+	pool->size = size;
+	pool->count = 0;
+	pool->sandbox = sandbox;
+	pool->content_type = content_type;
+	pool->reuse = reuse;
+	pool->chunksize = chunksize;
+	pool->narenas = 0;
+	return pool;
+}
+
+
+// Takes an idle state from the pool, or creates a new one
+lua_State *LF_poolget(LF_pool *pool)
+{
+	if(pool->chunksize){
+		LF_arena *arena;
+		if(pool->narenas > 0){ arena = pool->arenas[--pool->narenas]; }
+		else if((arena = LF_newarena(pool->chunksize)) == NULL){ return NULL; }
+
+		lua_State *l = LF_newarenastate(arena, pool->sandbox, pool->content_type);
+		if(l == NULL){
+			LF_arenareset(arena);
+			pool->arenas[pool->narenas++] = arena;
+		}
+		return l;
+	}
+
+	if(pool->count > 0){ return pool->states[--pool->count]; }
+
+	lua_State *l = LF_newstate(pool->sandbox, pool->content_type);
+	if(l != NULL && pool->reuse > 1){ LF_savestate(l); }
+	return l;
+}
+
+
+// Closes a state rather than returning it to its pool, e.g. once the
+// pool's been freed
+void LF_dropstate(lua_State *l)
+{
+	if(l == NULL){ return; }
+
+	LF_arena *arena = LF_statearena(l);
+	if(arena != NULL){
+		if(LF_cpustate == l){ LF_cpustate = NULL; }
+		LF_freearena(arena);
+		return;
+	}
+	LF_closestate(l);
+}
+
+
+// Frees a pool, closing the idle states it holds. States taken from it
+// are dropped rather than put back
+void LF_freepool(LF_pool *pool)
+{
+	if(pool == NULL){ return; }
+
+	for(int i=0; i < pool->count; i++){ LF_closestate(pool->states[i]); }
+	for(int i=0; i < pool->narenas; i++){ LF_freearena(pool->arenas[i]); }
+	free(pool->states);
+	free(pool->arenas);
+	free(pool);
+}
+
+
+// Returns a state to the pool once a request is finished with it
+void LF_poolput(LF_pool *pool, lua_State *l)
+{
+	if(l == NULL){ return; }
+
+	// An idle state mustn't be hooked by a late SIGXCPU
+	if(LF_cpustate == l){ LF_cpustate = NULL; }
+
+	// Arena states are dropped without lua_close, freeing them in one go
+	LF_arena *arena = LF_statearena(l);
+	if(arena != NULL){
+		LF_arenareset(arena);
+
+		if(pool->narenas < pool->size){ pool->arenas[pool->narenas++] = arena; }
+		else { LF_freearena(arena); }
+		return;
+	}
+
+	if(pool->reuse > 1 && pool->count < pool->size){
+		lua_pushstring(l, "USES");
+		lua_rawget(l, LUA_REGISTRYINDEX);
+		int uses = lua_tointeger(l, -1) + 1;
+
+		if(uses < pool->reuse && LF_resetstate(l) == 0){
+			lua_pushstring(l, "USES");
+			lua_pushinteger(l, uses);
+			lua_rawset(l, LUA_REGISTRYINDEX);
+
+			pool->states[pool->count++] = l;
+			return;
+		}
+	}
+
+	LF_closestate(l);
+}
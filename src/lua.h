@@ -7,25 +7,198 @@
 #define LF_ERRBYTECODE 6
 #define LF_ERRNOPATH   7
 #define LF_ERRNONAME   8
+#define LF_ERRTOOBIG   9
+
+// Phases of a request that are timed
+#define LF_PHASEPARSE   0
+#define LF_PHASELOAD    1
+#define LF_PHASEEXECUTE 2
+#define LF_PHASEFLUSH   3
+#define LF_PHASES       4
+
+// Limits a request ran into
+#define LF_TRIPCPU    1
+#define LF_TRIPMEMORY 2
+#define LF_TRIPOUTPUT 4
+#define LF_TRIPDB     8
+
+typedef struct {
+	char *headers;
+	size_t headerlen;
+	size_t headersize;
+
+	char *body;
+	size_t bodylen;
+	size_t bodysize;
+
+	size_t buffer;
+	int direct;
+	int streaming;
+	int nolength;
+	int failed;
+
+	// The response's status, and how much of it's been sent
+	int status;
+	uintmax_t sent;
+
+	// How sendfile() responds, and the file it's sending, -1 if none.
+	// handedoff is set once it's left the web server to send the body
+	int sendfile;
+	const char *sendprefix;
+	int handedoff;
+	int file;
+	uintmax_t fileoff;
+	uintmax_t fileleft;
+
+	const struct LF_rule *rules;
+	int nrules;
+	size_t compress_min;
+	int encoding;
+	int level;
+	int encoded;
+	int compressing;
+	struct z_stream_s *zstream;
+	struct z_stream_s *zstreams[2];
+	int zlevels[2];
+	char *zbuf;
+	size_t zbufsize;
+
+	// Copy of what's sent, for the response cache
+	int capturing;
+	int uncacheable;
+	char *capture;
+	size_t capturelen;
+	size_t capturesize;
+	size_t capturemax;
+} LF_output;
+
+// A request's use of the response cache: what cache() was called with,
+// the NUL separated names of the variables it varies on, and the key of
+// the response being captured
+typedef struct {
+	double ttl;
+	char *vary;
+	size_t varylen;
+	size_t varysize;
+
+	char *key;
+	size_t keylen;
+	size_t keysize;
+	int capture;
+	int filling;
+} LF_cacheuse;
+
+// A FastCGI variable. The name isn't terminated, the value is
+typedef struct {
+	const char *name;
+	size_t namelen;
+	char *value;
+	size_t valuelen;
+} LF_param;
 
 typedef struct {
 	FCGX_Stream *response;
 	int committed;
+	LF_output output;
+	size_t *output_limit;
+
+	FCGX_Request *request;
+	LF_param *params;
+	size_t nparams;
+	size_t paramsize;
+	unsigned int serial;
+	char *query_string;
+	char *content_type;
+	uintmax_t content_length;
+	uintmax_t content_read;
+
+	// HTTP_COOKIE, and the session SESSION was loaded from, if it was.
+	// The fields as they were loaded are kept, so only what the script
+	// changed is saved
+	char *cookie;
+	int session;
+	char session_id[32];
+	char *session_loaded;
+	size_t session_loadedlen;
+	size_t session_loadedsize;
+
+	LF_cacheuse cache;
+
+	// Nanoseconds spent in each phase, and the limits run into
+	uint64_t timing[LF_PHASES];
+	int trips;
+
+	// Operations made on, and bytes moved to and from, the database
+	size_t db_ops;
+	size_t db_bytes;
+
+	size_t upload_memory;
+	char *upload_dir;
+	int upload_parts_max;
+	int upload_files_max;
+
+	int *fds;
+	int nfds;
+
+	// File readfile() is copying out of, released here should it fail
+	struct LF_file *file;
+
+	// Only set by the event worker: the thread the script runs in, and
+	// a test for whether it should yield to let its output drain
+	lua_State *thread;
+	int (*congested)(void *);
+	void *data;
 } LF_state;
 
 typedef struct {
 	size_t memory;
 	struct timeval cpu;
 	size_t output;
+
+	timer_t cputimer;
+	int cputimed;
+	int cpuexceeded;
 } LF_limits;
 
+typedef struct {
+	int sandbox;
+	char *content_type;
+	int reuse;
+
+	int size;
+	int count;
+	lua_State **states;
+
+	size_t chunksize;
+	int narenas;
+	struct LF_arena **arenas;
+} LF_pool;
+
 
 lua_State *LF_newstate(int, char *);
 LF_limits *LF_newlimits();
+void LF_freelimits(LF_limits *);
 void LF_setlimits(LF_limits *, size_t, size_t, uint32_t, uint32_t);
 void LF_enablelimits(lua_State *, LF_limits *);
+void LF_disablelimits(LF_limits *);
+void LF_pauselimits(LF_limits *);
+void LF_resumelimits(lua_State *, LF_limits *);
+int LF_cpulimited(LF_limits *);
+int LF_yieldable(lua_State *, LF_state *);
+void LF_envparams(LF_state *, char **);
+const LF_param *LF_getparam(LF_state *, const char *, size_t);
 void LF_parserequest(lua_State *l, FCGX_Request *, LF_state *);
+LF_state *LF_getstate(lua_State *);
+int LF_trackfd(LF_state *, int);
+void LF_endrequest(LF_state *);
+void LF_freestate(LF_state *);
 void LF_emptystack(lua_State *);
 int LF_fileload(lua_State *, const char *, char *);
 int LF_loadscript(lua_State *);
 void LF_closestate(lua_State *);
+int LF_resetstate(lua_State *);
+LF_pool *LF_newpool(int, int, char *, int, size_t);
+lua_State *LF_poolget(LF_pool *);
+void LF_poolput(LF_pool *, lua_State *);
+void LF_dropstate(lua_State *);
+void LF_freepool(LF_pool *);
@@ -0,0 +1,456 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <fcgiapp.h>
+
+#include <lua5.1/lua.h>
+
+#include "lua.h"
+#include "log.h"
+#include "metrics.h"
+
+
+// Histogram buckets: exact below 4ns, then each power of two split in
+// four, which keeps values within 12.5% up to 2^40ns (about 18 minutes)
+#define LF_METRICS_BUCKETS 156
+// Scripts each thread keeps histograms for, any more are counted together
+#define LF_METRICS_SCRIPTS 256
+#define LF_METRICS_SLOTS   512
+// LF_ERR* outcomes counted
+#define LF_METRICS_OUTCOMES 9
+
+// Each thread only ever writes its own counters, so there's no need for
+// a locked add. Relaxed atomics keep reads from other threads whole
+#define LF_METRICSADD(x, v) __atomic_store_n(&(x), (x) + (v), __ATOMIC_RELAXED)
+#define LF_METRICSGET(x) __atomic_load_n(&(x), __ATOMIC_RELAXED)
+
+
+typedef struct {
+	uint64_t count;
+	uint64_t sum;
+	uint64_t buckets[LF_METRICS_BUCKETS];
+} LF_histogram;
+
+// A script's histograms, NULL named for those of scripts past the limit
+typedef struct {
+	char *name;
+	LF_histogram phases[LF_PHASES];
+} LF_mscript;
+
+struct LF_metrics {
+	uint64_t outcomes[LF_METRICS_OUTCOMES];
+	uint64_t trips[4];
+	uint64_t aborted;
+	uint64_t cached;
+
+	// Scripts in the order they were first seen, readers go by nscripts.
+	// slots is a hash index of them only the owning thread uses
+	LF_mscript *scripts[LF_METRICS_SCRIPTS];
+	int nscripts;
+	LF_mscript *slots[LF_METRICS_SLOTS];
+	LF_mscript *other;
+
+	// Set while a thread's using it. Counters outlive their thread, and
+	// are picked up by the next thread to start
+	int active;
+	LF_metrics *next;
+};
+
+
+static const char *LF_metricsoutcomes[LF_METRICS_OUTCOMES] = {
+	"ok", "error", "access", "memory", "notfound",
+	"syntax", "bytecode", "nopath", "noname"
+};
+static const char *LF_metricsphases[LF_PHASES] = {
+	"parse", "load", "execute", "flush"
+};
+static const char *LF_metricstrips[4] = { "cpu", "memory", "output", "db" };
+static const double LF_metricsquantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+
+static pthread_mutex_t LF_metricslock = PTHREAD_MUTEX_INITIALIZER;
+static LF_metrics *LF_metricslist = NULL;
+static const char *LF_metricspath = NULL;
+
+
+static inline uint32_t LF_metricshash(const char *key)
+{
+	uint32_t h = 2166136261u;
+	for(; *key; key++){
+		h ^= (unsigned char)*key;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+
+static inline int LF_metricsbucket(uint64_t v)
+{
+	if(v < 4){ return v; }
+
+	int msb = 63 - __builtin_clzll(v);
+	int b = 4 + (msb-2)*4 + ((v >> (msb-2)) & 3);
+	return (b < LF_METRICS_BUCKETS ? b : LF_METRICS_BUCKETS-1);
+}
+
+
+// Middle of the range a bucket covers
+static double LF_metricsvalue(int b)
+{
+	if(b < 4){ return b; }
+
+	int msb = (b-4)/4 + 2;
+	uint64_t width = 1ULL << (msb-2);
+	uint64_t low = (uint64_t)(4 + (b-4)%4) << (msb-2);
+	return low + (width / 2.0);
+}
+
+
+uint64_t LF_metricsclock()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+LF_metrics *LF_newmetrics()
+{
+	pthread_mutex_lock(&LF_metricslock);
+	LF_metrics *m = LF_metricslist;
+	while(m != NULL && m->active){ m = m->next; }
+
+	if(m == NULL && (m = calloc(1, sizeof(LF_metrics))) != NULL){
+		m->next = LF_metricslist;
+		LF_metricslist = m;
+	}
+	if(m != NULL){ __atomic_store_n(&m->active, 1, __ATOMIC_RELAXED); }
+	pthread_mutex_unlock(&LF_metricslock);
+	return m;
+}
+
+
+void LF_metricsrelease(LF_metrics *m)
+{
+	if(m == NULL){ return; }
+
+	pthread_mutex_lock(&LF_metricslock);
+	__atomic_store_n(&m->active, 0, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&LF_metricslock);
+}
+
+
+// Finds a script's histograms, adding them if add is set
+static LF_mscript *LF_metricsscript(LF_metrics *m, const char *name, int add)
+{
+	if(name != NULL){
+		uint32_t slot = LF_metricshash(name) % LF_METRICS_SLOTS;
+		while(m->slots[slot] != NULL){
+			if(strcmp(m->slots[slot]->name, name) == 0){ return m->slots[slot]; }
+			slot = (slot + 1) % LF_METRICS_SLOTS;
+		}
+
+		if(add && m->nscripts < LF_METRICS_SCRIPTS){
+			LF_mscript *s = calloc(1, sizeof(LF_mscript));
+			if(s == NULL){ return NULL; }
+			if((s->name = strdup(name)) == NULL){
+				free(s);
+				return NULL;
+			}
+
+			// Published once it's filled in
+			m->slots[slot] = s;
+			m->scripts[m->nscripts] = s;
+			__atomic_store_n(&m->nscripts, m->nscripts+1, __ATOMIC_RELEASE);
+			return s;
+		}
+	}
+
+	// Past the limit, without a name, or never loaded, everything goes in
+	// together
+	if(m->other == NULL){
+		LF_mscript *s = calloc(1, sizeof(LF_mscript));
+		if(s == NULL){ return NULL; }
+		__atomic_store_n(&m->other, s, __ATOMIC_RELEASE);
+	}
+	return m->other;
+}
+
+
+static void LF_metricstrip(LF_metrics *m, LF_state *state)
+{
+	if(state->trips & LF_TRIPCPU){ LF_METRICSADD(m->trips[0], 1); }
+	if(state->trips & LF_TRIPMEMORY){ LF_METRICSADD(m->trips[1], 1); }
+	if(state->trips & LF_TRIPOUTPUT){ LF_METRICSADD(m->trips[2], 1); }
+	if(state->trips & LF_TRIPDB){ LF_METRICSADD(m->trips[3], 1); }
+
+	memset(state->timing, 0, sizeof(state->timing));
+	state->trips = 0;
+}
+
+
+void LF_metricsrecord(LF_metrics *m, LF_state *state, int error)
+{
+	if(m == NULL){ return; }
+	if(error < 0 || error >= LF_METRICS_OUTCOMES){ error = LF_ERRANY; }
+	LF_METRICSADD(m->outcomes[error], 1);
+
+	// Only scripts that loaded get histograms of their own, so requests
+	// for names that don't exist can't use up every slot
+	const LF_param *script = LF_getparam(state, "SCRIPT_NAME", 11);
+	int loaded = (error == LF_ERRNONE || error == LF_ERRANY);
+	LF_mscript *s = LF_metricsscript(m, (script ? script->value : NULL), loaded);
+
+	// Phases that took no time at all were never reached
+	for(int i=0; s != NULL && i < LF_PHASES; i++){
+		uint64_t v = state->timing[i];
+		if(v == 0){ continue; }
+
+		LF_histogram *h = &s->phases[i];
+		LF_METRICSADD(h->buckets[LF_metricsbucket(v)], 1);
+		LF_METRICSADD(h->sum, v);
+		LF_METRICSADD(h->count, 1);
+	}
+
+	LF_metricstrip(m, state);
+}
+
+
+void LF_metricsaborted(LF_metrics *m, LF_state *state)
+{
+	if(m == NULL){ return; }
+	LF_METRICSADD(m->aborted, 1);
+	LF_metricstrip(m, state);
+}
+
+
+void LF_metricscached(LF_metrics *m)
+{
+	if(m == NULL){ return; }
+	LF_METRICSADD(m->cached, 1);
+}
+
+
+void LF_metricsinit(const char *path)
+{
+	LF_metricspath = path;
+}
+
+
+int LF_metricsrequest(LF_state *state)
+{
+	if(LF_metricspath == NULL){ return 0; }
+
+	const LF_param *script = LF_getparam(state, "SCRIPT_NAME", 11);
+	return (script != NULL && strcmp(script->value, LF_metricspath) == 0);
+}
+
+
+typedef struct {
+	char *data;
+	size_t len;
+	size_t size;
+	int failed;
+} LF_mbuf;
+
+
+static void LF_metricsprintf(LF_mbuf *b, const char *fmt, ...)
+{
+	if(b->failed){ return; }
+
+	for(;;){
+		va_list ap;
+		va_start(ap, fmt);
+		int n = vsnprintf(b->data + b->len, b->size - b->len, fmt, ap);
+		va_end(ap);
+
+		if(n < 0){
+			b->failed = 1;
+			return;
+		}
+		if((size_t)n < (b->size - b->len)){
+			b->len += n;
+			return;
+		}
+
+		size_t size = (b->size ? b->size * 2 : 4096);
+		while(size < (b->len + n + 1)){ size *= 2; }
+
+		char *data = realloc(b->data, size);
+		if(data == NULL){
+			b->failed = 1;
+			return;
+		}
+		b->data = data;
+		b->size = size;
+	}
+}
+
+
+// Writes a script name as a label value, escaped
+static void LF_metricslabel(LF_mbuf *b, const char *name)
+{
+	if(name == NULL){
+		LF_metricsprintf(b, "(other)");
+		return;
+	}
+
+	for(; *name; name++){
+		switch(*name){
+			case '\\': LF_metricsprintf(b, "\\\\"); break;
+			case '"': LF_metricsprintf(b, "\\\""); break;
+			case '\n': LF_metricsprintf(b, "\\n"); break;
+			default: LF_metricsprintf(b, "%c", *name); break;
+		}
+	}
+}
+
+
+// A script's histograms, added up over every thread
+typedef struct {
+	const char *name;
+	LF_histogram phases[LF_PHASES];
+} LF_mmerged;
+
+
+// Adds a thread's script histograms into the merged ones
+static int LF_metricsmerge(LF_mmerged **merged, size_t *nmerged, size_t *size, LF_mscript *s)
+{
+	LF_mmerged *t = NULL;
+	for(size_t i=0; i < *nmerged; i++){
+		const char *name = (*merged)[i].name;
+		if(name == s->name || (name != NULL && s->name != NULL && strcmp(name, s->name) == 0)){
+			t = &(*merged)[i];
+			break;
+		}
+	}
+
+	if(t == NULL){
+		if(*nmerged == *size){
+			size_t n = (*size ? *size * 2 : 64);
+			LF_mmerged *p = realloc(*merged, sizeof(LF_mmerged) * n);
+			if(p == NULL){ return 1; }
+			*merged = p;
+			*size = n;
+		}
+
+		t = &(*merged)[(*nmerged)++];
+		memset(t, 0, sizeof(LF_mmerged));
+		t->name = s->name;
+	}
+
+	for(int i=0; i < LF_PHASES; i++){
+		LF_histogram *h = &s->phases[i];
+		t->phases[i].count += LF_METRICSGET(h->count);
+		t->phases[i].sum += LF_METRICSGET(h->sum);
+		for(int j=0; j < LF_METRICS_BUCKETS; j++){
+			t->phases[i].buckets[j] += LF_METRICSGET(h->buckets[j]);
+		}
+	}
+	return 0;
+}
+
+
+char *LF_metricsrender(size_t *len)
+{
+	LF_mbuf b = { NULL, 0, 0, 0 };
+	uint64_t outcomes[LF_METRICS_OUTCOMES], trips[4], aborted = 0, cached = 0;
+	LF_mmerged *merged = NULL;
+	size_t nmerged = 0, msize = 0;
+	int threads = 0, failed = 0;
+
+	memset(outcomes, 0, sizeof(outcomes));
+	memset(trips, 0, sizeof(trips));
+
+	// Threads are never removed, nor are their scripts, so only adding
+	// to the list needs locking out
+	pthread_mutex_lock(&LF_metricslock);
+	LF_metrics *list = LF_metricslist;
+	pthread_mutex_unlock(&LF_metricslock);
+
+	for(LF_metrics *m = list; m != NULL; m = m->next){
+		if(__atomic_load_n(&m->active, __ATOMIC_RELAXED)){ threads++; }
+		for(int i=0; i < LF_METRICS_OUTCOMES; i++){ outcomes[i] += LF_METRICSGET(m->outcomes[i]); }
+		for(int i=0; i < 4; i++){ trips[i] += LF_METRICSGET(m->trips[i]); }
+		aborted += LF_METRICSGET(m->aborted);
+		cached += LF_METRICSGET(m->cached);
+
+		int n = __atomic_load_n(&m->nscripts, __ATOMIC_ACQUIRE);
+		for(int i=0; i < n && !failed; i++){
+			failed = LF_metricsmerge(&merged, &nmerged, &msize, m->scripts[i]);
+		}
+
+		LF_mscript *other = __atomic_load_n(&m->other, __ATOMIC_ACQUIRE);
+		if(other != NULL && !failed){ failed = LF_metricsmerge(&merged, &nmerged, &msize, other); }
+	}
+
+	LF_metricsprintf(&b, "Content-Type: text/plain; version=0.0.4\r\nCache-Control: no-store\r\n\r\n");
+
+	LF_metricsprintf(&b, "# HELP lf_threads Worker threads\n# TYPE lf_threads gauge\n");
+	LF_metricsprintf(&b, "lf_threads %d\n", threads);
+
+	LF_metricsprintf(&b, "# HELP lf_requests_total Requests finished, by outcome\n# TYPE lf_requests_total counter\n");
+	for(int i=0; i < LF_METRICS_OUTCOMES; i++){
+		LF_metricsprintf(&b, "lf_requests_total{outcome=\"%s\"} %llu\n", LF_metricsoutcomes[i], (unsigned long long)outcomes[i]);
+	}
+
+	LF_metricsprintf(&b, "# HELP lf_requests_aborted_total Requests dropped before they finished\n# TYPE lf_requests_aborted_total counter\n");
+	LF_metricsprintf(&b, "lf_requests_aborted_total %llu\n", (unsigned long long)aborted);
+
+	LF_metricsprintf(&b, "# HELP lf_requests_cached_total Requests answered from the response cache\n# TYPE lf_requests_cached_total counter\n");
+	LF_metricsprintf(&b, "lf_requests_cached_total %llu\n", (unsigned long long)cached);
+
+	LF_metricsprintf(&b, "# HELP lf_limit_trips_total Requests that ran into a limit\n# TYPE lf_limit_trips_total counter\n");
+	for(int i=0; i < 4; i++){
+		LF_metricsprintf(&b, "lf_limit_trips_total{limit=\"%s\"} %llu\n", LF_metricstrips[i], (unsigned long long)trips[i]);
+	}
+
+	LF_metricsprintf(&b, "# HELP lf_log_dropped_total Log entries dropped while a thread's ring was full\n# TYPE lf_log_dropped_total counter\n");
+	LF_metricsprintf(&b, "lf_log_dropped_total %llu\n", (unsigned long long)LF_logdropped());
+
+	LF_metricsprintf(&b, "# HELP lf_phase_seconds Time spent in each phase of a request, by script\n# TYPE lf_phase_seconds summary\n");
+	for(size_t i=0; i < nmerged; i++){
+		for(int p=0; p < LF_PHASES; p++){
+			LF_histogram *h = &merged[i].phases[p];
+			if(h->count == 0){ continue; }
+
+			for(size_t q=0; q < sizeof(LF_metricsquantiles)/sizeof(double); q++){
+				uint64_t rank = (uint64_t)(LF_metricsquantiles[q] * h->count + 0.5), seen = 0;
+				if(rank < 1){ rank = 1; }
+
+				int j = 0;
+				for(; j < LF_METRICS_BUCKETS-1; j++){
+					if((seen += h->buckets[j]) >= rank){ break; }
+				}
+
+				LF_metricsprintf(&b, "lf_phase_seconds{script=\"");
+				LF_metricslabel(&b, merged[i].name);
+				LF_metricsprintf(&b, "\",phase=\"%s\",quantile=\"%g\"} %.9f\n",
+					LF_metricsphases[p], LF_metricsquantiles[q], LF_metricsvalue(j) / 1e9
+				);
+			}
+
+			LF_metricsprintf(&b, "lf_phase_seconds_sum{script=\"");
+			LF_metricslabel(&b, merged[i].name);
+			LF_metricsprintf(&b, "\",phase=\"%s\"} %.9f\n", LF_metricsphases[p], h->sum / 1e9);
+
+			LF_metricsprintf(&b, "lf_phase_seconds_count{script=\"");
+			LF_metricslabel(&b, merged[i].name);
+			LF_metricsprintf(&b, "\",phase=\"%s\"} %llu\n", LF_metricsphases[p], (unsigned long long)h->count);
+		}
+	}
+
+	free(merged);
+
+	if(b.failed || failed){
+		free(b.data);
+		return NULL;
+	}
+
+	*len = b.len;
+	return b.data;
+}
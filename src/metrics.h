@@ -0,0 +1,34 @@
+typedef struct LF_metrics LF_metrics;
+
+// Sets up a thread's counters, which are only ever written by that
+// thread and merged with the others' when they're read
+LF_metrics *LF_newmetrics();
+
+// Hands a thread's counters on to the next thread to start, once it's
+// finished with them
+void LF_metricsrelease(LF_metrics *);
+
+// Monotonic clock, in nanoseconds
+uint64_t LF_metricsclock();
+
+// Counts a finished request by its outcome, an LF_ERR* code, and adds
+// its phase timings to its script's histograms. Scripts that failed to
+// load are only timed under their own name if they once loaded. The
+// state's timings and trips are cleared for the next request
+void LF_metricsrecord(LF_metrics *, LF_state *, int);
+
+// Counts a request dropped before it finished
+void LF_metricsaborted(LF_metrics *, LF_state *);
+
+// Counts a request answered from the response cache
+void LF_metricscached(LF_metrics *);
+
+// Sets the script name the metrics are served on, NULL for none
+void LF_metricsinit(const char *);
+
+// Whether a request is for the metrics, rather than a script
+int LF_metricsrequest(LF_state *);
+
+// Writes every thread's metrics out as Prometheus text, headers and all.
+// Returns NULL if there's not enough memory, a buffer to free otherwise
+char *LF_metricsrender(size_t *);
@@ -0,0 +1,457 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <fcgiapp.h>
+
+#include <lua5.1/lua.h>
+
+#include "lua.h"
+#include "config.h"
+#include "response.h"
+#include "session.h"
+#include "microcache.h"
+
+
+#define LF_MCACHE_BUCKETS 1024
+#define LF_MCACHE_SCRIPTS 64
+// Longest a request waits for another to make the response it wants
+#define LF_MCACHE_WAIT    10
+
+
+struct LF_mcentry {
+	uint32_t hash;
+	char *key;
+	size_t keylen;
+
+	// NULL while the response is first being made
+	char *data;
+	size_t len;
+	double expires;
+
+	int filling;
+	int refs;
+	int live;
+
+	struct LF_mcentry *hnext;
+	struct LF_mcentry *newer;
+	struct LF_mcentry *older;
+};
+
+// What a script that called cache() varies its response on, kept by its
+// file so the key can be made before it runs again. Scripts are only ever
+// added, in front of their bucket, so they're found without the lock.
+// What they vary on is only read or changed under it
+typedef struct LF_mcscript {
+	char *name;
+	char *vary;
+	size_t varylen;
+	struct LF_mcscript *next;
+} LF_mcscript;
+
+
+static pthread_mutex_t LF_mcachelock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t LF_mcachecond = PTHREAD_COND_INITIALIZER;
+static LF_mcentry *LF_mcachebuckets[LF_MCACHE_BUCKETS];
+static LF_mcscript *LF_mcachescripts[LF_MCACHE_SCRIPTS];
+static LF_mcentry *LF_mcachenewest = NULL;
+static LF_mcentry *LF_mcacheoldest = NULL;
+static size_t LF_mcacheused = 0;
+static size_t LF_mcachemax = 0;
+static const LF_rule *LF_mcacherules = NULL;
+static int LF_mcachenrules = 0;
+
+
+static double LF_mcachenow()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + (ts.tv_nsec / 1e9);
+}
+
+
+static inline uint32_t LF_mcachehash(const char *key, size_t len)
+{
+	uint32_t h = 2166136261u;
+	for(size_t i=0; i < len; i++){
+		h ^= (unsigned char)key[i];
+		h *= 16777619u;
+	}
+	return h;
+}
+
+
+static int LF_mcacheappend(LF_state *state, const char *data, size_t len)
+{
+	LF_cacheuse *c = &state->cache;
+	if((c->keylen + len + 1) > c->keysize){
+		size_t size = c->keysize ? c->keysize : 256;
+		while(size < (c->keylen + len + 1)){ size *= 2; }
+
+		char *key = realloc(c->key, size);
+		if(key == NULL){ return 1; }
+
+		c->key = key;
+		c->keysize = size;
+	}
+
+	memcpy(c->key + c->keylen, data, len);
+	c->key[c->keylen + len] = 0;
+	c->keylen += len + 1;
+	return 0;
+}
+
+
+// Appends the values of a query string parameter to the key, undecoded
+static int LF_mcachequery(LF_state *state, const char *query, const char *name, size_t len)
+{
+	for(const char *p = query; p != NULL && *p; p = strchr(p, '&')){
+		if(*p == '&'){ p++; }
+		if(strncmp(p, name, len) != 0 || (p[len] != '=' && p[len] != '&' && p[len] != 0)){ continue; }
+
+		const char *v = p + len + (p[len] == '=');
+		if(LF_mcacheappend(state, v, strcspn(v, "&"))){ return 1; }
+	}
+	return 0;
+}
+
+
+// Only GET and HEAD requests are answered from or stored in the cache
+static int LF_mcachemethod(LF_state *state)
+{
+	const LF_param *method = LF_getparam(state, "REQUEST_METHOD", 14);
+	return (method != NULL && (strcmp(method->value, "GET") == 0 || strcmp(method->value, "HEAD") == 0));
+}
+
+
+// Makes the key for a request into state->cache.key: the script's file,
+// so virtual hosts sharing script names are kept apart, the method, the
+// content coding it'd get, then the query string and each variable it
+// varies on. Names starting with '?' pick out query string parameters,
+// in which case the rest of the query string is ignored
+static int LF_mcachekey(LF_state *state, const char *vary, size_t varylen)
+{
+	const LF_param *file = LF_getparam(state, "SCRIPT_FILENAME", 15);
+	const LF_param *method = LF_getparam(state, "REQUEST_METHOD", 14);
+	const LF_param *query = LF_getparam(state, "QUERY_STRING", 12);
+	const LF_param *accept = LF_getparam(state, "HTTP_ACCEPT_ENCODING", 20);
+	if(file == NULL || method == NULL){ return 1; }
+
+	char encoding = '0';
+	if(accept != NULL && state->output.nrules > 0){ encoding += LF_acceptencoding(accept->value); }
+
+	state->cache.keylen = 0;
+	if(LF_mcacheappend(state, file->value, file->valuelen) ||
+		LF_mcacheappend(state, method->value, method->valuelen) ||
+		LF_mcacheappend(state, &encoding, 1)){
+		return 1;
+	}
+
+	int params = (memchr(vary, '?', varylen) != NULL);
+	if(!params && LF_mcacheappend(state, (query ? query->value : ""), (query ? query->valuelen : 0))){
+		return 1;
+	}
+
+	for(const char *v = vary; v < (vary + varylen); v += strlen(v) + 1){
+		if(*v == '?'){
+			if(query != NULL && LF_mcachequery(state, query->value, v+1, strlen(v+1))){ return 1; }
+			continue;
+		}
+
+		const LF_param *p = LF_getparam(state, v, strlen(v));
+		if(LF_mcacheappend(state, (p ? p->value : ""), (p ? p->valuelen : 0))){ return 1; }
+	}
+	return 0;
+}
+
+
+static LF_mcscript *LF_mcachescript(const char *name)
+{
+	LF_mcscript *s = __atomic_load_n(&LF_mcachescripts[LF_mcachehash(name, strlen(name)) % LF_MCACHE_SCRIPTS], __ATOMIC_ACQUIRE);
+	for(; s; s = s->next){
+		if(strcmp(s->name, name) == 0){ return s; }
+	}
+	return NULL;
+}
+
+
+// Seconds a config rule caches a script for, 0 if none match
+static int LF_mcacherule(const char *name)
+{
+	int ttl = 0;
+	size_t best = 0;
+	for(int i=0; i < LF_mcachenrules; i++){
+		const LF_rule *rule = &LF_mcacherules[i];
+		if(rule->len > best && strncmp(name, rule->prefix, rule->len) == 0){
+			ttl = rule->value;
+			best = rule->len;
+		}
+	}
+	return ttl;
+}
+
+
+static LF_mcentry **LF_mcachefind(const char *key, size_t keylen, uint32_t hash)
+{
+	LF_mcentry **p = &LF_mcachebuckets[hash % LF_MCACHE_BUCKETS];
+	while(*p != NULL && ((*p)->hash != hash || (*p)->keylen != keylen || memcmp((*p)->key, key, keylen) != 0)){
+		p = &(*p)->hnext;
+	}
+	return p;
+}
+
+
+static void LF_mcachefree(LF_mcentry *e)
+{
+	free(e->data);
+	free(e);
+}
+
+
+static void LF_mcacheunlink(LF_mcentry *e)
+{
+	*LF_mcachefind(e->key, e->keylen, e->hash) = e->hnext;
+
+	if(e->newer){ e->newer->older = e->older; }
+	else { LF_mcachenewest = e->older; }
+	if(e->older){ e->older->newer = e->newer; }
+	else { LF_mcacheoldest = e->newer; }
+
+	LF_mcacheused -= sizeof(LF_mcentry) + e->keylen + e->len;
+	e->live = 0;
+	if(e->refs == 0){ LF_mcachefree(e); }
+}
+
+
+// Makes an entry for a key, replacing any there is. Entries are dropped,
+// oldest first, to make room. The key's copied in front of the data
+static LF_mcentry *LF_mcacheinsert(const char *key, size_t keylen, uint32_t hash, const char *data, size_t len)
+{
+	size_t size = sizeof(LF_mcentry) + keylen + len;
+	if(size > LF_mcachemax){ return NULL; }
+
+	LF_mcentry *e = malloc(sizeof(LF_mcentry));
+	char *buf = malloc(keylen + len + 1);
+	if(e == NULL || buf == NULL){
+		free(e);
+		free(buf);
+		return NULL;
+	}
+
+	LF_mcentry *old = *LF_mcachefind(key, keylen, hash);
+	if(old != NULL){ LF_mcacheunlink(old); }
+	while(LF_mcacheoldest != NULL && (LF_mcacheused + size) > LF_mcachemax){
+		LF_mcacheunlink(LF_mcacheoldest);
+	}
+
+	memcpy(buf, key, keylen);
+	if(len > 0){ memcpy(buf + keylen, data, len); }
+
+	e->hash = hash;
+	e->key = buf;
+	e->keylen = keylen;
+	e->data = (data != NULL ? buf + keylen : NULL);
+	e->len = len;
+	e->expires = 0;
+	e->filling = 0;
+	e->refs = 0;
+	e->live = 1;
+
+	LF_mcentry **p = LF_mcachefind(key, keylen, hash);
+	e->hnext = *p;
+	*p = e;
+	e->newer = NULL;
+	e->older = LF_mcachenewest;
+	if(LF_mcachenewest){ LF_mcachenewest->newer = e; }
+	LF_mcachenewest = e;
+	if(LF_mcacheoldest == NULL){ LF_mcacheoldest = e; }
+
+	LF_mcacheused += size;
+	return e;
+}
+
+
+// Lets requests waiting on the one filling an entry go, dropping the
+// entry if it's still empty
+static void LF_mcacheunfill(LF_cacheuse *c)
+{
+	LF_mcentry *e = *LF_mcachefind(c->key, c->keylen, LF_mcachehash(c->key, c->keylen));
+	if(e != NULL){
+		e->filling = 0;
+		if(e->data == NULL){ LF_mcacheunlink(e); }
+	}
+	pthread_cond_broadcast(&LF_mcachecond);
+}
+
+
+void LF_mcacheinit(const LF_rule *rules, int nrules, size_t max)
+{
+	LF_mcacherules = rules;
+	LF_mcachenrules = nrules;
+	LF_mcachemax = max;
+}
+
+
+LF_mcentry *LF_mcacheget(LF_state *state, int wait)
+{
+	LF_cacheuse *c = &state->cache;
+	c->ttl = 0;
+	c->varylen = 0;
+	c->filling = 0;
+	c->capture = 0;
+
+	if(LF_mcachemax == 0){ return NULL; }
+
+	const LF_param *script = LF_getparam(state, "SCRIPT_NAME", 11);
+	const LF_param *file = LF_getparam(state, "SCRIPT_FILENAME", 15);
+	if(script == NULL || file == NULL || !LF_mcachemethod(state)){ return NULL; }
+
+	// Only scripts that have called cache() or match a rule are looked up
+	LF_mcscript *s = LF_mcachescript(file->value);
+	if(s == NULL && LF_mcacherule(script->value) == 0){ return NULL; }
+
+	pthread_mutex_lock(&LF_mcachelock);
+
+	c->capture = 1;
+	if(LF_mcachekey(state, (s ? s->vary : ""), (s ? s->varylen : 0))){
+		pthread_mutex_unlock(&LF_mcachelock);
+		return NULL;
+	}
+
+	uint32_t hash = LF_mcachehash(c->key, c->keylen);
+	struct timespec until;
+	int waited = 0;
+	for(;;){
+		LF_mcentry *e = *LF_mcachefind(c->key, c->keylen, hash);
+
+		// Stale responses are still sent while a new one's being made
+		if(e != NULL && e->data != NULL && (e->expires > LF_mcachenow() || e->filling)){
+			e->refs++;
+			pthread_mutex_unlock(&LF_mcachelock);
+			return e;
+		}
+
+		// Having waited once, the response probably isn't being cached
+		if(e != NULL && e->filling){
+			if(wait && !waited){
+				clock_gettime(CLOCK_REALTIME, &until);
+				until.tv_sec += LF_MCACHE_WAIT;
+				waited = 1;
+			}
+
+			if(waited && pthread_cond_timedwait(&LF_mcachecond, &LF_mcachelock, &until) == 0){
+				continue;
+			}
+			break;
+		}
+
+		if(waited){ break; }
+
+		// This request makes the response, others wait for it
+		if(e == NULL){ e = LF_mcacheinsert(c->key, c->keylen, hash, NULL, 0); }
+		if(e != NULL){
+			e->filling = 1;
+			c->filling = 1;
+		}
+		break;
+	}
+
+	pthread_mutex_unlock(&LF_mcachelock);
+	return NULL;
+}
+
+
+const char *LF_mcachedata(LF_mcentry *e, size_t *len)
+{
+	*len = e->len;
+	return e->data;
+}
+
+
+void LF_mcacherelease(LF_mcentry *e)
+{
+	pthread_mutex_lock(&LF_mcachelock);
+	if(--e->refs == 0 && !e->live){ LF_mcachefree(e); }
+	pthread_mutex_unlock(&LF_mcachelock);
+}
+
+
+void LF_mcacheabandon(LF_state *state)
+{
+	LF_cacheuse *c = &state->cache;
+	if(!c->filling){ return; }
+	c->filling = 0;
+
+	pthread_mutex_lock(&LF_mcachelock);
+	LF_mcacheunfill(c);
+	pthread_mutex_unlock(&LF_mcachelock);
+}
+
+
+void LF_mcachedone(LF_state *state, int ok)
+{
+	LF_cacheuse *c = &state->cache;
+	LF_output *o = &state->output;
+
+	// Done with, whichever way this goes
+	int filling = c->filling, capture = c->capture;
+	c->filling = c->capture = 0;
+	if(LF_mcachemax == 0 || (c->ttl <= 0 && !capture && !filling)){ return; }
+
+	const LF_param *script = LF_getparam(state, "SCRIPT_NAME", 11);
+	const LF_param *file = LF_getparam(state, "SCRIPT_FILENAME", 15);
+
+	// Only cached if the script or a rule asked, and the response isn't
+	// particular to the client
+	double ttl = (c->ttl > 0 ? c->ttl : (script ? LF_mcacherule(script->value) : 0));
+	int store = (ok && ttl > 0 && script != NULL && file != NULL && LF_mcachemethod(state) &&
+		o->capturing && !o->uncacheable && state->session == LF_SESSION_NONE);
+	if(!store && !filling){ return; }
+
+	pthread_mutex_lock(&LF_mcachelock);
+
+	// Whatever happens, requests waiting on this one can go
+	if(filling){ LF_mcacheunfill(c); }
+	if(!store){
+		pthread_mutex_unlock(&LF_mcachelock);
+		return;
+	}
+
+	// Remember what the script varies on, so the key can be made up front
+	LF_mcscript *s = LF_mcachescript(file->value);
+	if(c->ttl > 0){
+		if(s == NULL && (s = calloc(1, sizeof(LF_mcscript))) != NULL){
+			if((s->name = strdup(file->value)) == NULL){
+				free(s);
+				s = NULL;
+			} else {
+				uint32_t h = LF_mcachehash(file->value, file->valuelen) % LF_MCACHE_SCRIPTS;
+				s->next = LF_mcachescripts[h];
+				__atomic_store_n(&LF_mcachescripts[h], s, __ATOMIC_RELEASE);
+			}
+		}
+
+		if(s != NULL && (s->vary == NULL || s->varylen != c->varylen ||
+			memcmp(s->vary, c->vary, c->varylen) != 0)){
+			char *vary = malloc(c->varylen + 1);
+			if(vary != NULL){
+				memcpy(vary, c->vary, c->varylen);
+				free(s->vary);
+				s->vary = vary;
+				s->varylen = c->varylen;
+			}
+		}
+	}
+
+	if(LF_mcachekey(state, c->vary, c->varylen) == 0){
+		LF_mcentry *e = LF_mcacheinsert(
+			c->key, c->keylen, LF_mcachehash(c->key, c->keylen),
+			o->capture, o->capturelen
+		);
+		if(e != NULL){ e->expires = LF_mcachenow() + ttl; }
+	}
+
+	pthread_mutex_unlock(&LF_mcachelock);
+}
@@ -0,0 +1,25 @@
+typedef struct LF_mcentry LF_mcentry;
+
+// Sets the script name prefixes cached for so many seconds without the
+// script asking, and the most memory cached responses may take up
+void LF_mcacheinit(const LF_rule *, int, size_t);
+
+// Looks up a cached response for a request whose params have been read.
+// If there's none, the request is set up to capture its response, and
+// if wait is set and another request is making the same response, waits
+// for it. Returns NULL if the script should run, a held entry otherwise
+LF_mcentry *LF_mcacheget(LF_state *, int);
+
+// The response held in an entry, its header included
+const char *LF_mcachedata(LF_mcentry *, size_t *);
+
+// Lets go of an entry got from LF_mcacheget
+void LF_mcacherelease(LF_mcentry *);
+
+// Lets any requests waiting for the response a request's making go, once
+// it's known it won't be cached
+void LF_mcacheabandon(LF_state *);
+
+// Stores the response a request captured, if the script asked for it to
+// be cached and finished without error, and lets any waiting requests go
+void LF_mcachedone(LF_state *, int);
@@ -0,0 +1,386 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <limits.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/time.h>
+
+#include <fcgiapp.h>
+
+#include <lua5.1/lua.h>
+#include <lua5.1/lauxlib.h>
+
+#include "lua.h"
+#include "query.h"
+#include "reader.h"
+#include "multipart.h"
+
+
+// Size of the buffer the body is read through, bounds header line length
+#define LF_MULTIPART_BUFFER 16384
+// Longest field name, file name or content type kept
+#define LF_MULTIPART_FIELD  256
+
+
+typedef struct {
+	LF_state *state;
+
+	char *buf;
+	size_t size;
+	size_t start;
+	size_t end;
+} LF_mpbuf;
+
+
+typedef struct {
+	char name[LF_MULTIPART_FIELD];
+	size_t namelen;
+	char filename[LF_MULTIPART_FIELD];
+	size_t filenamelen;
+	char type[LF_MULTIPART_FIELD];
+	size_t typelen;
+	int isfile;
+
+	char *mem;
+	size_t memlen;
+	size_t memmax;
+
+	int fd;
+	size_t size;
+
+	// Parts spooled so far, and whether a part was refused for it
+	int files;
+	int toomany;
+} LF_part;
+
+
+// Reads more of the body in after whatever hasn't been consumed yet,
+// returns the number of bytes read
+static size_t LF_mpfill(LF_mpbuf *b)
+{
+	if(b->start > 0){
+		memmove(b->buf, b->buf + b->start, b->end - b->start);
+		b->end -= b->start;
+		b->start = 0;
+	}
+
+	// The body may already have been partly read through REQUEST_BODY
+	LF_state *state = b->state;
+	uintmax_t remaining = (state->content_read < state->content_length ?
+		state->content_length - state->content_read : 0);
+
+	size_t want = b->size - b->end;
+	if(want > remaining){ want = remaining; }
+	if(want == 0){ return 0; }
+
+	int r = FCGX_GetStr(b->buf + b->end, want, state->request->in);
+	if(r <= 0){
+		state->content_read = state->content_length;
+		return 0;
+	}
+
+	b->end += r;
+	state->content_read += r;
+	return r;
+}
+
+
+// Consumes a CRLF terminated line, returning it without the CRLF
+static char *LF_mpline(LF_mpbuf *b, size_t *len)
+{
+	for(;;){
+		char *line = b->buf + b->start;
+		char *eol = memmem(line, b->end - b->start, "\r\n", 2);
+		if(eol != NULL){
+			*len = eol - line;
+			b->start += *len + 2;
+			return line;
+		}
+
+		if(LF_mpfill(b) == 0){ return NULL; }
+	}
+}
+
+
+static int LF_mpwriteall(int fd, const char *data, size_t len)
+{
+	while(len > 0){
+		ssize_t r = write(fd, data, len);
+		if(r == -1){
+			if(errno == EINTR){ continue; }
+			return 1;
+		}
+		data += r;
+		len -= r;
+	}
+	return 0;
+}
+
+
+// Moves a part to an unlinked temporary file
+static int LF_partspool(LF_state *state, LF_part *p)
+{
+	if(state->upload_files_max > 0 && p->files >= state->upload_files_max){
+		p->toomany = 1;
+		return 1;
+	}
+	p->files++;
+
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/lua-fastcgi-XXXXXX", state->upload_dir);
+
+	int fd = mkstemp(path);
+	if(fd == -1){ return 1; }
+	unlink(path);
+
+	if(LF_trackfd(state, fd)){
+		close(fd);
+		return 1;
+	}
+
+	p->fd = fd;
+	if(p->memlen > 0 && LF_mpwriteall(fd, p->mem, p->memlen)){ return 1; }
+	p->memlen = 0;
+	return 0;
+}
+
+
+// Adds data to a part, spooling it to disk once it outgrows memory
+static int LF_partwrite(LF_state *state, LF_part *p, const char *data, size_t len)
+{
+	if(len == 0){ return 0; }
+	p->size += len;
+
+	if(p->fd == -1 && !p->isfile && (p->memlen + len) <= p->memmax){
+		memcpy(p->mem + p->memlen, data, len);
+		p->memlen += len;
+		return 0;
+	}
+
+	if(p->fd == -1 && LF_partspool(state, p)){ return 1; }
+	return LF_mpwriteall(p->fd, data, len);
+}
+
+
+static void LF_partinit(LF_part *p)
+{
+	p->namelen = p->filenamelen = p->typelen = 0;
+	p->isfile = 0;
+	p->memlen = 0;
+	p->fd = -1;
+	p->size = 0;
+}
+
+
+static size_t LF_mpcopy(char *dst, const char *src, size_t len)
+{
+	if(len >= LF_MULTIPART_FIELD){ len = LF_MULTIPART_FIELD - 1; }
+	memcpy(dst, src, len);
+	return len;
+}
+
+
+// Parses the parameters of a Content-Disposition header, e.g.
+// form-data; name="field"; filename="file.txt"
+static void LF_mpdisposition(LF_part *p, const char *v, const char *end)
+{
+	while(v < end){
+		const char *semi = memchr(v, ';', end - v);
+		if(semi == NULL){ return; }
+
+		v = semi + 1;
+		while(v < end && (*v == ' ' || *v == '\t')){ v++; }
+
+		const char *eq = memchr(v, '=', end - v);
+		if(eq == NULL){ return; }
+
+		const char *val = eq + 1, *vend, *next;
+		if(val < end && *val == '"'){
+			val++;
+			if((vend = memchr(val, '"', end - val)) == NULL){ vend = end; }
+			next = (vend < end ? vend + 1 : end);
+		} else {
+			if((vend = memchr(val, ';', end - val)) == NULL){ vend = end; }
+			next = vend;
+		}
+
+		size_t klen = eq - v;
+		if(klen == 4 && strncasecmp(v, "name", 4) == 0){
+			p->namelen = LF_mpcopy(p->name, val, vend - val);
+		} else if(klen == 8 && strncasecmp(v, "filename", 8) == 0){
+			p->filenamelen = LF_mpcopy(p->filename, val, vend - val);
+			p->isfile = 1;
+		}
+
+		v = next;
+	}
+}
+
+
+static void LF_mpheader(LF_part *p, const char *line, size_t len)
+{
+	const char *colon = memchr(line, ':', len);
+	if(colon == NULL){ return; }
+
+	size_t klen = colon - line;
+	const char *v = colon + 1, *end = line + len;
+	while(v < end && (*v == ' ' || *v == '\t')){ v++; }
+
+	if(klen == 19 && strncasecmp(line, "Content-Disposition", 19) == 0){
+		LF_mpdisposition(p, v, end);
+	} else if(klen == 12 && strncasecmp(line, "Content-Type", 12) == 0){
+		p->typelen = LF_mpcopy(p->type, v, end - v);
+	}
+}
+
+
+// Consumes the body up to and including the next delimiter, passing
+// whatever precedes it to the part (if any). Returns 0 when a delimiter
+// was found, 1 at the end of the body and -1 if the part couldn't be
+// written
+static int LF_mpscan(LF_state *state, LF_mpbuf *b, const char *delim, size_t dlen, LF_part *p)
+{
+	for(;;){
+		char *data = b->buf + b->start;
+		size_t avail = b->end - b->start;
+
+		char *hit = memmem(data, avail, delim, dlen);
+		if(hit != NULL){
+			if(p && LF_partwrite(state, p, data, hit - data)){ return -1; }
+			b->start += (hit - data) + dlen;
+			return 0;
+		}
+
+		// Hold back enough to match a delimiter split between reads
+		if(avail >= dlen){
+			size_t n = avail - (dlen - 1);
+			if(p && LF_partwrite(state, p, data, n)){ return -1; }
+			b->start += n;
+		}
+
+		if(LF_mpfill(b) == 0){ return 1; }
+	}
+}
+
+
+// Sets a finished part into the table at idx. Fields held in memory
+// become strings, files and spooled fields become tables with a reader
+static void LF_partpush(lua_State *l, LF_state *state, int idx, int arrays, LF_part *p)
+{
+	lua_pushlstring(l, p->name, p->namelen);
+
+	if(p->fd == -1 && !p->isfile){
+		lua_pushlstring(l, p->mem, p->memlen);
+	} else {
+		lua_createtable(l, 0, 4);
+
+		if(p->isfile){
+			lua_pushstring(l, "filename");
+			lua_pushlstring(l, p->filename, p->filenamelen);
+			lua_rawset(l, -3);
+		}
+
+		if(p->typelen > 0){
+			lua_pushstring(l, "content_type");
+			lua_pushlstring(l, p->type, p->typelen);
+			lua_rawset(l, -3);
+		}
+
+		lua_pushstring(l, "size");
+		lua_pushnumber(l, p->size);
+		lua_rawset(l, -3);
+
+		lua_pushstring(l, "file");
+		LF_pushfilereader(l, state, p->fd, p->size);
+		lua_rawset(l, -3);
+	}
+
+	LF_setpair(l, idx, arrays);
+}
+
+
+// Streams a multipart/form-data body from the request, pushing a table
+// of its parts. Returns an LF_MULTIPART_E* code if it's refused or a part
+// couldn't be spooled
+int LF_parsemultipart(lua_State *l, LF_state *state, const char *boundary, size_t blen)
+{
+	// Parts end with a line break followed by the boundary
+	char delim[LF_MULTIPART_BOUNDARY + 4];
+	if(blen > LF_MULTIPART_BOUNDARY){ blen = LF_MULTIPART_BOUNDARY; }
+	memcpy(delim, "\r\n--", 4);
+	memcpy(delim + 4, boundary, blen);
+	size_t dlen = blen + 4;
+
+	lua_newtable(l);
+	int table = lua_gettop(l);
+	lua_pushnil(l);
+	int arrays = lua_gettop(l);
+
+	LF_mpbuf b;
+	b.state = state;
+	b.size = LF_MULTIPART_BUFFER;
+	b.buf = lua_newuserdata(l, b.size);
+
+	LF_part p;
+	p.files = 0;
+	p.toomany = 0;
+	p.memmax = state->upload_memory;
+	p.mem = lua_newuserdata(l, (p.memmax > 0 ? p.memmax : 1));
+
+	// The first boundary isn't preceded by a line break, so add one
+	memcpy(b.buf, "\r\n", 2);
+	b.start = 0;
+	b.end = 2;
+
+	// Skip the preamble
+	int r = LF_mpscan(state, &b, delim, dlen, NULL);
+	for(int parts = 0; r == 0; parts++){
+		// The rest of the boundary line, "--" marks the last boundary
+		size_t len;
+		char *line = LF_mpline(&b, &len);
+		if(line == NULL || (len >= 2 && line[0] == '-' && line[1] == '-')){ break; }
+
+		if(state->upload_parts_max > 0 && parts >= state->upload_parts_max){
+			p.toomany = 1;
+			break;
+		}
+
+		LF_partinit(&p);
+		while((line = LF_mpline(&b, &len)) != NULL && len > 0){
+			LF_mpheader(&p, line, len);
+		}
+		if(line == NULL){ break; }
+
+		r = LF_mpscan(state, &b, delim, dlen, &p);
+		if(r == 0 && p.namelen > 0){ LF_partpush(l, state, table, arrays, &p); }
+	}
+
+	lua_settop(l, table);
+	if(p.toomany){ return LF_MULTIPART_ELIMIT; }
+	return (r < 0 ? LF_MULTIPART_ESPOOL : 0);
+}
+
+
+// Finds the boundary parameter of a multipart Content-Type
+const char *LF_multipartboundary(const char *content_type, size_t *len)
+{
+	const char *p = strcasestr(content_type, "boundary=");
+	if(p == NULL){ return NULL; }
+	p += 9;
+
+	const char *end;
+	if(*p == '"'){
+		p++;
+		end = strchr(p, '"');
+	} else {
+		end = strpbrk(p, "; \t");
+	}
+	if(end == NULL){ end = p + strlen(p); }
+
+	*len = end - p;
+	return (*len > 0 && *len <= LF_MULTIPART_BOUNDARY ? p : NULL);
+}
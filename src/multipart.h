@@ -0,0 +1,13 @@
+// Longest boundary allowed by RFC 2046
+#define LF_MULTIPART_BOUNDARY 70
+
+// Finds the boundary in a multipart/form-data Content-Type
+const char *LF_multipartboundary(const char *, size_t *);
+
+// Why a body couldn't be parsed
+#define LF_MULTIPART_ESPOOL 1
+#define LF_MULTIPART_ELIMIT 2
+
+// Streams a multipart/form-data request body into a table, returns an
+// LF_MULTIPART_E* code if it couldn't be
+int LF_parsemultipart(lua_State *, LF_state *, const char *, size_t);
@@ -0,0 +1,150 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <lua5.1/lua.h>
+
+#include "pack.h"
+
+
+static int LF_packappend(LF_packbuf *buf, const void *data, size_t len)
+{
+	if((buf->len + len) > buf->size){
+		size_t size = buf->size ? buf->size : 256;
+		while(size < (buf->len + len)){ size *= 2; }
+
+		char *p = realloc(buf->data, size);
+		if(p == NULL){ return 2; }
+
+		buf->data = p;
+		buf->size = size;
+	}
+
+	memcpy(buf->data + buf->len, data, len);
+	buf->len += len;
+	return 0;
+}
+
+
+// Packs anything but a table
+static int LF_packscalar(lua_State *l, int idx, LF_packbuf *buf)
+{
+	char tag;
+
+	switch(lua_type(l, idx)){
+		case LUA_TBOOLEAN:
+			tag = (lua_toboolean(l, idx) ? LF_PACK_TRUE : LF_PACK_FALSE);
+			return LF_packappend(buf, &tag, 1);
+
+		case LUA_TNUMBER: {
+			lua_Number n = lua_tonumber(l, idx);
+			tag = LF_PACK_NUMBER;
+			if(LF_packappend(buf, &tag, 1)){ return 2; }
+			return LF_packappend(buf, &n, sizeof(n));
+		}
+
+		case LUA_TSTRING: {
+			size_t len;
+			const char *str = lua_tolstring(l, idx, &len);
+			if(len > UINT32_MAX){ return 1; }
+
+			uint32_t len32 = len;
+			tag = LF_PACK_STRING;
+			if(LF_packappend(buf, &tag, 1) || LF_packappend(buf, &len32, sizeof(len32))){ return 2; }
+			return LF_packappend(buf, str, len);
+		}
+	}
+	return 1;
+}
+
+
+int LF_pack(lua_State *l, int idx, LF_packbuf *buf)
+{
+	if(!lua_istable(l, idx)){ return LF_packscalar(l, idx, buf); }
+
+	if(idx < 0){ idx = lua_gettop(l) + idx + 1; }
+
+	// The pair count is filled in once the table's been walked
+	char tag = LF_PACK_TABLE;
+	uint32_t count = 0;
+	if(LF_packappend(buf, &tag, 1) || LF_packappend(buf, &count, sizeof(count))){ return 2; }
+	size_t countpos = buf->len - sizeof(count);
+
+	lua_pushnil(l);
+	while(lua_next(l, idx)){
+		int r = LF_packscalar(l, -2, buf);
+		if(r == 0){ r = LF_packscalar(l, -1, buf); }
+		if(r){
+			lua_pop(l, 2);
+			return r;
+		}
+
+		count++;
+		lua_pop(l, 1);
+	}
+
+	memcpy(buf->data + countpos, &count, sizeof(count));
+	return 0;
+}
+
+
+static int LF_unpackscalar(lua_State *l, const char **p, const char *end)
+{
+	if(*p >= end){ return 1; }
+
+	switch(*(*p)++){
+		case LF_PACK_FALSE: lua_pushboolean(l, 0); return 0;
+		case LF_PACK_TRUE: lua_pushboolean(l, 1); return 0;
+
+		case LF_PACK_NUMBER: {
+			lua_Number n;
+			if((size_t)(end - *p) < sizeof(n)){ return 1; }
+			memcpy(&n, *p, sizeof(n));
+			*p += sizeof(n);
+			lua_pushnumber(l, n);
+		} return 0;
+
+		case LF_PACK_STRING: {
+			uint32_t len;
+			if((size_t)(end - *p) < sizeof(len)){ return 1; }
+			memcpy(&len, *p, sizeof(len));
+			*p += sizeof(len);
+
+			if((size_t)(end - *p) < len){ return 1; }
+			lua_pushlstring(l, *p, len);
+			*p += len;
+		} return 0;
+	}
+	return 1;
+}
+
+
+int LF_unpack(lua_State *l, const char *data, size_t len)
+{
+	const char *p = data, *end = data + len;
+	if(p >= end){ return 1; }
+
+	if(*p != LF_PACK_TABLE){
+		if(LF_unpackscalar(l, &p, end)){ return 1; }
+		return 0;
+	}
+
+	uint32_t count;
+	if((size_t)(end - ++p) < sizeof(count)){ return 1; }
+	memcpy(&count, p, sizeof(count));
+	p += sizeof(count);
+
+	lua_createtable(l, 0, count);
+	for(uint32_t i=0; i < count; i++){
+		if(LF_unpackscalar(l, &p, end)){
+			lua_pop(l, 1);
+			return 1;
+		}
+		if(LF_unpackscalar(l, &p, end)){
+			lua_pop(l, 2);
+			return 1;
+		}
+		lua_rawset(l, -3);
+	}
+	return 0;
+}
@@ -0,0 +1,21 @@
+// Type tags leading each packed value. Numbers are the tag followed by
+// the lua_Number itself
+#define LF_PACK_FALSE  1
+#define LF_PACK_TRUE   2
+#define LF_PACK_NUMBER 3
+#define LF_PACK_STRING 4
+#define LF_PACK_TABLE  5
+
+typedef struct {
+	char *data;
+	size_t len;
+	size_t size;
+} LF_packbuf;
+
+// Appends the value at an index to a buffer. Booleans, numbers, strings
+// and tables of those are supported. Returns 0 on success, 1 for values
+// that can't be packed and 2 if out of memory
+int LF_pack(lua_State *, int, LF_packbuf *);
+
+// Pushes a packed value. Returns 0 on success, non-zero if malformed
+int LF_unpack(lua_State *, const char *, size_t);
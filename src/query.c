@@ -0,0 +1,184 @@
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include <lua5.1/lua.h>
+
+#include "query.h"
+
+
+// Finds the next '+', '=', '&' or '%' at or after p, or returns end
+static inline const char *LF_nextspecial(const char *p, const char *end)
+{
+	#if defined(__AVX2__)
+	const __m256i plus32 = _mm256_set1_epi8('+'), eq32 = _mm256_set1_epi8('=');
+	const __m256i amp32 = _mm256_set1_epi8('&'), pct32 = _mm256_set1_epi8('%');
+	while((end - p) >= 32){
+		__m256i v = _mm256_loadu_si256((const __m256i *)p);
+		__m256i m = _mm256_or_si256(
+			_mm256_or_si256(_mm256_cmpeq_epi8(v, plus32), _mm256_cmpeq_epi8(v, eq32)),
+			_mm256_or_si256(_mm256_cmpeq_epi8(v, amp32), _mm256_cmpeq_epi8(v, pct32))
+		);
+		unsigned int mask = _mm256_movemask_epi8(m);
+		if(mask){ return p + __builtin_ctz(mask); }
+		p += 32;
+	}
+	#endif
+
+	#if defined(__SSE2__)
+	const __m128i plus = _mm_set1_epi8('+'), eq = _mm_set1_epi8('=');
+	const __m128i amp = _mm_set1_epi8('&'), pct = _mm_set1_epi8('%');
+	while((end - p) >= 16){
+		__m128i v = _mm_loadu_si128((const __m128i *)p);
+		__m128i m = _mm_or_si128(
+			_mm_or_si128(_mm_cmpeq_epi8(v, plus), _mm_cmpeq_epi8(v, eq)),
+			_mm_or_si128(_mm_cmpeq_epi8(v, amp), _mm_cmpeq_epi8(v, pct))
+		);
+		unsigned int mask = _mm_movemask_epi8(m);
+		if(mask){ return p + __builtin_ctz(mask); }
+		p += 16;
+	}
+	#endif
+
+	for(; p < end; p++){
+		switch(*p){
+			case '+': case '=': case '&': case '%': return p;
+		}
+	}
+	return end;
+}
+
+
+// Sets the key/value pair on top of the stack into the table at idx.
+// Repeated keys are collected into an array of their values. Values can
+// be tables themselves, so the keys made into arrays are kept in a table
+// at arrays, which starts out nil and is made when it's first needed
+void LF_setpair(lua_State *l, int idx, int arrays)
+{
+	lua_pushvalue(l, -2);
+	lua_rawget(l, idx);
+
+	if(lua_isnil(l, -1)){
+		lua_pop(l, 1);
+		lua_rawset(l, idx);
+		return;
+	}
+
+	int isarray = 0;
+	if(lua_istable(l, arrays)){
+		lua_pushvalue(l, -3);
+		lua_rawget(l, arrays);
+		isarray = lua_toboolean(l, -1);
+		lua_pop(l, 1);
+	}
+
+	if(isarray){
+		lua_insert(l, -2);
+		lua_rawseti(l, -2, lua_objlen(l, -2) + 1);
+		lua_pop(l, 2);
+		return;
+	}
+
+	// Second value for the key, turn it into an array
+	if(!lua_istable(l, arrays)){
+		lua_newtable(l);
+		lua_replace(l, arrays);
+	}
+	lua_pushvalue(l, -3);
+	lua_pushboolean(l, 1);
+	lua_rawset(l, arrays);
+
+	lua_createtable(l, 2, 0);
+	lua_insert(l, -2);
+	lua_rawseti(l, -2, 1);
+	lua_insert(l, -2);
+	lua_rawseti(l, -2, 2);
+	lua_rawset(l, idx);
+}
+
+
+// Parses a query string and pushes a table of its variables. Decoded
+// text is written to out, which may be the query string itself
+void LF_parsequerystring(lua_State *l, char *out, const char *query_string, size_t len)
+{
+	// Room for the keys made into arrays, below the table
+	lua_pushnil(l);
+	int arrays = lua_gettop(l);
+	lua_newtable(l);
+
+	int stack = lua_gettop(l);
+
+	const char *optr, *end = query_string + len;
+	char *sptr, *nptr;
+	for(nptr = sptr = out, optr = query_string; 1; optr++){
+		// Copy everything up to the next delimiter or escape in one go
+		const char *next = LF_nextspecial(optr, end);
+		if(next != optr){
+			if(nptr != optr){ memmove(nptr, optr, (next - optr)); }
+			nptr += (next - optr);
+			optr = next;
+		}
+
+		if(optr == end){
+			// Push key or value if valid
+			if((nptr-sptr) > 0){ lua_pushlstring(l, sptr, (nptr - sptr)); }
+
+			// Push value, if needed
+			if(lua_gettop(l) == (stack+1)){ lua_pushstring(l, ""); }
+
+			// Set key/value if valid
+			if(lua_gettop(l) == (stack+2)){ LF_setpair(l, stack, arrays); }
+			lua_remove(l, arrays);
+			return;
+		}
+
+		switch(*optr){
+			case '+':
+				*nptr++ = ' ';
+			break;
+
+			case '=':
+				// Push a key, if it's valid and there's not already one
+				if(lua_gettop(l) == stack){
+					if((nptr-sptr) > 0){ lua_pushlstring(l, sptr, (nptr - sptr)); }
+					sptr = nptr;
+				} else {
+					*nptr++ = '=';
+				}
+			break;
+
+			case '&':
+				// Push key or value if valid
+				if((nptr-sptr) > 0){ lua_pushlstring(l, sptr, (nptr - sptr)); }
+
+				// Push value, if there is already a key
+				if(lua_gettop(l) == (stack+1)){ lua_pushstring(l, ""); }
+
+				// Set key/value if they exist
+				if(lua_gettop(l) == (stack+2)){ LF_setpair(l, stack, arrays); }
+
+				sptr = nptr;
+			break;
+
+			case '%': {
+				// Decode hex percent encoded sets, if valid
+				char c1 = (end-optr > 1 ? *(optr+1) : 0);
+				char c2 = (end-optr > 2 ? *(optr+2) : 0);
+				if(isxdigit(c1) && isxdigit(c2)){
+					char digit = 16 * (c1 >= 'A' ? (c1 & 0xdf) - '7' : (c1 - '0'));
+					digit += (c2 >= 'A' ? (c2 & 0xdf) - '7' : (c2 - '0'));
+					*nptr++ = digit;
+					optr += 2;
+				} else {
+					*nptr++ = '%';
+				}
+			} break;
+		}
+	}
+}
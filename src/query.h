@@ -0,0 +1,6 @@
+// Sets a key/value pair into a table, collecting repeated keys. The keys
+// collected so far are kept in a table, or nil, at the second index
+void LF_setpair(lua_State *, int, int);
+
+// Parses a query string into a table pushed onto the stack
+void LF_parsequerystring(lua_State *, char *, const char *, size_t);
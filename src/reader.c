@@ -0,0 +1,215 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <sys/time.h>
+
+#include <fcgiapp.h>
+
+#include <lua5.1/lua.h>
+#include <lua5.1/lauxlib.h>
+
+#include "lua.h"
+#include "reader.h"
+
+
+#define LF_READER "LF_reader"
+
+
+// Readers read from a file descriptor or from the request body, and are
+// only valid for the request they were made in
+typedef struct {
+	LF_state *state;
+	unsigned int serial;
+
+	int body;
+	int fd;
+	uintmax_t length;
+	uintmax_t offset;
+} LF_reader;
+
+
+// The request body is shared with POST, so its position lives in the state
+static uintmax_t *LF_readerpos(LF_reader *r)
+{
+	return (r->body ? &r->state->content_read : &r->offset);
+}
+
+
+// Bytes left to read, none once the reader's request has ended
+static uintmax_t LF_readerleft(LF_reader *r)
+{
+	if(r->serial != r->state->serial){ return 0; }
+
+	uintmax_t pos = *LF_readerpos(r);
+	return (pos < r->length ? r->length - pos : 0);
+}
+
+
+// Reads up to n bytes, stopping after a line break if line is set.
+// Returns the number of bytes read
+static size_t LF_readerget(LF_reader *r, char *buf, size_t n, int line)
+{
+	uintmax_t left = LF_readerleft(r);
+	if(n > left){ n = left; }
+	if(n == 0){ return 0; }
+
+	uintmax_t *pos = LF_readerpos(r);
+	ssize_t got;
+
+	if(r->body){
+		FCGX_Stream *in = r->state->request->in;
+		if(line){
+			// Let libfcgi fill its buffer, then take up to the line break
+			if(in->rdNext == in->stop){ FCGX_UnGetChar(FCGX_GetChar(in), in); }
+
+			size_t avail = in->stop - in->rdNext;
+			if(avail > 0){
+				if(avail < n){ n = avail; }
+
+				char *nl = memchr(in->rdNext, '\n', n);
+				if(nl != NULL){ n = (nl - (char *)in->rdNext) + 1; }
+			}
+		}
+		got = FCGX_GetStr(buf, n, in);
+	} else {
+		do {
+			got = pread(r->fd, buf, n, *pos);
+		} while(got == -1 && errno == EINTR);
+
+		if(line && got > 0){
+			char *nl = memchr(buf, '\n', got);
+			if(nl != NULL){ got = (nl - buf) + 1; }
+		}
+	}
+
+	if(got <= 0){
+		// Treat errors as the end of the data
+		r->length = *pos;
+		return 0;
+	}
+
+	*pos += got;
+	return got;
+}
+
+
+// reader:read([n]), returns up to n bytes or everything left, nil at the end
+static int LF_readerread(lua_State *l)
+{
+	LF_reader *r = luaL_checkudata(l, 1, LF_READER);
+	uintmax_t left = LF_readerleft(r);
+	uintmax_t n = (lua_isnoneornil(l, 2) ? left : (uintmax_t)luaL_checknumber(l, 2));
+	if(n > left){ n = left; }
+
+	if(n == 0 && left == 0){
+		lua_pushnil(l);
+		return 1;
+	}
+
+	luaL_Buffer b;
+	luaL_buffinit(l, &b);
+	while(n > 0){
+		char *p = luaL_prepbuffer(&b);
+		size_t got = LF_readerget(r, p, (n < LUAL_BUFFERSIZE ? n : LUAL_BUFFERSIZE), 0);
+		if(got == 0){ break; }
+
+		luaL_addsize(&b, got);
+		n -= got;
+	}
+	luaL_pushresult(&b);
+	return 1;
+}
+
+
+// Iterator returned by reader:lines(), without the trailing line break
+static int LF_readerline(lua_State *l)
+{
+	LF_reader *r = lua_touserdata(l, lua_upvalueindex(1));
+	if(LF_readerleft(r) == 0){ return 0; }
+
+	luaL_Buffer b;
+	luaL_buffinit(l, &b);
+	for(;;){
+		char *p = luaL_prepbuffer(&b);
+		size_t got = LF_readerget(r, p, LUAL_BUFFERSIZE, 1);
+		if(got == 0){ break; }
+
+		if(p[got-1] == '\n'){
+			got--;
+			if(got > 0 && p[got-1] == '\r'){ got--; }
+			luaL_addsize(&b, got);
+			break;
+		}
+		luaL_addsize(&b, got);
+	}
+	luaL_pushresult(&b);
+	return 1;
+}
+
+
+static int LF_readerlines(lua_State *l)
+{
+	luaL_checkudata(l, 1, LF_READER);
+	lua_settop(l, 1);
+	lua_pushcclosure(l, &LF_readerline, 1);
+	return 1;
+}
+
+
+// reader:length(), the total number of bytes
+static int LF_readerlength(lua_State *l)
+{
+	LF_reader *r = luaL_checkudata(l, 1, LF_READER);
+	lua_pushnumber(l, r->length);
+	return 1;
+}
+
+
+static void LF_pushreader(lua_State *l, LF_state *state, int body, int fd, uintmax_t length)
+{
+	LF_reader *r = lua_newuserdata(l, sizeof(LF_reader));
+	r->state = state;
+	r->serial = state->serial;
+	r->body = body;
+	r->fd = fd;
+	r->length = length;
+	r->offset = 0;
+
+	if(luaL_newmetatable(l, LF_READER)){
+		static const luaL_Reg methods[] = {
+			{ "read", &LF_readerread },
+			{ "lines", &LF_readerlines },
+			{ "length", &LF_readerlength },
+			{ NULL, NULL }
+		};
+
+		lua_pushstring(l, "__index");
+		lua_newtable(l);
+		luaL_register(l, NULL, methods);
+		lua_rawset(l, -3);
+
+		// States outlive requests, so scripts mustn't alter the metatable
+		lua_pushstring(l, "__metatable");
+		lua_pushboolean(l, 0);
+		lua_rawset(l, -3);
+	}
+	lua_setmetatable(l, -2);
+}
+
+
+// Pushes a reader over length bytes of fd. The reader doesn't own fd,
+// which must stay open until the request ends
+void LF_pushfilereader(lua_State *l, LF_state *state, int fd, size_t length)
+{
+	LF_pushreader(l, state, 0, fd, (fd == -1 ? 0 : length));
+}
+
+
+// Pushes a reader over the request body. Nothing is read until the
+// script asks for it
+void LF_pushbodyreader(lua_State *l, LF_state *state)
+{
+	LF_pushreader(l, state, 1, -1, state->content_length);
+}
@@ -0,0 +1,5 @@
+// Pushes a reader object over a file descriptor
+void LF_pushfilereader(lua_State *, LF_state *, int, size_t);
+
+// Pushes a reader object over the request body
+void LF_pushbodyreader(lua_State *, LF_state *);
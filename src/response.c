@@ -0,0 +1,651 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+
+#include <zlib.h>
+#include <fcgiapp.h>
+#include <fastcgi.h>
+
+#include <lua5.1/lua.h>
+
+#include "lua.h"
+#include "config.h"
+#include "response.h"
+#include "microcache.h"
+#include "log.h"
+
+
+// Writes smaller than libfcgi's stream buffer go through it, larger ones
+// are sent straight to the socket as records of their own
+#define LF_RESPONSE_DIRECT 8192
+// Largest content a FastCGI record can carry
+#define LF_RECORD_MAX      65535
+// Records sent per writev()
+#define LF_RECORD_BATCH    16
+// Compressed output is sent in chunks of this size while streaming
+#define LF_DEFLATE_CHUNK   16384
+
+
+// Grows buf to hold at least need bytes
+static int LF_responsegrow(char **buf, size_t *size, size_t need)
+{
+	if(need <= *size){ return 0; }
+
+	size_t n = (*size > 0 ? *size : 1024);
+	while(n < need){ n *= 2; }
+
+	char *p = realloc(*buf, n);
+	if(p == NULL){ return 1; }
+
+	*buf = p;
+	*size = n;
+	return 0;
+}
+
+
+static int LF_writevall(int fd, struct iovec *iov, int count)
+{
+	while(count > 0){
+		ssize_t r = writev(fd, iov, count);
+		if(r == -1){
+			if(errno == EINTR){ continue; }
+			return 1;
+		}
+
+		// Skip past whatever was written
+		while(count > 0 && (size_t)r >= iov->iov_len){
+			r -= iov->iov_len;
+			iov++;
+			count--;
+		}
+		if(count > 0){
+			iov->iov_base = (char *)iov->iov_base + r;
+			iov->iov_len -= r;
+		}
+	}
+	return 0;
+}
+
+
+static void LF_recordheader(FCGI_Header *h, FCGX_Request *request, size_t clen)
+{
+	h->version = FCGI_VERSION_1;
+	h->type = FCGI_STDOUT;
+	h->requestIdB1 = (request->requestId >> 8) & 0xff;
+	h->requestIdB0 = request->requestId & 0xff;
+	h->contentLengthB1 = (clen >> 8) & 0xff;
+	h->contentLengthB0 = clen & 0xff;
+	h->paddingLength = 0;
+	h->reserved = 0;
+}
+
+
+// Sends data as FCGI_STDOUT records of up to 64KB each, bypassing the
+// stream's buffer, which must already have been flushed
+static int LF_writerecords(FCGX_Request *request, const char *data, size_t len)
+{
+	FCGI_Header headers[LF_RECORD_BATCH];
+	struct iovec iov[LF_RECORD_BATCH * 2];
+
+	while(len > 0){
+		int n;
+		for(n=0; n < LF_RECORD_BATCH && len > 0; n++){
+			size_t clen = (len > LF_RECORD_MAX ? LF_RECORD_MAX : len);
+
+			FCGI_Header *h = &headers[n];
+			LF_recordheader(h, request, clen);
+
+			iov[n*2].iov_base = h;
+			iov[n*2].iov_len = sizeof(FCGI_Header);
+			iov[n*2+1].iov_base = (char *)data;
+			iov[n*2+1].iov_len = clen;
+
+			data += clen;
+			len -= clen;
+		}
+
+		if(LF_writevall(request->ipcFd, iov, n*2)){ return 1; }
+	}
+	return 0;
+}
+
+
+static int LF_sendall(int fd, const void *data, size_t len, int flags)
+{
+	while(len > 0){
+		ssize_t r = send(fd, data, len, flags);
+		if(r == -1){
+			if(errno == EINTR){ continue; }
+			return 1;
+		}
+		data = (const char *)data + r;
+		len -= r;
+	}
+	return 0;
+}
+
+
+// Sends part of a file as FCGI_STDOUT records, the file's pages going
+// from the page cache to the socket without being copied through here
+static int LF_sendrecords(FCGX_Request *request, int fd, uintmax_t offset, uintmax_t len)
+{
+	static const char zeros[4096];
+	off_t off = offset;
+
+	while(len > 0){
+		size_t clen = (len > LF_RECORD_MAX ? LF_RECORD_MAX : len);
+
+		// Held back to go out in the same segment as the file
+		FCGI_Header h;
+		LF_recordheader(&h, request, clen);
+		if(LF_sendall(request->ipcFd, &h, sizeof(h), MSG_MORE)){ return 1; }
+
+		size_t left = clen;
+		while(left > 0){
+			ssize_t r = sendfile(request->ipcFd, fd, &off, left);
+			if(r == -1 && errno == EINTR){ continue; }
+			if(r <= 0){
+				// The file shrank or can't be read, so the record's
+				// padded out to keep the connection in step
+				while(left > 0){
+					size_t n = (left > sizeof(zeros) ? sizeof(zeros) : left);
+					if(LF_sendall(request->ipcFd, zeros, n, 0)){ break; }
+					left -= n;
+				}
+				return 1;
+			}
+			left -= r;
+		}
+		len -= clen;
+	}
+	return 0;
+}
+
+
+static void LF_responsesend(LF_state *state, const char *data, size_t len)
+{
+	LF_output *o = &state->output;
+	if(len == 0){ return; }
+	o->sent += len;
+
+	if(o->capturing){
+		if((o->capturelen + len) > o->capturemax ||
+			LF_responsegrow(&o->capture, &o->capturesize, o->capturelen + len)){
+			o->capturing = 0;
+			LF_mcacheabandon(state);
+		} else {
+			memcpy(o->capture + o->capturelen, data, len);
+			o->capturelen += len;
+		}
+	}
+
+	if(o->failed){ return; }
+
+	if(len < LF_RESPONSE_DIRECT || !o->direct){
+		if(FCGX_PutStr(data, len, state->response) != (int)len){ o->failed = 1; }
+		return;
+	}
+
+	if(FCGX_FFlush(state->response) || LF_writerecords(state->request, data, len)){
+		o->failed = 1;
+	}
+}
+
+
+// Finds the compression level for a content type, -1 if it isn't compressed
+static int LF_responselevel(LF_output *o, const char *type, size_t len)
+{
+	int level = -1;
+	size_t best = 0;
+	for(int i=0; i < o->nrules; i++){
+		const LF_rule *rule = &o->rules[i];
+		if(rule->len <= len && rule->len > best && strncasecmp(type, rule->prefix, rule->len) == 0){
+			level = rule->value;
+			best = rule->len;
+		}
+	}
+	return level;
+}
+
+
+// The content type is compressed, and nothing the script set rules it out
+static int LF_responsecompressible(LF_output *o)
+{
+	return (o->level > 0 && !o->encoded && !o->nolength);
+}
+
+
+// Readies the thread's compressor for the client's encoding. Compressors
+// are kept for the life of the thread, one for each encoding
+static int LF_deflatebegin(LF_output *o)
+{
+	if(o->encoding != LF_ENCODING_GZIP && o->encoding != LF_ENCODING_DEFLATE){ return 1; }
+
+	int i = (o->encoding == LF_ENCODING_GZIP ? 0 : 1);
+	z_stream *z = o->zstreams[i];
+
+	if(z == NULL){
+		if((z = malloc(sizeof(z_stream))) == NULL){ return 1; }
+		memset(z, 0, sizeof(z_stream));
+
+		// gzip wants a gzip wrapper, HTTP's deflate a zlib one
+		if(deflateInit2(z, o->level, Z_DEFLATED, (i == 0 ? 31 : 15), 8, Z_DEFAULT_STRATEGY) != Z_OK){
+			free(z);
+			return 1;
+		}
+		o->zstreams[i] = z;
+		o->zlevels[i] = o->level;
+	} else {
+		if(deflateReset(z) != Z_OK){ return 1; }
+		if(o->zlevels[i] != o->level){
+			if(deflateParams(z, o->level, Z_DEFAULT_STRATEGY) != Z_OK){ return 1; }
+			o->zlevels[i] = o->level;
+		}
+	}
+
+	o->zstream = z;
+	return 0;
+}
+
+
+// Compresses data, sending the output as it's produced
+static void LF_responsedeflate(LF_state *state, const char *data, size_t len, int flush)
+{
+	LF_output *o = &state->output;
+	z_stream *z = o->zstream;
+
+	if(LF_responsegrow(&o->zbuf, &o->zbufsize, LF_DEFLATE_CHUNK)){
+		o->failed = 1;
+		return;
+	}
+
+	z->next_in = (Bytef *)data;
+	z->avail_in = len;
+	do {
+		z->next_out = (Bytef *)o->zbuf;
+		z->avail_out = o->zbufsize;
+		if(deflate(z, flush) == Z_STREAM_ERROR){
+			o->failed = 1;
+			return;
+		}
+		LF_responsesend(state, o->zbuf, o->zbufsize - z->avail_out);
+	} while(z->avail_out == 0);
+}
+
+
+// Compresses the buffered body in one go, returns non-zero on failure
+static int LF_responsedeflateall(LF_output *o, size_t *len)
+{
+	z_stream *z = o->zstream;
+	if(LF_responsegrow(&o->zbuf, &o->zbufsize, deflateBound(z, o->bodylen))){ return 1; }
+
+	z->next_in = (Bytef *)o->body;
+	z->avail_in = o->bodylen;
+	z->next_out = (Bytef *)o->zbuf;
+	z->avail_out = o->zbufsize;
+	if(deflate(z, Z_FINISH) != Z_STREAM_END){ return 1; }
+
+	*len = o->zbufsize - z->avail_out;
+	return 0;
+}
+
+
+// Adds the headers describing how the body is encoded
+static void LF_responseencoding(LF_state *state, int compressed)
+{
+	LF_output *o = &state->output;
+
+	// Caches must keep compressed and plain copies apart
+	if(LF_responsecompressible(o)){
+		LF_responseheader(state, "Vary", 4, "Accept-Encoding", 15);
+	}
+
+	if(compressed){
+		if(o->encoding == LF_ENCODING_GZIP){
+			LF_responseheader(state, "Content-Encoding", 16, "gzip", 4);
+		} else {
+			LF_responseheader(state, "Content-Encoding", 16, "deflate", 7);
+		}
+	}
+}
+
+
+// Sends the headers and anything buffered so far, later writes are sent
+// as they're made
+static void LF_responsestream(LF_state *state)
+{
+	LF_output *o = &state->output;
+
+	o->compressing = (LF_responsecompressible(o) && !LF_deflatebegin(o));
+	LF_responseencoding(state, o->compressing);
+
+	LF_responsesend(state, o->headers, o->headerlen);
+	LF_responsesend(state, "\r\n", 2);
+
+	if(o->compressing){
+		LF_responsedeflate(state, o->body, o->bodylen, Z_NO_FLUSH);
+	} else {
+		LF_responsesend(state, o->body, o->bodylen);
+	}
+
+	o->bodylen = 0;
+	o->streaming = 1;
+}
+
+
+void LF_responsebegin(LF_state *state)
+{
+	LF_output *o = &state->output;
+	o->headerlen = 0;
+	o->bodylen = 0;
+	o->streaming = 0;
+	o->nolength = 0;
+	o->failed = 0;
+	o->status = 200;
+	o->sent = 0;
+	o->handedoff = 0;
+	o->file = -1;
+	o->fileleft = 0;
+	o->encoding = 0;
+	o->level = -1;
+	o->encoded = 0;
+	o->compressing = 0;
+	o->capturing = state->cache.capture;
+	o->uncacheable = 0;
+	o->capturelen = 0;
+}
+
+
+void LF_responsefree(LF_state *state)
+{
+	LF_output *o = &state->output;
+	free(o->headers);
+	free(o->body);
+	free(o->zbuf);
+	free(o->capture);
+
+	for(int i=0; i < 2; i++){
+		if(o->zstreams[i] == NULL){ continue; }
+		deflateEnd(o->zstreams[i]);
+		free(o->zstreams[i]);
+	}
+	memset(o, 0, sizeof(LF_output));
+}
+
+
+// Picks the encoding to use from an Accept-Encoding header, preferring
+// gzip. Codings with a q of 0 are refused
+int LF_acceptencoding(const char *accept)
+{
+	int gzip = 0, deflate = 0, any = 0;
+
+	for(const char *p = accept; *p;){
+		p += strspn(p, " \t,");
+		if(*p == 0){ break; }
+
+		const char *coding = p;
+		size_t len = strcspn(p, " \t,;");
+		p += len;
+
+		size_t plen = strcspn(p, ",");
+		const char *q = memmem(p, plen, "q=", 2);
+		int v = ((q == NULL || strtod(q+2, NULL) > 0) ? 1 : -1);
+		p += plen;
+
+		if((len == 4 && strncasecmp(coding, "gzip", 4) == 0) ||
+			(len == 6 && strncasecmp(coding, "x-gzip", 6) == 0)){
+			gzip = v;
+		} else if(len == 7 && strncasecmp(coding, "deflate", 7) == 0){
+			deflate = v;
+		} else if(len == 1 && *coding == '*'){
+			any = v;
+		}
+	}
+
+	if(gzip > 0 || (gzip == 0 && any > 0)){ return LF_ENCODING_GZIP; }
+	if(deflate > 0 || (deflate == 0 && any > 0)){ return LF_ENCODING_DEFLATE; }
+	return 0;
+}
+
+
+int LF_responseheader(LF_state *state, const char *key, size_t keylen, const char *val, size_t vallen)
+{
+	LF_output *o = &state->output;
+	if(LF_responsegrow(&o->headers, &o->headersize, o->headerlen + keylen + vallen + 4)){
+		return 1;
+	}
+
+	// Responses that mustn't have a body, or that already say how long
+	// they are, don't get a Content-Length added
+	if(keylen == 14 && strncasecmp(key, "Content-Length", 14) == 0){
+		o->nolength = 1;
+	} else if(keylen == 12 && strncasecmp(key, "Content-Type", 12) == 0){
+		o->level = LF_responselevel(o, val, vallen);
+	} else if(keylen == 16 && strncasecmp(key, "Content-Encoding", 16) == 0){
+		o->encoded = 1;
+	} else if(keylen == 6 && memcmp(key, "Status", 6) == 0 && vallen > 0){
+		if(val[0] == '1' || (vallen >= 3 && (memcmp(val, "204", 3) == 0 || memcmp(val, "304", 3) == 0))){
+			o->nolength = 1;
+		}
+
+		// Only whole, successful responses meant for anyone are cached
+		if(vallen < 3 || memcmp(val, "200", 3) != 0){ o->uncacheable = 1; }
+		if(vallen >= 3 && isdigit(val[0]) && isdigit(val[1]) && isdigit(val[2])){
+			o->status = (val[0]-'0')*100 + (val[1]-'0')*10 + (val[2]-'0');
+		}
+	} else if(keylen == 10 && strncasecmp(key, "Set-Cookie", 10) == 0){
+		o->uncacheable = 1;
+	}
+	if(o->uncacheable){ LF_mcacheabandon(state); }
+
+	char *p = o->headers + o->headerlen;
+	memcpy(p, key, keylen); p += keylen;
+	memcpy(p, ": ", 2); p += 2;
+	memcpy(p, val, vallen); p += vallen;
+	memcpy(p, "\r\n", 2);
+
+	o->headerlen += keylen + vallen + 4;
+	return 0;
+}
+
+
+void LF_responsestatus(LF_state *state, int code, const char *content_type)
+{
+	static const char *reasons[] = {
+		[200] = "OK",
+		[403] = "Forbidden",
+		[404] = "Not Found",
+		[500] = "Internal Server Error"
+	};
+
+	int known = (code >= 0 && code < (int)(sizeof(reasons)/sizeof(*reasons)));
+	const char *reason = (known && reasons[code] ? reasons[code] : "");
+
+	char status[64];
+	int len = snprintf(status, sizeof(status), "%d %s", code, reason);
+
+	// Drop whatever headers a failed script left half assembled
+	state->output.headerlen = 0;
+	state->output.nolength = 0;
+	state->output.level = -1;
+	state->output.encoded = 0;
+
+	LF_responseheader(state, "Status", 6, status, len);
+	LF_responseheader(state, "Content-Type", 12, content_type, strlen(content_type));
+	state->committed = 1;
+}
+
+
+// Sends the error page for a script's LF_ERR* outcome, unless the script
+// already started its own response. Runtime (LF_ERRANY) and syntax errors
+// take their message from the top of l's stack
+void LF_responseerror(LF_state *state, lua_State *l, int error, const char *content_type)
+{
+	int code = 500;
+	const char *message;
+
+	switch(error){
+		case LF_ERRNONE: code = 200; message = ""; break;
+		case LF_ERRANY:
+			message = (lua_isstring(l, -1) ? lua_tostring(l, -1) : "unspecified lua error");
+		break;
+		case LF_ERRACCESS: code = 403; message = "access denied"; break;
+		case LF_ERRMEMORY: message = "not enough memory"; break;
+		case LF_ERRNOTFOUND:
+			code = 404;
+			message = "no such file or directory";
+		break;
+		case LF_ERRSYNTAX: message = lua_tostring(l, -1); break;
+		case LF_ERRBYTECODE: code = 403; message = "compiled bytecode not supported"; break;
+		case LF_ERRNOPATH: message = "SCRIPT_FILENAME not provided"; break;
+		case LF_ERRNONAME: message = "SCRIPT_NAME not provided"; break;
+		default: message = "unspecified error"; break;
+	}
+
+	// A script that ran fine keeps whatever response it made
+	if(error == LF_ERRNONE && state->committed){ return; }
+	if(error != LF_ERRNONE){ LF_logscript(state, message, strlen(message)); }
+
+	// A file from sendfile() is the whole body, it's only logged
+	if(state->output.file != -1 || state->output.handedoff){ return; }
+
+	if(!state->committed){ LF_responsestatus(state, code, content_type); }
+	LF_responsewrite(state, message, strlen(message));
+}
+
+
+void LF_responsewrite(LF_state *state, const char *data, size_t len)
+{
+	LF_output *o = &state->output;
+	if(len == 0){ return; }
+
+	if(!o->streaming){
+		if((o->bodylen + len) <= o->buffer &&
+			!LF_responsegrow(&o->body, &o->bodysize, o->bodylen + len)){
+			memcpy(o->body + o->bodylen, data, len);
+			o->bodylen += len;
+			return;
+		}
+
+		// Too big to hold back for a Content-Length
+		LF_responsestream(state);
+	}
+
+	if(o->compressing){
+		LF_responsedeflate(state, data, len, Z_NO_FLUSH);
+	} else {
+		LF_responsesend(state, data, len);
+	}
+}
+
+
+void LF_responsefinish(LF_state *state)
+{
+	LF_output *o = &state->output;
+	if(o->streaming){
+		if(o->compressing){ LF_responsedeflate(state, NULL, 0, Z_FINISH); }
+		return;
+	}
+
+	const char *body = o->body;
+	size_t bodylen = o->bodylen;
+
+	int compressed = (
+		LF_responsecompressible(o) && o->bodylen >= o->compress_min &&
+		!LF_deflatebegin(o) && !LF_responsedeflateall(o, &bodylen)
+	);
+	if(compressed){
+		body = o->zbuf;
+	} else {
+		bodylen = o->bodylen;
+	}
+	LF_responseencoding(state, compressed);
+
+	// The whole body is known, so say how long it is
+	if(!o->nolength){
+		char length[32];
+		int len = snprintf(length, sizeof(length), "%zu", bodylen);
+		LF_responseheader(state, "Content-Length", 14, length, len);
+	}
+
+	LF_responsesend(state, o->headers, o->headerlen);
+	LF_responsesend(state, "\r\n", 2);
+	LF_responsesend(state, body, bodylen);
+
+	o->bodylen = 0;
+	o->streaming = 1;
+}
+
+
+int LF_responsefile(LF_state *state, int fd, uintmax_t offset, uintmax_t len)
+{
+	LF_output *o = &state->output;
+	if(o->streaming || o->bodylen > 0){ return 1; }
+
+	// Files are sent as they are, and not kept by the response cache
+	o->capturing = 0;
+	o->uncacheable = 1;
+	LF_mcacheabandon(state);
+
+	if(!o->nolength){
+		char length[32];
+		int n = snprintf(length, sizeof(length), "%ju", len);
+		LF_responseheader(state, "Content-Length", 14, length, n);
+	}
+
+	LF_responsesend(state, o->headers, o->headerlen);
+	LF_responsesend(state, "\r\n", 2);
+	o->streaming = 1;
+
+	o->file = fd;
+	o->fileoff = offset;
+	o->fileleft = len;
+
+	// Otherwise it's left to the worker to pump out
+	if(o->direct){
+		if(!o->failed && (FCGX_FFlush(state->response) || LF_sendrecords(state->request, fd, offset, len))){
+			o->failed = 1;
+		}
+		o->sent += len;
+		o->fileleft = 0;
+	}
+	return 0;
+}
+
+
+int LF_responsepump(LF_state *state, size_t max)
+{
+	LF_output *o = &state->output;
+	char buf[LF_RECORD_MAX];
+
+	while(o->fileleft > 0 && max > 0 && !o->failed){
+		size_t n = sizeof(buf);
+		if(n > o->fileleft){ n = o->fileleft; }
+		if(n > max){ n = max; }
+
+		ssize_t r = pread(o->file, buf, n, o->fileoff);
+		if(r == -1 && errno == EINTR){ continue; }
+		if(r <= 0){
+			o->failed = 1;
+			break;
+		}
+
+		LF_responsesend(state, buf, r);
+		o->fileoff += r;
+		o->fileleft -= r;
+		max -= r;
+	}
+
+	if(o->failed){ o->fileleft = 0; }
+	return (o->fileleft > 0);
+}
@@ -0,0 +1,35 @@
+#define LF_ENCODING_GZIP    1
+#define LF_ENCODING_DEFLATE 2
+
+// Starts buffering a new response
+void LF_responsebegin(LF_state *);
+
+// Adds a header line, returns non-zero if it couldn't be stored
+int LF_responseheader(LF_state *, const char *, size_t, const char *, size_t);
+
+// Replaces any headers with a status and content type
+void LF_responsestatus(LF_state *, int, const char *);
+
+// Sends the error page for an LF_ERR* code
+void LF_responseerror(LF_state *, lua_State *, int, const char *);
+
+// Adds to the response body
+void LF_responsewrite(LF_state *, const char *, size_t);
+
+// Frees the output's buffers and compressors, once the worker's done
+void LF_responsefree(LF_state *);
+
+// Sends whatever is still buffered
+void LF_responsefinish(LF_state *);
+
+// Sends the headers, then len bytes of a file from offset as the body.
+// Writing straight to the socket, it's sent there and then, otherwise
+// it's left for LF_responsepump(). Returns non-zero if the body's begun
+int LF_responsefile(LF_state *, int, uintmax_t, uintmax_t);
+
+// Sends up to max more bytes of the file being sent, returns non-zero
+// while there's more to send
+int LF_responsepump(LF_state *, size_t);
+
+// Picks gzip or deflate from an Accept-Encoding header, 0 for neither
+int LF_acceptencoding(const char *);
@@ -0,0 +1,527 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/random.h>
+
+#include <fcgiapp.h>
+
+#include <lua5.1/lua.h>
+#include <lua5.1/lauxlib.h>
+
+#include "lua.h"
+#include "pack.h"
+#include "config.h"
+#include "response.h"
+#include "microcache.h"
+#include "log.h"
+#include "session.h"
+
+
+// A key of a session and its packed value
+typedef struct LF_sessfield {
+	size_t keylen;
+	size_t len;
+	struct LF_sessfield *next;
+	char data[];
+} LF_sessfield;
+
+typedef struct LF_session {
+	char id[LF_SESSION_IDLEN];
+	uint32_t hash;
+	double expires;
+	LF_sessfield *fields;
+	// Bytes its keys and values take up
+	size_t size;
+
+	struct LF_session *hnext;
+	// Least recently used order, newest first. Since every session lives
+	// as long after its last use, it's also the order they expire in
+	struct LF_session *newer;
+	struct LF_session *older;
+} LF_session;
+
+
+static pthread_mutex_t LF_sessionlock = PTHREAD_MUTEX_INITIALIZER;
+static LF_session **LF_sessionbuckets = NULL;
+static size_t LF_sessionnbuckets = 0;
+static LF_session *LF_sessionnewest = NULL;
+static LF_session *LF_sessionoldest = NULL;
+static size_t LF_sessioncount = 0;
+static size_t LF_sessionmax = 0;
+static size_t LF_sessionbytesmax = 0;
+static double LF_sessionttl = 0;
+static const char *LF_sessionname = NULL;
+static size_t LF_sessionnamelen = 0;
+
+// Fields are copied through here, to be unpacked or stored outside of
+// the lock. Each is its key and value lengths, then the key and value
+static __thread LF_packbuf LF_sessionbuf = { NULL, 0, 0 };
+
+
+static double LF_sessionnow()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + (ts.tv_nsec / 1e9);
+}
+
+
+static inline uint32_t LF_sessionhash(const char *id)
+{
+	uint32_t h = 2166136261u;
+	for(int i=0; i < LF_SESSION_IDLEN; i++){
+		h ^= (unsigned char)id[i];
+		h *= 16777619u;
+	}
+	return h;
+}
+
+
+static int LF_sessionreserve(size_t len)
+{
+	LF_packbuf *buf = &LF_sessionbuf;
+	if((buf->len + len) <= buf->size){ return 0; }
+
+	size_t size = buf->size ? buf->size : 1024;
+	while(size < (buf->len + len)){ size *= 2; }
+
+	char *data = realloc(buf->data, size);
+	if(data == NULL){ return 1; }
+
+	buf->data = data;
+	buf->size = size;
+	return 0;
+}
+
+
+static LF_session **LF_sessionfind(const char *id, uint32_t hash)
+{
+	LF_session **p = &LF_sessionbuckets[hash & (LF_sessionnbuckets - 1)];
+	while(*p != NULL && ((*p)->hash != hash || memcmp((*p)->id, id, LF_SESSION_IDLEN) != 0)){
+		p = &(*p)->hnext;
+	}
+	return p;
+}
+
+
+static void LF_sessionunlink(LF_session *s)
+{
+	if(s->newer){ s->newer->older = s->older; }
+	else { LF_sessionnewest = s->older; }
+
+	if(s->older){ s->older->newer = s->newer; }
+	else { LF_sessionoldest = s->newer; }
+}
+
+
+// Marks a session as just used
+static void LF_sessiontouch(LF_session *s, double now)
+{
+	if(LF_sessionnewest != s){
+		LF_sessionunlink(s);
+		s->newer = NULL;
+		s->older = LF_sessionnewest;
+		if(LF_sessionnewest){ LF_sessionnewest->newer = s; }
+		LF_sessionnewest = s;
+		if(LF_sessionoldest == NULL){ LF_sessionoldest = s; }
+	}
+	s->expires = now + LF_sessionttl;
+}
+
+
+static void LF_sessionfreefields(LF_sessfield *f)
+{
+	while(f != NULL){
+		LF_sessfield *next = f->next;
+		free(f);
+		f = next;
+	}
+}
+
+
+static void LF_sessionremove(LF_session *s)
+{
+	LF_session **p = LF_sessionfind(s->id, s->hash);
+	*p = s->hnext;
+	LF_sessionunlink(s);
+	LF_sessioncount--;
+
+	LF_sessionfreefields(s->fields);
+	free(s);
+}
+
+
+// Drops expired sessions, oldest first
+static void LF_sessionexpire(double now)
+{
+	while(LF_sessionoldest != NULL && LF_sessionoldest->expires <= now){
+		LF_sessionremove(LF_sessionoldest);
+	}
+}
+
+
+// Reads the session id from a Cookie header into id, if it holds a
+// well formed one
+static int LF_sessioncookieid(const char *cookie, char *id)
+{
+	for(const char *p = cookie; p != NULL && *p; p = strchr(p, ';')){
+		if(*p == ';'){ p++; }
+		p += strspn(p, " \t");
+
+		if(strncmp(p, LF_sessionname, LF_sessionnamelen) != 0 || p[LF_sessionnamelen] != '='){
+			continue;
+		}
+
+		p += LF_sessionnamelen + 1;
+		if(strspn(p, "0123456789abcdef") != LF_SESSION_IDLEN){ return 0; }
+
+		memcpy(id, p, LF_SESSION_IDLEN);
+		return 1;
+	}
+	return 0;
+}
+
+
+static int LF_sessionnewid(char *id)
+{
+	unsigned char bytes[LF_SESSION_IDLEN / 2];
+	if(getrandom(bytes, sizeof(bytes), 0) != sizeof(bytes)){ return 1; }
+
+	for(size_t i=0; i < sizeof(bytes); i++){
+		id[i*2] = "0123456789abcdef"[bytes[i] >> 4];
+		id[i*2+1] = "0123456789abcdef"[bytes[i] & 0x0f];
+	}
+	return 0;
+}
+
+
+void LF_sessioninit(const char *name, double ttl, size_t max, size_t bytesmax)
+{
+	LF_sessionname = name;
+	LF_sessionnamelen = strlen(name);
+	LF_sessionttl = ttl;
+	LF_sessionbytesmax = bytesmax;
+
+	if(max == 0){ return; }
+
+	size_t n = 16;
+	while(n < max){ n *= 2; }
+
+	if((LF_sessionbuckets = calloc(n, sizeof(LF_session *))) == NULL){ return; }
+	LF_sessionnbuckets = n;
+	LF_sessionmax = max;
+}
+
+
+int LF_sessionload(lua_State *l, LF_state *state)
+{
+	if(LF_sessionmax == 0){ return 0; }
+
+	int found = 0, failed = 0;
+	LF_sessionbuf.len = 0;
+
+	if(LF_sessioncookieid(state->cookie, state->session_id)){
+		uint32_t hash = LF_sessionhash(state->session_id);
+		double now = LF_sessionnow();
+
+		pthread_mutex_lock(&LF_sessionlock);
+		LF_sessionexpire(now);
+
+		LF_session *s = *LF_sessionfind(state->session_id, hash);
+		if(s != NULL){
+			found = 1;
+			LF_sessiontouch(s, now);
+
+			for(LF_sessfield *f = s->fields; f != NULL; f = f->next){
+				size_t len = (sizeof(size_t) * 2) + f->keylen + f->len;
+				if(LF_sessionreserve(len)){
+					failed = 1;
+					break;
+				}
+
+				memcpy(LF_sessionbuf.data + LF_sessionbuf.len, f, sizeof(size_t) * 2);
+				memcpy(LF_sessionbuf.data + LF_sessionbuf.len + (sizeof(size_t) * 2), f->data, f->keylen + f->len);
+				LF_sessionbuf.len += len;
+			}
+		}
+
+		pthread_mutex_unlock(&LF_sessionlock);
+	}
+
+	// Kept to tell what the script changed. Part of a session would lose
+	// the rest when it's saved
+	if(!failed && state->session_loadedsize < LF_sessionbuf.len){
+		char *data = realloc(state->session_loaded, LF_sessionbuf.len);
+		if(data == NULL){
+			failed = 1;
+		} else {
+			state->session_loaded = data;
+			state->session_loadedsize = LF_sessionbuf.len;
+		}
+	}
+	if(failed){ luaL_error(l, "Not enough memory."); }
+
+	if(LF_sessionbuf.len > 0){ memcpy(state->session_loaded, LF_sessionbuf.data, LF_sessionbuf.len); }
+	state->session_loadedlen = LF_sessionbuf.len;
+
+	// Responses with a session aren't cached
+	LF_mcacheabandon(state);
+
+	if(!found){
+		if(LF_sessionnewid(state->session_id)){ return 0; }
+		state->session = LF_SESSION_NEW;
+
+		// Headers may still be held back even if they've been put together
+		if(state->committed && !state->output.streaming){ LF_sessioncookie(state); }
+
+		lua_newtable(l);
+		return 1;
+	}
+
+	state->session = LF_SESSION_LOADED;
+
+	lua_newtable(l);
+	for(size_t pos = 0; pos < state->session_loadedlen;){
+		size_t lens[2];
+		memcpy(lens, state->session_loaded + pos, sizeof(lens));
+		pos += sizeof(lens);
+
+		lua_pushlstring(l, state->session_loaded + pos, lens[0]);
+		if(LF_unpack(l, state->session_loaded + pos + lens[0], lens[1])){
+			lua_pop(l, 1);
+		} else {
+			lua_rawset(l, -3);
+		}
+		pos += lens[0] + lens[1];
+	}
+	return 1;
+}
+
+
+int LF_sessioncookie(LF_state *state)
+{
+	// Only sent back over HTTPS if that's how it came
+	const LF_param *https = LF_getparam(state, "HTTPS", 5);
+	int secure = (https != NULL && https->valuelen > 0 && strcasecmp(https->value, "off") != 0);
+
+	char cookie[LF_SESSION_IDLEN + 64];
+	int len = snprintf(
+		cookie, sizeof(cookie), "=%.*s; Path=/; HttpOnly; SameSite=Lax%s",
+		LF_SESSION_IDLEN, state->session_id, (secure ? "; Secure" : "")
+	);
+
+	// The name can be any length, so it's put in front separately
+	size_t namelen = LF_sessionnamelen;
+	char value[namelen + len + 1];
+	memcpy(value, LF_sessionname, namelen);
+	memcpy(value + namelen, cookie, len + 1);
+
+	if(LF_responseheader(state, "Set-Cookie", 10, value, namelen + len)){ return 1; }
+	state->session = LF_SESSION_LOADED;
+	return 0;
+}
+
+
+// Packs the string keyed pairs of SESSION into the thread's buffer. Values
+// that can't be packed aren't kept
+static int LF_sessionpack(lua_State *l)
+{
+	LF_sessionbuf.len = 0;
+
+	lua_pushstring(l, "SESSION");
+	lua_rawget(l, LUA_GLOBALSINDEX);
+	if(!lua_istable(l, -1)){ return 0; }
+	int t = lua_gettop(l);
+
+	lua_pushnil(l);
+	while(lua_next(l, t)){
+		if(lua_type(l, -2) == LUA_TSTRING){
+			size_t start = LF_sessionbuf.len, lens[2];
+			const char *key = lua_tolstring(l, -2, &lens[0]);
+
+			if(LF_sessionreserve(sizeof(lens) + lens[0])){ luaL_error(l, "Not enough memory."); }
+			memcpy(LF_sessionbuf.data + start + sizeof(lens), key, lens[0]);
+			LF_sessionbuf.len += sizeof(lens) + lens[0];
+
+			if(LF_pack(l, -1, &LF_sessionbuf)){
+				LF_sessionbuf.len = start;
+			} else {
+				lens[1] = LF_sessionbuf.len - start - sizeof(lens) - lens[0];
+				memcpy(LF_sessionbuf.data + start, lens, sizeof(lens));
+			}
+		}
+		lua_pop(l, 1);
+	}
+	return 0;
+}
+
+
+// Takes the field for a key out of a list, if it's there
+static LF_sessfield *LF_sessiontake(LF_sessfield **list, const char *key, size_t keylen)
+{
+	for(LF_sessfield **p = list; *p != NULL; p = &(*p)->next){
+		LF_sessfield *f = *p;
+		if(f->keylen == keylen && memcmp(f->data, key, keylen) == 0){
+			*p = f->next;
+			return f;
+		}
+	}
+	return NULL;
+}
+
+
+// Finds a key's value among packed fields, NULL if it isn't there
+static const char *LF_sessionlookup(const char *buf, size_t buflen, const char *key, size_t keylen, size_t *len)
+{
+	for(size_t pos = 0; pos < buflen;){
+		size_t lens[2];
+		memcpy(lens, buf + pos, sizeof(lens));
+		const char *data = buf + pos + sizeof(lens);
+		pos += sizeof(lens) + lens[0] + lens[1];
+
+		if(lens[0] == keylen && memcmp(data, key, keylen) == 0){
+			*len = lens[1];
+			return data + keylen;
+		}
+	}
+	return NULL;
+}
+
+
+// Stores a field, replacing any with the same key
+static void LF_sessionset(LF_session *s, const char *data, size_t keylen, size_t len)
+{
+	LF_sessfield *f = malloc(sizeof(LF_sessfield) + keylen + len);
+	if(f == NULL){ return; }
+
+	f->keylen = keylen;
+	f->len = len;
+	memcpy(f->data, data, keylen + len);
+
+	LF_sessfield *old = LF_sessiontake(&s->fields, data, keylen);
+	if(old != NULL){ s->size -= old->keylen + old->len; }
+	free(old);
+
+	f->next = s->fields;
+	s->fields = f;
+	s->size += keylen + len;
+}
+
+
+static void LF_sessionunset(LF_session *s, const char *key, size_t keylen)
+{
+	LF_sessfield *old = LF_sessiontake(&s->fields, key, keylen);
+	if(old != NULL){ s->size -= old->keylen + old->len; }
+	free(old);
+}
+
+
+// Bytes a key's stored field takes up, 0 if there's none
+static size_t LF_sessionfieldsize(LF_session *s, const char *key, size_t keylen)
+{
+	for(LF_sessfield *f = (s ? s->fields : NULL); f != NULL; f = f->next){
+		if(f->keylen == keylen && memcmp(f->data, key, keylen) == 0){ return f->keylen + f->len; }
+	}
+	return 0;
+}
+
+
+// Applies what a request changed from the fields it loaded to a session,
+// in the thread's buffer. Only what's changed is stored, so requests
+// sharing the session don't undo each other's changes. Without apply,
+// nothing's changed. Either way, returns the size the session would be
+static size_t LF_sessionapply(LF_session *s, const char *loaded, size_t loadedlen, int apply)
+{
+	size_t size = (s ? s->size : 0);
+
+	for(size_t pos = 0; pos < LF_sessionbuf.len;){
+		size_t lens[2], len;
+		memcpy(lens, LF_sessionbuf.data + pos, sizeof(lens));
+		const char *data = LF_sessionbuf.data + pos + sizeof(lens);
+		pos += sizeof(lens) + lens[0] + lens[1];
+
+		const char *was = LF_sessionlookup(loaded, loadedlen, data, lens[0], &len);
+		if(was == NULL || len != lens[1] || memcmp(was, data + lens[0], len) != 0){
+			size += lens[0] + lens[1] - LF_sessionfieldsize(s, data, lens[0]);
+			if(apply){ LF_sessionset(s, data, lens[0], lens[1]); }
+		}
+	}
+
+	// Then whatever it removed from SESSION
+	for(size_t pos = 0; pos < loadedlen;){
+		size_t lens[2], len;
+		memcpy(lens, loaded + pos, sizeof(lens));
+		const char *key = loaded + pos + sizeof(lens);
+		pos += sizeof(lens) + lens[0] + lens[1];
+
+		if(LF_sessionlookup(LF_sessionbuf.data, LF_sessionbuf.len, key, lens[0], &len) == NULL){
+			size -= LF_sessionfieldsize(s, key, lens[0]);
+			if(apply){ LF_sessionunset(s, key, lens[0]); }
+		}
+	}
+	return size;
+}
+
+
+void LF_sessionsave(lua_State *l, LF_state *state)
+{
+	if(state->session == LF_SESSION_NONE){ return; }
+
+	if(lua_cpcall(l, &LF_sessionpack, NULL)){
+		lua_pop(l, 1);
+		return;
+	}
+
+	uint32_t hash = LF_sessionhash(state->session_id);
+	double now = LF_sessionnow();
+
+	pthread_mutex_lock(&LF_sessionlock);
+	LF_sessionexpire(now);
+
+	// A session that's gone since it was loaded is saved whole
+	LF_session **p = LF_sessionfind(state->session_id, hash);
+	LF_session *s = *p;
+	size_t loadedlen = (s != NULL ? state->session_loadedlen : 0);
+
+	if(LF_sessionbytesmax > 0 && LF_sessionapply(s, state->session_loaded, loadedlen, 0) > LF_sessionbytesmax){
+		pthread_mutex_unlock(&LF_sessionlock);
+
+		static const char error[] = "SESSION not saved: larger than session_bytes_max";
+		LF_logscript(state, error, sizeof(error)-1);
+		return;
+	}
+
+	if(s == NULL){
+		// Empty sessions aren't worth keeping
+		if(LF_sessionbuf.len == 0 || (s = calloc(1, sizeof(LF_session))) == NULL){
+			pthread_mutex_unlock(&LF_sessionlock);
+			return;
+		}
+
+		if(LF_sessioncount >= LF_sessionmax){
+			LF_sessionremove(LF_sessionoldest);
+			p = LF_sessionfind(state->session_id, hash);
+		}
+
+		memcpy(s->id, state->session_id, LF_SESSION_IDLEN);
+		s->hash = hash;
+		s->hnext = *p;
+		*p = s;
+		s->newer = NULL;
+		s->older = LF_sessionnewest;
+		if(LF_sessionnewest){ LF_sessionnewest->newer = s; }
+		LF_sessionnewest = s;
+		if(LF_sessionoldest == NULL){ LF_sessionoldest = s; }
+		LF_sessioncount++;
+	}
+	LF_sessiontouch(s, now);
+	LF_sessionapply(s, state->session_loaded, loadedlen, 1);
+
+	pthread_mutex_unlock(&LF_sessionlock);
+
+	if(state->session == LF_SESSION_NEW && !state->output.streaming){ LF_sessioncookie(state); }
+}
@@ -0,0 +1,23 @@
+// Length of a session id, in hex digits
+#define LF_SESSION_IDLEN 32
+
+// A request's use of SESSION
+#define LF_SESSION_NONE   0
+#define LF_SESSION_LOADED 1
+// The session's new and its cookie hasn't been sent yet
+#define LF_SESSION_NEW    2
+
+// Sets the session cookie's name, how long sessions last unused in
+// seconds, how many are kept and the most bytes each may hold. A max of
+// 0 disables sessions, a bytes max of 0 doesn't limit them
+void LF_sessioninit(const char *, double, size_t, size_t);
+
+// Pushes the SESSION table for a request. Returns 0 if sessions are
+// disabled, with nothing pushed
+int LF_sessionload(lua_State *, LF_state *);
+
+// Adds a new session's Set-Cookie header, non-zero if out of memory
+int LF_sessioncookie(LF_state *);
+
+// Stores the changes the script made to SESSION, once it's done
+void LF_sessionsave(lua_State *, LF_state *);